@@ -601,7 +601,7 @@
  * @note    The default is @p FALSE.
  */
 #if !defined(CH_DBG_FILL_THREADS)
-#define CH_DBG_FILL_THREADS                 FALSE
+#define CH_DBG_FILL_THREADS                 TRUE
 #endif
 
 /**
@@ -617,6 +617,40 @@
 #define CH_DBG_THREADS_PROFILING            FALSE
 #endif
 
+/**
+ * @brief   Debug option, cycle counting threads and ISR profiler.
+ * @details If enabled then context switch and IRQ hooks measure time spent
+ *          in each thread and in ISRs using the realtime counter. Unlike
+ *          @p CH_DBG_THREADS_PROFILING this works in tickless mode.
+ *
+ * @note    The default is @p FALSE.
+ */
+#if !defined(CH_DBG_THREADS_PROFILER)
+#define CH_DBG_THREADS_PROFILER             TRUE
+#endif
+
+/**
+ * @brief   Debug option, objects FIFOs statistics.
+ * @details If enabled then C++ objects FIFO wrappers count occupancy,
+ *          high-water marks and blocked waits.
+ *
+ * @note    The default is @p FALSE.
+ */
+#if !defined(CH_DBG_OBJ_FIFOS_STATISTICS)
+#define CH_DBG_OBJ_FIFOS_STATISTICS         TRUE
+#endif
+
+/**
+ * @brief   Debug option, guarded memory pools statistics.
+ * @details If enabled then C++ guarded memory pool wrappers count
+ *          occupancy, high-water marks and blocked waits.
+ *
+ * @note    The default is @p FALSE.
+ */
+#if !defined(CH_DBG_MEMPOOLS_STATISTICS)
+#define CH_DBG_MEMPOOLS_STATISTICS          TRUE
+#endif
+
 /** @} */
 
 /*===========================================================================*/
@@ -646,8 +680,15 @@
  * @brief   Threads descriptor structure extension.
  * @details User fields added to the end of the @p thread_t structure.
  */
+#if CH_DBG_THREADS_PROFILER == TRUE
+#define CH_CFG_THREAD_EXTRA_FIELDS                                          \
+  /* Cycles spent running this thread and number of times it was started.*/ \
+  uint64_t prof_cycles;                                                     \
+  uint32_t prof_switches;
+#else
 #define CH_CFG_THREAD_EXTRA_FIELDS                                          \
   /* Add threads custom fields here.*/
+#endif
 
 /**
  * @brief   Threads initialization hook.
@@ -656,9 +697,16 @@
  * @note    It is invoked from within @p _thread_init() and implicitly from all
  *          the threads creation APIs.
  */
+#if CH_DBG_THREADS_PROFILER == TRUE
+#define CH_CFG_THREAD_INIT_HOOK(tp) {                                       \
+  (tp)->prof_cycles = 0;                                                    \
+  (tp)->prof_switches = 0;                                                  \
+}
+#else
 #define CH_CFG_THREAD_INIT_HOOK(tp) {                                       \
   /* Add threads initialization code here.*/                                \
 }
+#endif
 
 /**
  * @brief   Threads finalization hook.
@@ -672,23 +720,41 @@
  * @brief   Context switch hook.
  * @details This hook is invoked just before switching between threads.
  */
+#if CH_DBG_THREADS_PROFILER == TRUE
+#define CH_CFG_CONTEXT_SWITCH_HOOK(ntp, otp) {                              \
+  profilerContextSwitch(ntp, otp);                                          \
+}
+#else
 #define CH_CFG_CONTEXT_SWITCH_HOOK(ntp, otp) {                              \
   /* Context switch code here.*/                                            \
 }
+#endif
 
 /**
  * @brief   ISR enter hook.
  */
+#if CH_DBG_THREADS_PROFILER == TRUE
+#define CH_CFG_IRQ_PROLOGUE_HOOK() {                                        \
+  profilerIrqEnter();                                                       \
+}
+#else
 #define CH_CFG_IRQ_PROLOGUE_HOOK() {                                        \
   /* IRQ prologue code here.*/                                              \
 }
+#endif
 
 /**
  * @brief   ISR exit hook.
  */
+#if CH_DBG_THREADS_PROFILER == TRUE
+#define CH_CFG_IRQ_EPILOGUE_HOOK() {                                        \
+  profilerIrqExit();                                                        \
+}
+#else
 #define CH_CFG_IRQ_EPILOGUE_HOOK() {                                        \
   /* IRQ epilogue code here.*/                                              \
 }
+#endif
 
 /**
  * @brief   Idle thread enter hook.
@@ -751,6 +817,23 @@
 /* Port-specific settings (override port settings defaulted in chcore.h).    */
 /*===========================================================================*/
 
+/*===========================================================================*/
+/* Hooks implementation prototypes, see profiler.hpp.                        */
+/*===========================================================================*/
+
+#if (CH_DBG_THREADS_PROFILER == TRUE) && !defined(_FROM_ASM_)
+#ifdef __cplusplus
+extern "C" {
+#endif
+  struct ch_thread;
+  void profilerContextSwitch(struct ch_thread *ntp, struct ch_thread *otp);
+  void profilerIrqEnter(void);
+  void profilerIrqExit(void);
+#ifdef __cplusplus
+}
+#endif
+#endif
+
 #endif  /* CHCONF_H */
 
 /** @} */
@@ -15,10 +15,197 @@
 #define BUS_SERIAL SD4
 
 /*
- * Heap size for bus - set to 16k
+ * Bus transport used by UART threads:
+ * - serial driver on BUS_SERIAL, takes an interrupt per byte and overruns at
+ *   high rates
+ * - DMA driven UART driver on BUS_UART. Received data is collected in
+ *   circular buffer of BUS_DMA_BUFFER_SIZE bytes, reader is woken twice per
+ *   buffer and on idle line. This switches UART4 from serial to UART driver in
+ *   mcuconf.h.
+ * - in-memory loopback, output is returned to input
  */
-#define BUS_HEAP_SIZE 0x8000 
+#define BUS_TRANSPORT_SERIAL 0
+#define BUS_TRANSPORT_DMA_UART 1
+#define BUS_TRANSPORT_LOOPBACK 2
+#define BUS_TRANSPORT BUS_TRANSPORT_DMA_UART
+#define BUS_UART UARTD4
+#define BUS_DMA_BUFFER_SIZE 64
+#define BUS_LOOPBACK_BUFFER_SIZE 256
+
+/*
+ * Check received frames and realign stream after byte loss. Alignment is
+ * found again at an offset where BUS_SYNC_CONFIRM_FRAMES following frames
+ * are valid too.
+ */
+#define BUS_FRAME_SYNC TRUE
+#define BUS_SYNC_CONFIRM_FRAMES 2
+
+/*
+ * Send BusData with parity frames when losses are seen on the bus, so that
+ * lost frames are rebuilt by receiver. Requires BUS_FRAME_SYNC.
+ */
+#define BUS_DATA_FEC TRUE
+
+/*
+ * Accept BusData payload compressed with heatshrink compatible LZSS. State
+ * and a window of 1 << BUS_DATA_LZ_WINDOW_BITS bytes are taken from bus
+ * allocator for each compressed transfer, stream window must not be larger.
+ */
+#define BUS_DATA_LZ TRUE
+#define BUS_DATA_LZ_WINDOW_BITS 9
+
+/*
+ * Apply SysEx configuration records received as BusData or BusMessage to
+ * settings as they arrive.
+ */
+#define BUS_CONFIG_PARSER TRUE
+
+/*
+ * BusData that follows BUS_COMMAND_SYSEX_BRIDGE is sent on to the bus as a
+ * SysEx message in MIDI frames, for devices that forward MIDI but don't take
+ * BusData. First payload byte is the SysEx command.
+ */
+#define BUS_SYSEX_BRIDGE TRUE
+
+/*
+ * Shared bus time base. Peer 0 sends its time every BUS_CLOCK_SYNC_MS, other
+ * peers fall out of sync if they receive none for BUS_CLOCK_TIMEOUT_MS.
+ * Timed events are scheduled BUS_CLOCK_EVENT_DELAY_US ahead, that must cover
+ * the trip around the ring. Time stamps are 16 bit microseconds and wrap
+ * every 65.5 ms, so the delay must stay far below 32.7 ms.
+ */
+#define BUS_CLOCK_SYNC TRUE
+#define BUS_CLOCK_SYNC_MS 100
+#define BUS_CLOCK_TIMEOUT_MS 1000
+#define BUS_CLOCK_EVENT_DELAY_US 4000
+
+/*
+ * Deliver received parameters and buttons to audio side in per block
+ * batches, for up to BLOCK_QUEUE_BLOCKS blocks ahead. Each batch holds
+ * BLOCK_QUEUE_BATCH_SIZE events. Number of blocks must be a power of 2.
+ */
+#define BLOCK_QUEUE TRUE
+#define BLOCK_QUEUE_BLOCKS 16
+#define BLOCK_QUEUE_BATCH_SIZE 16
+
+/*
+ * Ramp parameters received in block batches towards new values. Each block
+ * covers PARAMETER_SMOOTHING_COEFFICIENT / 32768 of remaining distance, 4096
+ * gives about 11 ms time constant with 64 sample blocks at 48kHz.
+ */
+#define PARAMETER_SMOOTHING TRUE
+#define PARAMETER_SMOOTHING_COEFFICIENT 4096
+
+/*
+ * Correct parameter values with offset and Q12 scalar from SysEx
+ * configuration, separately for received and sent values.
+ */
+#define PARAMETER_CALIBRATION TRUE
+
+/*
+ * Received MIDI CC frames for patch parameter CCs from OpenWareMidiControl.h
+ * are delivered to audio side as parameter updates. Only CCs on MIDI input
+ * channel (MI) are taken, and none if bus MIDI forwarding (DM) is off.
+ */
+#define BUS_MIDI_CC_BRIDGE TRUE
+
+/*
+ * Filter outgoing parameter updates read from pots. Changes within
+ * BUS_PARAMETER_DEADBAND of last sent value are dropped, moving back against
+ * last change takes BUS_PARAMETER_HYSTERESIS. Updates that follow the
+ * previous one sooner than BUS_PARAMETER_INTERVAL_MS are held and only the
+ * latest one is sent when interval ends. Last dropped value is sent once pot
+ * stays quiet for BUS_PARAMETER_QUIET_MS, so that it settles where it stopped.
+ */
+#define BUS_PARAMETER_FILTER TRUE
+#define BUS_PARAMETER_DEADBAND 3
+#define BUS_PARAMETER_HYSTERESIS 8
+#define BUS_PARAMETER_INTERVAL_MS 4
+#define BUS_PARAMETER_QUIET_MS 50
+
+/*
+ * Bus starts at BUS_BAUD and switches to the highest rate supported by all
+ * peers after discovery. UART4 runs from 45MHz APB1 clock with 16x
+ * oversampling, BUS_MAX_BAUD should divide it evenly.
+ */
+#define BUS_BAUD 115200
+#define BUS_BAUD_NEGOTIATION TRUE
+#define BUS_MAX_BAUD 1500000
+#define BUS_BAUD_GUARD_MS 5
+#define BUS_BAUD_TIMEOUT_MS 100
+
+/*
+ * Print every received frame and decoded object to debug serial
+ */
+#define BUS_DEBUG_FRAMES FALSE
+
+/*
+ * Number of blocks in each size class of bus payload allocator. Total size
+ * is 32k: 64 * 64 + 32 * 256 + 8 * 1024 + 3 * 4096
+ */
+#define BUS_SLAB_64_NUM 64
+#define BUS_SLAB_256_NUM 32
+#define BUS_SLAB_1K_NUM 8
+#define BUS_SLAB_4K_NUM 3
 
 #define PROTOCOL_OBJECTS_POOL_NUM 128
 
+#define PROTOCOL_OUTPUT_POOL_NUM 32
+
+/*
+ * Bus discovery. Maximum number of peers is limited by 4-bit sequence in
+ * discover frames. Discover is resent if own token doesn't return in timeout,
+ * timeout is doubled on each retry up to BUS_DISCOVER_MAX_BACKOFF times.
+ * Tokens are complete when no discover frames were received for settle
+ * time, peer 0 then sends a census and peers connect when it passes them.
+ * Census that doesn't return in the same timeout starts the next round.
+ */
+#define BUS_MAX_PEERS 16
+#define BUS_DISCOVER_TIMEOUT_MS 20
+#define BUS_DISCOVER_MAX_BACKOFF 6
+#define BUS_DISCOVER_SETTLE_MS 4
+
+/*
+ * Settings are stored in two flash sectors, firmware must not grow into them.
+ * Flash layout is enforced by STM32F446xE_owpeer.ld, which limits firmware
+ * to sectors 0-4 (128k) and leaves sectors 5-7 to staging and settings.
+ */
+#define SETTINGS_STORE TRUE
+#define SETTINGS_SECTOR_A 6
+#define SETTINGS_SECTOR_B 7
+
+/*
+ * Firmware upload over the bus is written to staging sector in pages of
+ * FIRMWARE_PAGE_SIZE bytes. Staging sector limits image size to 128k, running
+ * firmware must fit below it.
+ */
+#define FIRMWARE_UPDATER TRUE
+#define FIRMWARE_STAGING_SECTOR 5
+#define FIRMWARE_PAGE_SIZE 1024
+
+/*
+ * Store peer id in settings after discovery and resume with it after reboot
+ * or bus reset. Requires SETTINGS_STORE.
+ */
+#define BUS_PEER_CACHE TRUE
+
+/*
+ * Measure MIDI timing clock jitter on bus ingress and egress. Stats are
+ * available in "jitter" device stats section.
+ */
+#define BUS_MIDI_JITTER_STATS FALSE
+
+/*
+ * Stamp frames and objects at each pipeline stage and keep per-stage latency
+ * histograms, available in "latency" device stats section.
+ */
+#define BUS_LATENCY_STATS FALSE
+
+/*
+ * Capture bus traffic to a ring buffer that can be drained from debug
+ * console with "capture dump". Buffer size must be a power of 2.
+ */
+#define BUS_CAPTURE FALSE
+#define BUS_CAPTURE_BUFFER_SIZE 4096
+
 #endif
\ No newline at end of file
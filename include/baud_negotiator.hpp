@@ -0,0 +1,124 @@
+#pragma once
+#ifndef __BAUD_NEGOTIATOR__
+#define __BAUD_NEGOTIATOR__
+
+#include "main.hpp"
+#include "bus.hpp"
+
+namespace owpeer {
+
+/*
+ * Bus baud rate negotiation.
+ *
+ * When ring is connected, peer 0 sends BUS_COMMAND_BAUD_OFFER with its
+ * maximum rate. Every other peer lowers it to its own maximum and forwards
+ * it. When offer returns, peer 0 sends BUS_COMMAND_BAUD_SWITCH with the ring
+ * minimum if that is higher than current rate.
+ *
+ * UART Tx thread changes rate right after transmitting switch frame and then
+ * holds output for BUS_BAUD_GUARD_MS. So each peer switches right after
+ * forwarding the command, and its successor has switched before it sends
+ * anything at the new rate.
+ *
+ * Peer 0 then sends BUS_COMMAND_BAUD_CONFIRM at the new rate. Peers that
+ * don't see it within BUS_BAUD_TIMEOUT_MS, and peer 0 if it doesn't come
+ * back, revert the whole ring: they send BUS_COMMAND_BAUD_SWITCH to BUS_BAUD,
+ * which every peer forwards and follows like any other switch. Peers that
+ * can't decode it time out themselves and do the same.
+ *
+ * Rate is only changed by UART Tx thread, so that restart never overlaps a
+ * write. Negotiator only asks for it, with switch frames or with a reset
+ * that Tx thread picks up at its next wake up.
+ *
+ * Rates are sent in units of 100 baud.
+ */
+class BaudNegotiator {
+public:
+    typedef void (*SendCallback)(uint8_t peer, uint8_t cmd, int16_t data);
+
+    enum State {
+        IDLE,
+        OFFERED,
+        SWITCHING,
+        CONFIRMING,
+        DONE,
+        FAILED,
+    };
+
+    BaudNegotiator(SendCallback send)
+        : send(send) {
+    }
+
+    /*
+     * Start negotiation after ring is connected, only peer 0 sends offer
+     */
+    void start(uint8_t own_uid, systime_t now);
+
+    /*
+     * Return to initial rate, i.e. on bus reset
+     */
+    void reset();
+
+    /*
+     * Check if rate should return to BUS_BAUD. Called from UART Tx thread.
+     */
+    bool takeReset() {
+        chSysLock();
+        bool ret = reset_pending;
+        reset_pending = false;
+        chSysUnlock();
+        return ret;
+    }
+
+    void handleCommand(uint8_t peer, uint8_t cmd, int16_t data, systime_t now);
+
+    void poll(systime_t now);
+
+    sysinterval_t getPollInterval() const {
+        return state == OFFERED || state == SWITCHING || state == CONFIRMING ?
+            TIME_MS2I(1) : TIME_INFINITE;
+    }
+
+    /*
+     * Check if frame should be followed by rate change. Called from UART Tx
+     * thread.
+     */
+    static bool isSwitchFrame(const BusFrame& frame, uint32_t& rate);
+
+    State getState() const {
+        return state;
+    }
+
+    /*
+     * Rate that ring has agreed on
+     */
+    uint32_t getBaud() const {
+        return baud;
+    }
+
+    void print(BaseSequentialStream* chp) const;
+
+private:
+    void fallback();
+
+    SendCallback send;
+    volatile State state = IDLE;
+    volatile bool reset_pending = false;
+    uint8_t uid = 0;
+    uint32_t baud = BUS_BAUD;
+    uint32_t target = 0;
+    systime_t timestamp = 0;
+    // Stats
+    uint32_t switches = 0;
+    uint32_t fallbacks = 0;
+};
+
+#if BUS_BAUD_NEGOTIATION == TRUE
+extern BaudNegotiator bus_baud;
+
+void printBaudStats(BaseSequentialStream* chp);
+#endif
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+#pragma once
+#ifndef __BLOCK_QUEUE__
+#define __BLOCK_QUEUE__
+
+#include "main.hpp"
+#include "bus.hpp"
+
+namespace owpeer {
+
+/*
+ * Parameter or button update for audio side
+ */
+struct BlockEvent {
+    // OWL_COMMAND_PARAMETER or OWL_COMMAND_BUTTON
+    uint8_t type;
+    // PatchParameterId or PatchButtonId
+    uint8_t id;
+    int16_t value;
+};
+
+/*
+ * Block synchronous delivery of received updates to audio side.
+ *
+ * Events are put in per block batches for up to BLOCK_QUEUE_BLOCKS blocks
+ * ahead. Timed events go to the block that contains their bus time, others
+ * to the next block. Events for a block that has already started are
+ * delivered with the next one, so nothing changes in the middle of a block.
+ * If a batch is full, event moves on to a later block.
+ *
+ * Audio side calls startBlock at each block boundary and gets the whole
+ * batch at once, that is constant time regardless of the number of events.
+ * Producer never writes to the batch of current block, so it can be read
+ * without locking until next boundary. Without a consumer, batches up to the
+ * horizon fill and further events are dropped.
+ */
+class BlockQueue {
+public:
+    static constexpr size_t num_batches = BLOCK_QUEUE_BLOCKS;
+    static constexpr size_t batch_size = BLOCK_QUEUE_BATCH_SIZE;
+
+    /*
+     * Set block duration from audio format, timed events are delivered with
+     * the next block until it's known
+     */
+    void configure(uint32_t rate, uint32_t block_size);
+
+    /*
+     * Queue event, called from message handler. Returns false if it was
+     * dropped because all batches up to the horizon are full.
+     */
+    bool push(const BlockEvent& event);
+    bool push(const BlockEvent& event, uint16_t time);
+
+    /*
+     * Start next block at given bus time, called from audio side. Returns
+     * events for this block, they stay valid until next call.
+     */
+    const BlockEvent* startBlock(uint16_t time, size_t& num);
+
+    uint32_t getBlock() const {
+        return block;
+    }
+
+    /*
+     * Block duration in 1/256 us, 0 until configured
+     */
+    uint32_t getPeriod() const {
+        return block_period;
+    }
+
+    void print(BaseSequentialStream* chp) const;
+
+private:
+    struct Batch {
+        uint16_t num;
+        BlockEvent events[batch_size];
+    };
+
+    bool pushI(const BlockEvent& event, uint32_t target);
+
+    Batch batches[num_batches] = {};
+    uint32_t block = 0;
+    // Bus time at start of current block
+    uint16_t block_time = 0;
+    // Block duration in 1/256 us
+    uint32_t block_period = 0;
+    // Stats
+    uint32_t pushed = 0;
+    uint32_t late = 0;
+    uint32_t deferred = 0;
+    uint32_t dropped = 0;
+    uint16_t max_batch = 0;
+};
+
+static_assert((BLOCK_QUEUE_BLOCKS & (BLOCK_QUEUE_BLOCKS - 1)) == 0,
+    "Number of batches must be a power of 2");
+
+/*
+ * Starts blocks at block rate in place of audio block interrupt, that this
+ * tree doesn't have. Block time is bus time at the tick. Batch of each block
+ * goes to parameter smoother, that is advanced by a block.
+ */
+class BlockTickThread : public BaseStaticThread<256> {
+private:
+    void main() override;
+};
+
+#if BLOCK_QUEUE == TRUE
+extern BlockQueue block_queue;
+
+void printBlockStats(BaseSequentialStream* chp);
+#endif
+
+}
+
+#endif
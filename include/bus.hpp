@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <cstdint>
 #include "OpenWareMidiControl.h"
+#include "latency_stamp.hpp"
 
 namespace owpeer {
 
@@ -35,6 +36,19 @@ enum UsbMidi {
   USB_COMMAND_SINGLE_BYTE         = 0x0F
 };
 
+/*
+ * System real-time messages. These are sent as USB_COMMAND_SINGLE_BYTE
+ * packets and must never be delayed behind other bus traffic.
+ */
+enum MidiRealtime {
+    MIDI_TIMING_CLOCK   = 0xf8,
+    MIDI_START          = 0xfa,
+    MIDI_CONTINUE       = 0xfb,
+    MIDI_STOP           = 0xfc,
+    MIDI_ACTIVE_SENSING = 0xfe,
+    MIDI_SYSTEM_RESET   = 0xff,
+};
+
 
 enum OwlProtocol {
     OWL_COMMAND_BUTTON    = 0x90,
@@ -44,10 +58,15 @@ enum OwlProtocol {
     OWL_COMMAND_MESSAGE   = 0xd0,
     OWL_COMMAND_DATA      = 0xe0,
     OWL_COMMAND_RESET     = 0xf0,
+    // Never sent on bus, frame sync puts it in place of lost frames
+    OWL_FRAME_GAP         = 0x80,
 };
 
 constexpr size_t frame_size = 4;
 
+// Patch parameters that can be sent in OWL_COMMAND_PARAMETER frames
+constexpr size_t num_parameters = PARAMETER_DH + 1;
+
 class BusFrame {
 public:
     BusFrame() = default;
@@ -59,6 +78,9 @@ public:
     BusFrame& operator=(BusFrame&&) = default; 
 
     uint8_t frame_buffer[frame_size];
+#if BUS_LATENCY_STATS == TRUE
+    LatencyStamp latency;
+#endif
 
     uint8_t getSeq() const {
         return frame_buffer[0] & 0x0f;
@@ -72,9 +94,26 @@ public:
         return OwlProtocol(getOwlProtocolId());
     }
 
+    /*
+     * MIDI frames are USB MIDI event packets for cable 0, so high nibble is
+     * always 0 and low nibble contains CIN.
+     */
+    uint8_t getUsbMidiCin() const {
+        return frame_buffer[0] & 0x0f;
+    }
+
     bool isMidi() const {
-        auto cmd_id = getOwlProtocolId();
-        return cmd_id <= USB_COMMAND_SINGLE_BYTE && cmd_id > USB_COMMAND_CABLE_EVENT;        
+        auto cin = getUsbMidiCin();
+        return getOwlProtocolId() == 0 && cin > USB_COMMAND_CABLE_EVENT;
+    }
+
+    bool isMidiRealtime() const {
+        return isMidi() && getUsbMidiCin() == USB_COMMAND_SINGLE_BYTE &&
+            frame_buffer[1] >= MIDI_TIMING_CLOCK;
+    }
+
+    bool isMidiClock() const {
+        return isMidiRealtime() && frame_buffer[1] == MIDI_TIMING_CLOCK;
     }
 
     void fill(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3) {
@@ -0,0 +1,106 @@
+#pragma once
+#ifndef __BUS_CAPTURE__
+#define __BUS_CAPTURE__
+
+#include "main.hpp"
+#include "bus.hpp"
+
+namespace owpeer {
+
+/*
+ * Bus traffic capture.
+ *
+ * Rx and Tx threads tap every frame into a ring buffer of variable size
+ * records, all values are little endian:
+ *
+ *   0  uint32  realtime counter timestamp
+ *   4  uint8   info: bit 7 - direction (1 = Tx), bit 6 - annotation present,
+ *              bit 5 - wraps present, bits 0-3 - capturing peer
+ *   5  uint8   frame bytes [4]
+ *   9  uint32  optional wraps: number of counter wraps since previous record
+ *      uint32  optional annotation: Rx - cycles from ingress to rx_fifo
+ *              enqueue, Tx - cycles from tx_fifo enqueue to last byte on wire
+ *
+ * Counter wraps every 2^32 cycles, about 24 s at 180 MHz. Wraps between
+ * records are counted with system time, so gaps of any length are kept.
+ *
+ * Records that don't fit are dropped rather than overwriting data that has
+ * not been drained yet. tools/bus_capture.py converts drained records to
+ * capture files and replays them.
+ */
+class BusCapture {
+public:
+    enum Direction {
+        CAPTURE_RX = 0x00,
+        CAPTURE_TX = 0x80,
+    };
+    static constexpr uint8_t INFO_ANNOTATION = 0x40;
+    static constexpr uint8_t INFO_WRAPS = 0x20;
+    static constexpr uint8_t INFO_PEER_MASK = 0x0f;
+    static constexpr size_t record_size = 9;
+    static constexpr size_t max_record_size = 17;
+
+    void start() {
+        running = true;
+    }
+    void stop() {
+        running = false;
+    }
+    bool isRunning() const {
+        return running;
+    }
+    void setPeer(uint8_t new_peer) {
+        peer = new_peer & INFO_PEER_MASK;
+    }
+
+    /*
+     * Store frame if capture is running, called from Rx and Tx threads
+     */
+    void tap(const BusFrame& frame, Direction dir) {
+        if (running)
+            write(frame, dir);
+    }
+
+    /*
+     * Remove oldest record from ring, returns its size or 0 if ring is empty
+     */
+    size_t readRecord(uint8_t* record);
+
+    size_t getUsed() const {
+        return head - tail;
+    }
+    uint32_t getDropped() const {
+        return dropped;
+    }
+
+private:
+    static constexpr size_t size = BUS_CAPTURE_BUFFER_SIZE;
+    static_assert((size & (size - 1)) == 0, "Size must be a power of 2");
+
+    uint8_t buffer[size];
+    // Free running indexes
+    volatile uint32_t head = 0, tail = 0;
+    volatile bool running = false;
+    uint8_t peer = 0;
+    uint32_t dropped = 0;
+    // Previous stored record
+    uint32_t last_timestamp = 0;
+    systime_t last_time = 0;
+
+    void write(const BusFrame& frame, Direction dir);
+    uint32_t getWraps(uint32_t timestamp, systime_t time) const;
+    void put(uint8_t value) {
+        buffer[head++ & (size - 1)] = value;
+    }
+    uint8_t get(uint32_t index) const {
+        return buffer[index & (size - 1)];
+    }
+};
+
+#if BUS_CAPTURE == TRUE
+extern BusCapture bus_capture;
+#endif
+
+}
+
+#endif
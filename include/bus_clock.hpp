@@ -0,0 +1,155 @@
+#pragma once
+#ifndef __BUS_CLOCK__
+#define __BUS_CLOCK__
+
+#include "main.hpp"
+#include "bus_protocol.hpp"
+
+namespace owpeer {
+
+/*
+ * Time base shared by all peers on the bus, in microseconds. Only low 16 bits
+ * are agreed on, so time stamps are compared modulo 65.5 ms. A time stamp is
+ * valid within 32.7 ms of now: an event that waited longer in queues is seen
+ * as one that is still ahead, so scheduling delay must stay well below that.
+ *
+ * Peer 0 is the master. It sends BUS_COMMAND_TIME_SYNC every
+ * BUS_CLOCK_SYNC_MS and every other peer forwards it. UART Tx thread writes
+ * own bus time at the start of transmission into command data, so queueing
+ * at each hop doesn't matter. UART Rx thread estimates when the last byte of
+ * the frame arrived from read time and the number of bytes that followed it.
+ * Receiver takes sent time plus link delay as bus time at that moment.
+ *
+ * Link delay starts as frame transmission time. When master's sync returns,
+ * difference from master's own time is the link delay error summed over all
+ * hops. Master corrects it and sends it with BUS_COMMAND_TIME_DELAY.
+ *
+ * Internally time is kept in 1/16 us, clock is the realtime counter.
+ */
+class BusClock {
+public:
+    typedef void (*SendCallback)(uint8_t peer, uint8_t cmd, int16_t data);
+
+    BusClock(SendCallback send)
+        : send(send) {
+    }
+
+    /*
+     * Start after ring is connected, peer 0 becomes master
+     */
+    void start(uint8_t own_uid, uint8_t num_peers, systime_t now);
+
+    /*
+     * Stop on bus reset, time is kept running until next sync
+     */
+    void reset();
+
+    void poll(systime_t now);
+
+    sysinterval_t getPollInterval() const;
+
+    /*
+     * Sync frame received, called from UART Rx thread
+     */
+    void receiveSync(
+        uint8_t peer, uint16_t time, rtcnt_t arrival, uint32_t baud);
+
+    /*
+     * Write own time to a sync frame before it's sent at given moment,
+     * called from UART Tx thread
+     */
+    void stamp(uint8_t* frame, rtcnt_t start) const;
+
+    /*
+     * Forwarding and link delay updates, called from message handler
+     */
+    void handleCommand(uint8_t peer, uint8_t cmd, int16_t data);
+
+    uint16_t getTime(rtcnt_t cycles) const {
+        return getFineTime(cycles) >> 4;
+    }
+    uint16_t now() const {
+        return getTime(chSysGetRealtimeCounterX());
+    }
+
+    /*
+     * Bus time for an event sent now, leaves time for it to reach all peers
+     */
+    uint16_t schedule() const {
+        return now() + BUS_CLOCK_EVENT_DELAY_US;
+    }
+
+    /*
+     * Microseconds until given time, negative if it has passed
+     */
+    static int16_t until(uint16_t time, uint16_t now) {
+        return int16_t(time - now);
+    }
+
+    bool isSynced() const {
+        return synced;
+    }
+
+    /*
+     * Per hop delay from frame start to its last byte, in 1/16 us
+     */
+    int32_t getLinkDelay() const {
+        return link_delay;
+    }
+
+    static bool isSyncFrame(const uint8_t* frame);
+
+    static rtcnt_t getByteCycles(uint32_t baud) {
+        // 8N1 framing
+        return STM32_HCLK / baud * 10;
+    }
+
+    void print(BaseSequentialStream* chp) const;
+
+private:
+    static constexpr rtcnt_t cycles_per_us = STM32_HCLK / 1000000;
+    // Larger offsets are corrected at once, smaller ones halved
+    static constexpr int32_t max_slew = 50 << 4;
+
+    /*
+     * Difference of 1/16 us time stamps, only 20 bits are valid
+     */
+    static int32_t diff(uint32_t a, uint32_t b) {
+        return int32_t((a - b) << 12) >> 12;
+    }
+
+    uint32_t getFineTime(rtcnt_t cycles) const;
+    void setTime(rtcnt_t cycles, uint32_t time);
+
+    SendCallback send;
+    uint8_t uid = NO_UID;
+    uint8_t peers = 0;
+    volatile bool synced = false;
+    // Bus time at given realtime counter value
+    rtcnt_t ref_cycles = 0;
+    uint32_t ref_time = 0;
+    // Set by UART Rx thread and message handler, accessed locked
+    int32_t link_delay = 0;
+    uint32_t link_baud = 0;
+    // Time of last sync seen by message handler
+    systime_t sync_time = 0;
+    uint32_t polled_syncs = 0;
+    // Stats, syncs are counted by UART Rx thread
+    volatile uint32_t syncs = 0;
+    uint32_t steps = 0;
+    int32_t last_error = 0;
+    int32_t max_error = 0;
+};
+
+static_assert(BUS_CLOCK_EVENT_DELAY_US < 0x8000 / 2,
+    "Timed events must be applied before their 16 bit stamps wrap");
+
+#if BUS_CLOCK_SYNC == TRUE
+extern BusClock bus_clock;
+
+void printClockStats(BaseSequentialStream* chp);
+#endif
+
+}
+
+#endif
@@ -0,0 +1,187 @@
+#pragma once
+#ifndef __BUS_DISCOVERY__
+#define __BUS_DISCOVERY__
+
+#include "ch.hpp"
+#include "owpeer.h"
+#include "bus.hpp"
+#include "bus_protocol.hpp"
+
+namespace owpeer {
+
+using namespace chibios_rt;
+
+/*
+ * Bus discovery state machine.
+ *
+ * Discover frames carry 24 bits: census flag, 7-bit round counter and a
+ * random 16-bit token. Every peer starts a round by sending its own token
+ * with sequence 0. Foreign tokens are forwarded along the ring with sequence
+ * incremented, so sequence received with a foreign token is the distance in
+ * hops from its owner. Own token is not forwarded - when it comes back,
+ * sequence + 1 is the number of peers on the ring.
+ *
+ * All tokens circulate in parallel. Tokens are complete when own token has
+ * returned and no discover frames were received for settle time. Peer with
+ * the lowest token becomes peer 0 and every other peer takes its distance
+ * from it as peer id.
+ *
+ * Two peers picking the same token stop each other's tokens early. This
+ * usually shows up as duplicate tokens or as token count not matching ring
+ * size. It doesn't when every peer has a twin, i.e. two peers with the same
+ * token, so peer 0 then sends a census with a fresh token around the ring.
+ * Each peer checks that census distance is its own id, and peer 0 checks
+ * that its own census returns after the number of peers. A peer connects
+ * when census passes, so ids are unique once all peers are connected.
+ *
+ * Any failed check or timeout starts the next round. Rounds compare in
+ * serial number arithmetic: frames from older rounds are stale and ignored,
+ * a newer round is joined. Connected peers restart discovery on any frame
+ * that isn't from their completed round, with a round newer than both.
+ *
+ * If own token doesn't return, discover is resent with exponential backoff
+ * in case the ring is not closed yet or frames were lost.
+ *
+ * Lowest token is also used as ring fingerprint. A peer that has peer id
+ * and fingerprint cached can resume without discovery. It announces itself
+ * to the next peer with BUS_COMMAND_RESUME, which restarts discovery if
+ * sender id or fingerprint don't match its own view of the ring.
+ */
+class BusDiscovery {
+public:
+    typedef void (*SendCallback)(uint8_t seq, uint32_t token);
+
+    static constexpr uint32_t token_mask = 0xffff;
+    static constexpr uint32_t round_mask = 0x7f;
+    static constexpr uint32_t round_shift = 16;
+    static constexpr uint32_t census_bit = 0x800000;
+
+    BusDiscovery(SendCallback send, SendCallback send_resume)
+        : send(send)
+        , send_resume(send_resume) {
+    }
+
+    /*
+     * Start discovery from scratch, i.e. on boot or bus reset
+     */
+    void start(systime_t now);
+
+    /*
+     * Assume connected state from cached values, starts discovery if they
+     * don't describe a valid ring
+     */
+    void resume(
+        systime_t now, uint8_t cached_uid, uint8_t cached_peers,
+        uint32_t cached_fingerprint);
+
+    /*
+     * Stop taking part in discovery
+     */
+    void stop();
+
+    void handleDiscover(uint8_t seq, uint32_t token, systime_t now);
+
+    void handleResume(uint8_t peer, uint16_t token, systime_t now);
+
+    /*
+     * Handle timeouts, must be called at least every getPollInterval()
+     */
+    void poll(systime_t now);
+
+    sysinterval_t getPollInterval() const {
+        return status == BUS_STATUS_DISCOVER ? TIME_MS2I(1) : TIME_INFINITE;
+    }
+
+    BusStatus getStatus() const {
+        return status;
+    }
+
+    /*
+     * Own peer id, NO_UID until connected
+     */
+    uint8_t getUid() const {
+        return uid;
+    }
+
+    /*
+     * Number of peers on the ring, including this one
+     */
+    uint8_t getPeers() const {
+        return peers;
+    }
+
+    uint32_t getFingerprint() const {
+        return fingerprint;
+    }
+
+    void print(BaseSequentialStream* chp) const;
+
+private:
+    struct TokenEntry {
+        uint32_t token;
+        uint8_t distance;
+    };
+
+    void startRound(systime_t now, uint8_t new_round);
+    void nextRound(systime_t now);
+    void finishRound(systime_t now);
+    void handleCensus(uint8_t seq, uint32_t other, systime_t now);
+    void connect(systime_t now);
+    bool isConsistent() const;
+    bool isKnownToken(uint32_t other) const;
+    uint32_t makeToken();
+
+    /*
+     * Serial number comparison, ties at half range go to higher number so
+     * that any two different rounds are ordered
+     */
+    static bool isNewer(uint8_t a, uint8_t b) {
+        uint8_t diff = (a - b) & round_mask;
+        return diff != 0 && (diff < (round_mask + 1) / 2 ||
+            (diff == (round_mask + 1) / 2 && a > b));
+    }
+
+    uint32_t encode(uint32_t value) const {
+        return value | (uint32_t(round) << round_shift);
+    }
+
+    SendCallback send;
+    SendCallback send_resume;
+    BusStatus status = BUS_STATUS_IDLE;
+    uint8_t uid = NO_UID;
+    uint8_t peers = 0;
+    uint8_t round = 0;
+    uint32_t token = 0;
+    // Token of census sent by peer 0
+    uint32_t census = 0;
+    uint32_t fingerprint = 0;
+    uint32_t seed = 0;
+    TokenEntry tokens[BUS_MAX_PEERS];
+    uint8_t tokens_num = 0;
+    uint8_t own_returns = 0;
+    uint8_t ring_size = 0;
+    bool duplicates = false;
+    // Tokens are complete, waiting for census
+    bool confirming = false;
+    uint8_t attempt = 0;
+    systime_t discovery_start = 0;
+    systime_t round_start = 0;
+    systime_t last_activity = 0;
+    systime_t confirm_start = 0;
+    // Stats
+    uint32_t rounds = 0;
+    uint32_t collisions = 0;
+    uint32_t census_conflicts = 0;
+    uint32_t timeouts = 0;
+    uint32_t resumes = 0;
+    uint32_t conflicts = 0;
+    sysinterval_t connect_time = 0;
+};
+
+extern BusDiscovery bus_discovery;
+
+void printDiscoveryStats(BaseSequentialStream* chp);
+
+}
+
+#endif
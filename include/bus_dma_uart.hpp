@@ -0,0 +1,89 @@
+#pragma once
+#ifndef __BUS_DMA_UART__
+#define __BUS_DMA_UART__
+
+#include "main.hpp"
+#include "bus.hpp"
+
+namespace owpeer {
+
+/*
+ * Bus UART driven by DMA in both directions.
+ *
+ * Receive DMA runs in circular mode over BUS_DMA_BUFFER_SIZE bytes and is
+ * never stopped. Reader is woken on half transfer, transfer complete and idle
+ * line, so a burst of frames costs 2 interrupts per buffer and a short
+ * message costs one idle interrupt at its end. Write position is taken from
+ * DMA counter, so whole frames are handed to the decoder as soon as reader
+ * runs.
+ *
+ * ChibiOS UART driver keeps its receive stream in a circular "idle loop"
+ * while no receive is started and calls rxchar_cb on every DMA interrupt in
+ * this state. We point this loop to our buffer and enable half transfer
+ * interrupt, uartStartReceive must never be used on this driver.
+ *
+ * Buffer is lapped if reader falls behind by more than one buffer, this is
+ * detected from number of DMA interrupts and unread data is dropped.
+ */
+class BusDmaUart {
+public:
+    BusDmaUart(UARTDriver* driver)
+        : driver(driver) {
+    }
+
+    /*
+     * Start or restart driver at given rate, waiting reader is woken and
+     * receives nothing.
+     */
+    void start(uint32_t baud);
+
+    uint32_t getBaud() const {
+        return config.speed;
+    }
+
+    /*
+     * Read whole frames that are available, at least one. Returns number of
+     * bytes read or 0 if driver was restarted while waiting.
+     */
+    size_t read(uint8_t* data, size_t len);
+
+    void write(const uint8_t* data, size_t len);
+
+    void print(BaseSequentialStream* chp) const;
+
+private:
+    static void dmaEvent(UARTDriver* driver, uint16_t c);
+    static void idleEvent(UARTDriver* driver);
+    static void errorEvent(UARTDriver* driver, uartflags_t flags);
+    void checkOverrun();
+    size_t getPending() const;
+
+    static constexpr size_t half_size = BUS_DMA_BUFFER_SIZE / 2;
+    // Driver callbacks don't carry user data, only one instance is supported
+    static BusDmaUart* instance;
+
+    UARTDriver* driver;
+    UARTConfig config = {
+        nullptr, nullptr, nullptr, dmaEvent, errorEvent, idleEvent,
+        BUS_BAUD, USART_CR1_IDLEIE, 0, 0};
+    uint8_t buffer[BUS_DMA_BUFFER_SIZE];
+    BinarySemaphore ready {true};
+    bool started = false;
+    size_t tail = 0;
+    // Number of half buffers filled by DMA and consumed by reader
+    volatile uint32_t halves_filled = 0;
+    uint32_t bytes_read = 0;
+    // Stats
+    volatile uint32_t dma_events = 0;
+    volatile uint32_t idle_events = 0;
+    volatile uint32_t errors = 0;
+    uint32_t frames = 0;
+    uint32_t overruns = 0;
+    systime_t start_time = 0;
+};
+
+extern BusDmaUart bus_dma_uart;
+
+}
+
+#endif
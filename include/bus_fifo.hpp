@@ -3,8 +3,8 @@
 #define __BUS_POOL__
 
 #include <variant>
+#include "chobjfifos.hpp"
 #include "bus.hpp"
-#include "bus_protocol.hpp"
 #include "owpeer.h"
 
 namespace owpeer {
@@ -18,13 +18,29 @@ class BusParameter;
 class BusCommand;
 class BusData;
 class BusMessage;
+class BusConfigRecord;
 
 using BusProtocolObject =
-    std::variant<BusDiscover, BusReset, BusMidi, BusButton, BusParameter, BusCommand, BusData, BusMessage>;
+    std::variant<BusDiscover, BusReset, BusMidi, BusButton, BusParameter, BusCommand, BusData, BusMessage, BusConfigRecord>;
 using BusProtocolFifo = ObjectsFifo<BusProtocolObject, PROTOCOL_OBJECTS_POOL_NUM>;
 
 extern BusProtocolFifo bus_protocol_fifo;
 
+/*
+ * Owning pointer for decoded objects. Object is returned to
+ * bus_protocol_fifo when its handler is done with it.
+ */
+using BusObjectPtr = PoolPtr<bus_protocol_fifo>;
+
+/*
+ * Objects waiting to be encoded and sent to bus
+ */
+using BusOutputFifo = ObjectsFifo<BusProtocolObject, PROTOCOL_OUTPUT_POOL_NUM>;
+
+extern BusOutputFifo bus_output_fifo;
+
+using BusOutputPtr = PoolPtr<bus_output_fifo>;
+
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,49 @@
+#pragma once
+#ifndef __BUS_LOOPBACK__
+#define __BUS_LOOPBACK__
+
+#include "main.hpp"
+#include "bus.hpp"
+
+namespace owpeer {
+
+/*
+ * In-memory link that returns written frames to reader. Writes that don't
+ * fit in buffer are dropped, like on a link that overruns.
+ */
+class BusLoopback {
+public:
+    void start(uint32_t baud);
+
+    uint32_t getBaud() const {
+        return baud;
+    }
+
+    size_t read(uint8_t* data, size_t len);
+
+    void write(const uint8_t* data, size_t len);
+
+    void print(BaseSequentialStream* chp) const;
+
+private:
+    static constexpr size_t mask = BUS_LOOPBACK_BUFFER_SIZE - 1;
+    static_assert((BUS_LOOPBACK_BUFFER_SIZE & mask) == 0,
+        "Loopback buffer size must be a power of 2");
+
+    uint8_t buffer[BUS_LOOPBACK_BUFFER_SIZE];
+    BinarySemaphore ready {true};
+    uint32_t baud = BUS_BAUD;
+    // Free running positions
+    volatile uint32_t head = 0;
+    volatile uint32_t tail = 0;
+    // Stats
+    uint32_t frames = 0;
+    uint32_t dropped = 0;
+    systime_t start_time = 0;
+};
+
+extern BusLoopback bus_loopback;
+
+}
+
+#endif
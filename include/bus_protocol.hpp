@@ -2,15 +2,81 @@
 #ifndef __BUS_PROTOCOL__
 #define __BUS_PROTOCOL__
 
+#include <cstring>
 #include <variant>
 #include "main.hpp"
 #include "bus.hpp"
 #include "bus_fifo.hpp"
+#include "lz_decoder.hpp"
 
 namespace owpeer {
 
 static constexpr uint8_t NO_UID = 0xff;
 
+/*
+ * Bus internal commands. These are sent in BusCommand objects along with
+ * SysEx commands, so values must not overlap with OpenWareMidiControl.h
+ */
+enum BusInternalCommand {
+    // Peer has resumed with cached id, data is ring fingerprint
+    BUS_COMMAND_RESUME = 0x7f,
+    // Baud rate negotiation, data is rate in units of 100 baud
+    BUS_COMMAND_BAUD_OFFER = 0x7c,
+    BUS_COMMAND_BAUD_SWITCH = 0x7b,
+    BUS_COMMAND_BAUD_CONFIRM = 0x7a,
+    // Bus clock sync, data is sender's bus time in us
+    BUS_COMMAND_TIME_SYNC = 0x79,
+    // Link delay measured by clock master, in 1/16 us
+    BUS_COMMAND_TIME_DELAY = 0x78,
+    // Bus time in us when the following parameter or button from the same
+    // peer should be applied
+    BUS_COMMAND_TIMESTAMP = 0x77,
+    // BusData from receiving peer was dropped, data is low 16 bits of its
+    // length
+    BUS_COMMAND_DATA_ERROR = 0x76,
+    // Next BusData from sender is sent on as SysEx, see BUS_SYSEX_BRIDGE
+    BUS_COMMAND_SYSEX_BRIDGE = 0x75,
+};
+
+/*
+ * Owning pointer for payload buffers taken from bus_allocator. Buffer is
+ * released when owner is destroyed, so decoded objects can be moved between
+ * pool slots without leaking it.
+ */
+class BusBuffer {
+public:
+    BusBuffer() = default;
+    explicit BusBuffer(size_t size)
+        : ptr(reinterpret_cast<uint8_t*>(bus_allocator.alloc(size))) {
+    }
+    ~BusBuffer() {
+        bus_allocator.free(ptr);
+    }
+
+    /* Prohibit copy construction and assignment, but allow move.*/
+    BusBuffer(const BusBuffer&) = delete;
+    BusBuffer& operator=(const BusBuffer&) = delete;
+    BusBuffer(BusBuffer&& other)
+        : ptr(other.ptr) {
+        other.ptr = nullptr;
+    }
+    BusBuffer& operator=(BusBuffer&& other) {
+        if (this != &other) {
+            bus_allocator.free(ptr);
+            ptr = other.ptr;
+            other.ptr = nullptr;
+        }
+        return *this;
+    }
+
+    uint8_t* get() const {
+        return ptr;
+    }
+
+private:
+    uint8_t* ptr = nullptr;
+};
+
 
 /*
  * Bus object base class
@@ -56,6 +122,10 @@ public:
         return object_type;
     }
 
+#if BUS_LATENCY_STATS == TRUE
+    LatencyStamp latency;
+#endif
+
 protected:
     OwlProtocol object_type;
     bool is_midi;
@@ -74,6 +144,9 @@ public:
         peer--;
         return *this;
     }
+    uint8_t getPeer() const {
+        return peer;
+    }
 
 protected:
     uint8_t peer;
@@ -88,10 +161,13 @@ public:
         : BusPeerObject(OWL_COMMAND_DISCOVER, peer)
         , token(token) {
     }
-    static BusProtocolObject* decodeFrame(const BusFrame& frame);
+    static BusObjectPtr decodeFrame(const BusFrame& frame);
     void encodeFrame(BusFrame& frame) {
         frame.fill(OWL_COMMAND_DISCOVER | peer, token >> 16, token >> 8, token);
     }
+    uint32_t getToken() const {
+        return token;
+    }
 
 private:
     uint32_t token;
@@ -102,9 +178,10 @@ private:
  * identical reset bytes are written
  */
 class BusReset : public BusObject {
+public:
     BusReset()
         : BusObject(OWL_COMMAND_RESET) {};
-    static BusProtocolObject* decodeFrame(const BusFrame& frame);
+    static BusObjectPtr decodeFrame(const BusFrame& frame);
     void encodeFrame(BusFrame& frame) {
         frame.fill(OWL_COMMAND_RESET, OWL_COMMAND_RESET, OWL_COMMAND_RESET,
             OWL_COMMAND_RESET);
@@ -115,6 +192,7 @@ class BusReset : public BusObject {
  * MIDI event forwarding
  */
 class BusMidi : public BusObject {
+public:
     BusMidi(uint8_t data1, uint8_t data2, uint8_t data3, uint8_t data4)
         : BusObject(true)
         , data1(data1)
@@ -122,52 +200,123 @@ class BusMidi : public BusObject {
         , data3(data3)
         , data4(data4) {
     }
-    static BusProtocolObject* decodeFrame(const BusFrame& frame);
+    static BusObjectPtr decodeFrame(const BusFrame& frame);
     void encodeFrame(BusFrame& frame) {
         frame.fill(data1, data2, data3, data4);
     }
 
+    uint8_t getCin() const {
+        return data1 & 0x0f;
+    }
+    uint8_t getStatus() const {
+        return data2;
+    }
+    /*
+     * Data bytes of control change
+     */
+    uint8_t getController() const {
+        return data3;
+    }
+    uint8_t getControllerValue() const {
+        return data4;
+    }
+
 private:
     uint8_t data1, data2, data3, data4;
 };
 
+/*
+ * Event that may be applied at a given bus time instead of on arrival. Time
+ * is sent in a BUS_COMMAND_TIMESTAMP frame right before the event.
+ */
+class BusTimedObject : public BusPeerObject {
+public:
+    BusTimedObject(OwlProtocol object_type, uint8_t peer)
+        : BusPeerObject(object_type, peer) {
+    }
+
+    void setTime(uint16_t new_time) {
+        time = new_time;
+        timed = true;
+    }
+    bool isTimed() const {
+        return timed;
+    }
+    uint16_t getTime() const {
+        return time;
+    }
+    void encodeTimestamp(BusFrame& frame) const {
+        frame.fill(OWL_COMMAND_COMMAND | peer, BUS_COMMAND_TIMESTAMP,
+            time >> 8, time);
+    }
+
+protected:
+    bool timed = false;
+    uint16_t time = 0;
+};
+
 /*
  * Button state
  */
-class BusButton : public BusPeerObject {
+class BusButton : public BusTimedObject {
+public:
     BusButton(uint8_t peer, PatchButtonId bid, int16_t value)
-        : BusPeerObject(OWL_COMMAND_BUTTON, peer)
+        : BusTimedObject(OWL_COMMAND_BUTTON, peer)
         , bid(bid)
         , value(value) {
     }
-    static BusProtocolObject* decodeFrame(const BusFrame& frame);
+    static BusObjectPtr decodeFrame(const BusFrame& frame);
     void encodeFrame(BusFrame& frame) {
         frame.fill(OWL_COMMAND_BUTTON | peer, uint8_t(bid), value >> 8, value);
     }
 
+    PatchButtonId getButtonId() const {
+        return bid;
+    }
+    int16_t getValue() const {
+        return value;
+    }
+
 private:
     PatchButtonId bid;
     int16_t value;
 };
 
 /*
- * Parameter state
+ * Parameter state. Values read from local pots are marked, only those go
+ * through outgoing change filter.
  */
-class BusParameter : public BusPeerObject {
+class BusParameter : public BusTimedObject {
 public:
-    BusParameter(uint8_t peer, PatchParameterId pid, int16_t value)
-        : BusPeerObject(OWL_COMMAND_PARAMETER, peer)
+    BusParameter(uint8_t peer, PatchParameterId pid, int16_t value,
+        bool from_pot = false)
+        : BusTimedObject(OWL_COMMAND_PARAMETER, peer)
         , pid(pid)
-        , value(value) {
+        , value(value)
+        , from_pot(from_pot) {
     }
-    static BusProtocolObject* decodeFrame(const BusFrame& frame);
+    static BusObjectPtr decodeFrame(const BusFrame& frame);
     void encodeFrame(BusFrame& frame) {
         frame.fill(OWL_COMMAND_PARAMETER | peer, uint8_t(pid), value >> 8, value);
     }
 
+    PatchParameterId getParameterId() const {
+        return pid;
+    }
+    int16_t getValue() const {
+        return value;
+    }
+    void setValue(int16_t value) {
+        this->value = value;
+    }
+    bool isFromPot() const {
+        return from_pot;
+    }
+
 private:
     PatchParameterId pid;
     int16_t value;
+    bool from_pot;
 };
 
 class BusCommand : public BusPeerObject {
@@ -177,16 +326,179 @@ public:
         , cmd(cmd)
         , data(data) {
     }
-    static BusProtocolObject* decodeFrame(const BusFrame& frame);
+    static BusObjectPtr decodeFrame(const BusFrame& frame);
     void encodeFrame(BusFrame& frame) {
         frame.fill(OWL_COMMAND_COMMAND | peer, cmd, data >> 8, data);
     }
 
+    uint8_t getCommand() const {
+        return cmd;
+    }
+    int16_t getData() const {
+        return data;
+    }
+
 private:
     uint8_t cmd;
     int16_t data;
 };
 
+/*
+ * SysEx configuration record parsed by frame decoder, passed to message
+ * handler that applies it. Records are never sent, configuration goes on
+ * the bus as text.
+ */
+class BusConfigRecord : public BusObject {
+public:
+    BusConfigRecord(uint16_t key, int32_t value)
+        : BusObject(OWL_COMMAND_MESSAGE)
+        , key(key)
+        , value(value) {
+    }
+
+    uint16_t getKey() const {
+        return key;
+    }
+    int32_t getValue() const {
+        return value;
+    }
+
+private:
+    uint16_t key;
+    int32_t value;
+};
+
+/*
+ * Receiver for BusData payload that is processed as it arrives instead of
+ * being stored in a buffer, i.e. firmware upload. Methods are called from
+ * frame decoder thread.
+ */
+class BusDataSink {
+public:
+    /*
+     * Called with payload size from header, returning false makes decoder
+     * use a regular buffer instead
+     */
+    virtual bool open(uint32_t len) = 0;
+    virtual void write(const uint8_t* data, size_t len) = 0;
+    /*
+     * Called after last frame
+     */
+    virtual void close() = 0;
+    /*
+     * Called if transfer was interrupted by bus reset
+     */
+    virtual void abort() = 0;
+};
+
+/*
+ * Forward error correction for BusData. Header length carries FEC flag in
+ * bit 23 and log2 of block size in bits 20-22. Bit 19 marks compressed
+ * payload, so length is limited to 512k.
+ *
+ * Payload frames are sent in blocks of K frames, each block (including the
+ * last partial one) is followed by 2 parity frames. First one is XOR of even
+ * frames in block, second one of odd frames. Positions of lost frames are
+ * known from frame sync gaps, so receiver rebuilds up to one lost frame in
+ * each half of the block. A byte lost on the link usually costs 2 adjacent
+ * frames, which is recoverable.
+ *
+ * Misaligned payload may also pass frame sync checks before the loss is
+ * seen, so the lost byte costs 3 or more frames and the block fails. Such
+ * frames are counted as erased, but damaged frames could still be taken for
+ * payload, so the last frame carries low 24 bits of payload CRC-32.
+ * Transfer fails if rebuilt payload doesn't match it, or if it was lost.
+ *
+ * State is kept in a buffer from bus allocator, receiver stores current
+ * block after it.
+ */
+static constexpr uint32_t BUS_DATA_FEC_FLAG = 0x800000;
+static constexpr uint32_t BUS_DATA_LZ_FLAG = 0x080000;
+static constexpr uint32_t BUS_DATA_LEN_MASK = 0x07ffff;
+static constexpr uint8_t BUS_DATA_FEC_MAX_SHIFT = 6;
+
+struct BusDataFec {
+    // Block size is 1 << shift payload frames
+    uint8_t shift;
+    // Frame position in current block, parity frames follow payload
+    uint8_t pos;
+    // Payload frames in current block
+    uint8_t frames;
+    // Bit per parity frame that was lost
+    uint8_t parity_lost;
+    bool failed;
+    uint8_t parity[2][3];
+    // Payload CRC-32, without final inversion
+    uint32_t crc;
+    // Bit per payload frame that was lost
+    uint64_t erased;
+
+    uint8_t* getBlock() {
+        return reinterpret_cast<uint8_t*>(this + 1);
+    }
+
+    void addParity(uint8_t group, const uint8_t* data) {
+        for (size_t i = 0; i < 3; i++)
+            parity[group][i] ^= data[i];
+    }
+
+    void startBlock(uint8_t num) {
+        pos = 0;
+        frames = num;
+        parity_lost = 0;
+        erased = 0;
+        memset(parity, 0, sizeof(parity));
+    }
+};
+
+/*
+ * FEC counters for all received transfers
+ */
+struct BusDataFecStats {
+    uint32_t transfers;
+    uint32_t rebuilt;
+    uint32_t failed;
+};
+
+/*
+ * Compressed BusData payload. It starts with stream parameters (window bits
+ * in upper nibble, count bits in lower one) and 24-bit decompressed size,
+ * followed by LZSS stream. Header length is the compressed size and FEC
+ * applies to compressed bytes.
+ *
+ * Decompressed size is known only after 4 payload bytes, so output buffer is
+ * allocated or stream sink opened at that point. State and window are kept
+ * in a buffer from bus allocator.
+ */
+struct BusDataLz {
+    uint8_t header[4];
+    uint8_t header_len;
+    uint32_t size;
+    LzDecoder decoder;
+
+    BusDataLz()
+        : header_len(0)
+        , size(0)
+        , decoder(getWindow(), BUS_DATA_LZ_WINDOW_BITS) {
+    }
+
+    uint8_t* getWindow() {
+        return reinterpret_cast<uint8_t*>(this + 1);
+    }
+};
+
+/*
+ * Decompression counters for all received transfers. Cycles are spent in
+ * decoder, not counting time taken by output.
+ */
+struct BusDataLzStats {
+    uint32_t transfers;
+    uint32_t failed;
+    uint32_t input;
+    uint32_t output;
+    uint32_t cycles;
+};
+
 class BusData : public BusPeerObject {
 public:
     BusData(uint8_t peer, const uint8_t* data, uint32_t len)
@@ -196,31 +508,149 @@ public:
         , bytes_remaining(len) {
         frames_remaining = len / 3;
         position = const_cast<uint8_t*>(data);
+        if (len % 3 == 0) // Last frame is 0-filled, as in BusMessage
+            bytes_remaining += 3;
+    }
+    /*
+     * Constructor used for decoding, payload buffer is taken from bus
+     * allocator and released with this object.
+     */
+    BusData(uint8_t peer, uint32_t len)
+        : BusData(peer, nullptr, len) {
+        buffer = BusBuffer(len);
+        data = position = buffer.get();
+        // Frames are still consumed until transfer ends
+        failed = data == nullptr;
+    }
+    /*
+     * Constructor used for decoding to a sink
+     */
+    BusData(uint8_t peer, uint32_t len, BusDataSink* sink)
+        : BusData(peer, nullptr, len) {
+        this->sink = sink;
+    }
+    ~BusData() {
+        if (sink != nullptr && !isDecoded())
+            sink->abort();
+    }
+
+    /*
+     * Next BusData received from peer is passed to this sink if it accepts
+     * it. Sink is used only once, so it must be set again for each transfer.
+     * Sinks are kept per peer, so that a request from one peer doesn't take
+     * over a transfer that another one was told to send. Setting another
+     * sink for the same peer replaces the one it had.
+     */
+    static void setStreamSink(uint8_t peer, BusDataSink* new_sink) {
+        stream_sinks[peer & 0x0f] = new_sink;
     }
 
     bool isAllocated() const {
         return data != nullptr;
     }
+    /*
+     * Payload was dropped, because it didn't fit bus allocator or couldn't
+     * be decoded
+     */
+    bool isFailed() const {
+        return failed;
+    }
+    const uint8_t* getData() const {
+        return data;
+    }
+    uint32_t getLength() const {
+        return len;
+    }
     /*
      * Frame decoding functions
      */
     bool isDecoded() const {
         return frames_remaining == FRAMES_UNKNOWN;
     }
-    static BusProtocolObject* decodeFrame(const BusFrame& frame);
+    /*
+     * Returns empty pointer if FEC block size in header is out of range
+     */
+    static BusObjectPtr decodeFrame(const BusFrame& frame);
     BusData& operator<<(const BusFrame& frame);
+    /*
+     * Frames were lost before next frame. Returns false if transfer can't
+     * be completed, it's then failed and the rest of its frames are only
+     * counted, so that none of them is taken for a header.
+     */
+    bool erase(uint8_t frames);
+    /*
+     * Another transfer started before this one ended, it's failed and
+     * decoded
+     */
+    void abort();
     /*
      * Frame encoding functions
      */
     bool isEncoded() const {
-        return bool(bytes_remaining);
+        return bytes_remaining || parity_remaining || crc_remaining;
     }
+    /*
+     * Send with FEC in blocks of 1 << shift frames, 0 disables it. Must be
+     * called before encoding header, length must fit BUS_DATA_LEN_MASK.
+     */
+    void setFec(uint8_t shift);
     void encodeFrame(BusFrame& frame) const {
-        frame.fill(OWL_COMMAND_DATA | peer, len >> 16, len >> 8, len);
+        uint32_t header = len;
+        if (getFec() != nullptr)
+            header |= BUS_DATA_FEC_FLAG | (getFec()->shift - 1) << 20;
+        frame.fill(OWL_COMMAND_DATA | peer, header >> 16, header >> 8, header);
     }
     BusData& operator>>(BusFrame& frame);
 
+    static const BusDataFecStats& getFecStats() {
+        return fec_stats;
+    }
+    static const BusDataLzStats& getLzStats() {
+        return lz_stats;
+    }
+
 private:
+    BusDataFec* getFec() const {
+        return reinterpret_cast<BusDataFec*>(fec.get());
+    }
+    void startFec(uint8_t shift);
+    void receiveFec(const uint8_t* data);
+    void finishBlock();
+    void checkCrc(const uint8_t* data);
+    BusDataLz* getLz() const {
+        return reinterpret_cast<BusDataLz*>(lz.get());
+    }
+    void startLz();
+    bool openLz();
+    /*
+     * Sink set for peer if it accepts payload size, it's then cleared
+     */
+    static BusDataSink* takeStreamSink(uint8_t peer, uint32_t size);
+    /*
+     * Received payload bytes, decompressed if needed
+     */
+    void writePayload(const uint8_t* bytes, size_t n);
+    /*
+     * Decoded bytes to sink or buffer
+     */
+    void output(const uint8_t* bytes, size_t n);
+    void closePayload(bool failed);
+    /*
+     * Release payload and fail transfer, frames are still counted
+     */
+    void drop();
+
+    BusBuffer buffer;
+    BusBuffer fec;
+    BusBuffer lz;
+    static BusDataFecStats fec_stats;
+    static BusDataLzStats lz_stats;
+    uint8_t parity_remaining = 0;
+    bool crc_remaining = false;
+    bool failed = false;
+    BusDataSink* sink = nullptr;
+    // Indexed by 4 bit peer id
+    static BusDataSink* volatile stream_sinks[0x10];
     const uint8_t* data;
     uint32_t len, bytes_remaining;
     uint32_t frames_remaining;
@@ -237,15 +667,54 @@ public:
         , msg(msg) {
         position = (uint8_t*)(const_cast<char*>(msg));
         len = std::find(msg, msg + max_msg_len, 0) - msg;
+        frames_remaining = len / 3;
         bytes_remaining = len;
         if (len % 3 == 0) // We want to force sending 0-filled frame
             bytes_remaining += 3;
     };
-    ~BusMessage() {
-        // Delete message data
-    };
-    static BusProtocolObject* decodeFrame(const BusFrame& frame);
+    /*
+     * Send message stored in a buffer from bus allocator. Buffer is released
+     * with this object.
+     */
+    BusMessage(uint8_t peer, BusBuffer&& text)
+        : BusMessage(peer, (const char*)text.get()) {
+        buffer = std::move(text);
+    }
+    /*
+     * Constructor used for decoding, message buffer is taken from bus
+     * allocator and released with this object.
+     */
+    explicit BusMessage(uint8_t peer)
+        : BusPeerObject(OWL_COMMAND_MESSAGE, peer)
+        , buffer(max_msg_len)
+        , msg((const char*)buffer.get())
+        , position(buffer.get())
+        , len(0)
+        , frames_remaining(0)
+        , bytes_remaining(0) {
+    }
+
+    const char* getMessage() const {
+        return msg;
+    }
+    /*
+     * Frame decoding functions. Message is complete when a frame containing
+     * terminating zero is received.
+     */
+    bool isDecoded() const {
+        return decoded;
+    }
+    static BusObjectPtr decodeFrame(const BusFrame& frame);
+    BusMessage& operator<<(const BusFrame& frame);
+    /*
+     * Frame encoding functions. Same as for BusData, isEncoded returns true
+     * while there are frames left to send.
+     */
+    bool isEncoded() const {
+        return bool(bytes_remaining);
+    }
     void encodeFrame(BusFrame& frame) {
+        frame.frame_buffer[0] = OWL_COMMAND_MESSAGE | peer;
         if (frames_remaining--) {
             frame.frame_buffer[1] = *position++;
             frame.frame_buffer[2] = *position++;
@@ -274,11 +743,24 @@ public:
     }
 
 private:
+    BusBuffer buffer;
     const char* msg;
     uint8_t* position;
     uint16_t len, frames_remaining, bytes_remaining;
+    bool decoded = false;
 };
 
+/*
+ * Access common base of any protocol object
+ */
+inline BusObject& getBusObject(BusProtocolObject& obj) {
+    return std::visit([](auto& o) -> BusObject& { return o; }, obj);
+}
+
+#if BUS_DATA_LZ == TRUE
+void printCompressionStats(BaseSequentialStream* chp);
+#endif
+
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,189 @@
+#pragma once
+#ifndef __BUS_TRANSPORT__
+#define __BUS_TRANSPORT__
+
+#include <algorithm>
+#include "main.hpp"
+#include "bus.hpp"
+#include "bus_dma_uart.hpp"
+#include "bus_loopback.hpp"
+
+namespace owpeer {
+
+/*
+ * Bus transport policy. UART threads are templated on it, so that the bus
+ * stack runs over any link that moves frames, or over memory without I/O.
+ * Transport provides static functions:
+ *
+ * start(baud) - start or restart link. Output that was already written is
+ *   sent at previous rate, reader that is waiting returns nothing.
+ * getBaud() - current rate
+ * read(data, len) - bulk read, blocks until at least one frame is available
+ *   and returns length of whole frames that were read, 0 if link was
+ *   restarted
+ * write(data, len) - bulk write of whole frames
+ * getQueued() - number of written bytes that are not on the wire yet
+ * print(chp) - link stats
+ */
+
+/*
+ * ChibiOS serial driver, takes an interrupt per byte
+ */
+template <SerialDriver* driver>
+class SerialTransport {
+public:
+    static void start(uint32_t baud) {
+        if (started) {
+            while (true) {
+                chSysLock();
+                bool empty = oqIsEmptyI(&driver->oqueue);
+                chSysUnlock();
+                if (empty)
+                    break;
+                chThdSleepMicroseconds(100);
+            }
+            // Last byte may still be in shift register, wait for 2 byte times
+            chThdSleepMicroseconds(20 * 1000000 / config.speed + 1);
+            sdStop(driver);
+        }
+        config.speed = baud;
+        sdStart(driver, &config);
+        started = true;
+    }
+
+    static uint32_t getBaud() {
+        return config.speed;
+    }
+
+    static size_t read(uint8_t* data, size_t len) {
+        // Partial frame is returned if port is restarted
+        if (sdRead(driver, data, frame_size) != frame_size)
+            return 0;
+        // Take frames that are already queued without blocking
+        chSysLock();
+        size_t full = iqGetFullI(&driver->iqueue);
+        chSysUnlock();
+        size_t more = std::min(full, len - frame_size) / frame_size;
+        if (more)
+            more = sdRead(driver, data + frame_size, more * frame_size) /
+                frame_size;
+        return (more + 1) * frame_size;
+    }
+
+    static void write(const uint8_t* data, size_t len) {
+        sdWrite(driver, data, len);
+    }
+
+    static size_t getQueued() {
+        chSysLock();
+        size_t queued = oqGetFullI(&driver->oqueue);
+        chSysUnlock();
+        return queued;
+    }
+
+    static void print(BaseSequentialStream* chp) {
+        chprintf(chp, "serial %u baud\r\n", config.speed);
+    }
+
+private:
+    static SerialConfig config;
+    static bool started;
+};
+
+template <SerialDriver* driver>
+SerialConfig SerialTransport<driver>::config = {BUS_BAUD, 0, 0, 0};
+
+template <SerialDriver* driver>
+bool SerialTransport<driver>::started = false;
+
+/*
+ * UART with circular receive DMA, see BusDmaUart. The same policy would wrap
+ * a DMA driven SPI link.
+ */
+class DmaUartTransport {
+public:
+    static void start(uint32_t baud) {
+        bus_dma_uart.start(baud);
+    }
+
+    static uint32_t getBaud() {
+        return bus_dma_uart.getBaud();
+    }
+
+    static size_t read(uint8_t* data, size_t len) {
+        return bus_dma_uart.read(data, len);
+    }
+
+    static void write(const uint8_t* data, size_t len) {
+        bus_dma_uart.write(data, len);
+    }
+
+    // Write returns when DMA transfer is complete
+    static size_t getQueued() {
+        return 0;
+    }
+
+    static void print(BaseSequentialStream* chp) {
+        bus_dma_uart.print(chp);
+    }
+};
+
+/*
+ * Output is looped back to input in memory, device works as a bus with a
+ * single peer. Protocol cost can be measured without any I/O.
+ */
+class LoopbackTransport {
+public:
+    static void start(uint32_t baud) {
+        bus_loopback.start(baud);
+    }
+
+    static uint32_t getBaud() {
+        return bus_loopback.getBaud();
+    }
+
+    static size_t read(uint8_t* data, size_t len) {
+        return bus_loopback.read(data, len);
+    }
+
+    static void write(const uint8_t* data, size_t len) {
+        bus_loopback.write(data, len);
+    }
+
+    static size_t getQueued() {
+        return 0;
+    }
+
+    static void print(BaseSequentialStream* chp) {
+        bus_loopback.print(chp);
+    }
+};
+
+#if BUS_TRANSPORT == BUS_TRANSPORT_SERIAL
+using BusTransport = SerialTransport<&BUS_SERIAL>;
+#elif BUS_TRANSPORT == BUS_TRANSPORT_DMA_UART
+using BusTransport = DmaUartTransport;
+#elif BUS_TRANSPORT == BUS_TRANSPORT_LOOPBACK
+using BusTransport = LoopbackTransport;
+#else
+#error "Unknown BUS_TRANSPORT"
+#endif
+
+/*
+ * Set initial rate, later changes are done by UART Tx thread
+ */
+inline void setBusBaud(uint32_t baud) {
+    BusTransport::start(baud);
+}
+
+inline uint32_t getBusBaud() {
+    return BusTransport::getBaud();
+}
+
+inline void printTransportStats(BaseSequentialStream* chp) {
+    BusTransport::print(chp);
+}
+
+}
+
+#endif
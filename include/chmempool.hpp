@@ -5,11 +5,32 @@
 
 namespace chibios_rt {
 
+/**
+ * @brief   Guarded memory pools statistics.
+ * @details If enabled, pools count current and peak number of allocated
+ *          objects and time spent blocked waiting for a free object.
+ */
+#if !defined(CH_DBG_MEMPOOLS_STATISTICS) || defined(__DOXYGEN__)
+#define CH_DBG_MEMPOOLS_STATISTICS          FALSE
+#endif
+
 #if ((CH_CFG_USE_MEMPOOLS == TRUE) && (CH_CFG_USE_SEMAPHORES == TRUE)) ||      \
     defined(__DOXYGEN__)
 /*------------------------------------------------------------------------*
  * chibios_rt::GuardedMemoryPool                                                 *
  *------------------------------------------------------------------------*/
+/**
+ * @brief   Guarded memory pool usage counters.
+ * @note    Wait times are in system ticks.
+ */
+struct MemoryPoolStats {
+    size_t used;
+    size_t used_peak;
+    uint32_t allocs;
+    uint32_t waits;
+    sysinterval_t wait_time;
+};
+
 /**
  * @brief   Class encapsulating a memory pool.
  */
@@ -19,6 +40,18 @@ class GuardedMemoryPool {
      */
     guarded_memory_pool_t pool;
 
+#if (CH_DBG_MEMPOOLS_STATISTICS == TRUE) || defined(__DOXYGEN__)
+    MemoryPoolStats stats = MemoryPoolStats();
+
+    void countAllocI(void* objp) {
+        if (objp != nullptr) {
+            stats.allocs++;
+            if (++stats.used > stats.used_peak)
+                stats.used_peak = stats.used;
+        }
+    }
+#endif
+
 public:
     /**
      * @brief   GuardedMemoryPool constructor.
@@ -88,7 +121,14 @@ public:
      */
     void* allocTimeout(sysinterval_t timeout) {
 
+#if CH_DBG_MEMPOOLS_STATISTICS == TRUE
+        chSysLock();
+        void* objp = allocTimeoutS(timeout);
+        chSysUnlock();
+        return objp;
+#else
         return chGuardedPoolAllocTimeout(&pool, timeout);
+#endif
     }
 
     /**
@@ -104,7 +144,19 @@ public:
      */
     void* allocTimeoutS(sysinterval_t timeout) {
 
+#if CH_DBG_MEMPOOLS_STATISTICS == TRUE
+        void* objp = chGuardedPoolAllocTimeoutS(&pool, TIME_IMMEDIATE);
+        if (objp == nullptr && timeout != TIME_IMMEDIATE) {
+            systime_t start = chVTGetSystemTimeX();
+            objp = chGuardedPoolAllocTimeoutS(&pool, timeout);
+            stats.waits++;
+            stats.wait_time += chVTTimeElapsedSinceX(start);
+        }
+        countAllocI(objp);
+        return objp;
+#else
         return chGuardedPoolAllocTimeoutS(&pool, timeout);
+#endif
     }
 
     /**
@@ -120,6 +172,11 @@ public:
      * @iclassb
      */
     void free(void* objp) {
+#if CH_DBG_MEMPOOLS_STATISTICS == TRUE
+        chSysLock();
+        stats.used--;
+        chSysUnlock();
+#endif
         chGuardedPoolFree(&pool, objp);
     }
 
@@ -138,8 +195,25 @@ public:
      * @iclass
      */
     void freeI(void* objp) {
+#if CH_DBG_MEMPOOLS_STATISTICS == TRUE
+        stats.used--;
+#endif
         chGuardedPoolFreeI(&pool, objp);
     }
+
+#if (CH_DBG_MEMPOOLS_STATISTICS == TRUE) || defined(__DOXYGEN__)
+    /**
+     * @brief   Returns a snapshot of usage counters.
+     *
+     * @api
+     */
+    MemoryPoolStats getStats() {
+        chSysLock();
+        MemoryPoolStats snapshot = stats;
+        chSysUnlock();
+        return snapshot;
+    }
+#endif
 };
 
 /*------------------------------------------------------------------------*
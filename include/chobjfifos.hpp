@@ -1,16 +1,44 @@
 #ifndef CHOBJFIFOS_HPP
 #define CHOBJFIFOS_HPP
 
+#include <new>
+#include <utility>
+#include <type_traits>
 #include "ch.hpp"
 #include "chmempool.hpp"
 
 namespace chibios_rt {
 
+/**
+ * @brief   Objects FIFO statistics.
+ * @details If enabled, FIFOs count current and peak number of taken and
+ *          posted objects and time producers spent blocked waiting for
+ *          free objects.
+ */
+#if !defined(CH_DBG_OBJ_FIFOS_STATISTICS) || defined(__DOXYGEN__)
+#define CH_DBG_OBJ_FIFOS_STATISTICS         FALSE
+#endif
 
 #if (CH_CFG_USE_OBJ_FIFOS == TRUE) || defined(__DOXYGEN__)
 /*------------------------------------------------------------------------*
  * chibios_rt::Fifo                                                       *
  *------------------------------------------------------------------------*/
+/**
+ * @brief   Objects FIFO usage counters.
+ * @note    Wait times are in system ticks.
+ */
+struct FifoStats {
+    size_t num;
+    size_t used;
+    size_t used_peak;
+    size_t pending;
+    size_t pending_peak;
+    uint32_t takes;
+    uint32_t sends;
+    uint32_t take_waits;
+    sysinterval_t take_wait_time;
+};
+
 /**
  * @brief   Class encapsulating an objects FIFO queue.
  */
@@ -20,6 +48,60 @@ class Fifo {
      */
     objects_fifo_t fifo;
 
+    /**
+     * @brief   Number of high priority objects at the head of the queue.
+     */
+    size_t ahead = 0;
+
+    /**
+     * @brief   Moves object that was just posted ahead behind the other high
+     *          priority objects, so that they are received in FIFO order.
+     */
+    void orderAheadI() {
+        mailbox_t* mbp = &fifo.mbx;
+        msg_t* p = mbp->rdptr;
+        msg_t msg = *p;
+        for (size_t i = 0; i < ahead; i++) {
+            msg_t* next = p + 1 < mbp->top ? p + 1 : mbp->buffer;
+            *p = *next;
+            p = next;
+        }
+        *p = msg;
+        ahead++;
+    }
+
+    void countAheadI(msg_t msg) {
+        if (msg == MSG_OK && ahead > 0)
+            ahead--;
+    }
+
+#if (CH_DBG_OBJ_FIFOS_STATISTICS == TRUE) || defined(__DOXYGEN__)
+    FifoStats stats;
+
+    void countTakeI(void* objp) {
+        if (objp != nullptr) {
+            stats.takes++;
+            if (++stats.used > stats.used_peak)
+                stats.used_peak = stats.used;
+        }
+    }
+
+    void countReturnI() {
+        stats.used--;
+    }
+
+    void countSendI() {
+        stats.sends++;
+        if (++stats.pending > stats.pending_peak)
+            stats.pending_peak = stats.pending;
+    }
+
+    void countReceiveI(msg_t msg) {
+        if (msg == MSG_OK)
+            stats.pending--;
+    }
+#endif
+
 public:
     /**
      * @brief   Initializes a FIFO object.
@@ -39,6 +121,10 @@ public:
     Fifo(size_t size, size_t n, void* buf, msg_t* msgbuf)
         : fifo() {
         chFifoObjectInit(&fifo, size, n, buf, msgbuf);
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        stats = FifoStats();
+        stats.num = n;
+#endif
     }
 
     /* Prohibit copy construction and assignment, but allow move.*/
@@ -56,7 +142,13 @@ public:
      * @iclass
      */
     void* takeObjectI(){
-        return chFifoTakeObjectI(&fifo);        
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        void* objp = chFifoTakeObjectI(&fifo);
+        countTakeI(objp);
+        return objp;
+#else
+        return chFifoTakeObjectI(&fifo);
+#endif
     }
 
     /**
@@ -74,7 +166,19 @@ public:
      * @sclass
      */
     void* takeObjectTimeoutS(sysinterval_t timeout) {
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        void* objp = chFifoTakeObjectTimeoutS(&fifo, TIME_IMMEDIATE);
+        if (objp == nullptr && timeout != TIME_IMMEDIATE) {
+            systime_t start = chVTGetSystemTimeX();
+            objp = chFifoTakeObjectTimeoutS(&fifo, timeout);
+            stats.take_waits++;
+            stats.take_wait_time += chVTTimeElapsedSinceX(start);
+        }
+        countTakeI(objp);
+        return objp;
+#else
         return chFifoTakeObjectTimeoutS(&fifo, timeout);
+#endif
     }
 
     /**
@@ -92,7 +196,14 @@ public:
      * @api
      */
     void* takeObjectTimeout(sysinterval_t timeout) {
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        chSysLock();
+        void* objp = takeObjectTimeoutS(timeout);
+        chSysUnlock();
+        return objp;
+#else
         return chFifoTakeObjectTimeout(&fifo, timeout);
+#endif
     }
 
     /**
@@ -103,6 +214,9 @@ public:
      * @iclass
      */
     void returnObjectI(void* objp){
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        countReturnI();
+#endif
         return chFifoReturnObjectI(&fifo, objp);
     }
 
@@ -114,6 +228,9 @@ public:
      * @sclass
      */
     void returnObjectS(void* objp){
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        countReturnI();
+#endif
         return chFifoReturnObjectS(&fifo, objp);
     }
 
@@ -125,7 +242,13 @@ public:
      * @api
      */
     void returnObject(void* objp){
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        chSysLock();
+        returnObjectS(objp);
+        chSysUnlock();
+#else
         return chFifoReturnObject(&fifo, objp);
+#endif
     }
 
     /**
@@ -137,6 +260,9 @@ public:
      * @iclass
      */
     void sendObjectI(void* objp){
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        countSendI();
+#endif
         return chFifoSendObjectI(&fifo, objp);
     }
 
@@ -149,6 +275,9 @@ public:
      * @sclass
      */
     void sendObjectS(void* objp){
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        countSendI();
+#endif
         return chFifoSendObjectS(&fifo, objp);
     }
 
@@ -161,11 +290,19 @@ public:
      * @api
      */
     void sendObject(void* objp){
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        chSysLock();
+        sendObjectS(objp);
+        chSysUnlock();
+#else
         return chFifoSendObject(&fifo, objp);
+#endif
     }
     
     /**
      * @brief   Posts an high priority object.
+     * @details Object is received before normal objects, but after high
+     *          priority objects that are already queued.
      * @note    By design the object can be always immediately posted.
      *
      * @param[in] objp      pointer to the object to be released
@@ -173,11 +310,17 @@ public:
      * @iclass
      */
     void sendObjectAheadI(void* objp){
-        return chFifoSendObjectAheadI(&fifo, objp);
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        countSendI();
+#endif
+        chFifoSendObjectAheadI(&fifo, objp);
+        orderAheadI();
     }                                            
 
     /**
      * @brief   Posts an high priority object.
+     * @details Object is received before normal objects, but after high
+     *          priority objects that are already queued.
      * @note    By design the object can be always immediately posted.
      *
      * @param[in] objp      pointer to the object to be released
@@ -185,11 +328,15 @@ public:
      * @sclass
      */
     void sendObjectAheadS(void* objp){
-        return chFifoSendObjectAheadS(&fifo, objp);
+        // Receiver may only run once object is in place
+        sendObjectAheadI(objp);
+        chSchRescheduleS();
     }
 
     /**
      * @brief   Posts an high priority object.
+     * @details Object is received before normal objects, but after high
+     *          priority objects that are already queued.
      * @note    By design the object can be always immediately posted.
      *
      * @param[in] objp      pointer to the object to be released
@@ -197,7 +344,9 @@ public:
      * @api
      */
     void sendObjectAhead(void* objp){
-        return chFifoSendObjectAhead(&fifo, objp);
+        chSysLock();
+        sendObjectAheadS(objp);
+        chSysUnlock();
     }
 
     /**
@@ -210,7 +359,12 @@ public:
      * @iclass
      */
     msg_t receiveObjectI(void** objpp){
-        return chFifoReceiveObjectI(&fifo, objpp);
+        msg_t msg = chFifoReceiveObjectI(&fifo, objpp);
+        countAheadI(msg);
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        countReceiveI(msg);
+#endif
+        return msg;
     }
 
     /**
@@ -227,7 +381,13 @@ public:
      * @sclass
      */
     msg_t receiveObjectTimeoutS(void** objpp, sysinterval_t timeout){
-        return chFifoReceiveObjectTimeoutS(&fifo, objpp, timeout);
+        // Consumer waits while it's idle, so this is not counted
+        msg_t msg = chFifoReceiveObjectTimeoutS(&fifo, objpp, timeout);
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+        countReceiveI(msg);
+#endif
+        countAheadI(msg);
+        return msg;
     }
 
     /**
@@ -244,8 +404,25 @@ public:
      * @api
      */
     msg_t receiveObjectTimeout(void** objpp, sysinterval_t timeout){
-        return chFifoReceiveObjectTimeout(&fifo, objpp, timeout);
+        chSysLock();
+        msg_t msg = receiveObjectTimeoutS(objpp, timeout);
+        chSysUnlock();
+        return msg;
     }
+
+#if (CH_DBG_OBJ_FIFOS_STATISTICS == TRUE) || defined(__DOXYGEN__)
+    /**
+     * @brief   Returns a snapshot of usage counters.
+     *
+     * @api
+     */
+    FifoStats getStats() {
+        chSysLock();
+        FifoStats snapshot = stats;
+        chSysUnlock();
+        return snapshot;
+    }
+#endif
 };
 
 /*------------------------------------------------------------------------*
@@ -260,6 +437,11 @@ class ObjectsFifo : public Fifo {
     msg_t mb_buf[N];
     
 public:
+    /**
+     * @brief   Type of objects stored in this FIFO.
+     */
+    using object_type = T;
+
     /**
      * @brief   ObjectsFifo constructor.
      *
@@ -504,6 +686,145 @@ public:
     }       
 };
 
+/*------------------------------------------------------------------------*
+ * chibios_rt::PoolPtr                                                    *
+ *------------------------------------------------------------------------*/
+/**
+ * @brief   Move-only owning pointer to an object from @p ObjectsFifo.
+ * @details The FIFO is a template parameter, so this has the size of a
+ *          single pointer and no vtable. Object is constructed in place
+ *          when taken from FIFO, then either posted with @p send() or
+ *          destroyed and returned to FIFO when pointer goes out of scope.
+ *          Receiving side wraps fetched objects with @p receive(), so
+ *          objects are always returned after processing.
+ *
+ * @tparam F            reference to the @p ObjectsFifo owning objects
+ */
+template <auto& F>
+class PoolPtr {
+public:
+    using fifo_type = std::remove_reference_t<decltype(F)>;
+    using element_type = typename fifo_type::object_type;
+
+    PoolPtr() = default;
+
+    /**
+     * @brief   Adopts an object that was taken or received from FIFO.
+     *
+     * @param[in] objp      pointer to a constructed object
+     */
+    explicit PoolPtr(element_type* objp) : ptr(objp) {};
+
+    ~PoolPtr() {
+        reset();
+    }
+
+    /* Prohibit copy construction and assignment, but allow move.*/
+    PoolPtr(const PoolPtr&) = delete;
+    PoolPtr& operator=(const PoolPtr&) = delete;
+    PoolPtr(PoolPtr&& other) : ptr(other.release()) {};
+    PoolPtr& operator=(PoolPtr&& other) {
+        if (this != &other) {
+            reset();
+            ptr = other.release();
+        }
+        return *this;
+    }
+
+    /**
+     * @brief   Takes a free object from FIFO with infinite timeout and
+     *          constructs it in place.
+     *
+     * @param[in] args      arguments for object constructor
+     * @return              Pointer owning the new object.
+     *
+     * @api
+     */
+    template <typename... Args>
+    static PoolPtr make(Args&&... args) {
+        auto objp = F.takeObjectTimeoutInfinite();
+        return PoolPtr(new (objp) element_type(std::forward<Args>(args)...));
+    }
+
+    /**
+     * @brief   Fetches a posted object.
+     *
+     * @param[in] timeout   the number of ticks before the operation timeouts,
+     *                      the following special values are allowed:
+     *                      - @a TIME_IMMEDIATE immediate timeout.
+     *                      - @a TIME_INFINITE no timeout.
+     * @return              Pointer owning fetched object, empty on timeout.
+     *
+     * @api
+     */
+    static PoolPtr receive(sysinterval_t timeout) {
+        element_type* objp;
+        if (F.receiveObjectTimeout(&objp, timeout) == MSG_OK)
+            return PoolPtr(objp);
+        return PoolPtr();
+    }
+
+    /**
+     * @brief   Posts owned object, ownership is passed to receiver.
+     *
+     * @api
+     */
+    void send() {
+        F.sendObject(release());
+    }
+
+    /**
+     * @brief   Posts owned object as high priority, ownership is passed to
+     *          receiver.
+     *
+     * @api
+     */
+    void sendAhead() {
+        F.sendObjectAhead(release());
+    }
+
+    /**
+     * @brief   Destroys owned object and returns it to FIFO.
+     *
+     * @api
+     */
+    void reset() {
+        if (ptr != nullptr) {
+            ptr->~element_type();
+            F.returnObject(ptr);
+            ptr = nullptr;
+        }
+    }
+
+    /**
+     * @brief   Gives up ownership without destroying object.
+     */
+    element_type* release() {
+        element_type* objp = ptr;
+        ptr = nullptr;
+        return objp;
+    }
+
+    element_type* get() const {
+        return ptr;
+    }
+
+    element_type& operator*() const {
+        return *ptr;
+    }
+
+    element_type* operator->() const {
+        return ptr;
+    }
+
+    explicit operator bool() const {
+        return ptr != nullptr;
+    }
+
+private:
+    element_type* ptr = nullptr;
+};
+
 #endif
 
 }
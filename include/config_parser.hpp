@@ -0,0 +1,185 @@
+#pragma once
+#ifndef __CONFIG_PARSER__
+#define __CONFIG_PARSER__
+
+#include <array>
+#include "main.hpp"
+#include "bus_protocol.hpp"
+#include "settings_store.hpp"
+
+namespace owpeer {
+
+/*
+ * SysEx configuration keys from OpenWareMidiControl.h
+ */
+static constexpr uint16_t config_keys[] = {
+    settingsKey(SYSEX_CONFIGURATION_AUDIO_RATE),
+    settingsKey(SYSEX_CONFIGURATION_AUDIO_BITDEPTH),
+    settingsKey(SYSEX_CONFIGURATION_AUDIO_DATAFORMAT),
+    settingsKey(SYSEX_CONFIGURATION_AUDIO_BLOCKSIZE),
+    settingsKey(SYSEX_CONFIGURATION_CODEC_SWAP),
+    settingsKey(SYSEX_CONFIGURATION_CODEC_BYPASS),
+    settingsKey(SYSEX_CONFIGURATION_CODEC_INPUT_GAIN),
+    settingsKey(SYSEX_CONFIGURATION_CODEC_OUTPUT_GAIN),
+    settingsKey(SYSEX_CONFIGURATION_PC_BUTTON),
+    settingsKey(SYSEX_CONFIGURATION_INPUT_OFFSET),
+    settingsKey(SYSEX_CONFIGURATION_INPUT_SCALAR),
+    settingsKey(SYSEX_CONFIGURATION_OUTPUT_OFFSET),
+    settingsKey(SYSEX_CONFIGURATION_OUTPUT_SCALAR),
+    settingsKey(SYSEX_CONFIGURATION_MIDI_INPUT_CHANNEL),
+    settingsKey(SYSEX_CONFIGURATION_MIDI_OUTPUT_CHANNEL),
+    settingsKey(SYSEX_CONFIGURATION_DIGITAL_BUS_ENABLE),
+    settingsKey(SYSEX_CONFIGURATION_DIGITAL_BUS_FORWARD_MIDI),
+    settingsKey(SYSEX_CONFIGURATION_DIGITAL_BUS_PEERS),
+    settingsKey(SYSEX_CONFIGURATION_DIGITAL_BUS_STATUS),
+};
+
+static constexpr size_t config_keys_num =
+    sizeof(config_keys) / sizeof(config_keys[0]);
+
+static constexpr size_t config_hash_bits = 5;
+
+static constexpr size_t configHash(uint16_t key, uint32_t multiplier) {
+    return uint16_t(key * multiplier) >> (16 - config_hash_bits);
+}
+
+static constexpr bool isPerfectConfigHash(uint32_t multiplier) {
+    bool used[1 << config_hash_bits] = {};
+    for (size_t i = 0; i < config_keys_num; i++) {
+        size_t slot = configHash(config_keys[i], multiplier);
+        if (used[slot])
+            return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+/*
+ * Smallest odd multiplier that maps each key to its own slot
+ */
+static constexpr uint32_t findConfigHashMultiplier() {
+    for (uint32_t multiplier = 1; multiplier < 0x10000; multiplier += 2) {
+        if (isPerfectConfigHash(multiplier))
+            return multiplier;
+    }
+    return 0;
+}
+
+static constexpr uint32_t config_hash_multiplier = findConfigHashMultiplier();
+
+static_assert(config_hash_multiplier != 0, "No perfect hash for config keys");
+
+static constexpr std::array<int8_t, 1 << config_hash_bits>
+makeConfigHashTable() {
+    std::array<int8_t, 1 << config_hash_bits> table = {};
+    for (size_t i = 0; i < table.size(); i++)
+        table[i] = -1;
+    for (size_t i = 0; i < config_keys_num; i++)
+        table[configHash(config_keys[i], config_hash_multiplier)] = i;
+    return table;
+}
+
+/*
+ * Index in config_keys for each hash slot, -1 if slot is free
+ */
+static constexpr std::array<int8_t, 1 << config_hash_bits> config_hash_table =
+    makeConfigHashTable();
+
+/*
+ * Streaming parser for SysEx configuration records, as in OpenWare: 2
+ * character key followed by hex value, i.e. "FSbb80" or "IO-1a". Records are
+ * separated by space, comma or any control character, so that includes
+ * SYSEX_CONFIGURATION_COMMAND byte of a SysEx message and terminating zero.
+ *
+ * Input may be split anywhere, nothing is buffered apart from the record
+ * being parsed. Keys are looked up with a perfect hash of config_keys that is
+ * found at compile time. Records with unknown keys or malformed values are
+ * skipped.
+ *
+ * Configuration is streamed as BusData after BusCommand
+ * SYSEX_CONFIGURATION_COMMAND, or sent as BusMessage that starts with
+ * SYSEX_CONFIGURATION_COMMAND byte. Both are parsed on frame decoder thread,
+ * which only queues records for message handler.
+ */
+class ConfigParser : public BusDataSink {
+public:
+    /*
+     * Returns false if value was not accepted
+     */
+    typedef bool (*ApplyCallback)(uint16_t key, int32_t value);
+
+    ConfigParser(ApplyCallback apply)
+        : apply(apply) {
+    }
+
+    bool open(uint32_t len) override;
+    void write(const uint8_t* data, size_t len) override;
+    void close() override;
+    void abort() override;
+
+    /*
+     * Index in config_keys, -1 if key is unknown
+     */
+    static int findKey(uint16_t key) {
+        int index = config_hash_table[configHash(key, config_hash_multiplier)];
+        return index >= 0 && config_keys[index] == key ? index : -1;
+    }
+
+    /*
+     * Format record without terminator, buffer must hold 11 characters.
+     * Returns record length.
+     */
+    static size_t format(char* buf, uint16_t key, int32_t value);
+
+    /*
+     * Count record that was passed on but not applied
+     */
+    static void refuse() {
+        refused++;
+    }
+
+    static void print(BaseSequentialStream* chp);
+
+private:
+    enum State : uint8_t {
+        KEY,
+        KEY_LOW,
+        SIGN,
+        VALUE,
+        SKIP,
+    };
+
+    void finish();
+
+    ApplyCallback apply;
+    State state = KEY;
+    bool negative = false;
+    uint8_t digits = 0;
+    uint16_t key = 0;
+    uint32_t value = 0;
+    // Stats, shared by all parsers
+    static uint32_t records;
+    static uint32_t rejected;
+    static uint32_t refused;
+    static uint32_t errors;
+};
+
+#if BUS_CONFIG_PARSER == TRUE
+/*
+ * Sends record to message handler, called from frame decoder
+ */
+bool queueConfiguration(uint16_t key, int32_t value);
+
+/*
+ * Writes value to settings, called from message handler
+ */
+bool applyConfiguration(uint16_t key, int32_t value);
+
+extern ConfigParser config_parser;
+
+void printConfigStats(BaseSequentialStream* chp);
+#endif
+
+}
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+#ifndef __CRC32__
+#define __CRC32__
+
+#include <cstdint>
+
+namespace owpeer {
+
+/*
+ * CRC-32 as used by zlib, with 4 bit lookup table. Start with 0xffffffff,
+ * result is inverted.
+ */
+inline uint32_t updateCrc(uint32_t crc, uint8_t byte) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    crc = table[(crc ^ byte) & 0x0f] ^ (crc >> 4);
+    crc = table[(crc ^ (byte >> 4)) & 0x0f] ^ (crc >> 4);
+    return crc;
+}
+
+}
+
+#endif
@@ -0,0 +1,29 @@
+#pragma once
+#ifndef __DEBUG_CONSOLE__
+#define __DEBUG_CONSOLE__
+
+#include "main.hpp"
+
+namespace owpeer {
+
+/*
+ * Line based command console on debug serial port. Command name is followed
+ * by an optional argument, i.e. "stats pools".
+ */
+class DebugConsoleThread : public BaseStaticThread<512> {
+public:
+    struct Command {
+        const char* name;
+        void (*handler)(BaseSequentialStream* chp, const char* arg);
+    };
+
+private:
+    void main (void) override;
+
+    static constexpr size_t max_line_len = 32;
+    char line[max_line_len];
+};
+
+}
+
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+#ifndef __DEVICE_STATS__
+#define __DEVICE_STATS__
+
+#include "main.hpp"
+
+namespace owpeer {
+
+/*
+ * Device stats are split into sections printed as text. The same output is
+ * used by debug console and in SYSEX_DEVICE_STATS responses, where a
+ * section is split at line ends into as many BusMessages as it needs.
+ */
+struct StatsSection {
+    const char* name;
+    void (*print)(BaseSequentialStream* chp);
+};
+
+extern const StatsSection stats_sections[];
+extern const size_t stats_sections_num;
+
+/*
+ * Print section by name, all sections are printed if name is nullptr.
+ * Returns false if there is no such section.
+ */
+bool printDeviceStats(BaseSequentialStream* chp, const char* name);
+
+/*
+ * Format section to a zero-terminated string, output is truncated to fit
+ * buffer. Returns false if section doesn't exist.
+ */
+bool formatDeviceStats(size_t section, char* buf, size_t size);
+
+/*
+ * Length of the next message of split text, up to max_len characters and
+ * ending after the last complete line that fits. Lines longer than max_len
+ * are cut.
+ */
+inline size_t getStatsMessageLength(const char* text, size_t max_len) {
+    size_t len = 0;
+    size_t line_end = 0;
+    while (len < max_len && text[len] != '\0') {
+        if (text[len++] == '\n')
+            line_end = len;
+    }
+    if (text[len] == '\0' || line_end == 0)
+        return len;
+    return line_end;
+}
+
+void printPoolStats(BaseSequentialStream* chp);
+
+}
+
+#endif
@@ -0,0 +1,139 @@
+#pragma once
+#ifndef __FIRMWARE_UPDATER__
+#define __FIRMWARE_UPDATER__
+
+#include "main.hpp"
+#include "bus_protocol.hpp"
+#include "flash_storage.hpp"
+
+namespace owpeer {
+
+enum FirmwareUploadOption {
+    FIRMWARE_UPLOAD_LZ = 0x01,
+};
+
+/*
+ * Page of firmware data passed from frame decoder to writer thread. The same
+ * objects carry erase and verify requests.
+ */
+struct FirmwarePage {
+    enum Type {
+        ERASE,
+        PROGRAM,
+        VERIFY,
+    };
+    Type type;
+    uint32_t offset;
+    uint32_t len;
+    uint8_t data[FIRMWARE_PAGE_SIZE];
+};
+
+/*
+ * Firmware upload that is written to a staging flash sector while it's
+ * received.
+ *
+ * Upload is started with SYSEX_FIRMWARE_UPLOAD command. Staging sector is
+ * erased by writer thread unless it's blank, then the peer replies with
+ * SYSEX_FIRMWARE_UPLOAD and progress 0 and accepts the next BusData as
+ * firmware. Command is refused with -1 while writer is busy. Payload is the image followed
+ * by its CRC-32 (as in zlib, little endian).
+ *
+ * Command data holds upload options. FIRMWARE_UPLOAD_LZ asks to send payload
+ * compressed, peers that can't decompress it reply with -1 and uploader
+ * falls back to plain transfer.
+ *
+ * Received bytes are collected in pages. Full pages are programmed by writer
+ * thread while decoder fills the other one, decoder only waits if both pages
+ * are pending. When transfer ends, image is read back from flash and checked
+ * against CRC. Progress is reported in percent every 10%, 100 means that
+ * image was verified and -1 is sent on error.
+ *
+ * SYSEX_FIRMWARE_STORE saves size and CRC of verified image in settings,
+ * installing it is left to bootloader.
+ */
+class FirmwareUpdater : public BusDataSink {
+public:
+    enum State {
+        IDLE,
+        ERASING,
+        READY,
+        RECEIVING,
+        VERIFYING,
+        DONE,
+        ERROR,
+    };
+
+    FirmwareUpdater(FlashStorage& storage, uint8_t sector)
+        : storage(storage)
+        , sector(sector) {
+    }
+
+    /*
+     * Prepare for upload from given peer. Called from message handler.
+     */
+    void begin(uint8_t peer, uint16_t options);
+
+    /*
+     * Save verified image info. Called from message handler.
+     */
+    bool store();
+
+    bool open(uint32_t len) override;
+    void write(const uint8_t* data, size_t len) override;
+    void close() override;
+    void abort() override;
+
+    /*
+     * Process pages, called from writer thread
+     */
+    void process();
+
+    State getState() const {
+        return state;
+    }
+
+    void print(BaseSequentialStream* chp) const;
+
+private:
+    bool isErased() const;
+    void submit();
+    void program(FirmwarePage& next);
+    void verify();
+    void report(int16_t progress);
+
+    FlashStorage& storage;
+    uint8_t sector;
+    ObjectsFifo<FirmwarePage, 2> pages;
+    FirmwarePage* page = nullptr;
+    volatile State state = IDLE;
+    uint8_t peer = 0;
+    uint32_t size = 0;
+    uint32_t received = 0;
+    uint32_t written = 0;
+    uint32_t crc = 0;
+    uint32_t expected_crc = 0;
+    int16_t reported = 0;
+    // Stats
+    systime_t start_time = 0;
+    sysinterval_t transfer_time = 0;
+    uint32_t page_waits = 0;
+    uint32_t program_errors = 0;
+};
+
+/*
+ * Thread that erases and programs flash for firmware updater
+ */
+class FirmwareWriterThread : public BaseStaticThread<256> {
+private:
+    void main() override;
+};
+
+#if FIRMWARE_UPDATER == TRUE
+extern FirmwareUpdater firmware_updater;
+
+void printFirmwareStats(BaseSequentialStream* chp);
+#endif
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+#pragma once
+#ifndef __FLASH_STORAGE__
+#define __FLASH_STORAGE__
+
+#include <cstddef>
+#include <cstdint>
+#include "ch.hpp"
+#include "owpeer.h"
+
+namespace owpeer {
+
+/*
+ * Persistent storage made of independently erasable sectors. Erased sector
+ * reads as 0xff, programming can only clear bits and is done in 32-bit words,
+ * so offset and length must be word aligned.
+ *
+ * Users access storage through this interface only, which allows replacing
+ * internal flash with a file or RAM backed implementation.
+ */
+class FlashStorage {
+public:
+    static constexpr uint32_t erased_word = 0xffffffff;
+
+    virtual size_t getSectorSize(uint8_t sector) const = 0;
+    virtual bool read(
+        uint8_t sector, size_t offset, void* data, size_t len) const = 0;
+    virtual bool erase(uint8_t sector) = 0;
+    virtual bool program(
+        uint8_t sector, size_t offset, const void* data, size_t len) = 0;
+
+protected:
+    bool isValid(uint8_t sector, size_t offset, size_t len) const {
+        size_t size = getSectorSize(sector);
+        return size != 0 && (offset & 3) == 0 && (len & 3) == 0 &&
+            offset + len <= size;
+    }
+};
+
+/*
+ * STM32F4 internal flash. Sectors 0-3 are 16k, 4 is 64k, the rest are
+ * 128k. Flash is programmed with x32 parallelism, which requires 2.7-3.6V
+ * supply.
+ *
+ * CPU stalls on flash reads while erase or program operation is in
+ * progress, so erasing a large sector stops everything that runs from flash
+ * for up to a couple of seconds.
+ */
+class Stm32FlashStorage : public FlashStorage {
+public:
+    static constexpr uint8_t num_sectors = 8;
+    // Sectors 0-4 hold firmware, STM32F446xE_owpeer.ld keeps it there
+    static constexpr uint8_t firmware_sectors = 5;
+
+    size_t getSectorSize(uint8_t sector) const override;
+    bool read(
+        uint8_t sector, size_t offset, void* data, size_t len) const override;
+    bool erase(uint8_t sector) override;
+    bool program(
+        uint8_t sector, size_t offset, const void* data, size_t len) override;
+
+private:
+    static uintptr_t getSectorAddress(uint8_t sector);
+    void unlock();
+    void lock();
+    bool waitReady();
+    void resetCaches();
+};
+
+extern Stm32FlashStorage flash_storage;
+
+}
+
+#endif
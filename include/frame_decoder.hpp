@@ -3,6 +3,8 @@
 #define __FRAME_DECODER__
 
 #include "bus_protocol.hpp"
+#include "frame_sync.hpp"
+#include "config_parser.hpp"
 //#include "bus_fifo.hpp"
 
 namespace owpeer {
@@ -10,15 +12,8 @@ namespace owpeer {
 using namespace chibios_rt;
 
 
-class FrameDecoderThread : public BaseStaticThread<128> {
-public:
-    void setMessageHandler(ThreadReference* tref){
-        message_handler = tref;
-    }
-
+class FrameDecoderThread : public BaseStaticThread<256> {
 private:
-    ThreadReference* message_handler;
-
     void main (void) override {
         setName("Frame decoder");
         chprintf(chp, "decoder started\r\n");
@@ -26,35 +21,111 @@ private:
         while (true){
             // read from Rx FIFO
             if (rx_fifo.receiveObjectTimeoutInfinite(&frame) == MSG_OK){
-                chprintf(chp, "got frame\r\n");
+                debugFrame("got frame\r\n");
+                if (frame->isMidi()) {
+                    auto obj = BusMidi::decodeFrame(*frame);
+                    // Real-time messages stay ahead of queued bus objects
+                    if (frame->isMidiRealtime())
+                        obj.sendAhead();
+                    else
+                        obj.send();
+                    rx_fifo.returnObject(frame);
+                    continue;
+                }
                 auto proto = frame->getOwlProtocolType();
-                chprintf(chp, "PROTO %u\r\n",  (int)proto);
+                debugFrame("PROTO %u\r\n",  (int)proto);
                 switch (proto) {
-                case OWL_COMMAND_DISCOVER: {
-                        chprintf(chp, "Received discover\r\n");
-                        auto obj = BusDiscover::decodeFrame(*frame);
-                        bus_protocol_fifo.sendObject(obj);
-                        //message_handler->sendMessage();
-                    }
+                case OWL_COMMAND_DISCOVER:
+                    debugFrame("Received discover\r\n");
+                    BusDiscover::decodeFrame(*frame).send();
                     break;
-                case OWL_COMMAND_BUTTON: {
-                        chprintf(chp, "Received button\r\n");
-                    }
+                case OWL_COMMAND_BUTTON:
+                    debugFrame("Received button\r\n");
+                    decodeTimed<BusButton>(*frame);
                     break;
                 case OWL_COMMAND_PARAMETER:
-                    chprintf(chp, "Received command\r\n");
+                    debugFrame("Received parameter\r\n");
+                    decodeTimed<BusParameter>(*frame);
                     break;
                 case OWL_COMMAND_DATA:
-                    chprintf(chp, "Received data\r\n");
+                    debugFrame("Received data\r\n");
+                    // Transfers don't interleave, frame from another peer
+                    // after a gap starts a new one
+                    if (rx_data && std::get<BusData>(*rx_data).getPeer() !=
+                        frame->getSeq()) {
+                        std::get<BusData>(*rx_data).abort();
+                        rx_data.send();
+                    }
+                    // First frame contains data size, the rest is payload
+                    if (!rx_data)
+                        rx_data = BusData::decodeFrame(*frame);
+                    else
+                        std::get<BusData>(*rx_data) << *frame;
+                    // Damaged header is dropped
+                    if (rx_data && std::get<BusData>(*rx_data).isDecoded())
+                        rx_data.send();
                     break;
                 case OWL_COMMAND_MESSAGE:
-                    chprintf(chp, "Received message\r\n");
+                    debugFrame("Received message\r\n");
+                    if (skip_message) {
+                        // Rest of a message that was cut by a gap
+                        skip_message = std::find(&frame->frame_buffer[1],
+                            &frame->frame_buffer[frame_size], 0) ==
+                            &frame->frame_buffer[frame_size];
+                        break;
+                    }
+#if BUS_CONFIG_PARSER == TRUE
+                    if (config_message || (!rx_message &&
+                        frame->frame_buffer[1] ==
+                            SYSEX_CONFIGURATION_COMMAND)) {
+                        decodeConfig(*frame);
+                        break;
+                    }
+#endif
+                    if (!rx_message)
+                        rx_message = BusMessage::decodeFrame(*frame);
+                    else
+                        std::get<BusMessage>(*rx_message) << *frame;
+                    if (std::get<BusMessage>(*rx_message).isDecoded())
+                        rx_message.send();
                     break;
                 case OWL_COMMAND_COMMAND:
-                    chprintf(chp, "Received command\r\n");
+                    debugFrame("Received command\r\n");
+                    if (frame->frame_buffer[1] == BUS_COMMAND_TIMESTAMP) {
+                        timestamps[frame->getSeq()] =
+                            (frame->frame_buffer[2] << 8) |
+                            frame->frame_buffer[3];
+                        timestamp_peers |= 1 << frame->getSeq();
+                        break;
+                    }
+                    BusCommand::decodeFrame(*frame).send();
+                    break;
+                case OWL_FRAME_GAP:
+                    debugFrame("Lost %u frames\r\n", frame->frame_buffer[1]);
+                    // Data sent with FEC is rebuilt. Other data is failed,
+                    // but the rest of its frames are counted, so that none
+                    // of them is taken for a header.
+                    if (rx_data) {
+                        auto& data = std::get<BusData>(*rx_data);
+                        data.erase(std::min(frame->frame_buffer[1] +
+                            frame->frame_buffer[2], 0xff));
+                        if (data.isDecoded())
+                            rx_data.send();
+                    }
+                    // Message frames are dropped until it ends
+                    skip_message = rx_message || isConfigMessage();
+                    rx_message.reset();
+                    abortConfig();
                     break;
                 case OWL_COMMAND_RESET:
-                    chprintf(chp, "Received reset\r\n");
+                    debugFrame("Received reset\r\n");
+                    // Partially received objects are dropped on reset
+                    rx_data.reset();
+                    rx_message.reset();
+                    skip_message = false;
+                    abortConfig();
+                    timestamp_peers = 0;
+                    BusReset::decodeFrame(*frame).send();
                     break;
                 default:
                     chprintf(chp, "Unknown protocol ID");
@@ -67,9 +138,66 @@ private:
         }
     };
 
+    /*
+     * Time stamp applies to the next button or parameter from the same peer
+     */
+    template <class T>
+    void decodeTimed(const BusFrame& frame) {
+        auto obj = T::decodeFrame(frame);
+        uint8_t peer = frame.getSeq();
+        if (timestamp_peers & (1 << peer)) {
+            std::get<T>(*obj).setTime(timestamps[peer]);
+            timestamp_peers &= ~(1 << peer);
+        }
+        obj.send();
+    }
+
+#if BUS_CONFIG_PARSER == TRUE
+    /*
+     * Configuration message is parsed frame by frame instead of being stored
+     */
+    void decodeConfig(const BusFrame& frame) {
+        config_message = true;
+        const uint8_t* data = &frame.frame_buffer[1];
+        const uint8_t* end = std::find(data, data + frame_size - 1, 0);
+        config_stream.write(data, end - data);
+        if (end < data + frame_size - 1) {
+            config_stream.close();
+            config_message = false;
+        }
+    }
+#endif
+
+    bool isConfigMessage() const {
+#if BUS_CONFIG_PARSER == TRUE
+        return config_message;
+#else
+        return false;
+#endif
+    }
+
+    void abortConfig() {
+#if BUS_CONFIG_PARSER == TRUE
+        if (config_message)
+            config_stream.abort();
+        config_message = false;
+#endif
+    }
+
     BusFrame rx_frame;
+    // Objects that are reassembled from multiple frames
+    BusObjectPtr rx_data;
+    BusObjectPtr rx_message;
+    bool skip_message = false;
+    // Indexed by 4 bit frame seq, peers with a stamp are set in the mask
+    uint16_t timestamps[0x10];
+    uint16_t timestamp_peers = 0;
+#if BUS_CONFIG_PARSER == TRUE
+    ConfigParser config_stream = ConfigParser(queueConfiguration);
+    bool config_message = false;
+#endif
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,27 +1,114 @@
 #pragma once
-#ifndef __UART_RX__
-#define __UART_RX__
+#ifndef __FRAME_ENCODER__
+#define __FRAME_ENCODER__
 
 #include "ch.hpp"
 #include "hal.h"
 #include "bus_protocol.hpp"
+#include "uart_fifo.hpp"
+#include "frame_sync.hpp"
+#include "parameter_filter.hpp"
+#include "parameter_calibration.hpp"
 
 namespace owpeer {
 
 using namespace chibios_rt;
 
-class FrameEncoderThread : public BaseStaticThread<128> {
+/*
+ * Encodes objects from bus output FIFO and posts frames to Tx FIFO
+ */
+class FrameEncoderThread : public BaseStaticThread<256> {
 private:
     void main (void) override {
         setName("Frame encoder");
 
         while (true){
+            // Object is returned to output pool once it's encoded
+            auto obj = BusOutputPtr::receive(getPollInterval());
+            if (obj)
+                std::visit([this](auto& o) { encode(o); }, *obj);
+#if BUS_PARAMETER_FILTER == TRUE
+            parameter_filter.poll(chVTGetSystemTimeX());
+#endif
         }
     };
 
-    BusFrame rx_frame;
+    sysinterval_t getPollInterval() const {
+#if BUS_PARAMETER_FILTER == TRUE
+        return parameter_filter.getPollInterval(chVTGetSystemTimeX());
+#else
+        return TIME_INFINITE;
+#endif
+    }
+
+    template <class T>
+    void encode(T& obj) {
+        auto frame = tx_fifo.takeObjectTimeoutInfinite();
+        obj.encodeFrame(*frame);
+        postFrame(tx_fifo, frame);
+    }
+
+    void encode(BusParameter& param) {
+#if PARAMETER_CALIBRATION == TRUE
+        // Filter compares corrected values, as they are sent
+        param.setValue(output_calibration.correct(param.getParameterId(),
+            param.getValue()));
+#endif
+#if BUS_PARAMETER_FILTER == TRUE
+        if (!param.isFromPot())
+            parameter_filter.cancel(param.getParameterId());
+        else if (!parameter_filter.update(param.getPeer(),
+                param.getParameterId(), param.getValue(),
+                chVTGetSystemTimeX()))
+            return;
+#endif
+        encodeTimed(param);
+    }
+
+    void encode(BusButton& button) {
+        encodeTimed(button);
+    }
+
+    void encode(BusConfigRecord&) {
+        // Only passed from decoder to message handler
+    }
+
+    /*
+     * Time stamp frame goes right before the event
+     */
+    template <class T>
+    void encodeTimed(T& obj) {
+        if (obj.isTimed()) {
+            auto frame = tx_fifo.takeObjectTimeoutInfinite();
+            obj.encodeTimestamp(*frame);
+            postFrame(tx_fifo, frame);
+        }
+        encode<T>(obj);
+    }
+
+    void encode(BusData& data) {
+        // Longer payload would set flags in header
+        if (data.getLength() > BUS_DATA_LEN_MASK)
+            return;
+#if BUS_DATA_FEC == TRUE
+        data.setFec(frame_sync.getFecShift());
+#endif
+        // Header frame with data size goes first
+        encode<BusData>(data);
+        while (data.isEncoded()) {
+            auto frame = tx_fifo.takeObjectTimeoutInfinite();
+            data >> *frame;
+            postFrame(tx_fifo, frame);
+        }
+    }
+
+    void encode(BusMessage& msg) {
+        while (msg.isEncoded()) {
+            encode<BusMessage>(msg);
+        }
+    }
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
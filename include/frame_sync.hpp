@@ -0,0 +1,125 @@
+#pragma once
+#ifndef __FRAME_SYNC__
+#define __FRAME_SYNC__
+
+#include "main.hpp"
+#include "bus.hpp"
+
+namespace owpeer {
+
+/*
+ * Frame alignment recovery for received byte stream.
+ *
+ * Bus has no framing besides 4 byte frame size, so a byte lost on the link
+ * misaligns everything after it. Each frame is checked before it's passed to
+ * decoder:
+ * - high nibble must be a known protocol, MIDI frames must be valid USB MIDI
+ *   event packets
+ * - reserved values must match, i.e. all bytes of reset frame, parameter and
+ *   button id ranges, known command ids and nonzero discovery token
+ * - data frames must continue current transfer from the same peer until it
+ *   ends
+ *
+ * After an invalid frame, stream is searched byte by byte for an offset
+ * where BUS_SYNC_CONFIRM_FRAMES following frames are valid too. Bytes that
+ * are skipped are dropped. Frames are only delayed while searching. A data
+ * transfer that was cut is expected to continue after the lost frames, so
+ * that its payload isn't taken for a header. As the frame before the gap may
+ * be damaged, the count is trusted again only when another peer starts a
+ * transfer or bus is reset.
+ *
+ * When alignment is found, an OWL_FRAME_GAP frame with number of lost frames
+ * in byte 1 is returned first. Decoder rebuilds or drops objects that were
+ * cut by it. Frame before the gap may also be damaged, as it's taken from
+ * bytes that preceded it. Misaligned payload may also pass for other frames
+ * before the loss is seen, so byte 2 has the number of frames that were
+ * returned since the last frame of a data transfer in progress. Decoder
+ * counts them as lost payload.
+ */
+class FrameSync {
+public:
+    /*
+     * Forget buffered bytes, i.e. after link restart. Next byte is assumed
+     * to start a frame.
+     */
+    void reset();
+
+    /*
+     * Add received bytes, returns number of bytes that fit into buffer
+     */
+    size_t write(const uint8_t* data, size_t len);
+
+    /*
+     * Take next aligned frame, returns false if there is none yet
+     */
+    bool read(uint8_t* frame);
+
+    bool isLocked() const {
+        return locked;
+    }
+
+    /*
+     * Bytes received after the frame that was read last
+     */
+    size_t getPending() const {
+        return head - tail;
+    }
+
+    /*
+     * Block size for sending BusData with FEC, as a power of 2. It's chosen
+     * from recent loss rate on our input, that's the only link we see, so
+     * that a block sees a loss with probability of about 1/16. Returns 0 if
+     * there were no losses.
+     */
+    uint8_t getFecShift() const;
+
+    void print(BaseSequentialStream* chp) const;
+
+private:
+    // Transfer that is in progress, needed to check continuity
+    struct Stream {
+        uint8_t data_peer = 0;
+        uint32_t data_frames = 0;
+        // Count isn't known for sure after realignment
+        bool exact = true;
+        // Other frames since the last data frame of transfer
+        uint8_t interleaved = 0;
+    };
+
+    static bool check(const uint8_t* frame, Stream& stream);
+    static bool checkMidi(const uint8_t* frame);
+    static bool checkCommand(uint8_t cmd);
+
+    static constexpr size_t buffer_size = 64;
+
+    uint8_t buffer[buffer_size];
+    size_t head = 0;
+    size_t tail = 0;
+    Stream stream;
+    // State when alignment was lost
+    Stream lost_stream;
+    bool locked = true;
+    systime_t loss_time = 0;
+    size_t search_bytes = 0;
+    uint8_t gap = 0;
+    uint8_t gap_interleaved = 0;
+    // Loss rate, halved every 64k frames
+    uint32_t recent_frames = 0;
+    uint32_t recent_losses = 0;
+    // Stats
+    uint32_t losses = 0;
+    uint32_t recoveries = 0;
+    uint32_t dropped_bytes = 0;
+    sysinterval_t last_recovery = 0;
+    sysinterval_t max_recovery = 0;
+};
+
+#if BUS_FRAME_SYNC == TRUE
+extern FrameSync frame_sync;
+
+void printSyncStats(BaseSequentialStream* chp);
+#endif
+
+}
+
+#endif
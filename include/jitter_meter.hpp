@@ -0,0 +1,81 @@
+#pragma once
+#ifndef __JITTER_METER__
+#define __JITTER_METER__
+
+#include <algorithm>
+#include "ch.hpp"
+#include "hal.h"
+#include "owpeer.h"
+
+namespace owpeer {
+
+/*
+ * Interval statistics for periodic events, i.e. MIDI timing clock.
+ *
+ * Each tick is stamped with realtime counter (DWT cycle counter on Cortex-M)
+ * and we keep min/max/sum/sum of squares of intervals between consecutive
+ * ticks. Standard deviation is computed only when stats are requested.
+ */
+class JitterMeter {
+public:
+    JitterMeter(const char* name)
+        : name(name) {
+        reset();
+    }
+
+    void reset() {
+        started = false;
+        count = 0;
+        min_interval = 0xffffffff;
+        max_interval = 0;
+        sum = 0;
+        sum_sq = 0;
+    }
+
+    /*
+     * Register a tick. This is called from thread context right after frame
+     * is read from or written to serial driver.
+     */
+    void tick() {
+        tick(chSysGetRealtimeCounterX());
+    }
+
+    void tick(rtcnt_t now) {
+        if (started) {
+            uint32_t interval = now - last;
+            min_interval = std::min(min_interval, interval);
+            max_interval = std::max(max_interval, interval);
+            sum += interval;
+            sum_sq += uint64_t(interval) * interval;
+            count++;
+        }
+        started = true;
+        last = now;
+    }
+
+    uint32_t getCount() const {
+        return count;
+    }
+
+    /*
+     * Print min/mean/max/stddev in microseconds
+     */
+    void print(BaseSequentialStream* chp) const;
+
+private:
+    const char* name;
+    bool started;
+    rtcnt_t last;
+    uint32_t count;
+    uint32_t min_interval, max_interval;
+    uint64_t sum, sum_sq;
+};
+
+#if BUS_MIDI_JITTER_STATS == TRUE
+extern JitterMeter clock_ingress_jitter;
+extern JitterMeter clock_egress_jitter;
+#endif
+
+}
+
+#endif
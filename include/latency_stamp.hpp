@@ -0,0 +1,23 @@
+#pragma once
+#ifndef __LATENCY_STAMP__
+#define __LATENCY_STAMP__
+
+#include <cstdint>
+#include "owpeer.h"
+
+namespace owpeer {
+
+/*
+ * Timestamps carried by frames and objects through the pipeline, in
+ * realtime counter cycles. This is only data, so that frame and object
+ * headers don't depend on the kernel; stamps are updated by functions in
+ * latency_stats.hpp.
+ */
+struct LatencyStamp {
+    uint32_t origin;
+    uint32_t last;
+};
+
+}
+
+#endif
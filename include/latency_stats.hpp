@@ -0,0 +1,101 @@
+#pragma once
+#ifndef __LATENCY_STATS__
+#define __LATENCY_STATS__
+
+#include "ch.hpp"
+#include "hal.h"
+#include "owpeer.h"
+#include "latency_stamp.hpp"
+
+namespace owpeer {
+
+/*
+ * Pipeline stages. Rx stages are measured between consecutive boundaries,
+ * RX_TOTAL is from serial ingress to handler dispatch.
+ */
+enum LatencyStage {
+    LATENCY_RX_QUEUE,   // serial ingress -> rx_fifo enqueue
+    LATENCY_DECODE,     // rx_fifo enqueue -> decoded object posted
+    LATENCY_DISPATCH,   // decoded object posted -> handler dispatch
+    LATENCY_RX_TOTAL,   // serial ingress -> handler dispatch
+    LATENCY_TX,         // tx_fifo enqueue -> last byte on the wire
+    LATENCY_NUM_STAGES,
+};
+
+/*
+ * Timestamp source. This is the DWT cycle counter on Cortex-M.
+ */
+inline rtcnt_t getLatencyTimestamp() {
+    return chSysGetRealtimeCounterX();
+}
+
+/*
+ * Histogram with log2 buckets, bucket N counts latencies in [2^N, 2^(N+1))
+ * cycles. Each stage is updated by a single thread, so counters are not
+ * locked.
+ */
+class LatencyHistogram {
+public:
+    static constexpr size_t num_buckets = 32;
+
+    void add(uint32_t cycles) {
+        buckets[31 - __builtin_clz(cycles | 1)]++;
+        count++;
+        if (cycles > max)
+            max = cycles;
+    }
+
+    void print(BaseSequentialStream* chp, const char* name) const;
+
+private:
+    uint32_t buckets[num_buckets] = {};
+    uint32_t count = 0;
+    uint32_t max = 0;
+};
+
+#if BUS_LATENCY_STATS == TRUE
+extern LatencyHistogram latency_histograms[LATENCY_NUM_STAGES];
+#endif
+
+/*
+ * Stamp origin of a frame
+ */
+inline void startLatency(LatencyStamp& stamp) {
+    stamp.origin = stamp.last = getLatencyTimestamp();
+}
+
+/*
+ * Record time since previous boundary for a stage. Boundary time may be
+ * in the future when it's known when a frame leaves the wire.
+ */
+inline void markLatencyAt(LatencyStamp& stamp, LatencyStage stage,
+    rtcnt_t now) {
+#if BUS_LATENCY_STATS == TRUE
+    latency_histograms[stage].add(now - stamp.last);
+#else
+    (void)stage;
+#endif
+    stamp.last = now;
+}
+
+inline void markLatency(LatencyStamp& stamp, LatencyStage stage) {
+    markLatencyAt(stamp, stage, getLatencyTimestamp());
+}
+
+/*
+ * Record time since origin for a stage
+ */
+inline void markLatencyTotal(const LatencyStamp& stamp, LatencyStage stage) {
+#if BUS_LATENCY_STATS == TRUE
+    latency_histograms[stage].add(getLatencyTimestamp() - stamp.origin);
+#else
+    (void)stamp;
+    (void)stage;
+#endif
+}
+
+void printLatencyStats(BaseSequentialStream* chp);
+
+}
+
+#endif
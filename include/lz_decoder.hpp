@@ -0,0 +1,147 @@
+#pragma once
+#ifndef __LZ_DECODER__
+#define __LZ_DECODER__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace owpeer {
+
+/*
+ * Streaming LZSS decoder for heatshrink compatible streams.
+ *
+ * Stream is read MSB first. Tag bit 1 is followed by a literal byte, tag bit
+ * 0 by a back reference: window_bits of offset - 1 and count_bits of
+ * length - 1. Decoded bytes go to a ring window that is passed to output in
+ * contiguous chunks, each chunk is flushed before window wraps over it. Input
+ * may be split at any byte, there's no other state than this object and the
+ * window.
+ */
+class LzDecoder {
+public:
+    /*
+     * Window holds 1 << window_size_bits bytes, it must be at least as large
+     * as stream window.
+     */
+    LzDecoder(uint8_t* window, uint8_t window_size_bits)
+        : window(window)
+        , mask((1 << window_size_bits) - 1) {
+    }
+
+    /*
+     * Start a new stream, returns false if window is too small for it
+     */
+    bool start(uint8_t new_window_bits, uint8_t new_count_bits) {
+        if (new_window_bits < 4 || (1u << new_window_bits) > mask + 1u ||
+            new_count_bits < 3 || new_count_bits >= new_window_bits)
+            return false;
+        window_bits = new_window_bits;
+        count_bits = new_count_bits;
+        state = TAG;
+        acc = 0;
+        acc_bits = 0;
+        head = flushed = 0;
+        memset(window, 0, mask + 1);
+        return true;
+    }
+
+    /*
+     * Decode input, output is called with (const uint8_t*, size_t) chunks
+     */
+    template <typename Output>
+    void write(const uint8_t* data, size_t len, Output&& output);
+
+    /*
+     * Total number of decoded bytes
+     */
+    uint32_t getSize() const {
+        return head;
+    }
+
+private:
+    enum State : uint8_t {
+        TAG,
+        LITERAL,
+        INDEX,
+        COUNT,
+    };
+
+    bool getBits(uint8_t num, uint16_t& value) {
+        if (acc_bits < num)
+            return false;
+        acc_bits -= num;
+        value = (acc >> acc_bits) & ((1 << num) - 1);
+        return true;
+    }
+
+    template <typename Output>
+    void put(uint8_t byte, Output& output) {
+        window[head++ & mask] = byte;
+        // Pass on the tail of window before wrapping
+        if ((head & mask) == 0)
+            flush(output);
+    }
+
+    template <typename Output>
+    void flush(Output& output) {
+        if (head != flushed) {
+            size_t start = flushed & mask;
+            output(window + start, size_t(head - flushed));
+            flushed = head;
+        }
+    }
+
+    uint8_t* window;
+    uint16_t mask;
+    uint8_t window_bits = 0;
+    uint8_t count_bits = 0;
+    State state = TAG;
+    uint8_t acc_bits = 0;
+    uint16_t index = 0;
+    uint32_t acc = 0;
+    uint32_t head = 0;
+    uint32_t flushed = 0;
+};
+
+template <typename Output>
+void LzDecoder::write(const uint8_t* data, size_t len, Output&& output) {
+    for (size_t i = 0; i < len; i++) {
+        acc = (acc << 8) | data[i];
+        acc_bits += 8;
+        uint16_t value;
+        bool more = true;
+        while (more) {
+            switch (state) {
+            case TAG:
+                if ((more = getBits(1, value)))
+                    state = value ? LITERAL : INDEX;
+                break;
+            case LITERAL:
+                if ((more = getBits(8, value))) {
+                    put(value, output);
+                    state = TAG;
+                }
+                break;
+            case INDEX:
+                if ((more = getBits(window_bits, value))) {
+                    index = value;
+                    state = COUNT;
+                }
+                break;
+            case COUNT:
+                if ((more = getBits(count_bits, value))) {
+                    for (uint16_t n = 0; n <= value; n++)
+                        put(window[(head - index - 1) & mask], output);
+                    state = TAG;
+                }
+                break;
+            }
+        }
+    }
+    flush(output);
+}
+
+}
+
+#endif
@@ -5,6 +5,7 @@
 #include "ch.hpp"
 #include "hal.h"
 #include "chobjfifos.hpp"
+#include "slab_allocator.hpp"
 #include "bus.hpp"
 //#include "bus_fifo.hpp"
 #include "chprintf.h"
@@ -32,7 +33,21 @@ namespace owpeer {
 using namespace chibios_rt;
 
 extern BaseSequentialStream* chp;
-extern Heap bus_heap;
+extern SlabAllocator bus_allocator;
+
+/*
+ * Per frame debug output. Printing to debug serial takes longer than
+ * receiving a frame, so it's disabled unless BUS_DEBUG_FRAMES is set.
+ */
+template <typename... Args>
+inline void debugFrame(const char* fmt, Args... args) {
+#if BUS_DEBUG_FRAMES == TRUE
+    chprintf(chp, fmt, args...);
+#else
+    (void)fmt;
+    ((void)args, ...);
+#endif
+}
 
 }
 
@@ -5,36 +5,339 @@
 #include "ch.hpp"
 #include "bus.hpp"
 #include "bus_protocol.hpp"
+#include "device_stats.hpp"
+#include "latency_stats.hpp"
+#include "bus_discovery.hpp"
+#include "settings_store.hpp"
+#include "firmware_updater.hpp"
+#include "baud_negotiator.hpp"
+#include "bus_clock.hpp"
+#include "block_queue.hpp"
+#include "parameter_calibration.hpp"
+#include "midi_cc_map.hpp"
+#include "config_parser.hpp"
+#include "sysex_codec.hpp"
 
 namespace owpeer {
 
 using namespace chibios_rt;
 
-class MessageHandlerThread : public BaseStaticThread<128> {
+class MessageHandlerThread : public BaseStaticThread<512> {
 private:
     void main() {
+        startBus();
         for(;;){
-            auto sender = waitMessage();
-            auto msg = sender.getMessage();
-            auto base_obj = reinterpret_cast<BusObject*>(msg);
-            if (base_obj->isMidi()){
-                // Not implemented yet
+            // Object is returned to pool when it goes out of scope
+            auto obj = BusObjectPtr::receive(getPollInterval());
+            if (obj) {
+#if BUS_LATENCY_STATS == TRUE
+                auto& latency = getBusObject(*obj).latency;
+                markLatency(latency, LATENCY_DISPATCH);
+                markLatencyTotal(latency, LATENCY_RX_TOTAL);
+#endif
+                std::visit([this](auto& o) { handle(o); }, *obj);
             }
-            else {
-                switch (base_obj->getObjectType()) {
-                case OWL_COMMAND_DISCOVER:
-                    chprintf(chp, "DISCOVER RECEIVED");
-                    break;
-                default:
-                    chprintf(chp, "UNHANDLED OBJECT");
-                    break;
-                }
-            }
-            sender.releaseMessage(msg);
+            systime_t now = chVTGetSystemTimeX();
+            bus_discovery.poll(now);
+            bool is_connected =
+                bus_discovery.getStatus() == BUS_STATUS_CONNECTED;
+#if BUS_BAUD_NEGOTIATION == TRUE
+            if (is_connected && !was_connected)
+                bus_baud.start(bus_discovery.getUid(), now);
+            bus_baud.poll(now);
+#endif
+#if BUS_CLOCK_SYNC == TRUE
+            if (is_connected && !was_connected)
+                bus_clock.start(bus_discovery.getUid(),
+                    bus_discovery.getPeers(), now);
+            bus_clock.poll(now);
+#endif
+            was_connected = is_connected;
+#if BUS_PEER_CACHE == TRUE
+            cachePeerId();
+#endif
+        }
+    }
+
+    sysinterval_t getPollInterval() const {
+        sysinterval_t interval = bus_discovery.getPollInterval();
+#if BUS_BAUD_NEGOTIATION == TRUE
+        interval = std::min(interval, bus_baud.getPollInterval());
+#endif
+#if BUS_CLOCK_SYNC == TRUE
+        interval = std::min(interval, bus_clock.getPollInterval());
+#endif
+        return interval;
+    }
+
+    /*
+     * Resume with cached peer id if possible, discovery runs only if cache is
+     * empty or some peer reports a conflict
+     */
+    void startBus() {
+        systime_t now = chVTGetSystemTimeX();
+#if BLOCK_QUEUE == TRUE && SETTINGS_STORE == TRUE
+        block_queue.configure(settings.get(SYSEX_CONFIGURATION_AUDIO_RATE),
+            settings.get(SYSEX_CONFIGURATION_AUDIO_BLOCKSIZE));
+#elif BLOCK_QUEUE == TRUE
+        block_queue.configure(48000, 64);
+#endif
+        configureCalibration();
+#if SETTINGS_STORE == TRUE
+        // Bus is quiet until discovery completes, so the stall of erasing
+        // spare settings sector doesn't drop traffic
+        settings.requestErase();
+        if (!settings.get(SYSEX_CONFIGURATION_DIGITAL_BUS_ENABLE)) {
+            bus_discovery.stop();
+            return;
+        }
+#endif
+#if BUS_PEER_CACHE == TRUE
+        int32_t peer = settings.get(SETTINGS_PEER_ID);
+        if (peer >= 0) {
+            bus_discovery.resume(now, peer & 0xff, peer >> 8,
+                settings.get(SETTINGS_PEER_FINGERPRINT));
+            return;
+        }
+#endif
+        bus_discovery.start(now);
+    }
+
+    /*
+     * Calibration tables change only if their settings have changed
+     */
+    void configureCalibration() {
+#if PARAMETER_CALIBRATION == TRUE
+        input_calibration.configure(SYSEX_CONFIGURATION_INPUT_OFFSET,
+            SYSEX_CONFIGURATION_INPUT_SCALAR);
+        output_calibration.configure(SYSEX_CONFIGURATION_OUTPUT_OFFSET,
+            SYSEX_CONFIGURATION_OUTPUT_SCALAR);
+#endif
+    }
+
+#if BUS_PEER_CACHE == TRUE
+    void cachePeerId() {
+        if (bus_discovery.getStatus() != BUS_STATUS_CONNECTED)
+            return;
+        int32_t peer =
+            bus_discovery.getUid() | (bus_discovery.getPeers() << 8);
+        int32_t fingerprint = bus_discovery.getFingerprint();
+        if (settings.get(SETTINGS_PEER_ID) != peer ||
+            settings.get(SETTINGS_PEER_FINGERPRINT) != fingerprint) {
+            settings.set(SETTINGS_PEER_ID, peer);
+            settings.set(SETTINGS_PEER_FINGERPRINT, fingerprint);
+            settings.requestStore();
+        }
+    }
+#endif
+
+#if BUS_MIDI_CC_BRIDGE == TRUE && BLOCK_QUEUE == TRUE
+    void handle(BusMidi& midi) {
+        int32_t channel = midi_omni_channel;
+#if SETTINGS_STORE == TRUE
+        if (!settings.get(SYSEX_CONFIGURATION_DIGITAL_BUS_FORWARD_MIDI))
+            return;
+        channel = settings.get(SYSEX_CONFIGURATION_MIDI_INPUT_CHANNEL);
+#endif
+        PatchParameterId pid;
+        int16_t value;
+        if (midiToParameter(midi, channel, pid, value))
+            block_queue.push({OWL_COMMAND_PARAMETER, uint8_t(pid),
+                correctInput(pid, value)});
+    }
+#else
+    void handle(BusMidi&) {
+        // Not implemented yet
+    }
+#endif
+
+#if BLOCK_QUEUE == TRUE
+    void handle(BusParameter& param) {
+        BlockEvent event = {OWL_COMMAND_PARAMETER,
+            uint8_t(param.getParameterId()),
+            correctInput(param.getParameterId(), param.getValue())};
+        queueEvent(param, event);
+    }
+
+    void handle(BusButton& button) {
+        BlockEvent event = {OWL_COMMAND_BUTTON,
+            uint8_t(button.getButtonId()), button.getValue()};
+        queueEvent(button, event);
+    }
+
+    void queueEvent(const BusTimedObject& obj, const BlockEvent& event) {
+        if (obj.isTimed())
+            block_queue.push(event, obj.getTime());
+        else
+            block_queue.push(event);
+    }
+#endif
+
+    static int16_t correctInput(PatchParameterId pid, int16_t value) {
+#if PARAMETER_CALIBRATION == TRUE
+        return input_calibration.correct(pid, value);
+#else
+        (void)pid;
+        return value;
+#endif
+    }
+
+    void handle(BusDiscover& discover) {
+        bus_discovery.handleDiscover(
+            discover.getPeer(), discover.getToken(), chVTGetSystemTimeX());
+    }
+
+    void handle(BusReset&) {
+#if BUS_BAUD_NEGOTIATION == TRUE
+        // Peers that have been reset start at initial rate
+        bus_baud.reset();
+#endif
+#if BUS_CLOCK_SYNC == TRUE
+        bus_clock.reset();
+#endif
+        startBus();
+    }
+
+    /*
+     * Payload that was received is not used yet, but sender is told when it
+     * was dropped
+     */
+    void handle(BusData& data) {
+        if (data.isFailed())
+            BusOutputPtr::make(std::in_place_type<BusCommand>, data.getPeer(),
+                BUS_COMMAND_DATA_ERROR, data.getLength()).send();
+    }
+
+    void handle(BusCommand& cmd) {
+        switch (cmd.getCommand()) {
+        case SYSEX_DEVICE_STATS:
+            sendDeviceStats(cmd.getPeer(), cmd.getData());
+            break;
+#if SETTINGS_STORE == TRUE
+        case SYSEX_SETTINGS_STORE:
+            settings.requestStore();
+            break;
+        case SYSEX_SETTINGS_RESET:
+            settings.reset();
+            break;
+#endif
+#if BUS_CONFIG_PARSER == TRUE && SETTINGS_STORE == TRUE
+        case SYSEX_CONFIGURATION_COMMAND:
+            handleConfiguration(cmd.getPeer(), cmd.getData());
+            break;
+#endif
+#if FIRMWARE_UPDATER == TRUE
+        case SYSEX_FIRMWARE_UPLOAD:
+            firmware_updater.begin(cmd.getPeer(), cmd.getData());
+            break;
+        case SYSEX_FIRMWARE_STORE:
+            BusOutputPtr::make(std::in_place_type<BusCommand>, cmd.getPeer(),
+                SYSEX_FIRMWARE_STORE, firmware_updater.store() ? 0 : -1)
+                .send();
+            break;
+#endif
+#if BUS_SYSEX_BRIDGE == TRUE
+        case BUS_COMMAND_SYSEX_BRIDGE:
+            BusData::setStreamSink(cmd.getPeer(), &sysex_sink);
+            break;
+#endif
+#if BUS_BAUD_NEGOTIATION == TRUE
+        case BUS_COMMAND_BAUD_OFFER:
+        case BUS_COMMAND_BAUD_SWITCH:
+        case BUS_COMMAND_BAUD_CONFIRM:
+            bus_baud.handleCommand(cmd.getPeer(), cmd.getCommand(),
+                cmd.getData(), chVTGetSystemTimeX());
+            break;
+#endif
+#if BUS_CLOCK_SYNC == TRUE
+        case BUS_COMMAND_TIME_SYNC:
+        case BUS_COMMAND_TIME_DELAY:
+            bus_clock.handleCommand(
+                cmd.getPeer(), cmd.getCommand(), cmd.getData());
+            break;
+#endif
+        case BUS_COMMAND_DATA_ERROR:
+            chprintf(chp, "Peer %u dropped data, length %u\r\n",
+                cmd.getPeer(), uint16_t(cmd.getData()));
+            break;
+        case BUS_COMMAND_RESUME:
+            bus_discovery.handleResume(
+                cmd.getPeer(), cmd.getData(), chVTGetSystemTimeX());
+            break;
+        default:
+            chprintf(chp, "UNHANDLED COMMAND");
+            break;
+        }
+    }
+
+#if BUS_CONFIG_PARSER == TRUE && SETTINGS_STORE == TRUE
+    /*
+     * Command data 0 means that configuration follows as BusData, otherwise
+     * it's a settings key and its value is sent back as a text message
+     */
+    void handleConfiguration(uint8_t peer, uint16_t key) {
+        if (key == 0) {
+            BusData::setStreamSink(peer, &config_parser);
+            return;
         }
+        if (ConfigParser::findKey(key) < 0)
+            return;
+        BusBuffer text(12);
+        if (text.get() == nullptr)
+            return;
+        char* buf = (char*)text.get();
+        buf[ConfigParser::format(buf, key, settings.get(key))] = '\0';
+        BusOutputPtr::make(
+            std::in_place_type<BusMessage>, peer, std::move(text))
+            .send();
+    }
+#endif
+
+#if BUS_CONFIG_PARSER == TRUE
+    void handle(BusConfigRecord& record) {
+        if (!applyConfiguration(record.getKey(), record.getValue()))
+            ConfigParser::refuse();
+        configureCalibration();
+    }
+#else
+    void handle(BusConfigRecord&) {
     }
+#endif
+
+    /*
+     * Reply with requested stats section as text messages, section is
+     * formatted to a large buffer and sent in chunks that end at line ends
+     */
+    void sendDeviceStats(uint8_t peer, size_t section) {
+        BusBuffer text(bus_allocator.getMaxSize());
+        if (text.get() == nullptr)
+            return;
+        const char* buf = (const char*)text.get();
+        if (!formatDeviceStats(section, (char*)text.get(),
+                bus_allocator.getMaxSize()))
+            return;
+        while (*buf != '\0') {
+            size_t len = getStatsMessageLength(buf, max_msg_len - 1);
+            BusBuffer msg(len + 1);
+            if (msg.get() == nullptr)
+                return;
+            memcpy(msg.get(), buf, len);
+            ((char*)msg.get())[len] = '\0';
+            BusOutputPtr::make(
+                std::in_place_type<BusMessage>, peer, std::move(msg))
+                .send();
+            buf += len;
+        }
+    }
+
+    template <class T>
+    void handle(T&) {
+        chprintf(chp, "UNHANDLED OBJECT");
+    }
+
+    bool was_connected = false;
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
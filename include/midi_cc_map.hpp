@@ -0,0 +1,88 @@
+#pragma once
+#ifndef __MIDI_CC_MAP__
+#define __MIDI_CC_MAP__
+
+#include <array>
+#include "bus_protocol.hpp"
+
+namespace owpeer {
+
+/*
+ * MIDI CC numbers of patch parameters from OpenWareMidiControl.h, indexed by
+ * PatchParameterId. This is the only place where the two enums are paired,
+ * CC to parameter table is generated from it at compile time.
+ */
+static constexpr std::array<uint8_t, num_parameters> parameter_to_cc = {
+    PATCH_PARAMETER_A,  PATCH_PARAMETER_B,  PATCH_PARAMETER_C,
+    PATCH_PARAMETER_D,  PATCH_PARAMETER_E,  PATCH_PARAMETER_F,
+    PATCH_PARAMETER_G,  PATCH_PARAMETER_H,
+    PATCH_PARAMETER_AA, PATCH_PARAMETER_AB, PATCH_PARAMETER_AC,
+    PATCH_PARAMETER_AD, PATCH_PARAMETER_AE, PATCH_PARAMETER_AF,
+    PATCH_PARAMETER_AG, PATCH_PARAMETER_AH,
+    PATCH_PARAMETER_BA, PATCH_PARAMETER_BB, PATCH_PARAMETER_BC,
+    PATCH_PARAMETER_BD, PATCH_PARAMETER_BE, PATCH_PARAMETER_BF,
+    PATCH_PARAMETER_BG, PATCH_PARAMETER_BH,
+    PATCH_PARAMETER_CA, PATCH_PARAMETER_CB, PATCH_PARAMETER_CC,
+    PATCH_PARAMETER_CD, PATCH_PARAMETER_CE, PATCH_PARAMETER_CF,
+    PATCH_PARAMETER_CG, PATCH_PARAMETER_CH,
+    PATCH_PARAMETER_DA, PATCH_PARAMETER_DB, PATCH_PARAMETER_DC,
+    PATCH_PARAMETER_DD, PATCH_PARAMETER_DE, PATCH_PARAMETER_DF,
+    PATCH_PARAMETER_DG, PATCH_PARAMETER_DH,
+};
+
+static constexpr uint8_t no_parameter = 0xff;
+
+static constexpr std::array<uint8_t, 128> makeCcTable() {
+    std::array<uint8_t, 128> table = {};
+    for (size_t cc = 0; cc < table.size(); cc++)
+        table[cc] = no_parameter;
+    for (size_t pid = 0; pid < parameter_to_cc.size(); pid++)
+        table[parameter_to_cc[pid]] = pid;
+    return table;
+}
+
+/*
+ * PatchParameterId for each CC number, no_parameter if it's not mapped
+ */
+static constexpr std::array<uint8_t, 128> cc_to_parameter = makeCcTable();
+
+static constexpr bool isCcMapUnique() {
+    for (size_t pid = 0; pid < parameter_to_cc.size(); pid++) {
+        if (parameter_to_cc[pid] > 127 ||
+            cc_to_parameter[parameter_to_cc[pid]] != pid)
+            return false;
+    }
+    return true;
+}
+
+static_assert(isCcMapUnique(), "Each parameter must have its own CC");
+
+/*
+ * Input channel setting that takes CCs on all channels. Any value outside
+ * 0-15 does the same.
+ */
+static constexpr int32_t midi_omni_channel = -1;
+
+/*
+ * Parameter update from a CC frame on given channel. 7 bit value is scaled to
+ * full 12 bit parameter range, 127 gives 4095.
+ */
+inline bool midiToParameter(const BusMidi& midi, int32_t channel,
+    PatchParameterId& pid, int16_t& value) {
+    if (midi.getCin() != USB_COMMAND_CONTROL_CHANGE ||
+        (midi.getStatus() & 0xf0) != 0xb0)
+        return false;
+    if (channel >= 0 && channel < 16 && (midi.getStatus() & 0x0f) != channel)
+        return false;
+    uint8_t id = cc_to_parameter[midi.getController() & 0x7f];
+    if (id == no_parameter)
+        return false;
+    pid = PatchParameterId(id);
+    uint8_t cc_value = midi.getControllerValue() & 0x7f;
+    value = (cc_value << 5) | (cc_value >> 2);
+    return true;
+}
+
+}
+
+#endif
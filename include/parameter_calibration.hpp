@@ -0,0 +1,102 @@
+#pragma once
+#ifndef __PARAMETER_CALIBRATION__
+#define __PARAMETER_CALIBRATION__
+
+#include "main.hpp"
+#include "bus.hpp"
+#include "block_queue.hpp"
+
+namespace owpeer {
+
+/*
+ * Offset and scale correction of parameter values:
+ *
+ *   value = sat((sat(raw + offset) * scalar) >> 12)
+ *
+ * Scalar is Q12, 4096 is unity. Each parameter has its own table entry.
+ * configure() fills them from settings when those change, except entries
+ * that were set on their own with setEntry().
+ *
+ * Raw values are collected with set() or apply() and marked dirty in pairs.
+ * process() corrects only dirty pairs, all of them at once. On Cortex-M4 a
+ * pair takes one saturating QADD16 and two halfword multiplies, elsewhere
+ * GCC vector extensions are used. Both give identical results. correct()
+ * does the same for a single value, along with entries that have changed.
+ */
+class ParameterCalibration {
+public:
+    static constexpr size_t size = num_parameters;
+    static constexpr int16_t unity = 4096;
+
+    ParameterCalibration() {
+        for (size_t i = 0; i < size; i++)
+            scalars[i] = unity;
+    }
+
+    /*
+     * Set entries from SysEx configuration keys, e.g.
+     * SYSEX_CONFIGURATION_INPUT_OFFSET and SYSEX_CONFIGURATION_INPUT_SCALAR,
+     * if they have changed since last call
+     */
+    void configure(const char* offset_key, const char* scalar_key);
+    void configure(int16_t offset, int16_t scalar);
+
+    /*
+     * Entry that is kept when configuration changes
+     */
+    void setEntry(PatchParameterId pid, int16_t offset, int16_t scalar) {
+        chSysLock();
+        offsets[pid] = offset;
+        scalars[pid] = scalar;
+        custom |= uint64_t(1) << pid;
+        dirty |= 1 << (pid >> 1);
+        chSysUnlock();
+    }
+
+    void set(PatchParameterId pid, int16_t value) {
+        raw[pid] = value;
+        dirty |= 1 << (pid >> 1);
+    }
+
+    /*
+     * Take parameter values from a block batch
+     */
+    void apply(const BlockEvent* events, size_t num);
+
+    /*
+     * Write corrected values of dirty parameters to values, e.g. targets of
+     * ParameterSmoother. Returns false if nothing changed.
+     */
+    bool process(int16_t* values);
+
+    /*
+     * Corrected value of a parameter that is received or sent. Called from
+     * any thread, entries may be configured meanwhile.
+     */
+    int16_t correct(PatchParameterId pid, int16_t value);
+
+private:
+    static_assert(size % 8 == 0, "Parameters are processed in groups of 8");
+
+    alignas(16) int16_t raw[size] = {};
+    alignas(16) int16_t offsets[size] = {};
+    alignas(16) int16_t scalars[size];
+    // Output of correct()
+    alignas(16) int16_t corrected[size] = {};
+    // One bit per pair of parameters
+    uint32_t dirty = 0;
+    // Entries set with setEntry()
+    uint64_t custom = 0;
+    // Last configured values, unity until configured
+    int16_t config_offset = 0;
+    int16_t config_scalar = unity;
+};
+
+#if PARAMETER_CALIBRATION == TRUE
+extern ParameterCalibration input_calibration;
+extern ParameterCalibration output_calibration;
+#endif
+
+}
+
+#endif
@@ -0,0 +1,106 @@
+#pragma once
+#ifndef __PARAMETER_FILTER__
+#define __PARAMETER_FILTER__
+
+#include "main.hpp"
+#include "bus.hpp"
+
+namespace owpeer {
+
+/*
+ * Change filter for outgoing parameter updates read from pots.
+ *
+ * Update is dropped if it's within deadband of the last sent value. Moving
+ * back against the last sent change takes hysteresis instead, so that noise
+ * around a knob that has just stopped doesn't pass. Dropped value is kept
+ * and sent by poll once no updates came for quiet interval, so that receiver
+ * ends up with the value where the knob stopped. Updates that come sooner
+ * than interval after the previous send are held, and the latest held value
+ * is sent by poll once interval ends.
+ *
+ * The first change after an idle period is passed immediately. Filter is
+ * used by frame encoder thread only, so state is not locked.
+ */
+class ParameterFilter {
+public:
+    typedef void (*SendCallback)(
+        uint8_t peer, PatchParameterId pid, int16_t value);
+
+    ParameterFilter(SendCallback send, uint16_t deadband, uint16_t hysteresis,
+        sysinterval_t interval, sysinterval_t quiet)
+        : send(send)
+        , deadband(deadband)
+        , hysteresis(hysteresis)
+        , interval(interval)
+        , quiet(quiet) {
+    }
+
+    /*
+     * Returns true if update should be sent now
+     */
+    bool update(uint8_t peer, PatchParameterId pid, int16_t value,
+        systime_t now);
+
+    /*
+     * Value that doesn't come from a pot was sent, pending pot value must
+     * not replace it later
+     */
+    void cancel(PatchParameterId pid);
+
+    /*
+     * Send held and settled values whose interval has ended
+     */
+    void poll(systime_t now);
+
+    sysinterval_t getPollInterval(systime_t now) const;
+
+    void print(BaseSequentialStream* chp) const;
+
+private:
+    struct State {
+        int16_t sent;
+        int16_t held;
+        // Time of last send and of last update
+        systime_t time;
+        systime_t held_time;
+        uint8_t peer;
+        // Sign of last sent change
+        int8_t direction : 4;
+        bool valid : 1;
+        // Held until interval ends, or dropped and kept until pot is quiet
+        bool is_held : 1;
+        bool is_settling : 1;
+    };
+
+    bool isPending(const State& state) const {
+        return state.is_held || state.is_settling;
+    }
+    sysinterval_t getRemaining(const State& state, systime_t now) const;
+    void hold(State& state, int16_t value, systime_t now, bool settling);
+    void release(State& state);
+    void commit(State& state, int16_t value, systime_t now);
+
+    SendCallback send;
+    uint16_t deadband;
+    uint16_t hysteresis;
+    sysinterval_t interval;
+    sysinterval_t quiet;
+    State states[num_parameters] = {};
+    uint8_t num_held = 0;
+    // Stats
+    uint32_t passed = 0;
+    uint32_t dropped = 0;
+    uint32_t coalesced = 0;
+    uint32_t flushed = 0;
+    uint32_t settled = 0;
+};
+
+#if BUS_PARAMETER_FILTER == TRUE
+extern ParameterFilter parameter_filter;
+
+void printParameterStats(BaseSequentialStream* chp);
+#endif
+
+}
+
+#endif
@@ -0,0 +1,89 @@
+#pragma once
+#ifndef __PARAMETER_SMOOTHER__
+#define __PARAMETER_SMOOTHER__
+
+#include "main.hpp"
+#include "bus.hpp"
+#include "block_queue.hpp"
+
+namespace owpeer {
+
+/*
+ * Ramps parameter values towards their targets once per audio block, so
+ * that stepwise updates don't cause zipper noise.
+ *
+ * Each block covers a fixed Q15 share k of the remaining distance:
+ *
+ *   value = (value * (1 - k) + target * k) >> 15
+ *
+ * Result is rounded towards target, so value reaches it exactly. Values and
+ * targets are kept in separate arrays. On Cortex-M4 a pair of parameters is
+ * processed per iteration with one SMLAD for each, elsewhere GCC vector
+ * extensions are used. Both give identical results.
+ */
+class ParameterSmoother {
+public:
+    static constexpr size_t size = num_parameters;
+
+    ParameterSmoother(int16_t coefficient) {
+        setCoefficient(coefficient);
+    }
+
+    /*
+     * Share of remaining distance covered per block in Q15, 1 to 32767
+     */
+    void setCoefficient(int16_t k) {
+        coefficient = (uint32_t(k) << 16) | uint32_t(32768 - k);
+    }
+
+    void setTarget(PatchParameterId pid, int16_t value) {
+        target[pid] = value;
+    }
+
+    /*
+     * Targets for bulk updates, i.e. from ParameterCalibration
+     */
+    int16_t* getTargets() {
+        return target;
+    }
+
+    /*
+     * Jump to value without smoothing
+     */
+    void setValue(PatchParameterId pid, int16_t value) {
+        target[pid] = current[pid] = value;
+    }
+
+    /*
+     * Take targets from a block batch
+     */
+    void apply(const BlockEvent* events, size_t num);
+
+    /*
+     * Advance by one block
+     */
+    void process();
+
+    int16_t getValue(PatchParameterId pid) const {
+        return current[pid];
+    }
+    const int16_t* getValues() const {
+        return current;
+    }
+
+private:
+    static_assert(size % 8 == 0, "Parameters are processed in groups of 8");
+
+    alignas(16) int16_t current[size] = {};
+    alignas(16) int16_t target[size] = {};
+    // 1 - k in low half, k in high half
+    uint32_t coefficient;
+};
+
+#if PARAMETER_SMOOTHING == TRUE
+extern ParameterSmoother parameter_smoother;
+#endif
+
+}
+
+#endif
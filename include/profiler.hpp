@@ -0,0 +1,24 @@
+#pragma once
+#ifndef __PROFILER__
+#define __PROFILER__
+
+#include "main.hpp"
+
+/*
+ * Threads and ISR profiler.
+ *
+ * Context switch hook charges cycles elapsed since previous switch to the
+ * outgoing thread, minus time spent in ISRs meanwhile. IRQ hooks measure ISR
+ * time separately. Everything is measured with realtime counter (DWT cycle
+ * counter) extended to 64 bits. Stack usage is found by scanning working
+ * areas for the fill pattern, so CH_DBG_FILL_THREADS must be enabled. Main
+ * thread and ISR stacks are scanned between their linker symbols.
+ */
+
+namespace owpeer {
+
+void printThreadStats(BaseSequentialStream* chp);
+
+}
+
+#endif
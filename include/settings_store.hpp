@@ -0,0 +1,197 @@
+#pragma once
+#ifndef __SETTINGS_STORE__
+#define __SETTINGS_STORE__
+
+#include "main.hpp"
+#include "flash_storage.hpp"
+#include "OpenWareMidiControl.h"
+
+namespace owpeer {
+
+/*
+ * Settings keys are 2 character strings from OpenWareMidiControl.h packed
+ * into 16 bits, i.e. settingsKey(SYSEX_CONFIGURATION_DIGITAL_BUS_ENABLE)
+ */
+constexpr uint16_t settingsKey(const char* name) {
+    return (uint16_t(name[0]) << 8) | uint8_t(name[1]);
+}
+
+/*
+ * Keys that are used by peer itself and not exposed in SysEx configuration.
+ * Lower case keys don't clash with OpenWareMidiControl.h.
+ */
+#define SETTINGS_PEER_ID "pi"
+#define SETTINGS_PEER_FINGERPRINT "pf"
+#define SETTINGS_FIRMWARE_SIZE "fs"
+#define SETTINGS_FIRMWARE_CRC "fc"
+
+struct SettingsEntry {
+    uint16_t key;
+    int32_t default_value;
+    int32_t value = 0;
+    // Value has been stored or changed since boot
+    bool stored = false;
+    // Value has changed, but not written to flash yet
+    bool dirty = false;
+};
+
+/*
+ * Append only key/value log on two flash sectors.
+ *
+ * Active sector starts with a header containing magic and generation,
+ * followed by 8 byte records with key, check and value. A new value is
+ * appended without touching older records. When active sector is full, live
+ * values are copied to the other sector and its header is written last with
+ * the next generation, so power loss during compaction leaves old sector
+ * valid. Sector with the highest generation is active.
+ *
+ * All known keys and their values are kept in RAM. On boot the end of log
+ * is found with binary search and records are read backwards until all keys
+ * are found, so normally only the latest values are read.
+ *
+ * Values are changed in RAM only. Writes and compaction are done from
+ * SettingsThread without holding the mutex, so that callers never wait for
+ * flash. Erasing a 128k sector stalls the CPU for a couple of seconds, so
+ * the spare sector is only erased on request, at boot and bus reset. Until
+ * then compaction is postponed and values that don't fit stay in RAM.
+ */
+class SettingsStore {
+public:
+    SettingsStore(FlashStorage& storage, uint8_t sector_a, uint8_t sector_b,
+        SettingsEntry* entries, size_t entries_num)
+        : storage(storage)
+        , sectors {sector_a, sector_b}
+        , entries(entries)
+        , entries_num(entries_num) {
+    }
+
+    /*
+     * Load values from flash, must be called before starting SettingsThread
+     */
+    void load();
+
+    int32_t get(uint16_t key);
+    int32_t get(const char* name) {
+        return get(settingsKey(name));
+    }
+
+    /*
+     * Change value in RAM, returns false for unknown key
+     */
+    bool set(uint16_t key, int32_t value);
+    bool set(const char* name, int32_t value) {
+        return set(settingsKey(name), value);
+    }
+
+    /*
+     * Restore defaults, stored values are dropped on next store
+     */
+    void reset();
+
+    /*
+     * Wake up settings thread to write changed values
+     */
+    void requestStore() {
+        store_request.signal();
+    }
+
+    /*
+     * Write changed values. Called from settings thread.
+     */
+    void store();
+
+    /*
+     * Ask settings thread to erase spare sector, called when a stall is
+     * acceptable
+     */
+    void requestErase() {
+        erase_pending = true;
+        store_request.signal();
+    }
+
+    /*
+     * Make sure spare sector is erased if it was requested. Called from
+     * settings thread.
+     */
+    void prepareSpare();
+
+    /*
+     * Wait for store request or timeout
+     */
+    void waitRequest(sysinterval_t timeout) {
+        store_request.wait(timeout);
+    }
+
+    void print(BaseSequentialStream* chp);
+
+private:
+    struct Header {
+        uint32_t magic;
+        uint32_t generation;
+    };
+    struct Record {
+        uint16_t key;
+        uint16_t check;
+        int32_t value;
+
+        uint16_t getCheck() const {
+            return ~(key ^ uint16_t(value) ^ uint16_t(uint32_t(value) >> 16));
+        }
+    };
+    static_assert(sizeof(Record) == 8, "Record must be 2 words");
+    static constexpr uint32_t header_magic = 0x564b574f; // "OWKV"
+    static constexpr uint16_t erased_key = 0xffff;
+
+    enum SpareState {
+        SPARE_UNKNOWN,
+        SPARE_DIRTY,
+        SPARE_ERASED,
+    };
+
+    SettingsEntry* find(uint16_t key);
+    bool readHeader(uint8_t sector, Header& header);
+    bool isErased(uint8_t sector, size_t offset);
+    size_t findEnd(uint8_t sector);
+    bool takeDirty(size_t index, Record& record);
+    void markDirty(size_t index);
+    bool append(const Record& record);
+    bool compact();
+
+    FlashStorage& storage;
+    uint8_t sectors[2];
+    SettingsEntry* entries;
+    size_t entries_num;
+    Mutex mutex;
+    BinarySemaphore store_request {true};
+    uint8_t active = 0;
+    uint32_t generation = 0;
+    size_t end_offset = 0;
+    SpareState spare_state = SPARE_UNKNOWN;
+    volatile bool erase_pending = false;
+    bool reset_pending = false;
+    // Stats
+    uint32_t boot_records_read = 0;
+    uint32_t logical_bytes = 0;
+    uint32_t physical_bytes = 0;
+    uint32_t erases = 0;
+    uint32_t compactions = 0;
+    uint32_t failures = 0;
+};
+
+/*
+ * Low priority thread that does all flash writes for settings
+ */
+class SettingsThread : public BaseStaticThread<256> {
+private:
+    void main() override;
+};
+
+#if SETTINGS_STORE == TRUE
+extern SettingsStore settings;
+
+void printSettingsStats(BaseSequentialStream* chp);
+#endif
+
+}
+
+#endif
@@ -0,0 +1,204 @@
+#pragma once
+#ifndef __SLAB_ALLOCATOR__
+#define __SLAB_ALLOCATOR__
+
+#include "ch.hpp"
+
+namespace owpeer {
+
+using namespace chibios_rt;
+
+/*
+ * Single size class for slab allocator. This is a memory pool of fixed size
+ * blocks, so both allocation and release are O(1). Address range is kept to
+ * find owning class when memory is released.
+ */
+class SlabClass {
+public:
+    SlabClass(size_t size, void* buf, size_t num)
+        : pool(size, nullptr)
+        , size(size)
+        , num(num)
+        , begin(reinterpret_cast<uint8_t*>(buf))
+        , end(begin + size * num) {
+        pool.loadArray(buf, num);
+    }
+
+    /* Prohibit copy construction and assignment */
+    SlabClass(const SlabClass&) = delete;
+    SlabClass& operator=(const SlabClass&) = delete;
+
+    /*
+     * Allocate a block from this class, returns nullptr if class is exhausted
+     *
+     * @iclass
+     */
+    void* allocI() {
+        void* p = pool.allocI();
+        if (p == nullptr) {
+            failures++;
+        }
+        else {
+            allocs++;
+            if (++used > peak)
+                peak = used;
+        }
+        return p;
+    }
+
+    /*
+     * Release block that belongs to this class
+     *
+     * @iclass
+     */
+    void freeI(void* p) {
+        pool.freeI(p);
+        used--;
+    }
+
+    bool owns(const void* p) const {
+        auto addr = reinterpret_cast<const uint8_t*>(p);
+        return addr >= begin && addr < end;
+    }
+
+    size_t getSize() const {
+        return size;
+    }
+    size_t getNum() const {
+        return num;
+    }
+    size_t getUsed() const {
+        return used;
+    }
+    size_t getPeak() const {
+        return peak;
+    }
+    uint32_t getAllocs() const {
+        return allocs;
+    }
+    uint32_t getFailures() const {
+        return failures;
+    }
+
+private:
+    MemoryPool pool;
+    const size_t size, num;
+    const uint8_t* const begin;
+    const uint8_t* const end;
+    size_t used = 0, peak = 0;
+    uint32_t allocs = 0, failures = 0;
+};
+
+/*
+ * Size class with its own static storage
+ */
+template <size_t S, size_t N>
+class StaticSlabClass : public SlabClass {
+    static_assert(S % sizeof(void*) == 0, "Block size must be pointer aligned");
+    /* Declared as an array of pointers for the same reasons as in
+       GuardedObjectsPool - blocks must be able to store a pointer to next
+       free block.*/
+    void* slab_buf[(N * S) / sizeof(void*)];
+
+public:
+    StaticSlabClass()
+        : SlabClass(S, slab_buf, N) {
+    }
+};
+
+/*
+ * Size class allocator for bus payloads.
+ *
+ * Classes must be sorted by block size. Allocation takes the smallest class
+ * that fits requested size and falls back to larger classes if it's
+ * exhausted. Since number of classes is fixed, this is still O(1) and unlike
+ * chHeap there is no fragmentation or coalescing.
+ */
+class SlabAllocator {
+public:
+    SlabAllocator(SlabClass* const* classes, size_t num_classes)
+        : classes(classes)
+        , num_classes(num_classes) {
+    }
+
+    /* Prohibit copy construction and assignment */
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+    /*
+     * Allocate memory block of at least size bytes
+     *
+     * @return              pointer to allocated block
+     * @retval nullptr      if size is too large or all fitting classes are
+     *                      exhausted
+     *
+     * @api
+     */
+    void* alloc(size_t size) {
+        chSysLock();
+        void* p = allocI(size);
+        chSysUnlock();
+        return p;
+    }
+
+    /*
+     * @iclass
+     */
+    void* allocI(size_t size) {
+        for (size_t i = 0; i < num_classes; i++) {
+            if (classes[i]->getSize() >= size) {
+                void* p = classes[i]->allocI();
+                if (p != nullptr)
+                    return p;
+            }
+        }
+        return nullptr;
+    }
+
+    /*
+     * Release block previously returned by alloc. Releasing nullptr is
+     * allowed and has no effect.
+     *
+     * @api
+     */
+    void free(void* p) {
+        chSysLock();
+        freeI(p);
+        chSysUnlock();
+    }
+
+    /*
+     * @iclass
+     */
+    void freeI(void* p) {
+        if (p == nullptr)
+            return;
+        for (size_t i = 0; i < num_classes; i++) {
+            if (classes[i]->owns(p)) {
+                classes[i]->freeI(p);
+                return;
+            }
+        }
+        chDbgAssert(false, "not a slab block");
+    }
+
+    size_t getNumClasses() const {
+        return num_classes;
+    }
+
+    const SlabClass& getClass(size_t i) const {
+        return *classes[i];
+    }
+
+    size_t getMaxSize() const {
+        return classes[num_classes - 1]->getSize();
+    }
+
+private:
+    SlabClass* const* classes;
+    const size_t num_classes;
+};
+
+}
+
+#endif
@@ -0,0 +1,307 @@
+#pragma once
+#ifndef __SYSEX_CODEC__
+#define __SYSEX_CODEC__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "bus_protocol.hpp"
+
+namespace owpeer {
+
+/*
+ * 8 to 7 bit SysEx payload encoding as in OpenWare. Each group of 7 bytes is
+ * sent as a byte with their high bits, bit n for byte n, followed by the 7
+ * bytes with high bit cleared. Last group may be shorter.
+ *
+ * Messages are F0, MIDI_SYSEX_MANUFACTURER, MIDI_SYSEX_OMNI_DEVICE, command,
+ * encoded payload, F7. They are carried in USB MIDI event packets for cable
+ * 0, packed as little endian words with CIN in the low byte like BusMidi
+ * frames.
+ *
+ * High bits of 4 bytes are moved to or from a nibble with a single multiply,
+ * words are processed as a whole otherwise. Host builds run the same code,
+ * there is no separate SIMD path as they only exist for tests.
+ */
+namespace sysex {
+
+static constexpr uint32_t spread = 0x00204081;
+
+/*
+ * High bits of bytes 0-3 to bits 0-3
+ */
+static inline uint32_t gatherHighBits(uint32_t word) {
+    return (((word & 0x80808080) >> 7) * spread >> 21) & 0x0f;
+}
+
+/*
+ * Bits 0-3 to high bits of bytes 0-3
+ */
+static inline uint32_t spreadHighBits(uint32_t bits) {
+    return ((bits * spread) & 0x01010101) << 7;
+}
+
+static inline uint32_t load(const uint8_t* data) {
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+}
+
+/*
+ * Encodes a message straight to USB MIDI packets, output is called with
+ * each uint32_t packet. Payload may be written in any number of parts, only a
+ * partial group and at most 2 bytes of a partial packet are kept between
+ * calls.
+ */
+class SysexEncoder {
+public:
+    template <typename Output>
+    void begin(uint8_t command, Output&& output) {
+        group_len = 0;
+        pending = 0;
+        pending_len = 0;
+        put(0xf0 | (MIDI_SYSEX_MANUFACTURER << 8) |
+            (MIDI_SYSEX_OMNI_DEVICE << 16) | (uint32_t(command) << 24), 4,
+            output);
+    }
+
+    template <typename Output>
+    void write(const uint8_t* data, size_t len, Output&& output) {
+        if (group_len) {
+            size_t n = std::min<size_t>(len, group_size - group_len);
+            memcpy(group + group_len, data, n);
+            group_len += n;
+            data += n;
+            len -= n;
+            if (group_len < group_size)
+                return;
+            putGroup(group, group_size, output);
+            group_len = 0;
+        }
+        for (; len >= group_size; data += group_size, len -= group_size)
+            putGroup(data, group_size, output);
+        memcpy(group, data, len);
+        group_len = len;
+    }
+
+    /*
+     * Flush last group and terminate message
+     */
+    template <typename Output>
+    void end(Output&& output) {
+        if (group_len) {
+            memset(group + group_len, 0, sizeof(group) - group_len);
+            putGroup(group, group_len, output);
+            group_len = 0;
+        }
+        // F7 always fits in the last packet
+        output(uint32_t(USB_COMMAND_SYSEX_EOX1 + pending_len) |
+            uint32_t((pending | (uint32_t(0xf7) << (8 * pending_len))) << 8));
+        pending = 0;
+        pending_len = 0;
+    }
+
+    /*
+     * Number of packets for a payload, including header and terminator
+     */
+    static size_t getPackets(size_t len) {
+        size_t bytes = 4 + len + (len + group_size - 1) / group_size + 1;
+        return (bytes + 2) / 3;
+    }
+
+private:
+    static constexpr size_t group_size = 7;
+
+    /*
+     * Encode group of len bytes, data must be readable for 7 bytes
+     */
+    template <typename Output>
+    void putGroup(const uint8_t* data, size_t len, Output& output) {
+        uint32_t lo = sysex::load(data);
+        uint32_t hi = data[4] | (data[5] << 8) | (data[6] << 16);
+        uint32_t bits =
+            sysex::gatherHighBits(lo) | (sysex::gatherHighBits(hi) << 4);
+        lo &= 0x7f7f7f7f;
+        hi &= 0x7f7f7f7f;
+        if (len < 4) {
+            put(bits | (lo << 8), len + 1, output);
+        }
+        else {
+            put(bits | (lo << 8), 4, output);
+            put((lo >> 24) | (hi << 8), len - 3, output);
+        }
+    }
+
+    /*
+     * Append up to 4 bytes of word, bytes above len must be 0
+     */
+    template <typename Output>
+    void put(uint32_t word, size_t len, Output& output) {
+        uint64_t bytes = pending | (uint64_t(word) << (8 * pending_len));
+        len += pending_len;
+        for (; len >= 3; len -= 3, bytes >>= 24)
+            output(USB_COMMAND_SYSEX | uint32_t(bytes << 8));
+        pending = bytes;
+        pending_len = len;
+    }
+
+    uint8_t group[group_size + 1];
+    uint8_t group_len = 0;
+    uint8_t pending_len = 0;
+    uint32_t pending = 0;
+};
+
+/*
+ * Decodes a message from USB MIDI packets, output is called with
+ * (const uint8_t*, size_t) for each group of up to 7 payload bytes. Messages
+ * from other manufacturers are ignored.
+ */
+class SysexDecoder {
+public:
+    /*
+     * Returns true when packet ends a message that was decoded
+     */
+    template <typename Output>
+    bool write(uint32_t packet, Output&& output) {
+        uint8_t cin = packet & 0x0f;
+        size_t len;
+        if (cin == USB_COMMAND_SYSEX)
+            len = 3;
+        else if (cin >= USB_COMMAND_SYSEX_EOX1 && cin <= USB_COMMAND_SYSEX_EOX3)
+            len = cin - USB_COMMAND_SYSEX_EOX1 + 1;
+        else
+            return false;
+        for (size_t i = 0; i < len; i++) {
+            uint8_t c = packet >> (8 * (i + 1));
+            if (c == 0xf0) {
+                state = MANUFACTURER;
+                group = 0;
+                group_len = 0;
+                size = 0;
+            }
+            else if (c == 0xf7) {
+                bool decoded = state == PAYLOAD;
+                if (decoded && group_len > 1)
+                    putGroup(output);
+                state = IDLE;
+                return decoded;
+            }
+            else if (state == PAYLOAD) {
+                group |= uint64_t(c) << (8 * group_len);
+                if (++group_len == 8)
+                    putGroup(output);
+            }
+            else if (state == MANUFACTURER) {
+                state = c == MIDI_SYSEX_MANUFACTURER ? DEVICE : IDLE;
+            }
+            else if (state == DEVICE) {
+                state = COMMAND;
+            }
+            else if (state == COMMAND) {
+                command = c;
+                state = PAYLOAD;
+            }
+        }
+        return false;
+    }
+
+    uint8_t getCommand() const {
+        return command;
+    }
+
+    /*
+     * Decoded payload bytes of current or last message
+     */
+    uint32_t getSize() const {
+        return size;
+    }
+
+private:
+    enum State : uint8_t {
+        IDLE,
+        MANUFACTURER,
+        DEVICE,
+        COMMAND,
+        PAYLOAD,
+    };
+
+    template <typename Output>
+    void putGroup(Output& output) {
+        uint32_t bits = group & 0x7f;
+        uint32_t lo = uint32_t(group >> 8) | sysex::spreadHighBits(bits & 0x0f);
+        uint32_t hi = uint32_t(group >> 40) | sysex::spreadHighBits(bits >> 4);
+        uint8_t out[8];
+        memcpy(out, &lo, sizeof(lo));
+        memcpy(out + 4, &hi, sizeof(hi));
+        output(out, group_len - 1u);
+        size += group_len - 1;
+        group = 0;
+        group_len = 0;
+    }
+
+    State state = IDLE;
+    uint8_t command = 0;
+    uint8_t group_len = 0;
+    uint64_t group = 0;
+    uint32_t size = 0;
+};
+
+/*
+ * Sends BusData payload on as a SysEx message. First payload byte is the
+ * SysEx command, the rest is encoded. Packets are passed to output as they
+ * are encoded, so transfer of any size goes through without a buffer.
+ * Interrupted transfer still terminates the message, so that receiver leaves
+ * SysEx state, payload is then short.
+ */
+class SysexSink : public BusDataSink {
+public:
+    typedef void (*Output)(uint32_t packet);
+
+    SysexSink(Output output)
+        : output(output) {
+    }
+
+    bool open(uint32_t len) override {
+        started = false;
+        return len > 0;
+    }
+
+    void write(const uint8_t* data, size_t len) override {
+        if (!len)
+            return;
+        if (!started) {
+            encoder.begin(*data++, output);
+            started = true;
+            len--;
+        }
+        encoder.write(data, len, output);
+    }
+
+    void close() override {
+        if (started)
+            encoder.end(output);
+        started = false;
+    }
+
+    void abort() override {
+        close();
+    }
+
+private:
+    SysexEncoder encoder;
+    Output output;
+    bool started = false;
+};
+
+#if BUS_SYSEX_BRIDGE == TRUE
+/*
+ * Sends packets to bus as BusMidi
+ */
+extern SysexSink sysex_sink;
+#endif
+
+}
+
+#endif
@@ -4,6 +4,7 @@
 
 #include "chobjfifos.hpp"
 #include "bus.hpp"
+#include "latency_stats.hpp"
 
 namespace owpeer {
 
@@ -15,6 +16,23 @@ using FramesFifo = ObjectsFifo<BusFrame, num_frames>;
 extern FramesFifo rx_fifo;
 extern FramesFifo tx_fifo;
 
+/*
+ * Post frame to a frames FIFO. MIDI real-time frames (clock, start/stop,
+ * active sensing) are sent ahead of other frames that are already queued, so
+ * that tempo sync doesn't depend on parameter bursts or data transfers.
+ * Real-time frames keep their order among themselves.
+ */
+inline void postFrame(FramesFifo& fifo, BusFrame* frame) {
+#if BUS_LATENCY_STATS == TRUE
+    if (&fifo == &tx_fifo)
+        startLatency(frame->latency);
+#endif
+    if (frame->isMidiRealtime())
+        fifo.sendObjectAhead(frame);
+    else
+        fifo.sendObject(frame);
+}
+
 
 }
 #endif
\ No newline at end of file
@@ -2,34 +2,88 @@
 #ifndef __UART_RX__
 #define __UART_RX__
 
+#include <cstring>
 #include "main.hpp"
 #include "bus.hpp"
 #include "uart_fifo.hpp"
+#include "latency_stats.hpp"
+#include "jitter_meter.hpp"
+#include "bus_capture.hpp"
+#include "frame_sync.hpp"
+#include "bus_clock.hpp"
 
 namespace owpeer {
 
-class UartRxThread : public BaseStaticThread<128> {
+template <typename Transport>
+class UartRxThread : public BaseStaticThread<256> {
 private:
     void main (void) override {
         setName("UART Rx");
 
         while (true){
-            // Allocate new frame in RX pool
-            auto rx_frame = rx_fifo.takeObjectTimeoutInfinite();
-
-            // read from serial
-            sdRead(&BUS_SERIAL, (uint8_t*)(rx_frame->frame_buffer), frame_size);
-            chprintf(chp, "Received [%u,%u,%u,%u]\r\n",
-                rx_frame->frame_buffer[0], rx_frame->frame_buffer[1],
-                rx_frame->frame_buffer[2], rx_frame->frame_buffer[3]);
-
-            rx_fifo.sendObject(rx_frame);
+            // read whole frames from bus, nothing is returned if link is
+            // restarted for baud rate change
+            size_t len = Transport::read(buffer, sizeof(buffer));
+            read_time = chSysGetRealtimeCounterX();
+#if BUS_FRAME_SYNC == TRUE
+            if (len == 0) {
+                frame_sync.reset();
+                continue;
+            }
+            // frames are realigned if bytes were lost
+            frame_sync.write(buffer, len);
+            uint8_t frame[frame_size];
+            while (frame_sync.read(frame))
+                post(frame, frame_sync.getPending());
+#else
+            for (size_t pos = 0; pos < len; pos += frame_size)
+                post(buffer + pos, len - pos - frame_size);
+#endif
         }
     };
 
-    BusFrame rx_frame;
+    /*
+     * Frame is followed by given number of bytes that were read with it
+     */
+    void post(const uint8_t* data, size_t bytes_after) {
+#if BUS_CLOCK_SYNC == TRUE
+        // Last byte of the frame arrived before the bytes that follow it
+        if (BusClock::isSyncFrame(data)) {
+            uint32_t baud = Transport::getBaud();
+            bus_clock.receiveSync(data[0] & 0x0f, (data[2] << 8) | data[3],
+                read_time - bytes_after * BusClock::getByteCycles(baud),
+                baud);
+        }
+#else
+        (void)bytes_after;
+#endif
+        // Allocate new frame in RX pool
+        auto rx_frame = rx_fifo.takeObjectTimeoutInfinite();
+        memcpy(rx_frame->frame_buffer, data, frame_size);
+#if BUS_LATENCY_STATS == TRUE
+        startLatency(rx_frame->latency);
+#endif
+#if BUS_MIDI_JITTER_STATS == TRUE
+        if (rx_frame->isMidiClock())
+            clock_ingress_jitter.tick();
+#endif
+        debugFrame("Received [%u,%u,%u,%u]\r\n",
+            rx_frame->frame_buffer[0], rx_frame->frame_buffer[1],
+            rx_frame->frame_buffer[2], rx_frame->frame_buffer[3]);
+
+#if BUS_LATENCY_STATS == TRUE
+        markLatency(rx_frame->latency, LATENCY_RX_QUEUE);
+#endif
+#if BUS_CAPTURE == TRUE
+        bus_capture.tap(*rx_frame, BusCapture::CAPTURE_RX);
+#endif
+        postFrame(rx_fifo, rx_frame);
+    }
+
+    uint8_t buffer[frame_size * 8];
+    rtcnt_t read_time;
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
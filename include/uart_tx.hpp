@@ -2,28 +2,115 @@
 #ifndef __UART_TX__
 #define __UART_TX__
 
-#include "ch.hpp"
-#include "hal.h"
-#include "bus_frame.hpp"
+#include <cstring>
+#include "main.hpp"
+#include "bus.hpp"
+#include "uart_fifo.hpp"
+#include "latency_stats.hpp"
+#include "jitter_meter.hpp"
+#include "bus_capture.hpp"
+#include "baud_negotiator.hpp"
+#include "bus_clock.hpp"
 
 namespace owpeer {
 
-using namespace chibios_rt;
-
-class UartTxThread : public BaseStaticThread<128> {
+template <typename Transport>
+class UartTxThread : public BaseStaticThread<256> {
 private:
+    static constexpr size_t batch_size = 8;
+#if BUS_BAUD_NEGOTIATION == TRUE
+    // Thread wakes up without output to return to initial rate on reset
+    static constexpr sysinterval_t wait_interval =
+        TIME_MS2I(BUS_BAUD_GUARD_MS);
+#else
+    static constexpr sysinterval_t wait_interval = TIME_INFINITE;
+#endif
+
     void main (void) override {
-        setName("Uart Tx");
+        setName("UART Tx");
 
         while (true){
-            // receive frame from output buffer
-            // write ot serial
+            // receive frame from output buffer and whatever else is queued
+            size_t num = 0;
+            uint32_t baud = 0;
+            msg_t msg = tx_fifo.receiveObjectTimeout(&frames[0], wait_interval);
+#if BUS_BAUD_NEGOTIATION == TRUE
+            // Only this thread restarts transport, so that it never overlaps
+            // a write
+            if (bus_baud.takeReset() && Transport::getBaud() != BUS_BAUD)
+                Transport::start(BUS_BAUD);
+#endif
+            while (msg == MSG_OK) {
+                memcpy(buffer + num * frame_size, frames[num]->frame_buffer,
+                    frame_size);
+#if BUS_BAUD_NEGOTIATION == TRUE
+                // Rate is changed right after forwarding switch command, so
+                // it ends the batch
+                if (BaudNegotiator::isSwitchFrame(*frames[num++], baud))
+                    break;
+#else
+                num++;
+#endif
+                if (num == batch_size)
+                    break;
+                msg = tx_fifo.receiveObjectTimeout(&frames[num],
+                    TIME_IMMEDIATE);
+            }
+            if (num == 0)
+                continue;
+
+#if BUS_CLOCK_SYNC == TRUE
+            // Sync frames carry bus time when their transmission starts,
+            // after the output that transport still holds
+            rtcnt_t frame_cycles =
+                BusClock::getByteCycles(Transport::getBaud()) * frame_size;
+            rtcnt_t start = chSysGetRealtimeCounterX() +
+                Transport::getQueued() * frame_cycles / frame_size;
+            for (size_t i = 0; i < num; i++) {
+                uint8_t* data = buffer + i * frame_size;
+                if (BusClock::isSyncFrame(data))
+                    bus_clock.stamp(data, start + i * frame_cycles);
+            }
+#endif
+            // write to bus
+            Transport::write(buffer, num * frame_size);
+#if BUS_LATENCY_STATS == TRUE
+            // Transport may still hold the tail of this batch, frames are
+            // stamped with the time their last byte leaves the wire
+            rtcnt_t written = getLatencyTimestamp();
+            rtcnt_t byte_cycles = BusClock::getByteCycles(Transport::getBaud());
+            size_t queued = Transport::getQueued();
+#endif
+            for (size_t i = 0; i < num; i++) {
+                BusFrame* tx_frame = frames[i];
+#if BUS_LATENCY_STATS == TRUE
+                size_t after = (num - 1 - i) * frame_size;
+                rtcnt_t on_wire = written +
+                    (queued > after ? (queued - after) * byte_cycles : 0);
+                markLatencyAt(tx_frame->latency, LATENCY_TX, on_wire);
+#endif
+#if BUS_CAPTURE == TRUE
+                bus_capture.tap(*tx_frame, BusCapture::CAPTURE_TX);
+#endif
+#if BUS_MIDI_JITTER_STATS == TRUE
+                if (tx_frame->isMidiClock())
+                    clock_egress_jitter.tick();
+#endif
+                tx_fifo.returnObject(tx_frame);
+            }
+#if BUS_BAUD_NEGOTIATION == TRUE
+            if (baud && baud != Transport::getBaud()) {
+                Transport::start(baud);
+                chThdSleepMilliseconds(BUS_BAUD_GUARD_MS);
+            }
+#endif
         }
     };
 
-    BusFrame tx_frame;
+    BusFrame* frames[batch_size];
+    uint8_t buffer[frame_size * batch_size];
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,140 @@
+#include <algorithm>
+#include "baud_negotiator.hpp"
+#include "bus_protocol.hpp"
+
+namespace owpeer {
+
+#if BUS_BAUD_NEGOTIATION == TRUE
+static void sendCommand(uint8_t peer, uint8_t cmd, int16_t data) {
+    BusOutputPtr::make(std::in_place_type<BusCommand>, peer, cmd, data).send();
+}
+
+BaudNegotiator bus_baud(sendCommand);
+
+void printBaudStats(BaseSequentialStream* chp) {
+    bus_baud.print(chp);
+}
+#endif
+
+void BaudNegotiator::start(uint8_t own_uid, systime_t now) {
+    uid = own_uid;
+    if (uid != 0) {
+        state = IDLE;
+        return;
+    }
+    state = OFFERED;
+    timestamp = now;
+    send(uid, BUS_COMMAND_BAUD_OFFER, BUS_MAX_BAUD / 100);
+}
+
+void BaudNegotiator::reset() {
+    state = IDLE;
+    baud = BUS_BAUD;
+    reset_pending = true;
+}
+
+void BaudNegotiator::handleCommand(
+    uint8_t peer, uint8_t cmd, int16_t data, systime_t now) {
+    uint32_t rate = uint32_t(uint16_t(data)) * 100;
+    switch (cmd) {
+    case BUS_COMMAND_BAUD_OFFER:
+        if (peer != uid) {
+            send(peer, cmd, std::min<uint32_t>(rate, BUS_MAX_BAUD) / 100);
+        }
+        else if (state == OFFERED) {
+            if (rate > baud) {
+                target = rate;
+                state = SWITCHING;
+                timestamp = now;
+                send(uid, BUS_COMMAND_BAUD_SWITCH, data);
+            }
+            else {
+                state = DONE;
+            }
+        }
+        break;
+    case BUS_COMMAND_BAUD_SWITCH:
+        // Own switch command comes back at old rate, it's not expected to
+        // be received
+        if (peer == uid)
+            break;
+        if (rate == BUS_BAUD) {
+            // Ring is reverted, nothing to confirm
+            if (state != IDLE)
+                state = FAILED;
+            baud = BUS_BAUD;
+        }
+        else {
+            target = rate;
+            state = SWITCHING;
+            timestamp = now;
+        }
+        send(peer, cmd, data);
+        break;
+    case BUS_COMMAND_BAUD_CONFIRM:
+        if (peer != uid)
+            send(peer, cmd, data);
+        if (state == SWITCHING || state == CONFIRMING) {
+            state = DONE;
+            baud = target;
+            switches++;
+        }
+        break;
+    }
+}
+
+void BaudNegotiator::poll(systime_t now) {
+    sysinterval_t elapsed = chTimeDiffX(timestamp, now);
+    switch (state) {
+    case OFFERED:
+        if (elapsed >= TIME_MS2I(BUS_BAUD_TIMEOUT_MS))
+            state = FAILED;
+        break;
+    case SWITCHING:
+        if (uid == 0 && elapsed >= TIME_MS2I(BUS_BAUD_GUARD_MS * 2)) {
+            // Everyone should have switched by now
+            state = CONFIRMING;
+            timestamp = now;
+            send(uid, BUS_COMMAND_BAUD_CONFIRM, target / 100);
+        }
+        else if (elapsed >= TIME_MS2I(BUS_BAUD_TIMEOUT_MS)) {
+            fallback();
+        }
+        break;
+    case CONFIRMING:
+        if (elapsed >= TIME_MS2I(BUS_BAUD_TIMEOUT_MS))
+            fallback();
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Peers that have switched can only be reached at the new rate, so revert
+ * is sent as a switch before this peer returns to BUS_BAUD
+ */
+void BaudNegotiator::fallback() {
+    state = FAILED;
+    baud = BUS_BAUD;
+    fallbacks++;
+    send(uid, BUS_COMMAND_BAUD_SWITCH, BUS_BAUD / 100);
+}
+
+bool BaudNegotiator::isSwitchFrame(const BusFrame& frame, uint32_t& rate) {
+    if (frame.getOwlProtocolType() != OWL_COMMAND_COMMAND ||
+        frame.frame_buffer[1] != BUS_COMMAND_BAUD_SWITCH)
+        return false;
+    rate = ((frame.frame_buffer[2] << 8) | frame.frame_buffer[3]) * 100;
+    return true;
+}
+
+void BaudNegotiator::print(BaseSequentialStream* chp) const {
+    static const char* const names[] = {
+        "idle", "offered", "switching", "confirming", "done", "failed"};
+    chprintf(chp, "baud %u, max %u, negotiation %s, switches %u, "
+        "fallbacks %u\r\n", baud, BUS_MAX_BAUD, names[state],
+        switches, fallbacks);
+}
+
+}
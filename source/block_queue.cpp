@@ -0,0 +1,118 @@
+#include "block_queue.hpp"
+#include "bus_clock.hpp"
+#include "parameter_smoother.hpp"
+
+namespace owpeer {
+
+#if BLOCK_QUEUE == TRUE
+BlockQueue block_queue;
+
+void printBlockStats(BaseSequentialStream* chp) {
+    block_queue.print(chp);
+}
+
+static uint16_t getBlockTime() {
+#if BUS_CLOCK_SYNC == TRUE
+    return bus_clock.now();
+#else
+    return RTC2US(STM32_HCLK, chSysGetRealtimeCounterX());
+#endif
+}
+
+void BlockTickThread::main() {
+    setName("Block tick");
+    systime_t prev = chVTGetSystemTimeX();
+    // Part of block period that doesn't make a whole tick yet, in 1/256 us
+    uint32_t remainder = 0;
+    while (true) {
+        uint32_t period = block_queue.getPeriod();
+        if (period == 0) {
+            chThdSleepMilliseconds(1);
+            prev = chVTGetSystemTimeX();
+            continue;
+        }
+        remainder += period;
+        sysinterval_t ticks = TIME_US2I(remainder >> 8);
+        remainder -= TIME_I2US(ticks) << 8;
+        systime_t next = chTimeAddX(prev, ticks);
+        // Returns at once if it's already late
+        chThdSleepUntilWindowed(prev, next);
+        prev = next;
+        size_t num;
+        const BlockEvent* events = block_queue.startBlock(getBlockTime(), num);
+#if PARAMETER_SMOOTHING == TRUE
+        parameter_smoother.apply(events, num);
+        parameter_smoother.process();
+#else
+        (void)events;
+#endif
+    }
+}
+#endif
+
+void BlockQueue::configure(uint32_t rate, uint32_t block_size) {
+    chSysLock();
+    block_period = rate ? (uint64_t(block_size) * 1000000 << 8) / rate : 0;
+    chSysUnlock();
+}
+
+bool BlockQueue::push(const BlockEvent& event) {
+    chSysLock();
+    bool result = pushI(event, block + 1);
+    chSysUnlock();
+    return result;
+}
+
+bool BlockQueue::push(const BlockEvent& event, uint16_t time) {
+    chSysLock();
+    uint32_t target = block + 1;
+    int16_t offset = time - block_time;
+    if (block_period && offset >= 0) {
+        // Block that contains event time, limited by horizon
+        uint32_t ahead = std::min<uint32_t>(
+            (uint32_t(offset) << 8) / block_period, num_batches - 1);
+        target = std::max(target, block + ahead);
+    }
+    if (offset < 0 || (uint32_t(offset) << 8) < block_period)
+        late++;
+    bool result = pushI(event, target);
+    chSysUnlock();
+    return result;
+}
+
+bool BlockQueue::pushI(const BlockEvent& event, uint32_t target) {
+    // Batch of current block is being read and it's reused for the block
+    // after the horizon
+    for (; target < block + num_batches; target++) {
+        Batch& batch = batches[target & (num_batches - 1)];
+        if (batch.num < batch_size) {
+            batch.events[batch.num++] = event;
+            pushed++;
+            return true;
+        }
+        deferred++;
+    }
+    dropped++;
+    return false;
+}
+
+const BlockEvent* BlockQueue::startBlock(uint16_t time, size_t& num) {
+    chSysLock();
+    // Previous batch has been processed
+    batches[block & (num_batches - 1)].num = 0;
+    block++;
+    block_time = time;
+    Batch& batch = batches[block & (num_batches - 1)];
+    num = batch.num;
+    chSysUnlock();
+    max_batch = std::max<uint16_t>(max_batch, num);
+    return batch.events;
+}
+
+void BlockQueue::print(BaseSequentialStream* chp) const {
+    chprintf(chp, "block %u, period %u us, events %u, late %u, deferred %u, "
+        "dropped %u, max batch %u\r\n", block, block_period >> 8, pushed, late,
+        deferred, dropped, max_batch);
+}
+
+}
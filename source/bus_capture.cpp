@@ -0,0 +1,82 @@
+#include "bus_capture.hpp"
+
+namespace owpeer {
+
+#if BUS_CAPTURE == TRUE
+BusCapture bus_capture;
+#endif
+
+/*
+ * System time is off by up to a tick, that's far less than a counter
+ * period, so elapsed time is rounded to nearest whole number of periods
+ */
+uint32_t BusCapture::getWraps(uint32_t timestamp, systime_t time) const {
+    uint64_t elapsed = uint64_t(chTimeDiffX(last_time, time)) *
+        (STM32_HCLK / CH_CFG_ST_FREQUENCY);
+    uint32_t delta = timestamp - last_timestamp;
+    if (elapsed <= delta)
+        return 0;
+    return uint32_t((elapsed - delta + (1ull << 31)) >> 32);
+}
+
+void BusCapture::write(const BusFrame& frame, Direction dir) {
+    uint8_t info = dir | peer;
+    size_t len = record_size;
+#if BUS_LATENCY_STATS == TRUE
+    // Rx frames are stamped on ingress, Tx frames when they leave the wire
+    uint32_t annotation = frame.latency.last - frame.latency.origin;
+    info |= INFO_ANNOTATION;
+    len += 4;
+#endif
+
+    chSysLock();
+    uint32_t timestamp = chSysGetRealtimeCounterX();
+    systime_t time = chVTGetSystemTimeX();
+    uint32_t wraps = getWraps(timestamp, time);
+    if (wraps) {
+        info |= INFO_WRAPS;
+        len += 4;
+    }
+    if (size - (head - tail) < len) {
+        dropped++;
+        chSysUnlock();
+        return;
+    }
+    last_timestamp = timestamp;
+    last_time = time;
+    for (size_t i = 0; i < 4; i++)
+        put(timestamp >> (i * 8));
+    put(info);
+    for (size_t i = 0; i < frame_size; i++)
+        put(frame.frame_buffer[i]);
+    if (wraps) {
+        for (size_t i = 0; i < 4; i++)
+            put(wraps >> (i * 8));
+    }
+#if BUS_LATENCY_STATS == TRUE
+    for (size_t i = 0; i < 4; i++)
+        put(annotation >> (i * 8));
+#endif
+    chSysUnlock();
+}
+
+size_t BusCapture::readRecord(uint8_t* record) {
+    chSysLock();
+    if (head == tail) {
+        chSysUnlock();
+        return 0;
+    }
+    uint8_t info = get(tail + 4);
+    size_t len = record_size;
+    if (info & INFO_WRAPS)
+        len += 4;
+    if (info & INFO_ANNOTATION)
+        len += 4;
+    for (size_t i = 0; i < len; i++)
+        record[i] = get(tail + i);
+    tail += len;
+    chSysUnlock();
+    return len;
+}
+
+}
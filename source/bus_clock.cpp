@@ -0,0 +1,151 @@
+#include "bus_clock.hpp"
+
+namespace owpeer {
+
+#if BUS_CLOCK_SYNC == TRUE
+static void sendCommand(uint8_t peer, uint8_t cmd, int16_t data) {
+    BusOutputPtr::make(std::in_place_type<BusCommand>, peer, cmd, data).send();
+}
+
+BusClock bus_clock(sendCommand);
+
+void printClockStats(BaseSequentialStream* chp) {
+    bus_clock.print(chp);
+}
+#endif
+
+void BusClock::start(uint8_t own_uid, uint8_t num_peers, systime_t now) {
+    uid = own_uid;
+    peers = num_peers;
+    sync_time = now;
+    if (uid == 0) {
+        synced = true;
+        // Sync is sent on next poll
+        sync_time -= TIME_MS2I(BUS_CLOCK_SYNC_MS);
+    }
+}
+
+void BusClock::reset() {
+    uid = NO_UID;
+    synced = false;
+}
+
+void BusClock::poll(systime_t now) {
+    // Reference is moved forward before realtime counter wraps
+    rtcnt_t cycles = chSysGetRealtimeCounterX();
+    if (int32_t(cycles - ref_cycles) >= int32_t(STM32_HCLK))
+        setTime(cycles, getFineTime(cycles));
+    if (uid == NO_UID)
+        return;
+    if (uid != 0 && syncs != polled_syncs) {
+        // Rx thread only counts syncs, time taken there could be later than
+        // now
+        polled_syncs = syncs;
+        sync_time = now;
+    }
+    sysinterval_t elapsed = chTimeDiffX(sync_time, now);
+    if (uid == 0) {
+        if (elapsed >= TIME_MS2I(BUS_CLOCK_SYNC_MS)) {
+            sync_time = now;
+            send(uid, BUS_COMMAND_TIME_SYNC, 0);
+        }
+    }
+    else if (synced && elapsed >= TIME_MS2I(BUS_CLOCK_TIMEOUT_MS)) {
+        synced = false;
+    }
+}
+
+sysinterval_t BusClock::getPollInterval() const {
+    if (uid == 0)
+        return TIME_MS2I(BUS_CLOCK_SYNC_MS);
+    return TIME_MS2I(BUS_CLOCK_TIMEOUT_MS);
+}
+
+void BusClock::receiveSync(
+    uint8_t peer, uint16_t time, rtcnt_t arrival, uint32_t baud) {
+    chSysLock();
+    if (baud != link_baud) {
+        // Last byte arrives a frame time after the first one was sent
+        link_baud = baud;
+        link_delay = (getByteCycles(baud) * frame_size << 4) / cycles_per_us;
+    }
+    int32_t delay = link_delay;
+    chSysUnlock();
+    if (uid == NO_UID || peer != 0)
+        return;
+    uint32_t arrived = (uint32_t(time) << 4) + delay;
+    int32_t error = diff(arrived, getFineTime(arrival));
+    if (uid == 0) {
+        // Own sync went through all hops, each added the same delay error
+        if (peers > 1) {
+            chSysLock();
+            link_delay -= error / peers / 2;
+            delay = link_delay;
+            chSysUnlock();
+            last_error = error;
+            send(uid, BUS_COMMAND_TIME_DELAY, delay);
+        }
+        return;
+    }
+    syncs++;
+    if (synced) {
+        last_error = error;
+        max_error = std::max(max_error, error < 0 ? -error : error);
+    }
+    if (!synced || error > max_slew || error < -max_slew) {
+        steps++;
+        setTime(arrival, arrived);
+    }
+    else {
+        setTime(arrival, getFineTime(arrival) + error / 2);
+    }
+    synced = true;
+}
+
+void BusClock::stamp(uint8_t* frame, rtcnt_t start) const {
+    uint16_t time = getTime(start);
+    frame[2] = time >> 8;
+    frame[3] = time;
+}
+
+void BusClock::handleCommand(uint8_t peer, uint8_t cmd, int16_t data) {
+    if (peer == uid)
+        return;
+    if (cmd == BUS_COMMAND_TIME_DELAY) {
+        chSysLock();
+        link_delay = data;
+        chSysUnlock();
+    }
+    // Sync time is written again when forwarded frame is sent
+    send(peer, cmd, data);
+}
+
+bool BusClock::isSyncFrame(const uint8_t* frame) {
+    return (frame[0] & 0xf0) == OWL_COMMAND_COMMAND &&
+        frame[1] == BUS_COMMAND_TIME_SYNC;
+}
+
+uint32_t BusClock::getFineTime(rtcnt_t cycles) const {
+    chSysLock();
+    // Arrival time may precede reference that was just moved
+    int32_t elapsed = cycles - ref_cycles;
+    uint32_t time = ref_time;
+    chSysUnlock();
+    return time + uint32_t(int64_t(elapsed) * 16 / int32_t(cycles_per_us));
+}
+
+void BusClock::setTime(rtcnt_t cycles, uint32_t time) {
+    chSysLock();
+    ref_cycles = cycles;
+    ref_time = time;
+    chSysUnlock();
+}
+
+void BusClock::print(BaseSequentialStream* chp) const {
+    chprintf(chp, "clock %s, time %u us, syncs %u, steps %u, "
+        "error %d/16 us, max %d/16 us, link delay %d/16 us\r\n",
+        uid == 0 ? "master" : synced ? "synced" : "free", now(), syncs,
+        steps, last_error, max_error, link_delay);
+}
+
+}
@@ -0,0 +1,280 @@
+#include "chprintf.h"
+#include "hal.h"
+#include "bus_discovery.hpp"
+#include "bus_fifo.hpp"
+#include "bus_capture.hpp"
+
+namespace owpeer {
+
+static void sendDiscover(uint8_t seq, uint32_t token) {
+    BusOutputPtr::make(std::in_place_type<BusDiscover>, seq, token).send();
+}
+
+static void sendResume(uint8_t uid, uint32_t fingerprint) {
+    BusOutputPtr::make(std::in_place_type<BusCommand>, uid, BUS_COMMAND_RESUME,
+        int16_t(fingerprint))
+        .send();
+}
+
+BusDiscovery bus_discovery(sendDiscover, sendResume);
+
+void BusDiscovery::start(systime_t now) {
+    status = BUS_STATUS_DISCOVER;
+    uid = NO_UID;
+    peers = 0;
+    attempt = 0;
+    discovery_start = now;
+    nextRound(now);
+}
+
+void BusDiscovery::resume(systime_t now, uint8_t cached_uid,
+    uint8_t cached_peers, uint32_t cached_fingerprint) {
+    // Cache from another firmware or a damaged record can't be trusted
+    if (cached_peers == 0 || cached_peers > BUS_MAX_PEERS ||
+        cached_uid >= cached_peers) {
+        start(now);
+        return;
+    }
+    status = BUS_STATUS_CONNECTED;
+    uid = cached_uid;
+    peers = cached_peers;
+    fingerprint = cached_fingerprint;
+    // No known tokens, so that any discover restarts discovery
+    tokens_num = 0;
+    discovery_start = now;
+    connect_time = 0;
+    resumes++;
+#if BUS_CAPTURE == TRUE
+    bus_capture.setPeer(uid);
+#endif
+    send_resume(uid, fingerprint);
+}
+
+void BusDiscovery::handleResume(uint8_t peer, uint16_t other, systime_t now) {
+    if (status != BUS_STATUS_CONNECTED)
+        return;
+    // Resume is not forwarded, so it must come from previous peer
+    uint8_t expected = (uid + peers - 1) % peers;
+    if (peer != expected || other != uint16_t(fingerprint)) {
+        conflicts++;
+        start(now);
+    }
+}
+
+void BusDiscovery::stop() {
+    status = BUS_STATUS_IDLE;
+    uid = NO_UID;
+    peers = 0;
+}
+
+void BusDiscovery::startRound(systime_t now, uint8_t new_round) {
+    round = new_round & round_mask;
+    token = makeToken();
+    census = 0;
+    tokens_num = 0;
+    own_returns = 0;
+    ring_size = 0;
+    duplicates = false;
+    confirming = false;
+    round_start = now;
+    last_activity = now;
+    rounds++;
+    send(0, encode(token));
+}
+
+void BusDiscovery::nextRound(systime_t now) {
+    startRound(now, round + 1);
+}
+
+void BusDiscovery::handleDiscover(uint8_t seq, uint32_t value, systime_t now) {
+    if (status == BUS_STATUS_IDLE)
+        return;
+    uint8_t other_round = (value >> round_shift) & round_mask;
+    uint32_t other = value & token_mask;
+    if (status == BUS_STATUS_CONNECTED) {
+        // Late frames from completed round are ignored, anything else means
+        // that a peer has restarted discovery
+        if (other_round == round &&
+            (other == token || other == census || isKnownToken(other)))
+            return;
+        status = BUS_STATUS_DISCOVER;
+        uid = NO_UID;
+        attempt = 0;
+        discovery_start = now;
+        if (!isNewer(other_round, round)) {
+            // Restarted peer is behind, it joins our next round
+            nextRound(now);
+            return;
+        }
+        startRound(now, other_round);
+    }
+    else if (isNewer(other_round, round)) {
+        startRound(now, other_round);
+    }
+    else if (other_round != round) {
+        // Stale frame from a previous round
+        return;
+    }
+    last_activity = now;
+
+    if (value & census_bit) {
+        handleCensus(seq, other, now);
+        return;
+    }
+
+    if (other == token) {
+        own_returns++;
+        ring_size = seq + 1;
+        return;
+    }
+
+    uint8_t distance = seq + 1;
+    if (distance < BUS_MAX_PEERS)
+        send(distance, encode(other));
+    else
+        duplicates = true;
+
+    if (isKnownToken(other) || tokens_num == BUS_MAX_PEERS)
+        duplicates = true;
+    else
+        tokens[tokens_num++] = {other, distance};
+}
+
+void BusDiscovery::poll(systime_t now) {
+    if (status != BUS_STATUS_DISCOVER)
+        return;
+    sysinterval_t timeout = TIME_MS2I(BUS_DISCOVER_TIMEOUT_MS) << attempt;
+    if (confirming || own_returns == 0) {
+        systime_t start = confirming ? confirm_start : round_start;
+        if (chTimeDiffX(start, now) >= timeout) {
+            timeouts++;
+            if (attempt < BUS_DISCOVER_MAX_BACKOFF)
+                attempt++;
+            nextRound(now);
+        }
+    }
+    else if (chTimeDiffX(last_activity, now) >=
+        TIME_MS2I(BUS_DISCOVER_SETTLE_MS)) {
+        finishRound(now);
+    }
+}
+
+void BusDiscovery::finishRound(systime_t now) {
+    if (!isConsistent()) {
+        // Colliding peers can't tell which token was duplicated, so everyone
+        // rolls a new token
+        collisions++;
+        nextRound(now);
+        return;
+    }
+    fingerprint = token;
+    uid = 0;
+    for (size_t i = 0; i < tokens_num; i++) {
+        if (tokens[i].token < fingerprint) {
+            fingerprint = tokens[i].token;
+            uid = tokens[i].distance;
+        }
+    }
+    peers = ring_size;
+    confirming = true;
+    confirm_start = now;
+    if (uid == 0) {
+        census = makeToken();
+        send(0, encode(census | census_bit));
+    }
+}
+
+/*
+ * Census is forwarded by every peer but its sender, so it's received at
+ * distance equal to receiver id
+ */
+void BusDiscovery::handleCensus(uint8_t seq, uint32_t other, systime_t now) {
+    if (!confirming) {
+        // Peer 0 has settled before this peer
+        if (own_returns == 0)
+            return;
+        finishRound(now);
+        if (!confirming)
+            return;
+    }
+    bool passed = uid == 0 ? other == census && seq + 1 == peers :
+                             seq + 1 == uid;
+    if (!passed) {
+        census_conflicts++;
+        nextRound(now);
+        return;
+    }
+    if (uid != 0) {
+        census = other;
+        send(seq + 1, encode(other | census_bit));
+    }
+    connect(now);
+}
+
+void BusDiscovery::connect(systime_t now) {
+    confirming = false;
+    status = BUS_STATUS_CONNECTED;
+    connect_time = chTimeDiffX(discovery_start, now);
+#if BUS_CAPTURE == TRUE
+    bus_capture.setPeer(uid);
+#endif
+}
+
+bool BusDiscovery::isConsistent() const {
+    if (own_returns != 1 || duplicates || tokens_num + 1 != ring_size)
+        return false;
+    for (size_t i = 0; i < tokens_num; i++) {
+        if (tokens[i].distance >= ring_size)
+            return false;
+    }
+    return true;
+}
+
+bool BusDiscovery::isKnownToken(uint32_t other) const {
+    for (size_t i = 0; i < tokens_num; i++) {
+        if (tokens[i].token == other)
+            return true;
+    }
+    return false;
+}
+
+uint32_t BusDiscovery::makeToken() {
+    if (seed == 0) {
+        // Device unique ID makes sequences differ between peers that
+        // start at the same cycle count
+        const uint32_t* device_id = (const uint32_t*)UID_BASE;
+        seed = device_id[0] ^ device_id[1] ^ device_id[2];
+    }
+    // Cycle counter at the time of new round depends on frame arrival, so
+    // peers that have collided will diverge
+    seed ^= chSysGetRealtimeCounterX();
+    uint32_t value;
+    do {
+        if (seed == 0)
+            seed = 1;
+        // xorshift32
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        value = seed & token_mask;
+    } while (value == 0);
+    return value;
+}
+
+void BusDiscovery::print(BaseSequentialStream* chp) const {
+    static const char* const names[] = {"idle", "discover", "connected"};
+    chprintf(chp, "status %s, peer %u of %u, round %u, token %04x\r\n",
+        status < 3 ? names[status] : "error", uid, peers, round, token);
+    chprintf(chp,
+        "rounds %u, collisions %u, census conflicts %u, timeouts %u, "
+        "connected in %u us\r\n",
+        rounds, collisions, census_conflicts, timeouts,
+        TIME_I2US(connect_time));
+    chprintf(chp, "resumes %u, conflicts %u\r\n", resumes, conflicts);
+}
+
+void printDiscoveryStats(BaseSequentialStream* chp) {
+    bus_discovery.print(chp);
+}
+
+}
@@ -0,0 +1,122 @@
+#include <algorithm>
+#include "bus_dma_uart.hpp"
+
+namespace owpeer {
+
+#if BUS_TRANSPORT == BUS_TRANSPORT_DMA_UART
+BusDmaUart bus_dma_uart(&BUS_UART);
+#endif
+
+BusDmaUart* BusDmaUart::instance = nullptr;
+
+void BusDmaUart::start(uint32_t baud) {
+    if (started) {
+        while (driver->txstate == UART_TX_ACTIVE)
+            chThdSleepMicroseconds(100);
+        // Last byte may still be in shift register, wait for 2 byte times
+        chThdSleepMicroseconds(20 * 1000000 / config.speed + 1);
+        uartStop(driver);
+    }
+    instance = this;
+    config.speed = baud;
+    uartStart(driver, &config);
+
+    // Replace driver's single byte idle loop with our circular buffer
+    chSysLock();
+    dmaStreamDisable(driver->dmarx);
+    dmaStreamSetMemory0(driver->dmarx, buffer);
+    dmaStreamSetTransactionSize(driver->dmarx, BUS_DMA_BUFFER_SIZE);
+    dmaStreamSetMode(driver->dmarx, driver->dmarxmode | STM32_DMA_CR_DIR_P2M |
+        STM32_DMA_CR_MINC | STM32_DMA_CR_CIRC | STM32_DMA_CR_HTIE |
+        STM32_DMA_CR_TCIE);
+    dmaStreamEnable(driver->dmarx);
+    tail = 0;
+    halves_filled = 0;
+    bytes_read = 0;
+    chSysUnlock();
+
+    // Wake reader waiting on previous port
+    ready.reset(true);
+    started = true;
+    start_time = chVTGetSystemTimeX();
+}
+
+size_t BusDmaUart::read(uint8_t* data, size_t len) {
+    size_t pending;
+    while (true) {
+        checkOverrun();
+        pending = getPending();
+        if (pending >= frame_size)
+            break;
+        if (ready.wait(TIME_INFINITE) != MSG_OK)
+            return 0;
+    }
+    len = std::min(pending, len) / frame_size * frame_size;
+    for (size_t i = 0; i < len; i++) {
+        data[i] = buffer[tail];
+        tail = (tail + 1) % BUS_DMA_BUFFER_SIZE;
+    }
+    bytes_read += len;
+    frames += len / frame_size;
+    return len;
+}
+
+void BusDmaUart::write(const uint8_t* data, size_t len) {
+    uartSendTimeout(driver, &len, data, TIME_INFINITE);
+}
+
+size_t BusDmaUart::getPending() const {
+    // Counter is reloaded after last byte, so head can be equal to size
+    size_t head = (BUS_DMA_BUFFER_SIZE -
+                      dmaStreamGetTransactionSize(driver->dmarx)) %
+        BUS_DMA_BUFFER_SIZE;
+    return (head + BUS_DMA_BUFFER_SIZE - tail) % BUS_DMA_BUFFER_SIZE;
+}
+
+void BusDmaUart::checkOverrun() {
+    uint32_t filled = halves_filled * half_size;
+    if (int32_t(filled - bytes_read) >= int32_t(BUS_DMA_BUFFER_SIZE)) {
+        // DMA has passed reader, continue from the half that it fills now
+        tail = (filled % BUS_DMA_BUFFER_SIZE);
+        bytes_read = filled;
+        overruns++;
+    }
+}
+
+void BusDmaUart::dmaEvent(UARTDriver* driver, uint16_t c) {
+    (void)driver;
+    (void)c;
+    chSysLockFromISR();
+    instance->halves_filled++;
+    instance->dma_events++;
+    instance->ready.signalI();
+    chSysUnlockFromISR();
+}
+
+void BusDmaUart::idleEvent(UARTDriver* driver) {
+    (void)driver;
+    chSysLockFromISR();
+    instance->idle_events++;
+    instance->ready.signalI();
+    chSysUnlockFromISR();
+}
+
+void BusDmaUart::errorEvent(UARTDriver* driver, uartflags_t flags) {
+    (void)driver;
+    (void)flags;
+    instance->errors++;
+}
+
+void BusDmaUart::print(BaseSequentialStream* chp) const {
+    uint32_t ms = TIME_I2MS(chVTTimeElapsedSinceX(start_time));
+    uint32_t irqs = dma_events + idle_events;
+    chprintf(chp, "dma uart %u baud, buffer %u, frames %u, overruns %u, "
+        "errors %u\r\n", config.speed, BUS_DMA_BUFFER_SIZE, frames, overruns,
+        errors);
+    chprintf(chp, "rx irqs %u (dma %u, idle %u), %u/s, %u bytes/irq\r\n",
+        irqs, dma_events, idle_events,
+        ms ? uint32_t(uint64_t(irqs) * 1000 / ms) : 0,
+        irqs ? bytes_read / irqs : 0);
+}
+
+}
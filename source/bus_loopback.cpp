@@ -0,0 +1,51 @@
+#include <algorithm>
+#include "bus_loopback.hpp"
+
+namespace owpeer {
+
+#if BUS_TRANSPORT == BUS_TRANSPORT_LOOPBACK
+BusLoopback bus_loopback;
+#endif
+
+void BusLoopback::start(uint32_t new_baud) {
+    chSysLock();
+    head = 0;
+    tail = 0;
+    chSysUnlock();
+    baud = new_baud;
+    ready.reset(true);
+    start_time = chVTGetSystemTimeX();
+}
+
+size_t BusLoopback::read(uint8_t* data, size_t len) {
+    uint32_t available;
+    while ((available = head - tail) < frame_size) {
+        if (ready.wait(TIME_INFINITE) != MSG_OK)
+            return 0;
+    }
+    len = std::min<size_t>(available, len) / frame_size * frame_size;
+    for (size_t i = 0; i < len; i++)
+        data[i] = buffer[(tail + i) & mask];
+    tail += len;
+    return len;
+}
+
+void BusLoopback::write(const uint8_t* data, size_t len) {
+    if (len > BUS_LOOPBACK_BUFFER_SIZE - (head - tail)) {
+        dropped += len / frame_size;
+        return;
+    }
+    for (size_t i = 0; i < len; i++)
+        buffer[(head + i) & mask] = data[i];
+    head += len;
+    frames += len / frame_size;
+    ready.signal();
+}
+
+void BusLoopback::print(BaseSequentialStream* chp) const {
+    uint32_t ms = TIME_I2MS(chVTTimeElapsedSinceX(start_time));
+    chprintf(chp, "loopback, frames %u, %u/s, dropped %u\r\n", frames,
+        ms ? uint32_t(uint64_t(frames) * 1000 / ms) : 0, dropped);
+}
+
+}
@@ -1,67 +1,291 @@
+#include <new>
 #include <variant>
 //#include "bus_fifo.hpp"
 #include "bus_protocol.hpp"
+#include "latency_stats.hpp"
+#include "crc32.hpp"
 
 namespace owpeer {
 
-BusProtocolObject* BusDiscover::decodeFrame(const BusFrame& frame) {
-    auto new_discover = bus_protocol_fifo.takeObjectTimeoutInfinite();
-    *new_discover = BusDiscover(frame.getSeq(),
+static_assert(sizeof(BusObjectPtr) == sizeof(BusProtocolObject*),
+    "Owning pointer must have no overhead");
+
+/*
+ * Pool slots are raw memory, so objects are constructed in place. Objects
+ * inherit latency timestamps from the frame they were decoded from, for
+ * multi-frame objects that's the first frame.
+ */
+template <class T, typename... Args>
+static BusObjectPtr makeObject(const BusFrame& frame, Args&&... args) {
+    auto obj = BusObjectPtr::make(
+        std::in_place_type<T>, std::forward<Args>(args)...);
+#if BUS_LATENCY_STATS == TRUE
+    auto& latency = getBusObject(*obj).latency;
+    latency = frame.latency;
+    markLatency(latency, LATENCY_DECODE);
+#else
+    (void)frame;
+#endif
+    return obj;
+}
+
+BusObjectPtr BusDiscover::decodeFrame(const BusFrame& frame) {
+    return makeObject<BusDiscover>(frame, frame.getSeq(),
         (frame.frame_buffer[1] << 16) | (frame.frame_buffer[2] << 8) |
             frame.frame_buffer[3]);
-    return new_discover;
 }
 
-BusProtocolObject* BusReset::decodeFrame(const BusFrame& frame) {
-    (void)frame;
-    auto new_reset = bus_protocol_fifo.takeObjectTimeoutInfinite();
-    *new_reset = BusReset();
-    return new_reset;
+BusObjectPtr BusReset::decodeFrame(const BusFrame& frame) {
+    return makeObject<BusReset>(frame);
 }
 
-BusProtocolObject* BusMidi::decodeFrame(const BusFrame& frame) {
-    auto new_midi = bus_protocol_fifo.takeObjectTimeoutInfinite();
-    *new_midi = BusMidi(frame.frame_buffer[0], frame.frame_buffer[1],
-        frame.frame_buffer[2], frame.frame_buffer[3]);
-    return new_midi;
+BusObjectPtr BusMidi::decodeFrame(const BusFrame& frame) {
+    return makeObject<BusMidi>(frame, frame.frame_buffer[0],
+        frame.frame_buffer[1], frame.frame_buffer[2], frame.frame_buffer[3]);
 }
 
-BusProtocolObject* BusButton::decodeFrame(const BusFrame& frame) {
+BusObjectPtr BusButton::decodeFrame(const BusFrame& frame) {
     PatchButtonId new_bid = PatchButtonId(frame.frame_buffer[1]);
     uint32_t new_value = (frame.frame_buffer[2] << 8) | frame.frame_buffer[3];
-    auto new_button = bus_protocol_fifo.takeObjectTimeoutInfinite();
-    *new_button = BusButton(frame.getSeq(), new_bid, new_value);
-    return new_button;
+    return makeObject<BusButton>(frame, frame.getSeq(), new_bid, new_value);
 }
 
-BusProtocolObject* BusParameter::decodeFrame(const BusFrame& frame) {
+BusObjectPtr BusParameter::decodeFrame(const BusFrame& frame) {
     PatchParameterId new_pid = PatchParameterId(frame.frame_buffer[1]);
     uint32_t new_value = (frame.frame_buffer[2] << 8) | frame.frame_buffer[3];
-    auto new_parameter = bus_protocol_fifo.takeObjectTimeoutInfinite();
-    *new_parameter = BusParameter(frame.getSeq(), new_pid, new_value);
-    return new_parameter;
+    return makeObject<BusParameter>(frame, frame.getSeq(), new_pid, new_value);
 }
 
-BusProtocolObject* BusCommand::decodeFrame(const BusFrame& frame) {
-    auto new_command = bus_protocol_fifo.takeObjectTimeoutInfinite();
-    *new_command = BusCommand(frame.getSeq(), frame.frame_buffer[1],
+BusObjectPtr BusCommand::decodeFrame(const BusFrame& frame) {
+    return makeObject<BusCommand>(frame, frame.getSeq(), frame.frame_buffer[1],
         (frame.frame_buffer[2] << 8) | frame.frame_buffer[3]);
-    return new_command;
 }
 
-BusProtocolObject* BusData::decodeFrame(const BusFrame& frame) {
+BusDataSink* volatile BusData::stream_sinks[0x10] = {};
+BusDataFecStats BusData::fec_stats = {};
+BusDataLzStats BusData::lz_stats = {};
+
+#if BUS_DATA_LZ == TRUE
+void printCompressionStats(BaseSequentialStream* chp) {
+    auto& lz = BusData::getLzStats();
+    chprintf(chp, "lz transfers %u, failed %u, in %u bytes, out %u bytes, "
+        "%u cycles, %u cycles/kB\r\n", lz.transfers, lz.failed, lz.input,
+        lz.output, lz.cycles,
+        lz.output ? uint32_t(uint64_t(lz.cycles) * 1024 / lz.output) : 0);
+}
+#endif
+
+BusObjectPtr BusData::decodeFrame(const BusFrame& frame) {
     uint32_t size = (frame.frame_buffer[1] << 16) |
         (frame.frame_buffer[2] << 8) | frame.frame_buffer[3];
-    void* data = nullptr;
-    if (size < FRAMES_UNKNOWN) {
-        data = bus_heap.alloc(size);
+    uint8_t fec_shift = 0;
+    if (size & BUS_DATA_FEC_FLAG)
+        fec_shift = ((size >> 20) & 0x07) + 1;
+    // Block wouldn't fit erasure mask, header is damaged
+    if (fec_shift > BUS_DATA_FEC_MAX_SHIFT)
+        return BusObjectPtr();
+    bool compressed = size & BUS_DATA_LZ_FLAG;
+    size &= BUS_DATA_LEN_MASK;
+    BusObjectPtr obj;
+    BusDataSink* sink;
+    if (compressed) {
+        // Output is opened when decompressed size is known
+        obj = makeObject<BusData>(frame, frame.getSeq(), size, nullptr);
+        std::get<BusData>(*obj).startLz();
+    }
+    else if ((sink = takeStreamSink(frame.getSeq(), size)) != nullptr) {
+        obj = makeObject<BusData>(frame, frame.getSeq(), size, sink);
+    }
+    else {
+        // Transfer fails if payload doesn't fit any slab class
+        obj = makeObject<BusData>(frame, frame.getSeq(), size);
+    }
+    if (fec_shift)
+        std::get<BusData>(*obj).startFec(fec_shift);
+    return obj;
+}
+
+void BusData::startFec(uint8_t shift) {
+    uint32_t total = len / 3 + 1;
+    fec_stats.transfers++;
+    fec = BusBuffer(sizeof(BusDataFec) + (3 << shift));
+    BusDataFec* f = getFec();
+    if (f == nullptr) {
+        // Without block buffer frames are only counted, parity and CRC
+        // included
+        drop();
+        frames_remaining = total + 2 * ((total + (1 << shift) - 1) >> shift);
+        fec_stats.failed++;
+        return;
+    }
+    f->shift = shift;
+    f->failed = false;
+    f->crc = 0xffffffff;
+    uint8_t num = std::min<uint32_t>(total, 1 << shift);
+    frames_remaining = total - num;
+    f->startBlock(num);
+}
+
+void BusData::receiveFec(const uint8_t* frame_data) {
+    BusDataFec* f = getFec();
+    // Block is finished when the next one starts, so that a gap right after
+    // its last parity frame can still mark it as lost
+    if (f->pos == f->frames + 2)
+        finishBlock();
+    if (f->frames == 0) {
+        // Last block is followed by CRC
+        checkCrc(frame_data);
+        return;
+    }
+    if (f->pos < f->frames) {
+        uint8_t* dst = f->getBlock() + f->pos * 3;
+        if (frame_data == nullptr) {
+            memset(dst, 0, 3);
+            f->erased |= uint64_t(1) << f->pos;
+        }
+        else {
+            memcpy(dst, frame_data, 3);
+            f->addParity(f->pos & 1, frame_data);
+        }
+    }
+    else {
+        uint8_t group = f->pos - f->frames;
+        if (frame_data == nullptr)
+            f->parity_lost |= 1 << group;
+        else
+            f->addParity(group, frame_data);
+    }
+    f->pos++;
+}
+
+/*
+ * Each parity group can rebuild one lost frame if its parity frame arrived
+ */
+static bool canRebuild(const BusDataFec& f) {
+    static constexpr uint64_t even = 0x5555555555555555;
+    for (uint8_t group = 0; group < 2; group++) {
+        uint64_t lost = f.erased & (group ? ~even : even);
+        if (lost && ((lost & (lost - 1)) || (f.parity_lost & (1 << group))))
+            return false;
+    }
+    return true;
+}
+
+void BusData::finishBlock() {
+    BusDataFec* f = getFec();
+    uint8_t* block = f->getBlock();
+    if (!canRebuild(*f)) {
+        f->failed = true;
+    }
+    else {
+        // XOR of received frames and parity leaves the lost frame
+        for (uint8_t i = 0; i < f->frames; i++) {
+            if (f->erased & (uint64_t(1) << i)) {
+                memcpy(block + i * 3, f->parity[i & 1], 3);
+                fec_stats.rebuilt++;
+            }
+        }
+    }
+    // Last block ends with a partial frame
+    size_t bytes = frames_remaining ? f->frames * 3 :
+                                      (f->frames - 1) * 3 + len % 3;
+    if (!f->failed) {
+        for (size_t i = 0; i < bytes; i++)
+            f->crc = updateCrc(f->crc, block[i]);
+        writePayload(block, bytes);
+    }
+    uint8_t num = std::min<uint32_t>(frames_remaining, 1 << f->shift);
+    frames_remaining -= num;
+    f->startBlock(num);
+}
+
+void BusData::checkCrc(const uint8_t* frame_data) {
+    BusDataFec* f = getFec();
+    uint32_t crc = ~f->crc & 0xffffff;
+    if (!f->failed && (frame_data == nullptr ||
+        uint32_t((frame_data[0] << 16) | (frame_data[1] << 8) |
+            frame_data[2]) != crc)) {
+        f->failed = true;
+        fec_stats.failed++;
     }
-    auto new_data = bus_protocol_fifo.takeObjectTimeoutInfinite();
-    *new_data = std::move(BusData(frame.getSeq(), (uint8_t*)data, size));
-    return new_data;
+    frames_remaining = FRAMES_UNKNOWN;
+    closePayload(f->failed);
+}
+
+bool BusData::erase(uint8_t frames) {
+    BusDataFec* f = getFec();
+    if (isDecoded())
+        return false;
+    if (f == nullptr) {
+        // Frames remaining counts down to FRAMES_UNKNOWN after last frame
+        drop();
+        frames_remaining = frames > frames_remaining ?
+            FRAMES_UNKNOWN : frames_remaining - frames;
+        return false;
+    }
+    bool was_failed = f->failed;
+    // Frame before the gap may contain bytes that followed it
+    if (f->pos > f->frames) {
+        f->parity_lost |= 1 << (f->pos - f->frames - 1);
+    }
+    else if (f->pos > 0 && !(f->erased & (uint64_t(1) << (f->pos - 1)))) {
+        uint8_t prev = f->pos - 1;
+        uint8_t* p = f->getBlock() + prev * 3;
+        f->addParity(prev & 1, p);
+        memset(p, 0, 3);
+        f->erased |= uint64_t(1) << prev;
+    }
+    // Failed blocks are still counted to the end of transfer
+    while (frames-- && !isDecoded())
+        receiveFec(nullptr);
+    if (!isDecoded() && !f->failed && !canRebuild(*f))
+        f->failed = true;
+    if (f->failed && !was_failed)
+        fec_stats.failed++;
+    return !f->failed;
+}
+
+void BusData::abort() {
+    if (isDecoded())
+        return;
+    BusDataFec* f = getFec();
+    if (f != nullptr && !f->failed)
+        fec_stats.failed++;
+    drop();
+    fec = BusBuffer();
+    frames_remaining = FRAMES_UNKNOWN;
+}
+
+void BusData::drop() {
+    if (sink != nullptr) {
+        sink->abort();
+        sink = nullptr;
+    }
+    buffer = BusBuffer();
+    lz = BusBuffer();
+    data = nullptr;
+    failed = true;
 }
 
 BusData& BusData::operator<<(const BusFrame& frame) {
+    if (getFec() != nullptr) {
+        receiveFec(&frame.frame_buffer[1]);
+        return *this;
+    }
+    if (sink != nullptr || getLz() != nullptr) {
+        if (frames_remaining--) {
+            writePayload(&frame.frame_buffer[1], 3);
+        }
+        else {
+            writePayload(&frame.frame_buffer[1], len % 3);
+            closePayload(false);
+        }
+        return *this;
+    }
+    if (!isAllocated()) {
+        frames_remaining--;
+        return *this;
+    }
     if (frames_remaining--) {
         // This handles frame decoding until last frame is reached
         *position++ = frame.frame_buffer[1];
@@ -85,8 +309,147 @@ BusData& BusData::operator<<(const BusFrame& frame) {
     return *this;
 }
 
+void BusData::startLz() {
+#if BUS_DATA_LZ == TRUE
+    lz_stats.transfers++;
+    lz = BusBuffer(sizeof(BusDataLz) + (1 << BUS_DATA_LZ_WINDOW_BITS));
+    if (lz.get() != nullptr)
+        new (lz.get()) BusDataLz();
+    else {
+        lz_stats.failed++;
+        failed = true;
+    }
+#endif
+    // Without decoder state frames are only counted
+}
+
+bool BusData::openLz() {
+    BusDataLz* z = getLz();
+    z->size = (z->header[1] << 16) | (z->header[2] << 8) | z->header[3];
+    if (!z->decoder.start(z->header[0] >> 4, z->header[0] & 0x0f))
+        return false;
+    sink = takeStreamSink(peer, z->size);
+    if (sink == nullptr) {
+        buffer = BusBuffer(z->size);
+        data = position = buffer.get();
+        if (data == nullptr)
+            return false;
+    }
+    return true;
+}
+
+BusDataSink* BusData::takeStreamSink(uint8_t peer, uint32_t size) {
+    BusDataSink* sink = stream_sinks[peer & 0x0f];
+    if (sink == nullptr || !sink->open(size))
+        return nullptr;
+    // Sink that message handler set meanwhile stays for the next transfer
+    chSysLock();
+    if (stream_sinks[peer & 0x0f] == sink)
+        stream_sinks[peer & 0x0f] = nullptr;
+    chSysUnlock();
+    return sink;
+}
+
+void BusData::writePayload(const uint8_t* bytes, size_t n) {
+    BusDataLz* z = getLz();
+    if (z == nullptr) {
+        output(bytes, n);
+        return;
+    }
+    lz_stats.input += n;
+    while (n && z->header_len < sizeof(z->header)) {
+        z->header[z->header_len++] = *bytes++;
+        n--;
+        if (z->header_len == sizeof(z->header) && !openLz()) {
+            lz_stats.failed++;
+            lz = BusBuffer();
+            failed = true;
+            return;
+        }
+    }
+    if (n == 0)
+        return;
+    rtcnt_t start = chSysGetRealtimeCounterX();
+    rtcnt_t excluded = 0;
+    z->decoder.write(bytes, n, [&](const uint8_t* chunk, size_t size) {
+        rtcnt_t output_start = chSysGetRealtimeCounterX();
+        // Corrupted stream must not overflow output buffer
+        uint32_t done = z->decoder.getSize() - size;
+        if (done < z->size)
+            output(chunk, std::min<uint32_t>(size, z->size - done));
+        excluded += chSysGetRealtimeCounterX() - output_start;
+    });
+    lz_stats.cycles += chSysGetRealtimeCounterX() - start - excluded;
+}
+
+void BusData::output(const uint8_t* bytes, size_t n) {
+    if (sink != nullptr) {
+        sink->write(bytes, n);
+    }
+    else if (isAllocated()) {
+        memcpy(position, bytes, n);
+        position += n;
+    }
+}
+
+void BusData::closePayload(bool failed) {
+    BusDataLz* z = getLz();
+    if (z != nullptr) {
+        lz_stats.output += z->decoder.getSize();
+        if (z->header_len < sizeof(z->header) ||
+            z->decoder.getSize() < z->size)
+            failed = true;
+        if (failed)
+            lz_stats.failed++;
+    }
+    this->failed |= failed;
+    if (failed && sink == nullptr) {
+        // Incomplete payload is not delivered
+        buffer = BusBuffer();
+        data = nullptr;
+    }
+    if (sink != nullptr) {
+        if (failed)
+            sink->abort();
+        else
+            sink->close();
+    }
+}
+
+/*
+ * Caller must check isEncoded result before sending each frame
+ */
+void BusData::setFec(uint8_t shift) {
+    if (shift == 0)
+        return;
+    fec = BusBuffer(sizeof(BusDataFec));
+    chDbgAssert(len <= BUS_DATA_LEN_MASK, "FEC length doesn't fit header");
+    BusDataFec* f = getFec();
+    if (f != nullptr) {
+        f->shift = std::min(shift, BUS_DATA_FEC_MAX_SHIFT);
+        f->failed = false;
+        f->crc = 0xffffffff;
+        f->startBlock(0);
+    }
+}
+
 BusData& BusData::operator>>(BusFrame& frame) {
     frame.frame_buffer[0] = OWL_COMMAND_DATA | peer;
+    BusDataFec* f = getFec();
+    if (parity_remaining) {
+        // Parity frames close each block
+        const uint8_t* p = f->parity[2 - parity_remaining];
+        frame.fill(p[0], p[1], p[2]);
+        if (--parity_remaining == 0)
+            f->startBlock(0);
+        return *this;
+    }
+    if (crc_remaining) {
+        uint32_t crc = ~f->crc;
+        frame.fill(crc >> 16, crc >> 8, crc);
+        crc_remaining = false;
+        return *this;
+    }
     if (frames_remaining--) {
         frame.frame_buffer[1] = *position++;
         frame.frame_buffer[2] = *position++;
@@ -94,7 +457,10 @@ BusData& BusData::operator>>(BusFrame& frame) {
         bytes_remaining -= 3;
     }
     else {
-        switch (len) {
+        switch (len % 3) {
+        case 0:
+            frame.fill('\0', '\0', '\0');
+            break;
         case 1:
             frame.fill(*position++, '\0', '\0');
             break;
@@ -103,14 +469,42 @@ BusData& BusData::operator>>(BusFrame& frame) {
             frame.frame_buffer[2] = *position++;
             frame.frame_buffer[3] = '\0';
             break;
-        default:
-            // This clause should never be reached - it would mean that
-            // isEncoded result hasn't been checked before sending last frame
-            break;
         };
         bytes_remaining = 0;
     }
+    if (f != nullptr) {
+        size_t bytes = bytes_remaining ? 3 : len % 3;
+        for (size_t i = 0; i < bytes; i++)
+            f->crc = updateCrc(f->crc, frame.frame_buffer[1 + i]);
+        f->addParity(f->pos & 1, &frame.frame_buffer[1]);
+        if (++f->pos == (1 << f->shift) || bytes_remaining == 0)
+            parity_remaining = 2;
+        crc_remaining = bytes_remaining == 0;
+    }
     return *this;
 }
 
-}
\ No newline at end of file
+BusObjectPtr BusMessage::decodeFrame(const BusFrame& frame) {
+    auto new_message = makeObject<BusMessage>(frame, frame.getSeq());
+    std::get<BusMessage>(*new_message) << frame;
+    return new_message;
+}
+
+BusMessage& BusMessage::operator<<(const BusFrame& frame) {
+    for (size_t i = 1; i < frame_size && !decoded; i++) {
+        char c = frame.frame_buffer[i];
+        // Message is truncated if it doesn't fit max_msg_len
+        if (c == '\0' || len == max_msg_len - 1)
+            decoded = true;
+        if (position != nullptr) {
+            *position = decoded ? '\0' : c;
+            if (!decoded) {
+                position++;
+                len++;
+            }
+        }
+    }
+    return *this;
+}
+
+}
@@ -0,0 +1,139 @@
+#include "config_parser.hpp"
+#include "latency_stats.hpp"
+
+namespace owpeer {
+
+#if BUS_CONFIG_PARSER == TRUE
+bool queueConfiguration(uint16_t key, int32_t value) {
+    // Decoder waits here if message handler is behind
+    auto obj = BusObjectPtr::make(
+        std::in_place_type<BusConfigRecord>, key, value);
+#if BUS_LATENCY_STATS == TRUE
+    startLatency(getBusObject(*obj).latency);
+#endif
+    obj.send();
+    return true;
+}
+
+bool applyConfiguration(uint16_t key, int32_t value) {
+#if SETTINGS_STORE == TRUE
+    return settings.set(key, value);
+#else
+    (void)key;
+    (void)value;
+    return false;
+#endif
+}
+
+ConfigParser config_parser(queueConfiguration);
+
+void printConfigStats(BaseSequentialStream* chp) {
+    ConfigParser::print(chp);
+}
+#endif
+
+uint32_t ConfigParser::records = 0;
+uint32_t ConfigParser::rejected = 0;
+uint32_t ConfigParser::refused = 0;
+uint32_t ConfigParser::errors = 0;
+
+bool ConfigParser::open(uint32_t len) {
+    (void)len;
+    state = KEY;
+    return true;
+}
+
+void ConfigParser::write(const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = data[i];
+        if (c <= ' ' || c == ',') {
+            finish();
+            continue;
+        }
+        switch (state) {
+        case KEY:
+            key = c << 8;
+            state = KEY_LOW;
+            break;
+        case KEY_LOW:
+            key |= c;
+            negative = false;
+            digits = 0;
+            value = 0;
+            state = SIGN;
+            break;
+        case SIGN:
+            if (c == '-') {
+                negative = true;
+                state = VALUE;
+                break;
+            }
+            [[fallthrough]];
+        case VALUE: {
+            uint8_t digit = c - '0';
+            if (digit > 9) {
+                digit = (c | 0x20) - 'a' + 10;
+                if (digit < 10 || digit > 15)
+                    digit = 0xff;
+            }
+            if (digit == 0xff || digits == 8) {
+                state = SKIP;
+                break;
+            }
+            value = (value << 4) | digit;
+            digits++;
+            state = VALUE;
+            break;
+        }
+        case SKIP:
+            break;
+        }
+    }
+}
+
+void ConfigParser::close() {
+    finish();
+}
+
+void ConfigParser::abort() {
+    if (state != KEY)
+        errors++;
+    state = KEY;
+}
+
+void ConfigParser::finish() {
+    if (state == KEY)
+        return;
+    if (state != VALUE || digits == 0)
+        errors++;
+    else if (findKey(key) < 0 || !apply(key, negative ? -value : value))
+        rejected++;
+    else
+        records++;
+    state = KEY;
+}
+
+size_t ConfigParser::format(char* buf, uint16_t key, int32_t value) {
+    static const char hex[] = "0123456789abcdef";
+    char* p = buf;
+    *p++ = key >> 8;
+    *p++ = key;
+    uint32_t v = value;
+    if (value < 0) {
+        *p++ = '-';
+        v = -v;
+    }
+    size_t digits = 1;
+    while (digits < 8 && (v >> (digits * 4)))
+        digits++;
+    for (size_t i = digits; i > 0; i--)
+        *p++ = hex[(v >> ((i - 1) * 4)) & 0xf];
+    return p - buf;
+}
+
+void ConfigParser::print(BaseSequentialStream* chp) {
+    chprintf(chp, "config records %u, rejected %u, refused %u, errors %u\r\n",
+        records, rejected, refused, errors);
+}
+
+}
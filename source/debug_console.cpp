@@ -0,0 +1,118 @@
+#include <cstdlib>
+#include <cstring>
+#include "debug_console.hpp"
+#include "device_stats.hpp"
+#include "bus_capture.hpp"
+#include "settings_store.hpp"
+
+namespace owpeer {
+
+static void cmdStats(BaseSequentialStream* chp, const char* arg) {
+    if (!printDeviceStats(chp, arg))
+        chprintf(chp, "No such stats section\r\n");
+}
+
+#if BUS_CAPTURE == TRUE
+/*
+ * Captured records are printed one per line as "C <hex bytes>"
+ */
+static void cmdCapture(BaseSequentialStream* chp, const char* arg) {
+    if (arg != nullptr && strcmp(arg, "start") == 0) {
+        bus_capture.start();
+    }
+    else if (arg != nullptr && strcmp(arg, "stop") == 0) {
+        bus_capture.stop();
+    }
+    else if (arg != nullptr && strcmp(arg, "dump") == 0) {
+        uint8_t record[BusCapture::max_record_size];
+        size_t len;
+        while ((len = bus_capture.readRecord(record)) != 0) {
+            chprintf(chp, "C ");
+            for (size_t i = 0; i < len; i++)
+                chprintf(chp, "%02x", record[i]);
+            chprintf(chp, "\r\n");
+        }
+        chprintf(chp, "C end\r\n");
+    }
+    chprintf(chp, "capture %s, %u bytes used, %u dropped\r\n",
+        bus_capture.isRunning() ? "running" : "stopped", bus_capture.getUsed(),
+        bus_capture.getDropped());
+}
+#endif
+
+#if SETTINGS_STORE == TRUE
+/*
+ * "settings XX value" changes a value in RAM, "settings store" and
+ * "settings reset" work like corresponding SysEx commands
+ */
+static void cmdSettings(BaseSequentialStream* chp, const char* arg) {
+    if (arg != nullptr && strcmp(arg, "store") == 0) {
+        settings.requestStore();
+    }
+    else if (arg != nullptr && strcmp(arg, "reset") == 0) {
+        settings.reset();
+    }
+    else if (arg != nullptr && strlen(arg) > 3 && arg[2] == ' ') {
+        if (!settings.set(arg, atoi(arg + 3)))
+            chprintf(chp, "No such setting\r\n");
+    }
+    settings.print(chp);
+}
+#endif
+
+static void cmdHelp(BaseSequentialStream* chp, const char* arg);
+
+static const DebugConsoleThread::Command commands[] = {
+    {"help", cmdHelp},
+    {"stats", cmdStats},
+#if BUS_CAPTURE == TRUE
+    {"capture", cmdCapture},
+#endif
+#if SETTINGS_STORE == TRUE
+    {"settings", cmdSettings},
+#endif
+};
+
+static void cmdHelp(BaseSequentialStream* chp, const char* arg) {
+    (void)arg;
+    for (auto& cmd : commands)
+        chprintf(chp, "%s\r\n", cmd.name);
+    chprintf(chp, "stats sections:");
+    for (size_t i = 0; i < stats_sections_num; i++)
+        chprintf(chp, " %s", stats_sections[i].name);
+    chprintf(chp, "\r\n");
+}
+
+void DebugConsoleThread::main() {
+    setName("Debug console");
+
+    size_t len = 0;
+    while (true) {
+        msg_t c = sdGet(&USB_SERIAL);
+        if (c != '\r' && c != '\n') {
+            // Overlong lines are truncated
+            if (len < max_line_len - 1)
+                line[len++] = c;
+            continue;
+        }
+        if (len == 0)
+            continue;
+        line[len] = '\0';
+        len = 0;
+
+        char* arg = strchr(line, ' ');
+        if (arg != nullptr)
+            *arg++ = '\0';
+        bool found = false;
+        for (auto& cmd : commands) {
+            if (strcmp(line, cmd.name) == 0) {
+                cmd.handler(chp, arg);
+                found = true;
+            }
+        }
+        if (!found)
+            chprintf(chp, "Unknown command, try help\r\n");
+    }
+}
+
+}
@@ -0,0 +1,119 @@
+#include <cstring>
+#include "memstreams.h"
+#include "device_stats.hpp"
+#include "jitter_meter.hpp"
+#include "profiler.hpp"
+#include "latency_stats.hpp"
+#include "uart_fifo.hpp"
+#include "bus_protocol.hpp"
+#include "bus_discovery.hpp"
+#include "settings_store.hpp"
+#include "firmware_updater.hpp"
+#include "baud_negotiator.hpp"
+#include "bus_transport.hpp"
+#include "frame_sync.hpp"
+#include "parameter_filter.hpp"
+#include "bus_clock.hpp"
+#include "block_queue.hpp"
+#include "config_parser.hpp"
+
+namespace owpeer {
+
+#if BUS_MIDI_JITTER_STATS == TRUE
+static void printJitterStats(BaseSequentialStream* chp) {
+    clock_ingress_jitter.print(chp);
+    clock_egress_jitter.print(chp);
+}
+#endif
+
+const StatsSection stats_sections[] = {
+    {"discovery", printDiscoveryStats},
+#if BUS_BAUD_NEGOTIATION == TRUE
+    {"baud", printBaudStats},
+#endif
+    {"transport", printTransportStats},
+#if BUS_FRAME_SYNC == TRUE
+    {"sync", printSyncStats},
+#endif
+#if BUS_DATA_LZ == TRUE
+    {"compression", printCompressionStats},
+#endif
+#if BUS_CLOCK_SYNC == TRUE
+    {"clock", printClockStats},
+#endif
+#if BLOCK_QUEUE == TRUE
+    {"blocks", printBlockStats},
+#endif
+#if BUS_PARAMETER_FILTER == TRUE
+    {"parameters", printParameterStats},
+#endif
+    {"pools", printPoolStats},
+    {"threads", printThreadStats},
+#if SETTINGS_STORE == TRUE
+    {"settings", printSettingsStats},
+#endif
+#if BUS_CONFIG_PARSER == TRUE
+    {"config", printConfigStats},
+#endif
+#if FIRMWARE_UPDATER == TRUE
+    {"firmware", printFirmwareStats},
+#endif
+#if BUS_LATENCY_STATS == TRUE
+    {"latency", printLatencyStats},
+#endif
+#if BUS_MIDI_JITTER_STATS == TRUE
+    {"jitter", printJitterStats},
+#endif
+};
+
+const size_t stats_sections_num = sizeof(stats_sections) / sizeof(StatsSection);
+
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+static void printFifoStats(
+    BaseSequentialStream* chp, const char* name, Fifo& fifo) {
+    auto stats = fifo.getStats();
+    chprintf(chp, "%s: used %u/%u peak %u, pending %u peak %u, "
+        "takes %u sends %u, take waits %u (%u ms)\r\n",
+        name, stats.used, stats.num, stats.used_peak, stats.pending,
+        stats.pending_peak, stats.takes, stats.sends, stats.take_waits,
+        TIME_I2MS(stats.take_wait_time));
+}
+#endif
+
+void printPoolStats(BaseSequentialStream* chp) {
+#if CH_DBG_OBJ_FIFOS_STATISTICS == TRUE
+    printFifoStats(chp, "rx", rx_fifo);
+    printFifoStats(chp, "tx", tx_fifo);
+    printFifoStats(chp, "proto", bus_protocol_fifo);
+    printFifoStats(chp, "out", bus_output_fifo);
+#endif
+    for (size_t i = 0; i < bus_allocator.getNumClasses(); i++) {
+        auto& slab = bus_allocator.getClass(i);
+        chprintf(chp, "slab %u: used %u/%u peak %u, allocs %u failed %u\r\n",
+            slab.getSize(), slab.getUsed(), slab.getNum(), slab.getPeak(),
+            slab.getAllocs(), slab.getFailures());
+    }
+}
+
+bool printDeviceStats(BaseSequentialStream* chp, const char* name) {
+    bool found = false;
+    for (size_t i = 0; i < stats_sections_num; i++) {
+        if (name == nullptr || strcmp(name, stats_sections[i].name) == 0) {
+            stats_sections[i].print(chp);
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool formatDeviceStats(size_t section, char* buf, size_t size) {
+    if (section >= stats_sections_num || size == 0)
+        return false;
+    MemoryStream ms;
+    msObjectInit(&ms, (uint8_t*)buf, size - 1, 0);
+    stats_sections[section].print((BaseSequentialStream*)&ms);
+    buf[ms.eos] = '\0';
+    return true;
+}
+
+}
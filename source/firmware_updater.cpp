@@ -0,0 +1,239 @@
+#include <cstring>
+#include "firmware_updater.hpp"
+#include "settings_store.hpp"
+#include "crc32.hpp"
+
+namespace owpeer {
+
+#if FIRMWARE_UPDATER == TRUE
+FirmwareUpdater firmware_updater(flash_storage, FIRMWARE_STAGING_SECTOR);
+
+void printFirmwareStats(BaseSequentialStream* chp) {
+    firmware_updater.print(chp);
+}
+
+void FirmwareWriterThread::main() {
+    setName("Firmware writer");
+    while (true)
+        firmware_updater.process();
+}
+#endif
+
+void FirmwareUpdater::begin(uint8_t new_peer, uint16_t options) {
+#if BUS_DATA_LZ == TRUE
+    uint16_t supported = FIRMWARE_UPLOAD_LZ;
+#else
+    uint16_t supported = 0;
+#endif
+    if (state == ERASING || state == RECEIVING || state == VERIFYING) {
+        report(-1);
+        return;
+    }
+    peer = new_peer;
+    if (options & ~supported) {
+        report(-1);
+        return;
+    }
+    // Pages are only held by writer thread while an upload is in progress,
+    // so message handler doesn't wait for flash here
+    FirmwarePage* request = pages.takeObjectTimeout(TIME_IMMEDIATE);
+    if (request == nullptr) {
+        report(-1);
+        return;
+    }
+    state = ERASING;
+    request->type = FirmwarePage::ERASE;
+    pages.sendObject(request);
+}
+
+bool FirmwareUpdater::store() {
+#if SETTINGS_STORE == TRUE
+    if (state == DONE) {
+        settings.set(SETTINGS_FIRMWARE_SIZE, size);
+        settings.set(SETTINGS_FIRMWARE_CRC, expected_crc);
+        settings.requestStore();
+        return true;
+    }
+#endif
+    return false;
+}
+
+bool FirmwareUpdater::open(uint32_t len) {
+    if (state != READY || len < 4 || len - 4 > storage.getSectorSize(sector))
+        return false;
+    size = len - 4;
+    received = 0;
+    written = 0;
+    crc = 0xffffffff;
+    expected_crc = 0;
+    reported = 0;
+    page = pages.takeObjectTimeout(TIME_IMMEDIATE);
+    if (page == nullptr)
+        return false;
+    page->type = FirmwarePage::PROGRAM;
+    page->offset = 0;
+    page->len = 0;
+    start_time = chVTGetSystemTimeX();
+    state = RECEIVING;
+    return true;
+}
+
+void FirmwareUpdater::write(const uint8_t* data, size_t len) {
+    if (state != RECEIVING)
+        return;
+    for (size_t i = 0; i < len; i++) {
+        if (received < size) {
+            crc = updateCrc(crc, data[i]);
+            page->data[page->len++] = data[i];
+            if (page->len == FIRMWARE_PAGE_SIZE)
+                submit();
+        }
+        else if (received < size + 4) {
+            // CRC follows image
+            expected_crc |= uint32_t(data[i]) << ((received - size) * 8);
+        }
+        received++;
+    }
+}
+
+void FirmwareUpdater::close() {
+    if (state != RECEIVING)
+        return;
+    if (received != size + 4) {
+        abort();
+        return;
+    }
+    if (page->len)
+        submit();
+    page->type = FirmwarePage::VERIFY;
+    pages.sendObject(page);
+    page = nullptr;
+    state = VERIFYING;
+}
+
+void FirmwareUpdater::abort() {
+    if (state != RECEIVING)
+        return;
+    state = ERROR;
+    if (page != nullptr) {
+        pages.returnObject(page);
+        page = nullptr;
+    }
+    report(-1);
+}
+
+void FirmwareUpdater::submit() {
+    uint32_t offset = page->offset + page->len;
+    pages.sendObject(page);
+    // Decoder only waits if writer is still busy with previous page
+    page = pages.takeObjectTimeout(TIME_IMMEDIATE);
+    if (page == nullptr) {
+        page_waits++;
+        page = pages.takeObjectTimeout(TIME_INFINITE);
+    }
+    page->type = FirmwarePage::PROGRAM;
+    page->offset = offset;
+    page->len = 0;
+}
+
+void FirmwareUpdater::process() {
+    FirmwarePage* next;
+    if (pages.receiveObjectTimeout(&next, TIME_INFINITE) != MSG_OK)
+        return;
+    switch (next->type) {
+    case FirmwarePage::ERASE:
+        pages.returnObject(next);
+        // Erase stalls the CPU, so it's skipped if sector is already blank
+        if (isErased() || storage.erase(sector)) {
+            state = READY;
+            BusData::setStreamSink(peer, this);
+            report(0);
+        }
+        else {
+            state = ERROR;
+            report(-1);
+        }
+        break;
+    case FirmwarePage::PROGRAM:
+        program(*next);
+        pages.returnObject(next);
+        break;
+    case FirmwarePage::VERIFY:
+        pages.returnObject(next);
+        verify();
+        break;
+    }
+}
+
+bool FirmwareUpdater::isErased() const {
+    size_t size = storage.getSectorSize(sector);
+    for (size_t offset = 0; offset < size; offset += 4) {
+        uint32_t word;
+        if (!storage.read(sector, offset, &word, sizeof(word)) ||
+            word != FlashStorage::erased_word)
+            return false;
+    }
+    return true;
+}
+
+void FirmwareUpdater::program(FirmwarePage& next) {
+    if (state == ERROR)
+        return;
+    // Flash is programmed in words, tail is padded with erased value
+    uint32_t len = (next.len + 3) & ~3;
+    memset(next.data + next.len, 0xff, len - next.len);
+    if (!storage.program(sector, next.offset, next.data, len)) {
+        program_errors++;
+        state = ERROR;
+        report(-1);
+        return;
+    }
+    written += next.len;
+    int16_t progress = written * 100 / size;
+    if (progress / 10 > reported / 10 && progress < 100)
+        report(progress / 10 * 10);
+}
+
+void FirmwareUpdater::verify() {
+    if (state == ERROR)
+        return;
+    // Image is read back, so that flash contents are checked
+    uint32_t flash_crc = 0xffffffff;
+    uint8_t buf[64];
+    for (uint32_t offset = 0; offset < size; offset += sizeof(buf)) {
+        uint32_t len = std::min<uint32_t>(sizeof(buf), size - offset);
+        storage.read(sector, offset, buf, (len + 3) & ~3);
+        for (size_t i = 0; i < len; i++)
+            flash_crc = updateCrc(flash_crc, buf[i]);
+    }
+    flash_crc ^= 0xffffffff;
+    transfer_time = chVTTimeElapsedSinceX(start_time);
+    if (flash_crc == expected_crc && (crc ^ 0xffffffff) == expected_crc) {
+        state = DONE;
+        report(100);
+    }
+    else {
+        state = ERROR;
+        report(-1);
+    }
+}
+
+void FirmwareUpdater::report(int16_t progress) {
+    reported = progress;
+    BusOutputPtr::make(
+        std::in_place_type<BusCommand>, peer, SYSEX_FIRMWARE_UPLOAD, progress)
+        .send();
+}
+
+void FirmwareUpdater::print(BaseSequentialStream* chp) const {
+    static const char* const names[] = {"idle", "erasing", "ready",
+        "receiving", "verifying", "done", "error"};
+    uint32_t ms = TIME_I2MS(transfer_time);
+    chprintf(chp, "firmware %s, %u/%u bytes, crc %08x\r\n", names[state],
+        received, size + 4, expected_crc);
+    chprintf(chp, "transfer %u ms, %u bytes/s, page waits %u, errors %u\r\n",
+        ms, ms ? uint32_t(uint64_t(size) * 1000 / ms) : 0, page_waits,
+        program_errors);
+}
+
+}
@@ -0,0 +1,121 @@
+#include <cstring>
+#include "hal.h"
+#include "flash_storage.hpp"
+
+namespace owpeer {
+
+Stm32FlashStorage flash_storage;
+
+#if SETTINGS_STORE == TRUE
+static_assert(SETTINGS_SECTOR_A >= Stm32FlashStorage::firmware_sectors &&
+    SETTINGS_SECTOR_B >= Stm32FlashStorage::firmware_sectors,
+    "Settings sectors overlap firmware");
+#endif
+#if FIRMWARE_UPDATER == TRUE
+static_assert(
+    FIRMWARE_STAGING_SECTOR >= Stm32FlashStorage::firmware_sectors,
+    "Staging sector overlaps firmware");
+#endif
+
+static constexpr uint32_t flash_base = 0x08000000;
+static constexpr uint32_t flash_errors = FLASH_SR_PGSERR | FLASH_SR_PGPERR |
+    FLASH_SR_PGAERR | FLASH_SR_WRPERR | FLASH_SR_OPERR;
+
+size_t Stm32FlashStorage::getSectorSize(uint8_t sector) const {
+    if (sector < 4)
+        return 16 * 1024;
+    else if (sector == 4)
+        return 64 * 1024;
+    else if (sector < num_sectors)
+        return 128 * 1024;
+    else
+        return 0;
+}
+
+uintptr_t Stm32FlashStorage::getSectorAddress(uint8_t sector) {
+    if (sector <= 4)
+        return flash_base + sector * 16 * 1024;
+    else
+        return flash_base + (sector - 4) * 128 * 1024;
+}
+
+bool Stm32FlashStorage::read(
+    uint8_t sector, size_t offset, void* data, size_t len) const {
+    if (!isValid(sector, offset, len))
+        return false;
+    // Flash is memory mapped
+    memcpy(data, (const void*)(getSectorAddress(sector) + offset), len);
+    return true;
+}
+
+bool Stm32FlashStorage::erase(uint8_t sector) {
+    if (sector < firmware_sectors || !isValid(sector, 0, 0))
+        return false;
+    unlock();
+    bool ret = waitReady();
+    if (ret) {
+        FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_SER |
+            (sector << FLASH_CR_SNB_Pos);
+        FLASH->CR |= FLASH_CR_STRT;
+        ret = waitReady();
+        FLASH->CR &= ~(FLASH_CR_SER | FLASH_CR_SNB);
+    }
+    lock();
+    resetCaches();
+    return ret;
+}
+
+bool Stm32FlashStorage::program(
+    uint8_t sector, size_t offset, const void* data, size_t len) {
+    if (sector < firmware_sectors || !isValid(sector, offset, len))
+        return false;
+    volatile uint32_t* dst =
+        (volatile uint32_t*)(getSectorAddress(sector) + offset);
+    const uint8_t* src = (const uint8_t*)data;
+    unlock();
+    bool ret = waitReady();
+    if (ret) {
+        FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_PG;
+        for (size_t i = 0; i < len / 4 && ret; i++) {
+            // Source may be unaligned
+            uint32_t word;
+            memcpy(&word, src + i * 4, 4);
+            dst[i] = word;
+            __DSB();
+            ret = waitReady();
+        }
+        FLASH->CR &= ~FLASH_CR_PG;
+    }
+    lock();
+    return ret;
+}
+
+void Stm32FlashStorage::unlock() {
+    if (FLASH->CR & FLASH_CR_LOCK) {
+        FLASH->KEYR = FLASH_KEY1;
+        FLASH->KEYR = FLASH_KEY2;
+    }
+    // Clear errors left from previous operations
+    FLASH->SR = flash_errors | FLASH_SR_EOP;
+}
+
+void Stm32FlashStorage::lock() {
+    FLASH->CR |= FLASH_CR_LOCK;
+}
+
+bool Stm32FlashStorage::waitReady() {
+    while (FLASH->SR & FLASH_SR_BSY)
+        ;
+    return (FLASH->SR & flash_errors) == 0;
+}
+
+void Stm32FlashStorage::resetCaches() {
+    // Data cache may contain stale contents of erased sector
+    uint32_t acr = FLASH->ACR;
+    FLASH->ACR = acr & ~(FLASH_ACR_DCEN | FLASH_ACR_ICEN);
+    FLASH->ACR |= FLASH_ACR_DCRST | FLASH_ACR_ICRST;
+    FLASH->ACR &= ~(FLASH_ACR_DCRST | FLASH_ACR_ICRST);
+    FLASH->ACR = acr;
+}
+
+}
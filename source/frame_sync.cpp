@@ -0,0 +1,265 @@
+#include <cstring>
+#include "frame_sync.hpp"
+#include "bus_protocol.hpp"
+
+namespace owpeer {
+
+#if BUS_FRAME_SYNC == TRUE
+FrameSync frame_sync;
+
+void printSyncStats(BaseSequentialStream* chp) {
+    frame_sync.print(chp);
+}
+#endif
+
+void FrameSync::reset() {
+    head = 0;
+    tail = 0;
+    stream = Stream();
+    lost_stream = Stream();
+    locked = true;
+    gap = 0;
+}
+
+size_t FrameSync::write(const uint8_t* data, size_t len) {
+    if (tail) {
+        memmove(buffer, buffer + tail, head - tail);
+        head -= tail;
+        tail = 0;
+    }
+    len = std::min(len, buffer_size - head);
+    memcpy(buffer + head, data, len);
+    head += len;
+    return len;
+}
+
+bool FrameSync::read(uint8_t* frame) {
+    if (!locked) {
+        // Search for offset that starts a run of valid frames
+        constexpr size_t window = frame_size * (BUS_SYNC_CONFIRM_FRAMES + 1);
+        while (head - tail >= window) {
+            // Transfer that was cut continues after the frames that were
+            // lost, and after other frames that took the place of its
+            // payload
+            uint32_t lost = (search_bytes + 3) / frame_size;
+            uint32_t skipped = lost + lost_stream.interleaved;
+            Stream start;
+            if (lost_stream.data_frames > skipped) {
+                start = lost_stream;
+                start.data_frames -= skipped;
+            }
+            start.exact = false;
+            start.interleaved = 0;
+            Stream next = start;
+            bool valid = true;
+            for (size_t pos = 0; pos < window && valid; pos += frame_size)
+                valid = check(buffer + tail + pos, next);
+            if (valid) {
+                locked = true;
+                stream = start;
+                recoveries++;
+                last_recovery = chVTTimeElapsedSinceX(loss_time);
+                max_recovery = std::max(max_recovery, last_recovery);
+                // Skipped bytes and the bytes lost on link make whole frames
+                gap = std::min<size_t>(lost, 0xff);
+                gap_interleaved = lost_stream.interleaved;
+                break;
+            }
+            tail++;
+            search_bytes++;
+            dropped_bytes++;
+        }
+        if (!locked)
+            return false;
+    }
+    if (gap) {
+        frame[0] = OWL_FRAME_GAP;
+        frame[1] = gap;
+        frame[2] = gap_interleaved;
+        frame[3] = 0;
+        gap = 0;
+        return true;
+    }
+    if (head - tail < frame_size)
+        return false;
+    Stream next = stream;
+    if (!check(buffer + tail, next)) {
+        // Stream state is unknown until alignment is found again
+        locked = false;
+        losses++;
+        recent_losses++;
+        loss_time = chVTGetSystemTimeX();
+        lost_stream = stream;
+        tail++;
+        search_bytes = 1;
+        dropped_bytes++;
+        return read(frame);
+    }
+    // Other frames within a transfer may be misaligned payload
+    if ((buffer[tail] & 0xf0) == OWL_COMMAND_DATA || next.data_frames == 0)
+        next.interleaved = 0;
+    else if (next.interleaved < 0xff)
+        next.interleaved++;
+    stream = next;
+    memcpy(frame, buffer + tail, frame_size);
+    tail += frame_size;
+    if (++recent_frames == 0x10000) {
+        recent_frames /= 2;
+        recent_losses /= 2;
+    }
+    return true;
+}
+
+uint8_t FrameSync::getFecShift() const {
+    if (recent_losses == 0)
+        return 0;
+    uint32_t frames_per_loss = recent_frames / recent_losses;
+    uint8_t shift = 2;
+    while (shift < BUS_DATA_FEC_MAX_SHIFT &&
+        (16u << (shift + 1)) <= frames_per_loss)
+        shift++;
+    return shift;
+}
+
+bool FrameSync::checkMidi(const uint8_t* frame) {
+    uint8_t cin = frame[0] & 0x0f;
+    switch (cin) {
+    case USB_COMMAND_MISC:
+    case USB_COMMAND_CABLE_EVENT:
+        return false;
+    case USB_COMMAND_2BYTE_SYSTEM_COMMON:
+    case USB_COMMAND_3BYTE_SYSTEM_COMMON:
+        return frame[1] >= 0xf0 && frame[2] < 0x80 && frame[3] < 0x80;
+    case USB_COMMAND_SYSEX:
+    case USB_COMMAND_SYSEX_EOX1:
+    case USB_COMMAND_SYSEX_EOX2:
+    case USB_COMMAND_SYSEX_EOX3:
+        for (size_t i = 1; i < frame_size; i++) {
+            if (frame[i] >= 0x80 && frame[i] != 0xf0 && frame[i] != 0xf7)
+                return false;
+        }
+        return true;
+    case USB_COMMAND_SINGLE_BYTE:
+        return true;
+    default:
+        // Channel messages repeat CIN in status byte
+        return (frame[1] >> 4) == cin && frame[2] < 0x80 && frame[3] < 0x80;
+    }
+}
+
+/*
+ * SysEx commands from OpenWareMidiControl.h and bus internal commands
+ */
+bool FrameSync::checkCommand(uint8_t cmd) {
+    switch (cmd) {
+    case SYSEX_PRESET_NAME_COMMAND:
+    case SYSEX_PARAMETER_NAME_COMMAND:
+    case SYSEX_CONFIGURATION_COMMAND:
+    case SYSEX_DEVICE_RESET_COMMAND:
+    case SYSEX_BOOTLOADER_COMMAND:
+    case SYSEX_FIRMWARE_UPLOAD:
+    case SYSEX_FIRMWARE_STORE:
+    case SYSEX_FIRMWARE_RUN:
+    case SYSEX_FIRMWARE_FLASH:
+    case SYSEX_FLASH_ERASE:
+    case SYSEX_SETTINGS_RESET:
+    case SYSEX_SETTINGS_STORE:
+    case SYSEX_FIRMWARE_VERSION:
+    case SYSEX_DEVICE_ID:
+    case SYSEX_PROGRAM_MESSAGE:
+    case SYSEX_DEVICE_STATS:
+    case SYSEX_PROGRAM_STATS:
+    case SYSEX_PROGRAM_ERROR:
+    case BUS_COMMAND_RESUME:
+    case BUS_COMMAND_BAUD_OFFER:
+    case BUS_COMMAND_BAUD_SWITCH:
+    case BUS_COMMAND_BAUD_CONFIRM:
+    case BUS_COMMAND_TIME_SYNC:
+    case BUS_COMMAND_TIME_DELAY:
+    case BUS_COMMAND_TIMESTAMP:
+    case BUS_COMMAND_DATA_ERROR:
+#if BUS_SYSEX_BRIDGE == TRUE
+    case BUS_COMMAND_SYSEX_BRIDGE:
+#endif
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool FrameSync::check(const uint8_t* frame, Stream& stream) {
+    uint8_t peer = frame[0] & 0x0f;
+    switch (frame[0] & 0xf0) {
+    case 0:
+        return checkMidi(frame);
+    case OWL_COMMAND_BUTTON:
+        // Ids between last button and gate are unused, notes follow gate
+        return frame[1] <= BUTTON_H || frame[1] >= GATE_BUTTON;
+    case OWL_COMMAND_DISCOVER:
+        // Byte 1 holds census flag and round, token is never 0
+        return frame[2] != 0 || frame[3] != 0;
+    case OWL_COMMAND_COMMAND:
+        return checkCommand(frame[1]);
+    case OWL_COMMAND_PARAMETER:
+        return frame[1] <= PARAMETER_DH;
+    case OWL_COMMAND_MESSAGE:
+        // Messages are text
+        return frame[1] < 0x80 && frame[2] < 0x80 && frame[3] < 0x80;
+    case OWL_COMMAND_DATA:
+        if (stream.data_frames && peer != stream.data_peer) {
+            // Payload must come from the peer that started transfer. After
+            // realignment the count may be off, but transfers don't
+            // interleave, so another peer starts a new one.
+            if (stream.exact)
+                return false;
+            stream.data_frames = 0;
+            stream.exact = true;
+        }
+        if (stream.data_frames) {
+            stream.data_frames--;
+        }
+        else {
+            // Header, payload is followed by a partial frame
+            uint32_t len = (frame[1] << 16) | (frame[2] << 8) | frame[3];
+            stream.data_peer = peer;
+            if (len & BUS_DATA_FEC_FLAG) {
+                // Each block is followed by 2 parity frames, the last one
+                // by CRC
+                uint8_t shift = ((len >> 20) & 0x07) + 1;
+                if (shift > BUS_DATA_FEC_MAX_SHIFT)
+                    return false;
+                uint32_t frames = (len & BUS_DATA_LEN_MASK) / 3 + 1;
+                stream.data_frames = frames +
+                    2 * ((frames + (1 << shift) - 1) >> shift) + 1;
+            }
+            else {
+                // Block size bits are only used with FEC
+                if (len & ~(BUS_DATA_LZ_FLAG | BUS_DATA_LEN_MASK))
+                    return false;
+                stream.data_frames = (len & BUS_DATA_LEN_MASK) / 3 + 1;
+            }
+        }
+        return true;
+    case OWL_COMMAND_RESET:
+        if (frame[1] != OWL_COMMAND_RESET || frame[2] != OWL_COMMAND_RESET ||
+            frame[3] != OWL_COMMAND_RESET)
+            return false;
+        stream = Stream();
+        return true;
+    default:
+        return false;
+    }
+}
+
+void FrameSync::print(BaseSequentialStream* chp) const {
+    chprintf(chp, "sync %s, losses %u, recoveries %u, dropped %u bytes\r\n",
+        locked ? "locked" : "searching", losses, recoveries, dropped_bytes);
+    chprintf(chp, "recovery last %u ms, max %u ms\r\n",
+        TIME_I2MS(last_recovery), TIME_I2MS(max_recovery));
+    auto& fec = BusData::getFecStats();
+    chprintf(chp, "fec block %u, transfers %u, rebuilt %u, failed %u\r\n",
+        getFecShift() ? 1 << getFecShift() : 0, fec.transfers, fec.rebuilt,
+        fec.failed);
+}
+
+}
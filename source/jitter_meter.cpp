@@ -0,0 +1,46 @@
+#include <algorithm>
+#include "chprintf.h"
+#include "jitter_meter.hpp"
+
+namespace owpeer {
+
+#if BUS_MIDI_JITTER_STATS == TRUE
+JitterMeter clock_ingress_jitter("clock in");
+JitterMeter clock_egress_jitter("clock out");
+#endif
+
+static uint32_t isqrt(uint64_t value) {
+    uint64_t result = 0;
+    uint64_t bit = uint64_t(1) << 62;
+    while (bit > value)
+        bit >>= 2;
+    while (bit) {
+        if (value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        }
+        else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return result;
+}
+
+static uint32_t cyclesToUs(uint64_t cycles) {
+    return cycles * 1000000 / STM32_HCLK;
+}
+
+void JitterMeter::print(BaseSequentialStream* chp) const {
+    if (count == 0) {
+        chprintf(chp, "%s: no data\r\n", name);
+        return;
+    }
+    uint64_t mean = sum / count;
+    uint64_t variance = sum_sq / count - mean * mean;
+    chprintf(chp, "%s: n=%u min=%uus mean=%uus max=%uus stddev=%uus\r\n",
+        name, count, cyclesToUs(min_interval), cyclesToUs(mean),
+        cyclesToUs(max_interval), cyclesToUs(isqrt(variance)));
+}
+
+}
@@ -0,0 +1,37 @@
+#include "chprintf.h"
+#include "latency_stats.hpp"
+
+namespace owpeer {
+
+#if BUS_LATENCY_STATS == TRUE
+LatencyHistogram latency_histograms[LATENCY_NUM_STAGES];
+
+static const char* const stage_names[LATENCY_NUM_STAGES] = {
+    "rxq", "decode", "dispatch", "rx", "tx"};
+#endif
+
+/*
+ * Output format is "<stage> n=<count> max=<cycles> <bucket>:<count>...",
+ * only non-empty buckets are printed. tools/latency_report.py parses it.
+ */
+void LatencyHistogram::print(
+    BaseSequentialStream* chp, const char* name) const {
+    chprintf(chp, "%s n=%u max=%u", name, count, max);
+    for (size_t i = 0; i < num_buckets; i++) {
+        if (buckets[i])
+            chprintf(chp, " %u:%u", i, buckets[i]);
+    }
+    chprintf(chp, "\r\n");
+}
+
+void printLatencyStats(BaseSequentialStream* chp) {
+#if BUS_LATENCY_STATS == TRUE
+    chprintf(chp, "clock %u\r\n", STM32_HCLK);
+    for (size_t i = 0; i < LATENCY_NUM_STAGES; i++)
+        latency_histograms[i].print(chp, stage_names[i]);
+#else
+    (void)chp;
+#endif
+}
+
+}
@@ -1,19 +1,44 @@
 #include "owpeer.h"
 #include "main.hpp"
 #include "uart_rx.hpp"
+#include "uart_tx.hpp"
 #include "frame_decoder.hpp"
+#include "frame_encoder.hpp"
 #include "message_handler.hpp"
+#include "debug_console.hpp"
+#include "settings_store.hpp"
+#include "firmware_updater.hpp"
+#include "bus_transport.hpp"
+#include "block_queue.hpp"
 
 
 namespace owpeer {
 
 FramesFifo rx_fifo, tx_fifo;
-UartRxThread uart_rx_thread;
+UartRxThread<BusTransport> uart_rx_thread;
+UartTxThread<BusTransport> uart_tx_thread;
 FrameDecoderThread frame_decoder_thread;
+FrameEncoderThread frame_encoder_thread;
 MessageHandlerThread message_handler_thread;
-static uint8_t bus_heap_buffer[BUS_HEAP_SIZE];
-Heap bus_heap((void*)bus_heap_buffer, BUS_HEAP_SIZE);
+DebugConsoleThread debug_console_thread;
+#if SETTINGS_STORE == TRUE
+SettingsThread settings_thread;
+#endif
+#if FIRMWARE_UPDATER == TRUE
+FirmwareWriterThread firmware_writer_thread;
+#endif
+#if BLOCK_QUEUE == TRUE
+BlockTickThread block_tick_thread;
+#endif
+static StaticSlabClass<64, BUS_SLAB_64_NUM> bus_slab_64;
+static StaticSlabClass<256, BUS_SLAB_256_NUM> bus_slab_256;
+static StaticSlabClass<1024, BUS_SLAB_1K_NUM> bus_slab_1k;
+static StaticSlabClass<4096, BUS_SLAB_4K_NUM> bus_slab_4k;
+static SlabClass* const bus_slab_classes[] = {
+    &bus_slab_64, &bus_slab_256, &bus_slab_1k, &bus_slab_4k};
+SlabAllocator bus_allocator(bus_slab_classes, 4);
 BusProtocolFifo bus_protocol_fifo;
+BusOutputFifo bus_output_fifo;
 
 /*
  * Serial driver config
@@ -21,13 +46,6 @@ BusProtocolFifo bus_protocol_fifo;
 
 BaseSequentialStream* chp = (BaseSequentialStream*)&USB_SERIAL;
 
-static const SerialConfig serialcfg = {
-  115200,
-  0,
-  0,
-  0
-};
-
 
 /*
  * Application entry point.
@@ -45,14 +63,27 @@ int main(void) {
     halInit();
     chSysInit();
     sdStart(&USB_SERIAL, NULL);
-    sdStart(&BUS_SERIAL, &serialcfg);
+    setBusBaud(BUS_BAUD);
 
     chprintf(chp, "Let's make some noise!\r\n");
 
-    auto handler = message_handler_thread.start(NORMALPRIO + 1);
-    frame_decoder_thread.setMessageHandler(&handler);
+#if SETTINGS_STORE == TRUE
+    settings.load();
+    settings_thread.start(NORMALPRIO - 1);
+#endif
+#if FIRMWARE_UPDATER == TRUE
+    firmware_writer_thread.start(NORMALPRIO);
+#endif
+#if BLOCK_QUEUE == TRUE
+    // Stands in for audio interrupt, so it runs ahead of bus threads
+    block_tick_thread.start(NORMALPRIO + 2);
+#endif
+    message_handler_thread.start(NORMALPRIO + 1);
     frame_decoder_thread.start(NORMALPRIO + 1);
+    frame_encoder_thread.start(NORMALPRIO + 1);
     uart_rx_thread.start(NORMALPRIO + 1);
+    uart_tx_thread.start(NORMALPRIO + 1);
+    debug_console_thread.start(NORMALPRIO);
 
     while (true) {
         palClearPad(GPIOA, GPIOA_LED_GREEN);
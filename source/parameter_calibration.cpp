@@ -0,0 +1,116 @@
+#include <cstring>
+#include "parameter_calibration.hpp"
+#include "settings_store.hpp"
+
+namespace owpeer {
+
+#if PARAMETER_CALIBRATION == TRUE
+ParameterCalibration input_calibration;
+ParameterCalibration output_calibration;
+#endif
+
+void ParameterCalibration::configure(
+    const char* offset_key, const char* scalar_key) {
+#if SETTINGS_STORE == TRUE
+    int32_t offset = settings.get(offset_key);
+    int32_t scalar = settings.get(scalar_key);
+    configure(
+        std::min<int32_t>(std::max<int32_t>(offset, INT16_MIN), INT16_MAX),
+        std::min<int32_t>(std::max<int32_t>(scalar, INT16_MIN), INT16_MAX));
+#else
+    (void)offset_key;
+    (void)scalar_key;
+#endif
+}
+
+void ParameterCalibration::configure(int16_t offset, int16_t scalar) {
+    // Bus reset configures again, entries set since then are kept
+    if (offset == config_offset && scalar == config_scalar)
+        return;
+    config_offset = offset;
+    config_scalar = scalar;
+    chSysLock();
+    for (size_t i = 0; i < size; i++) {
+        if (custom & (uint64_t(1) << i))
+            continue;
+        offsets[i] = offset;
+        scalars[i] = scalar;
+        dirty |= 1 << (i >> 1);
+    }
+    chSysUnlock();
+}
+
+int16_t ParameterCalibration::correct(PatchParameterId pid, int16_t value) {
+    if (size_t(pid) >= size)
+        return value;
+    chSysLock();
+    set(pid, value);
+    process(corrected);
+    value = corrected[pid];
+    chSysUnlock();
+    return value;
+}
+
+void ParameterCalibration::apply(const BlockEvent* events, size_t num) {
+    for (size_t i = 0; i < num; i++) {
+        if (events[i].type == OWL_COMMAND_PARAMETER && events[i].id < size)
+            set(PatchParameterId(events[i].id), events[i].value);
+    }
+}
+
+/*
+ * Pairs and groups of values are copied in and out with memcpy, compiler
+ * turns those into plain loads and stores
+ */
+#if defined(__ARM_FEATURE_DSP)
+bool ParameterCalibration::process(int16_t* values) {
+    if (!dirty)
+        return false;
+    for (uint32_t pairs = dirty; pairs; pairs &= pairs - 1) {
+        size_t i = __builtin_ctz(pairs) * 2;
+        uint32_t r, o, s;
+        memcpy(&r, raw + i, sizeof(r));
+        memcpy(&o, offsets + i, sizeof(o));
+        memcpy(&s, scalars + i, sizeof(s));
+        uint32_t sum = __QADD16(r, o);
+        int32_t lo = __SSAT(int32_t(__SMULBB(sum, s)) >> 12, 16);
+        int32_t hi = __SSAT(int32_t(__SMULTT(sum, s)) >> 12, 16);
+        uint32_t v = __PKHBT(lo, hi, 16);
+        memcpy(values + i, &v, sizeof(v));
+    }
+    dirty = 0;
+    return true;
+}
+#else
+bool ParameterCalibration::process(int16_t* values) {
+    typedef int16_t v8hi __attribute__((vector_size(16)));
+    typedef int32_t v8si __attribute__((vector_size(32)));
+    // Dirty bit of each lane within a group of 4 pairs
+    const v8si lane_bits = {1, 1, 2, 2, 4, 4, 8, 8};
+    if (!dirty)
+        return false;
+    for (size_t i = 0; i < size; i += 8) {
+        uint32_t group = (dirty >> (i / 2)) & 0xf;
+        if (!group)
+            continue;
+        v8hi r16, o16, s16, out16;
+        memcpy(&r16, raw + i, sizeof(r16));
+        memcpy(&o16, offsets + i, sizeof(o16));
+        memcpy(&s16, scalars + i, sizeof(s16));
+        memcpy(&out16, values + i, sizeof(out16));
+        v8si sum = __builtin_convertvector(r16, v8si) +
+            __builtin_convertvector(o16, v8si);
+        sum = sum > INT16_MAX ? INT16_MAX : sum < INT16_MIN ? INT16_MIN : sum;
+        v8si v = (sum * __builtin_convertvector(s16, v8si)) >> 12;
+        v = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+        v = (lane_bits & int32_t(group)) != 0 ?
+            v : __builtin_convertvector(out16, v8si);
+        out16 = __builtin_convertvector(v, v8hi);
+        memcpy(values + i, &out16, sizeof(out16));
+    }
+    dirty = 0;
+    return true;
+}
+#endif
+
+}
@@ -0,0 +1,143 @@
+#include "parameter_filter.hpp"
+#include "bus_protocol.hpp"
+#include "uart_fifo.hpp"
+
+namespace owpeer {
+
+#if BUS_PARAMETER_FILTER == TRUE
+/*
+ * Held updates are sent from encoder thread, so they go straight to Tx FIFO
+ */
+static void sendParameter(uint8_t peer, PatchParameterId pid, int16_t value) {
+    auto frame = tx_fifo.takeObjectTimeoutInfinite();
+    BusParameter(peer, pid, value).encodeFrame(*frame);
+    postFrame(tx_fifo, frame);
+}
+
+ParameterFilter parameter_filter(sendParameter, BUS_PARAMETER_DEADBAND,
+    BUS_PARAMETER_HYSTERESIS, TIME_MS2I(BUS_PARAMETER_INTERVAL_MS),
+    TIME_MS2I(BUS_PARAMETER_QUIET_MS));
+
+void printParameterStats(BaseSequentialStream* chp) {
+    parameter_filter.print(chp);
+}
+#endif
+
+bool ParameterFilter::update(
+    uint8_t peer, PatchParameterId pid, int16_t value, systime_t now) {
+    if (size_t(pid) >= num_parameters)
+        return true;
+    State& state = states[pid];
+    if (!state.valid || state.peer != peer) {
+        state.peer = peer;
+        state.direction = 0;
+        release(state);
+        commit(state, value, now);
+        return true;
+    }
+    int32_t delta = int32_t(value) - state.sent;
+    if (delta == 0) {
+        // Pot is back where it was sent, nothing to settle
+        release(state);
+        dropped++;
+        return false;
+    }
+    int8_t direction = delta > 0 ? 1 : -1;
+    uint16_t threshold = state.direction && direction != state.direction ?
+        hysteresis : deadband;
+    if (uint32_t(delta < 0 ? -delta : delta) <= threshold) {
+        // Replaces held value, sent if pot stays here
+        hold(state, value, now, true);
+        dropped++;
+        return false;
+    }
+    if (chTimeDiffX(state.time, now) < interval) {
+        if (state.is_held)
+            coalesced++;
+        hold(state, value, now, false);
+        return false;
+    }
+    if (state.is_held) {
+        // Newer value replaces held one
+        coalesced++;
+    }
+    release(state);
+    state.direction = direction;
+    commit(state, value, now);
+    return true;
+}
+
+void ParameterFilter::cancel(PatchParameterId pid) {
+    if (size_t(pid) < num_parameters)
+        release(states[pid]);
+}
+
+void ParameterFilter::hold(
+    State& state, int16_t value, systime_t now, bool settling) {
+    if (!isPending(state))
+        num_held++;
+    state.is_held = !settling;
+    state.is_settling = settling;
+    state.held = value;
+    state.held_time = now;
+}
+
+void ParameterFilter::release(State& state) {
+    if (isPending(state))
+        num_held--;
+    state.is_held = false;
+    state.is_settling = false;
+}
+
+void ParameterFilter::commit(State& state, int16_t value, systime_t now) {
+    state.valid = true;
+    state.sent = value;
+    state.time = now;
+    passed++;
+}
+
+sysinterval_t ParameterFilter::getRemaining(
+    const State& state, systime_t now) const {
+    sysinterval_t wait = state.is_held ? interval : quiet;
+    sysinterval_t elapsed =
+        chTimeDiffX(state.is_held ? state.time : state.held_time, now);
+    return elapsed < wait ? wait - elapsed : 0;
+}
+
+void ParameterFilter::poll(systime_t now) {
+    for (size_t pid = 0; pid < num_parameters && num_held; pid++) {
+        State& state = states[pid];
+        if (!isPending(state) || getRemaining(state, now))
+            continue;
+        if (state.is_held)
+            flushed++;
+        else
+            settled++;
+        release(state);
+        state.direction = state.held > state.sent ? 1 : -1;
+        commit(state, state.held, now);
+        send(state.peer, PatchParameterId(pid), state.held);
+    }
+}
+
+sysinterval_t ParameterFilter::getPollInterval(systime_t now) const {
+    if (num_held == 0)
+        return TIME_INFINITE;
+    sysinterval_t next = std::max(interval, quiet);
+    for (size_t pid = 0; pid < num_parameters; pid++) {
+        const State& state = states[pid];
+        // Zero would mean TIME_IMMEDIATE for receive
+        if (isPending(state))
+            next = std::min(next, std::max<sysinterval_t>(
+                getRemaining(state, now), 1));
+    }
+    return next;
+}
+
+void ParameterFilter::print(BaseSequentialStream* chp) const {
+    chprintf(chp, "parameters passed %u, dropped %u, coalesced %u, "
+        "flushed %u, settled %u, pending %u\r\n", passed, dropped, coalesced,
+        flushed, settled, num_held);
+}
+
+}
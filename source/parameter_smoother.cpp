@@ -0,0 +1,58 @@
+#include <cstring>
+#include "parameter_smoother.hpp"
+
+namespace owpeer {
+
+#if PARAMETER_SMOOTHING == TRUE
+ParameterSmoother parameter_smoother(PARAMETER_SMOOTHING_COEFFICIENT);
+#endif
+
+void ParameterSmoother::apply(const BlockEvent* events, size_t num) {
+    for (size_t i = 0; i < num; i++) {
+        if (events[i].type == OWL_COMMAND_PARAMETER && events[i].id < size)
+            target[events[i].id] = events[i].value;
+    }
+}
+
+/*
+ * Pairs and groups of values are copied in and out with memcpy, compiler
+ * turns that into plain word or vector loads
+ */
+#if defined(__ARM_FEATURE_DSP)
+void ParameterSmoother::process() {
+    for (size_t i = 0; i < size; i += 2) {
+        uint32_t c, t;
+        memcpy(&c, current + i, sizeof(c));
+        memcpy(&t, target + i, sizeof(t));
+        // Rounding down moves towards target only if it's below value
+        int32_t d = __QSUB16(t, c);
+        int32_t round_lo = int16_t(d) > 0 ? 32767 : 0;
+        int32_t round_hi = (d >> 16) > 0 ? 32767 : 0;
+        int32_t lo = int32_t(__SMLAD(__PKHBT(c, t, 16), coefficient,
+            round_lo)) >> 15;
+        int32_t hi = int32_t(__SMLAD(__PKHTB(t, c, 16), coefficient,
+            round_hi)) >> 15;
+        uint32_t v = __PKHBT(lo, hi, 16);
+        memcpy(current + i, &v, sizeof(v));
+    }
+}
+#else
+void ParameterSmoother::process() {
+    typedef int16_t v8hi __attribute__((vector_size(16)));
+    typedef int32_t v8si __attribute__((vector_size(32)));
+    const int32_t k = coefficient >> 16;
+    for (size_t i = 0; i < size; i += 8) {
+        v8hi c16, t16;
+        memcpy(&c16, current + i, sizeof(c16));
+        memcpy(&t16, target + i, sizeof(t16));
+        v8si c = __builtin_convertvector(c16, v8si);
+        v8si t = __builtin_convertvector(t16, v8si);
+        v8si round = (t > c) & 32767;
+        v8si v = (c * (32768 - k) + t * k + round) >> 15;
+        v8hi v16 = __builtin_convertvector(v, v8hi);
+        memcpy(current + i, &v16, sizeof(v16));
+    }
+}
+#endif
+
+}
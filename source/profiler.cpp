@@ -0,0 +1,136 @@
+#include "profiler.hpp"
+
+#if CH_DBG_THREADS_PROFILER == TRUE
+
+static uint64_t cycles;
+static rtcnt_t last_count;
+static uint64_t last_switch;
+static uint64_t total_cycles;
+static uint64_t irq_cycles;
+static uint64_t irq_cycles_at_switch;
+static uint32_t irq_count;
+static uint32_t irq_nesting;
+static uint64_t irq_start;
+
+/*
+ * Realtime counter wraps every 2^32 cycles, that is about 24 s at 180 MHz.
+ * It's extended to 64 bits by every hook, so time is lost only if nothing
+ * at all happens for that long.
+ */
+static uint64_t getCycles() {
+    syssts_t sts = chSysGetStatusAndLockX();
+    rtcnt_t now = chSysGetRealtimeCounterX();
+    cycles += rtcnt_t(now - last_count);
+    last_count = now;
+    uint64_t result = cycles;
+    chSysRestoreStatusX(sts);
+    return result;
+}
+
+extern "C" {
+
+/*
+ * Called with kernel locked
+ */
+void profilerContextSwitch(thread_t* ntp, thread_t* otp) {
+    uint64_t now = getCycles();
+    uint64_t elapsed = now - last_switch;
+    uint64_t in_irq = irq_cycles - irq_cycles_at_switch;
+    if (elapsed > in_irq)
+        otp->prof_cycles += elapsed - in_irq;
+    ntp->prof_switches++;
+    total_cycles += elapsed;
+    last_switch = now;
+    irq_cycles_at_switch = irq_cycles;
+}
+
+/*
+ * Only outermost ISR is measured, so that nested ones are not counted twice
+ */
+void profilerIrqEnter(void) {
+    if (irq_nesting++ == 0)
+        irq_start = getCycles();
+    irq_count++;
+}
+
+void profilerIrqExit(void) {
+    if (--irq_nesting == 0)
+        irq_cycles += getCycles() - irq_start;
+}
+
+}
+
+#endif
+
+namespace owpeer {
+
+#if CH_DBG_FILL_THREADS == TRUE
+// Main thread runs on process stack and ISRs on main stack, both are filled
+// with the same pattern by startup code
+extern "C" uint8_t __process_stack_base__[], __process_stack_end__[];
+extern "C" uint8_t __main_stack_base__[], __main_stack_end__[];
+
+static size_t getStackUnused(const uint8_t* base, size_t size) {
+    size_t unused = 0;
+    while (unused < size && base[unused] == CH_DBG_STACK_FILL_VALUE)
+        unused++;
+    return unused;
+}
+
+static void printStackStats(BaseSequentialStream* chp, const uint8_t* base,
+    const uint8_t* end) {
+    size_t size = end - base;
+    chprintf(chp, " stack %u/%u", size - getStackUnused(base, size), size);
+}
+#endif
+
+/*
+ * CPU usage is printed in 0.1% units
+ */
+static uint32_t getPermille(uint64_t cycles, uint64_t total) {
+    return total ? uint32_t(cycles * 1000 / total) : 0;
+}
+
+void printThreadStats(BaseSequentialStream* chp) {
+    chprintf(chp, "ISR:");
+#if CH_DBG_THREADS_PROFILER == TRUE
+    chSysLock();
+    uint64_t total = total_cycles;
+    uint64_t irq = irq_cycles;
+    uint32_t irqs = irq_count;
+    chSysUnlock();
+    uint32_t irq_permille = getPermille(irq, total);
+    chprintf(chp, " cpu %u.%u%% count %u", irq_permille / 10,
+        irq_permille % 10, irqs);
+#endif
+#if CH_DBG_FILL_THREADS == TRUE
+    printStackStats(chp, __main_stack_base__, __main_stack_end__);
+#endif
+    chprintf(chp, "\r\n");
+    for (thread_t* tp = chRegFirstThread(); tp != nullptr;
+         tp = chRegNextThread(tp)) {
+        chprintf(chp, "%s:", tp->name ? tp->name : "?");
+#if CH_DBG_THREADS_PROFILER == TRUE
+        chSysLock();
+        uint64_t cycles = tp->prof_cycles;
+        uint32_t switches = tp->prof_switches;
+        chSysUnlock();
+        uint32_t permille = getPermille(cycles, total);
+        chprintf(chp, " cpu %u.%u%% switches %u", permille / 10,
+            permille % 10, switches);
+#endif
+#if CH_DBG_FILL_THREADS == TRUE
+        // Thread structure is located on top of its working area, except
+        // for main thread that has no working area without stack checks
+        if (tp->wabase == nullptr)
+            printStackStats(chp, __process_stack_base__,
+                __process_stack_end__);
+        else
+            printStackStats(chp, reinterpret_cast<const uint8_t*>(tp->wabase),
+                reinterpret_cast<const uint8_t*>(tp));
+#endif
+        chprintf(chp, "\r\n");
+    }
+}
+
+}
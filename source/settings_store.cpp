@@ -0,0 +1,324 @@
+#include "settings_store.hpp"
+
+namespace owpeer {
+
+#if SETTINGS_STORE == TRUE
+static SettingsEntry settings_entries[] = {
+    {settingsKey(SYSEX_CONFIGURATION_DIGITAL_BUS_ENABLE), 1},
+    {settingsKey(SYSEX_CONFIGURATION_DIGITAL_BUS_FORWARD_MIDI), 1},
+    // Omni, CCs on any channel are mapped to parameters
+    {settingsKey(SYSEX_CONFIGURATION_MIDI_INPUT_CHANNEL), -1},
+    {settingsKey(SYSEX_CONFIGURATION_DIGITAL_BUS_PEERS), 0},
+    {settingsKey(SYSEX_CONFIGURATION_AUDIO_RATE), 48000},
+    {settingsKey(SYSEX_CONFIGURATION_AUDIO_BLOCKSIZE), 64},
+    // Parameter calibration, scalars are Q12
+    {settingsKey(SYSEX_CONFIGURATION_INPUT_OFFSET), 0},
+    {settingsKey(SYSEX_CONFIGURATION_INPUT_SCALAR), 4096},
+    {settingsKey(SYSEX_CONFIGURATION_OUTPUT_OFFSET), 0},
+    {settingsKey(SYSEX_CONFIGURATION_OUTPUT_SCALAR), 4096},
+    // Peer id in bits 0-7, number of peers in bits 8-15
+    {settingsKey(SETTINGS_PEER_ID), -1},
+    {settingsKey(SETTINGS_PEER_FINGERPRINT), 0},
+    // Verified image in staging sector
+    {settingsKey(SETTINGS_FIRMWARE_SIZE), 0},
+    {settingsKey(SETTINGS_FIRMWARE_CRC), 0},
+};
+
+SettingsStore settings(flash_storage, SETTINGS_SECTOR_A, SETTINGS_SECTOR_B,
+    settings_entries, sizeof(settings_entries) / sizeof(SettingsEntry));
+
+void printSettingsStats(BaseSequentialStream* chp) {
+    settings.print(chp);
+}
+#endif
+
+void SettingsStore::load() {
+    mutex.lock();
+    for (size_t i = 0; i < entries_num; i++) {
+        entries[i].value = entries[i].default_value;
+        entries[i].stored = false;
+        entries[i].dirty = false;
+    }
+
+    Header headers[2];
+    bool valid[2];
+    for (size_t i = 0; i < 2; i++)
+        valid[i] = readHeader(sectors[i], headers[i]);
+    if (valid[0] && valid[1])
+        active = int32_t(headers[1].generation - headers[0].generation) > 0;
+    else
+        active = valid[1];
+    uint8_t spare = 1 - active;
+    if (valid[active]) {
+        generation = headers[active].generation;
+        spare_state = valid[spare] || !isErased(sectors[spare], 0) ?
+            SPARE_DIRTY : SPARE_UNKNOWN;
+    }
+    else {
+        // Blank or corrupted storage, this is the only place where we wait
+        // for sector erase
+        Header header = {header_magic, 1};
+        storage.erase(sectors[active]);
+        storage.program(sectors[active], 0, &header, sizeof(header));
+        erases++;
+        physical_bytes += sizeof(header);
+        generation = 1;
+        spare_state = SPARE_UNKNOWN;
+    }
+
+    end_offset = findEnd(sectors[active]);
+    size_t found = 0;
+    for (size_t offset = end_offset; offset > sizeof(Header) &&
+         found < entries_num;) {
+        offset -= sizeof(Record);
+        Record record;
+        storage.read(sectors[active], offset, &record, sizeof(record));
+        boot_records_read++;
+        if (record.key == erased_key || record.check != record.getCheck())
+            continue;
+        SettingsEntry* entry = find(record.key);
+        if (entry != nullptr && !entry->stored) {
+            entry->value = record.value;
+            entry->stored = true;
+            found++;
+        }
+    }
+    mutex.unlock();
+}
+
+int32_t SettingsStore::get(uint16_t key) {
+    SettingsEntry* entry = find(key);
+    return entry == nullptr ? 0 : entry->value;
+}
+
+bool SettingsStore::set(uint16_t key, int32_t value) {
+    SettingsEntry* entry = find(key);
+    if (entry == nullptr)
+        return false;
+    mutex.lock();
+    if (entry->value != value) {
+        entry->value = value;
+        entry->stored = true;
+        entry->dirty = true;
+    }
+    mutex.unlock();
+    return true;
+}
+
+void SettingsStore::reset() {
+    mutex.lock();
+    for (size_t i = 0; i < entries_num; i++) {
+        entries[i].value = entries[i].default_value;
+        entries[i].stored = false;
+        entries[i].dirty = false;
+    }
+    reset_pending = true;
+    mutex.unlock();
+    requestStore();
+}
+
+void SettingsStore::store() {
+    mutex.lock();
+    size_t dirty = 0;
+    for (size_t i = 0; i < entries_num; i++)
+        dirty += entries[i].dirty;
+    bool reset = reset_pending;
+    reset_pending = false;
+    mutex.unlock();
+    size_t size = storage.getSectorSize(sectors[active]);
+    if (reset || end_offset + dirty * sizeof(Record) > size) {
+        // Reset is retried with the next store if compaction can't be done
+        if (!compact() && reset) {
+            mutex.lock();
+            reset_pending = true;
+            mutex.unlock();
+        }
+        return;
+    }
+    // Only this thread appends, entries are copied one at a time so that
+    // set() doesn't wait for flash
+    Record record;
+    for (size_t i = 0; i < entries_num; i++) {
+        if (takeDirty(i, record)) {
+            if (append(record))
+                logical_bytes += sizeof(Record);
+            else
+                markDirty(i);
+        }
+    }
+}
+
+void SettingsStore::prepareSpare() {
+    if (!erase_pending)
+        return;
+    erase_pending = false;
+    uint8_t sector = sectors[1 - active];
+    if (spare_state == SPARE_UNKNOWN) {
+        // Erase could have been interrupted, so we check the whole sector
+        size_t size = storage.getSectorSize(sector);
+        spare_state = SPARE_ERASED;
+        for (size_t offset = 0; offset < size; offset += 4) {
+            if (!isErased(sector, offset)) {
+                spare_state = SPARE_DIRTY;
+                break;
+            }
+        }
+    }
+    if (spare_state == SPARE_DIRTY) {
+        erases++;
+        if (storage.erase(sector))
+            spare_state = SPARE_ERASED;
+        else
+            failures++;
+    }
+}
+
+void SettingsStore::print(BaseSequentialStream* chp) {
+    for (size_t i = 0; i < entries_num; i++) {
+        chprintf(chp, "%c%c=%d%s ", entries[i].key >> 8, entries[i].key & 0xff,
+            entries[i].value, entries[i].dirty ? "*" : "");
+    }
+    chprintf(chp, "\r\n");
+    uint32_t amplification =
+        logical_bytes ? physical_bytes * 100 / logical_bytes : 0;
+    chprintf(chp,
+        "generation %u, used %u/%u, boot read %u records\r\n", generation,
+        end_offset, storage.getSectorSize(sectors[active]), boot_records_read);
+    chprintf(chp,
+        "logical %u bytes, physical %u bytes, amplification %u.%02u, "
+        "compactions %u, erases %u, failures %u\r\n",
+        logical_bytes, physical_bytes, amplification / 100,
+        amplification % 100, compactions, erases, failures);
+}
+
+SettingsEntry* SettingsStore::find(uint16_t key) {
+    for (size_t i = 0; i < entries_num; i++) {
+        if (entries[i].key == key)
+            return &entries[i];
+    }
+    return nullptr;
+}
+
+bool SettingsStore::readHeader(uint8_t sector, Header& header) {
+    return storage.read(sector, 0, &header, sizeof(header)) &&
+        header.magic == header_magic;
+}
+
+bool SettingsStore::isErased(uint8_t sector, size_t offset) {
+    uint32_t word;
+    return storage.read(sector, offset, &word, sizeof(word)) &&
+        word == FlashStorage::erased_word;
+}
+
+size_t SettingsStore::findEnd(uint8_t sector) {
+    // Records are appended, so all slots after the last one are erased
+    size_t lo = 0;
+    size_t hi = (storage.getSectorSize(sector) - sizeof(Header)) /
+        sizeof(Record);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (isErased(sector, sizeof(Header) + mid * sizeof(Record)))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return sizeof(Header) + lo * sizeof(Record);
+}
+
+bool SettingsStore::takeDirty(size_t index, Record& record) {
+    mutex.lock();
+    bool dirty = entries[index].dirty;
+    if (dirty) {
+        record = {entries[index].key, 0, entries[index].value};
+        record.check = record.getCheck();
+        entries[index].dirty = false;
+    }
+    mutex.unlock();
+    return dirty;
+}
+
+/*
+ * Value that failed to be written is retried with the next store, unless it
+ * has been reset meanwhile
+ */
+void SettingsStore::markDirty(size_t index) {
+    mutex.lock();
+    if (entries[index].stored)
+        entries[index].dirty = true;
+    mutex.unlock();
+}
+
+bool SettingsStore::append(const Record& record) {
+    if (end_offset + sizeof(Record) > storage.getSectorSize(sectors[active]))
+        return false;
+    // Slot is skipped on failure, partially written record fails check
+    bool ret =
+        storage.program(sectors[active], end_offset, &record, sizeof(record));
+    end_offset += sizeof(Record);
+    physical_bytes += sizeof(Record);
+    if (!ret)
+        failures++;
+    return ret;
+}
+
+/*
+ * Copy live values to erased spare sector. Values are taken one at a time
+ * under mutex, values that change meanwhile stay dirty and are appended by
+ * the next store.
+ */
+bool SettingsStore::compact() {
+    if (spare_state != SPARE_ERASED)
+        return false;
+    uint8_t spare = 1 - active;
+    size_t offset = sizeof(Header);
+    bool ret = true;
+    for (size_t i = 0; i < entries_num && ret; i++) {
+        mutex.lock();
+        bool stored = entries[i].stored;
+        bool dirty = entries[i].dirty;
+        Record record = {entries[i].key, 0, entries[i].value};
+        entries[i].dirty = false;
+        mutex.unlock();
+        if (!stored)
+            continue;
+        record.check = record.getCheck();
+        ret = storage.program(sectors[spare], offset, &record, sizeof(record));
+        offset += sizeof(Record);
+        physical_bytes += sizeof(Record);
+        if (dirty)
+            logical_bytes += sizeof(Record);
+    }
+    // Header is written last, until then old sector remains active
+    Header header = {header_magic, generation + 1};
+    ret = ret && storage.program(sectors[spare], 0, &header, sizeof(header));
+    physical_bytes += sizeof(header);
+    spare_state = SPARE_DIRTY;
+    if (!ret) {
+        // Old sector remains active, so all its values need to be written
+        // again
+        failures++;
+        for (size_t i = 0; i < entries_num; i++)
+            markDirty(i);
+        return false;
+    }
+    active = spare;
+    generation++;
+    end_offset = offset;
+    compactions++;
+    return true;
+}
+
+#if SETTINGS_STORE == TRUE
+void SettingsThread::main() {
+    setName("Settings");
+    while (true) {
+        settings.waitRequest(TIME_INFINITE);
+        // Erase happens only when requested, then postponed compaction can
+        // be done right away
+        settings.prepareSpare();
+        settings.store();
+    }
+}
+#endif
+
+}
@@ -0,0 +1,19 @@
+#include "sysex_codec.hpp"
+
+namespace owpeer {
+
+#if BUS_SYSEX_BRIDGE == TRUE
+/*
+ * Packet layout matches BusMidi frames, decoder thread waits here if
+ * encoder is behind
+ */
+static void sendSysexPacket(uint32_t packet) {
+    BusOutputPtr::make(std::in_place_type<BusMidi>, uint8_t(packet),
+        uint8_t(packet >> 8), uint8_t(packet >> 16), uint8_t(packet >> 24))
+        .send();
+}
+
+SysexSink sysex_sink(sendSysexPacket);
+#endif
+
+}
@@ -0,0 +1,51 @@
+/*
+ * Time per record and per byte of ConfigParser on a full settings dump, one
+ * record for each key, written in 3 byte frames as they come off the bus.
+ * Host numbers only compare changes to parser, records are applied to a
+ * counter instead of settings.
+ */
+#include <chrono>
+#include <string>
+#include "test.hpp"
+#include "config_parser.hpp"
+
+using namespace owpeer;
+
+// Settings are linked for applyConfiguration(), never stored here
+static FLASH_TypeDef host_flash;
+FLASH_TypeDef* const FLASH = &host_flash;
+
+static constexpr size_t rounds = 200000;
+
+static size_t applied = 0;
+
+static bool apply(uint16_t key, int32_t value) {
+    applied += key != 0 && value != 0x7fffffff;
+    return true;
+}
+
+int main() {
+    std::string dump(1, char(SYSEX_CONFIGURATION_COMMAND));
+    for (size_t i = 0; i < config_keys_num; i++) {
+        char buf[11];
+        dump.append(buf, ConfigParser::format(buf, config_keys[i],
+            int32_t(i * 0x1234567) - 0x40000000));
+        dump += ',';
+    }
+    ConfigParser parser(apply);
+    const uint8_t* data = (const uint8_t*)dump.data();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+        parser.open(dump.size());
+        for (size_t pos = 0; pos < dump.size(); pos += 3)
+            parser.write(data + pos, std::min<size_t>(3, dump.size() - pos));
+        parser.close();
+    }
+    double ns = std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - start).count();
+    CHECK_EQ(applied, config_keys_num * rounds);
+    printf("%u records, %u bytes: %.1f ns/record, %.2f ns/byte\n",
+        unsigned(config_keys_num), unsigned(dump.size()),
+        ns / (rounds * config_keys_num), ns / (rounds * dump.size()));
+    return test::report("bench_config_parser");
+}
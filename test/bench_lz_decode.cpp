@@ -0,0 +1,97 @@
+/*
+ * LZ decoding speed on the host, for the same corpus as test_bus_data_lz.
+ * Decoder alone and BusData frames to a sink that drops output. Host numbers
+ * only compare changes, the device runs several times slower.
+ */
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include "test.hpp"
+#include "lz_encoder.hpp"
+#include "bus_protocol.hpp"
+
+using namespace owpeer;
+
+static const char* const corpus[] = {
+    "../source/bus_protocol.cpp",
+    "../source/frame_sync.cpp",
+    "../source/settings_store.cpp",
+    "../include/bus_protocol.hpp",
+    "../include/message_handler.hpp",
+};
+
+static constexpr size_t rounds = 200;
+
+static std::vector<uint8_t> readFile(const char* path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+class NullSink : public BusDataSink {
+public:
+    bool open(uint32_t) override {
+        return true;
+    }
+    void write(const uint8_t*, size_t len) override {
+        bytes += len;
+    }
+    void close() override {}
+    void abort() override {}
+
+    size_t bytes = 0;
+};
+
+static double elapsedNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    test::LzEncoder encoder(BUS_DATA_LZ_WINDOW_BITS, 4);
+    std::vector<std::vector<uint8_t>> packed;
+    size_t total = 0;
+    for (const char* path : corpus) {
+        auto src = readFile(path);
+        total += src.size();
+        packed.push_back(encoder.encode(src));
+    }
+
+    static uint8_t window[1 << BUS_DATA_LZ_WINDOW_BITS];
+    LzDecoder decoder(window, BUS_DATA_LZ_WINDOW_BITS);
+    size_t out = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+        for (auto& stream : packed) {
+            decoder.start(stream[0] >> 4, stream[0] & 0x0f);
+            decoder.write(stream.data() + 4, stream.size() - 4,
+                [&](const uint8_t*, size_t len) { out += len; });
+        }
+    }
+    double decoder_ns = elapsedNs(start);
+    CHECK_EQ(out, total * rounds);
+
+    NullSink sink;
+    start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+        for (auto& stream : packed) {
+            BusData tx(3, stream.data(), stream.size());
+            BusFrame frame;
+            tx.encodeFrame(frame);
+            frame.frame_buffer[1] |= BUS_DATA_LZ_FLAG >> 16;
+            BusData::setStreamSink(3, &sink);
+            BusObjectPtr obj = BusData::decodeFrame(frame);
+            auto& rx = std::get<BusData>(*obj);
+            while (tx.isEncoded()) {
+                tx >> frame;
+                rx << frame;
+            }
+        }
+    }
+    double frames_ns = elapsedNs(start);
+    CHECK_EQ(sink.bytes, total * rounds);
+
+    printf("decoder %.2f ns/byte, BusData frames %.2f ns/byte\n",
+        decoder_ns / (total * rounds), frames_ns / (total * rounds));
+    return test::report("bench_lz_decode");
+}
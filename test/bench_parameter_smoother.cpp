@@ -0,0 +1,34 @@
+/*
+ * Time per block of ParameterSmoother::process() with all parameters moving.
+ * Host build runs the generic vector path, numbers only compare changes to
+ * it. Cortex-M4 path needs to be timed on target.
+ */
+#include <chrono>
+#include "test.hpp"
+#include "parameter_smoother.hpp"
+
+using namespace owpeer;
+
+static constexpr size_t blocks = 10000000;
+
+int main() {
+    ParameterSmoother smoother(PARAMETER_SMOOTHING_COEFFICIENT);
+    int32_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t block = 0; block < blocks; block++) {
+        // Targets jump before values settle
+        if (block % 64 == 0) {
+            for (size_t i = 0; i < ParameterSmoother::size; i++)
+                smoother.setTarget(PatchParameterId(i),
+                    (block & 64) ? 30000 - i * 100 : -30000 + i * 100);
+        }
+        smoother.process();
+        checksum += smoother.getValue(PARAMETER_A);
+    }
+    double ns = std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - start).count();
+    CHECK(checksum != 0);
+    printf("process %.1f ns/block for %u parameters\n", ns / blocks,
+        unsigned(ParameterSmoother::size));
+    return test::report("bench_parameter_smoother");
+}
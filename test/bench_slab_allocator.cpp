@@ -0,0 +1,268 @@
+/*
+ * Bus allocator against a general purpose heap under random payload sizes.
+ * chHeapAlloc is malloc on the host, which never runs out and doesn't
+ * fragment like the device heap, so the heap here is a model of ChibiOS
+ * chmemheaps.c instead: first fit over an address ordered free list, 8 byte
+ * units with a header, split on allocation and merged with neighbours on
+ * release. Its arena is as large as the slab classes of bus_env together.
+ * Both run the same sequence of allocations and releases. Failures of the
+ * heap with enough free memory in total are counted as fragmentation. Times
+ * are the fastest of several rounds for each operation, less the cost of
+ * reading the clock, so that the worst case is not a host preemption.
+ */
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "test.hpp"
+#include "bus_protocol.hpp"
+
+using namespace owpeer;
+
+static constexpr size_t ops = 1000000;
+static constexpr size_t rounds = 5;
+static constexpr size_t max_live = 64;
+static constexpr size_t arena_size = 64 * BUS_SLAB_64_NUM +
+    256 * BUS_SLAB_256_NUM + 1024 * BUS_SLAB_1K_NUM + 4096 * BUS_SLAB_4K_NUM;
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+/*
+ * Mostly parameter dumps and messages, sometimes a patch or resource
+ */
+static size_t randomSize() {
+    uint32_t kind = random(100);
+    if (kind < 70)
+        return 1 + random(64);
+    if (kind < 90)
+        return 65 + random(192);
+    if (kind < 98)
+        return 257 + random(768);
+    return 1025 + random(3072);
+}
+
+class FirstFitHeap {
+public:
+    FirstFitHeap() {
+        free_list = 0;
+        units[0] = {none, uint32_t(num_units - 1)};
+    }
+
+    void* alloc(size_t size) {
+        uint32_t pages = (size + unit - 1) / unit;
+        uint32_t prev = none;
+        for (uint32_t p = free_list; p != none; p = units[p].next) {
+            if (units[p].pages >= pages) {
+                uint32_t next = units[p].next;
+                if (units[p].pages > pages + 1) {
+                    // Tail of the block stays free
+                    uint32_t rest = p + 1 + pages;
+                    units[rest] = {next, units[p].pages - pages - 1};
+                    units[p].pages = pages;
+                    next = rest;
+                }
+                link(prev, next);
+                free_pages -= units[p].pages + 1;
+                return &units[p + 1];
+            }
+            prev = p;
+        }
+        return nullptr;
+    }
+
+    void free(void* ptr) {
+        uint32_t p = static_cast<Header*>(ptr) - units - 1;
+        free_pages += units[p].pages + 1;
+        uint32_t prev = none, next = free_list;
+        while (next != none && next < p) {
+            prev = next;
+            next = units[next].next;
+        }
+        units[p].next = next;
+        link(prev, p);
+        if (next != none && p + 1 + units[p].pages == next) {
+            units[p].pages += units[next].pages + 1;
+            units[p].next = units[next].next;
+        }
+        if (prev != none && prev + 1 + units[prev].pages == p) {
+            units[prev].pages += units[p].pages + 1;
+            units[prev].next = units[p].next;
+        }
+    }
+
+    /*
+     * Free memory that a block could use if it was contiguous
+     */
+    size_t getFree() const {
+        return free_pages * unit;
+    }
+
+private:
+    struct Header {
+        uint32_t next;
+        uint32_t pages;
+    };
+
+    static constexpr size_t unit = sizeof(Header);
+    static constexpr size_t num_units = arena_size / unit;
+    static constexpr uint32_t none = UINT32_MAX;
+
+    void link(uint32_t prev, uint32_t next) {
+        if (prev == none)
+            free_list = next;
+        else
+            units[prev].next = next;
+    }
+
+    Header units[num_units];
+    uint32_t free_list;
+    size_t free_pages = num_units;
+};
+
+struct Result {
+    // Fastest time of each operation over all rounds
+    std::vector<double> alloc_ns, free_ns;
+    size_t failures = 0;
+    size_t fragmented = 0;
+};
+
+static double elapsedNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Cost of reading the clock, subtracted from every operation
+ */
+static double clockOverheadNs() {
+    std::vector<double> samples;
+    for (size_t i = 0; i < 10000; i++)
+        samples.push_back(elapsedNs(std::chrono::steady_clock::now()));
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2,
+        samples.end());
+    return samples[samples.size() / 2];
+}
+
+struct Op {
+    // Size to allocate, or 0 to release block at index
+    size_t size;
+    size_t index;
+};
+
+static std::vector<Op> makeOps() {
+    std::vector<Op> sequence;
+    size_t live = 0;
+    for (size_t i = 0; i < ops; i++) {
+        if (live == 0 || (live < max_live && random(2))) {
+            sequence.push_back({randomSize(), 0});
+            live++;
+        }
+        else {
+            sequence.push_back({0, random(live)});
+            live--;
+        }
+    }
+    return sequence;
+}
+
+static void keepFastest(std::vector<double>& times, size_t i, double ns) {
+    if (i == times.size())
+        times.push_back(ns);
+    else
+        times[i] = std::min(times[i], ns);
+}
+
+/*
+ * Sequence runs several times, so that operations that were preempted on
+ * the host can be told apart from slow ones. Failed allocations are kept as
+ * null blocks, so that both allocators release at the same steps.
+ */
+template <typename Alloc, typename Free, typename Available>
+static Result run(const std::vector<Op>& sequence, Alloc alloc, Free free,
+    Available available) {
+    Result result;
+    for (size_t round = 0; round < rounds; round++) {
+        std::vector<void*> blocks;
+        size_t allocs = 0, frees = 0;
+        result.failures = result.fragmented = 0;
+        for (const Op& op : sequence) {
+            if (op.size) {
+                auto start = std::chrono::steady_clock::now();
+                void* p = alloc(op.size);
+                keepFastest(result.alloc_ns, allocs++, elapsedNs(start));
+                if (p == nullptr) {
+                    result.failures++;
+                    result.fragmented += available() >= op.size;
+                }
+                blocks.push_back(p);
+            }
+            else {
+                void* p = blocks[op.index];
+                blocks[op.index] = blocks.back();
+                blocks.pop_back();
+                if (p == nullptr)
+                    continue;
+                auto start = std::chrono::steady_clock::now();
+                free(p);
+                keepFastest(result.free_ns, frees++, elapsedNs(start));
+            }
+        }
+        for (void* p : blocks) {
+            if (p != nullptr)
+                free(p);
+        }
+    }
+    return result;
+}
+
+static void printTimes(std::vector<double>& times, double overhead) {
+    double total = 0, max = 0;
+    for (double& ns : times) {
+        ns = std::max(ns - overhead, 0.0);
+        total += ns;
+        max = std::max(max, ns);
+    }
+    printf("  %8.1f  %7.1f", total / times.size(), max);
+}
+
+static void print(const char* name, Result& result, double overhead) {
+    printf("%-5s", name);
+    printTimes(result.alloc_ns, overhead);
+    printTimes(result.free_ns, overhead);
+    printf("  %8u  %10u\n", unsigned(result.failures),
+        unsigned(result.fragmented));
+}
+
+int main() {
+    auto sequence = makeOps();
+    static FirstFitHeap heap;
+
+    Result slab = run(sequence,
+        [](size_t size) { return bus_allocator.alloc(size); },
+        [](void* p) { bus_allocator.free(p); },
+        [] { return size_t(0); });
+    Result first_fit = run(sequence,
+        [](size_t size) { return heap.alloc(size); },
+        [](void* p) { heap.free(p); },
+        [] { return heap.getFree(); });
+
+    for (size_t i = 0; i < bus_allocator.getNumClasses(); i++)
+        CHECK_EQ(bus_allocator.getClass(i).getUsed(), 0);
+    CHECK_EQ(heap.getFree(), arena_size);
+    CHECK_EQ(slab.alloc_ns.size(), first_fit.alloc_ns.size());
+    double overhead = clockOverheadNs();
+
+    printf("%u operations, up to %u blocks of 1-4096 bytes in %u bytes\n",
+        unsigned(ops), unsigned(max_live), unsigned(arena_size));
+    printf("       alloc ns           free ns\n");
+    printf("       mean      max      mean      max      failed  fragmented\n");
+    print("slab", slab, overhead);
+    print("heap", first_fit, overhead);
+    return test::report("bench_slab_allocator");
+}
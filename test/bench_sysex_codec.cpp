@@ -0,0 +1,137 @@
+/*
+ * SysEx codec throughput on a 1 MB payload: bulk encode, encode from 3 byte
+ * BusData frames, decode, and a byte by byte encoder for comparison. Host
+ * builds run the same word code as target, numbers only compare changes to
+ * it. Cortex-M4 needs to be timed on target.
+ */
+#include <chrono>
+#include <vector>
+#include "test.hpp"
+#include "sysex_codec.hpp"
+
+using namespace owpeer;
+
+static constexpr size_t size = 1 << 20;
+static constexpr size_t rounds = 20;
+
+static uint32_t checksum = 0;
+
+static void consume(uint32_t packet) {
+    checksum = checksum * 31 + packet;
+}
+
+/*
+ * One byte at a time, packet is sent as soon as it has 3 bytes
+ */
+class ByteEncoder {
+public:
+    void begin(uint8_t command) {
+        put(0xf0);
+        put(MIDI_SYSEX_MANUFACTURER);
+        put(MIDI_SYSEX_OMNI_DEVICE);
+        put(command);
+    }
+    void write(const uint8_t* data, size_t len) {
+        for (size_t i = 0; i < len; i += 7) {
+            size_t n = std::min<size_t>(7, len - i);
+            uint8_t bits = 0;
+            for (size_t j = 0; j < n; j++)
+                bits |= (data[i + j] >> 7) << j;
+            put(bits);
+            for (size_t j = 0; j < n; j++)
+                put(data[i + j] & 0x7f);
+        }
+    }
+    void end() {
+        packet |= 0xf7 << (8 * ++len);
+        consume(packet | (USB_COMMAND_SYSEX_EOX1 + len - 1));
+        packet = 0;
+        len = 0;
+    }
+
+private:
+    void put(uint8_t byte) {
+        packet |= uint32_t(byte) << (8 * ++len);
+        if (len == 3) {
+            consume(packet | USB_COMMAND_SYSEX);
+            packet = 0;
+            len = 0;
+        }
+    }
+    uint32_t packet = 0;
+    size_t len = 0;
+};
+
+static double mbPerSecond(std::chrono::steady_clock::time_point start) {
+    double s = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    return double(size) * rounds / s / 1e6;
+}
+
+int main() {
+    std::vector<uint8_t> payload(size);
+    uint32_t rng = 1;
+    for (auto& byte : payload) {
+        rng = rng * 1664525 + 1013904223;
+        byte = rng >> 24;
+    }
+
+    SysexEncoder encoder;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+        encoder.begin(SYSEX_FIRMWARE_UPLOAD, consume);
+        encoder.write(payload.data(), size, consume);
+        encoder.end(consume);
+    }
+    double bulk = mbPerSecond(start);
+    uint32_t bulk_checksum = checksum;
+
+    checksum = 0;
+    ByteEncoder byte_encoder;
+    start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+        byte_encoder.begin(SYSEX_FIRMWARE_UPLOAD);
+        byte_encoder.write(payload.data(), size);
+        byte_encoder.end();
+    }
+    double bytes = mbPerSecond(start);
+    CHECK_EQ(checksum, bulk_checksum);
+
+    checksum = 0;
+    std::vector<uint32_t> packets;
+    start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+        encoder.begin(SYSEX_FIRMWARE_UPLOAD, consume);
+        for (size_t pos = 0; pos < size; pos += 3)
+            encoder.write(payload.data() + pos,
+                std::min<size_t>(3, size - pos), consume);
+        encoder.end(consume);
+    }
+    double frames = mbPerSecond(start);
+    CHECK_EQ(checksum, bulk_checksum);
+
+    encoder.begin(SYSEX_FIRMWARE_UPLOAD,
+        [&](uint32_t packet) { packets.push_back(packet); });
+    encoder.write(payload.data(), size,
+        [&](uint32_t packet) { packets.push_back(packet); });
+    encoder.end([&](uint32_t packet) { packets.push_back(packet); });
+    SysexDecoder decoder;
+    uint32_t decoded_sum = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+        for (uint32_t packet : packets)
+            decoder.write(packet, [&](const uint8_t* data, size_t len) {
+                for (size_t i = 0; i < len; i++)
+                    decoded_sum += data[i];
+            });
+    }
+    double decode = mbPerSecond(start);
+    uint32_t payload_sum = 0;
+    for (uint8_t byte : payload)
+        payload_sum += byte;
+    CHECK_EQ(decoded_sum, payload_sum * uint32_t(rounds));
+
+    printf("encode %.0f MB/s, byte loop %.0f MB/s, from 3 byte frames "
+        "%.0f MB/s, decode %.0f MB/s\n", bulk, bytes, frames, decode);
+    return test::report("bench_sysex_codec");
+}
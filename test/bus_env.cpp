@@ -0,0 +1,22 @@
+/*
+ * Bus globals that main.cpp defines on target
+ */
+#include "main.hpp"
+#include "uart_fifo.hpp"
+#include "bus_protocol.hpp"
+
+namespace owpeer {
+
+FramesFifo rx_fifo, tx_fifo;
+static StaticSlabClass<64, BUS_SLAB_64_NUM> bus_slab_64;
+static StaticSlabClass<256, BUS_SLAB_256_NUM> bus_slab_256;
+static StaticSlabClass<1024, BUS_SLAB_1K_NUM> bus_slab_1k;
+static StaticSlabClass<4096, BUS_SLAB_4K_NUM> bus_slab_4k;
+static SlabClass* const bus_slab_classes[] = {
+    &bus_slab_64, &bus_slab_256, &bus_slab_1k, &bus_slab_4k};
+SlabAllocator bus_allocator(bus_slab_classes, 4);
+BusProtocolFifo bus_protocol_fifo;
+BusOutputFifo bus_output_fifo;
+BaseSequentialStream* chp = nullptr;
+
+}
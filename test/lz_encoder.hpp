@@ -0,0 +1,101 @@
+/*
+ * Greedy LZSS encoder, same as lz_compress in tools/firmware_upload.py.
+ * Output starts with stream parameters and 24-bit size as expected by
+ * BusData decoder.
+ */
+#pragma once
+#ifndef __LZ_ENCODER__
+#define __LZ_ENCODER__
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace test {
+
+class LzEncoder {
+public:
+    LzEncoder(uint8_t window_bits, uint8_t count_bits)
+        : window_bits(window_bits)
+        , count_bits(count_bits) {
+    }
+
+    std::vector<uint8_t> encode(const std::vector<uint8_t>& data) {
+        size_t window = size_t(1) << window_bits;
+        size_t max_count = size_t(1) << count_bits;
+        // Back reference pays off from 2 bytes
+        size_t min_count = (1 + window_bits + count_bits) / 9 + 1;
+        out.assign({uint8_t(window_bits << 4 | count_bits),
+            uint8_t(data.size() >> 16), uint8_t(data.size() >> 8),
+            uint8_t(data.size())});
+        bits = 0;
+        num_bits = 0;
+        std::map<uint16_t, std::vector<size_t>> chains;
+        size_t pos = 0;
+        while (pos < data.size()) {
+            size_t best = 0, best_pos = 0;
+            size_t limit = std::min(max_count, data.size() - pos);
+            if (pos + 2 <= data.size()) {
+                auto& candidates = chains[key(data, pos)];
+                size_t tried = 0;
+                for (auto it = candidates.rbegin();
+                    it != candidates.rend() && tried < 64; ++it, tried++) {
+                    if (pos - *it > window)
+                        break;
+                    size_t n = 0;
+                    while (n < limit && data[*it + n] == data[pos + n])
+                        n++;
+                    if (n > best) {
+                        best = n;
+                        best_pos = *it;
+                        if (n == limit)
+                            break;
+                    }
+                }
+            }
+            if (best >= min_count) {
+                put(0, 1);
+                put(pos - best_pos - 1, window_bits);
+                put(best - 1, count_bits);
+            }
+            else {
+                best = 1;
+                put(1, 1);
+                put(data[pos], 8);
+            }
+            for (size_t i = pos; i < pos + best; i++) {
+                if (i + 2 <= data.size())
+                    chains[key(data, i)].push_back(i);
+            }
+            pos += best;
+        }
+        if (num_bits)
+            put(0, 8 - num_bits);
+        return out;
+    }
+
+private:
+    static uint16_t key(const std::vector<uint8_t>& data, size_t pos) {
+        return (data[pos] << 8) | data[pos + 1];
+    }
+
+    void put(uint32_t value, uint8_t num) {
+        bits = (bits << num) | value;
+        num_bits += num;
+        while (num_bits >= 8) {
+            num_bits -= 8;
+            out.push_back(bits >> num_bits);
+        }
+        bits &= (1 << num_bits) - 1;
+    }
+
+    uint8_t window_bits;
+    uint8_t count_bits;
+    std::vector<uint8_t> out;
+    uint32_t bits = 0;
+    uint8_t num_bits = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * Host subset of ChibiOS RT for unit tests. Kernel objects are functional
+ * for a single thread: pools and mailboxes keep real state, operations that
+ * would block report failure instead. Time only moves when a test advances
+ * it or a thread sleeps.
+ */
+#pragma once
+#ifndef __HOST_CH__
+#define __HOST_CH__
+
+#include <cstddef>
+#include <cstdint>
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define CH_CFG_USE_OBJ_FIFOS TRUE
+#define CH_CFG_USE_MEMPOOLS TRUE
+#define CH_CFG_USE_SEMAPHORES TRUE
+#define CH_CFG_USE_HEAP TRUE
+#define CH_CFG_ST_FREQUENCY 10000
+#define CH_DBG_OBJ_FIFOS_STATISTICS TRUE
+#define CH_DBG_MEMPOOLS_STATISTICS TRUE
+#define CH_DBG_THREADS_PROFILER TRUE
+#define CH_DBG_FILL_THREADS TRUE
+#define CH_DBG_STACK_FILL_VALUE 0x55
+
+// Objects FIFOs pass pointers as messages
+typedef intptr_t msg_t;
+typedef uint32_t sysinterval_t;
+typedef uint32_t systime_t;
+typedef uint32_t rtcnt_t;
+typedef uint32_t eventmask_t;
+typedef uint32_t eventflags_t;
+typedef uint32_t syssts_t;
+typedef uint8_t tprio_t;
+
+#define MSG_OK 0
+#define MSG_TIMEOUT -1
+#define MSG_RESET -2
+#define TIME_INFINITE ((sysinterval_t)-1)
+#define TIME_IMMEDIATE ((sysinterval_t)0)
+#define NORMALPRIO 128
+#define HIGHPRIO 255
+#define TIME_MS2I(x) ((sysinterval_t)(x) * (CH_CFG_ST_FREQUENCY / 1000))
+#define TIME_US2I(x) ((sysinterval_t)(x) / (1000000 / CH_CFG_ST_FREQUENCY))
+#define TIME_I2MS(x) ((x) / (CH_CFG_ST_FREQUENCY / 1000))
+#define TIME_I2US(x) ((x) * (1000000 / CH_CFG_ST_FREQUENCY))
+#define EVENT_MASK(x) (1u << (x))
+#define ALL_EVENTS ((eventmask_t)-1)
+#define THD_WORKING_AREA(s, n) uint8_t s[n]
+#define THD_WORKING_AREA_SIZE(n) (n)
+
+#define STM32_HCLK 180000000
+#define STM32_SYSCLK 180000000
+#define RTC2US(f, n) ((n) / ((f) / 1000000))
+#define port_rt_get_counter_value() chSysGetRealtimeCounterX()
+
+// Device unique ID, tests set it per simulated peer
+extern uint32_t host_device_uid[3];
+#define UID_BASE ((uintptr_t)host_device_uid)
+
+void host_assert(bool cond, const char* msg);
+#define chDbgAssert(c, m) host_assert((c), (m))
+#define osalDbgAssert(c, m) host_assert((c), (m))
+
+/*
+ * Simulated clocks, system time runs at CH_CFG_ST_FREQUENCY and cycle
+ * counter at STM32_HCLK
+ */
+extern systime_t host_system_time;
+extern rtcnt_t host_cycles;
+void host_advance_us(uint32_t us);
+
+// Free objects are kept out of line, host pointers don't fit in 4 byte
+// objects like they do on target
+struct memory_pool_t {
+    void** free;
+    size_t free_num;
+    size_t free_size;
+    size_t object_size;
+    void* (*provider)(size_t, unsigned);
+};
+
+struct guarded_memory_pool_t {
+    size_t count;
+    memory_pool_t pool;
+};
+
+struct mailbox_t {
+    msg_t* buffer;
+    msg_t* top;
+    msg_t* wrptr;
+    msg_t* rdptr;
+    size_t cnt;
+    bool reset;
+};
+
+struct objects_fifo_t {
+    guarded_memory_pool_t free;
+    mailbox_t mbx;
+};
+
+struct memory_heap_t {
+    int unused;
+};
+
+struct ch_thread {
+    const char* name;
+    uint32_t time;
+    tprio_t prio;
+    void* wabase;
+    ch_thread* newer;
+    uint64_t prof_cycles;
+    uint32_t prof_switches;
+};
+typedef ch_thread thread_t;
+
+void chSysInit();
+void chSysLock();
+void chSysUnlock();
+void chSysLockFromISR();
+void chSysUnlockFromISR();
+syssts_t chSysGetStatusAndLockX();
+void chSysRestoreStatusX(syssts_t);
+void chSysHalt(const char*);
+void chSchRescheduleS();
+rtcnt_t chSysGetRealtimeCounterX();
+systime_t chVTGetSystemTimeX();
+systime_t chVTGetSystemTime();
+sysinterval_t chVTTimeElapsedSinceX(systime_t start);
+inline sysinterval_t chTimeDiffX(systime_t start, systime_t end) {
+    return end - start;
+}
+inline systime_t chTimeAddX(systime_t time, sysinterval_t interval) {
+    return time + interval;
+}
+void chThdSleep(sysinterval_t);
+void chThdSleepMilliseconds(uint32_t);
+void chThdSleepMicroseconds(uint32_t);
+systime_t chThdSleepUntilWindowed(systime_t prev, systime_t next);
+thread_t* chThdGetSelfX();
+thread_t* chRegFirstThread();
+thread_t* chRegNextThread(thread_t*);
+thread_t* chThdCreateFromMemoryPool(memory_pool_t*, const char*, tprio_t,
+    void (*)(void*), void*);
+
+void chPoolObjectInit(memory_pool_t*, size_t, void* (*)(size_t, unsigned));
+void chPoolLoadArray(memory_pool_t*, void*, size_t);
+void* chPoolAllocI(memory_pool_t*);
+void* chPoolAlloc(memory_pool_t*);
+void chPoolFreeI(memory_pool_t*, void*);
+void chPoolFree(memory_pool_t*, void*);
+
+void chGuardedPoolObjectInit(guarded_memory_pool_t*, size_t);
+void chGuardedPoolLoadArray(guarded_memory_pool_t*, void*, size_t);
+void* chGuardedPoolAllocTimeoutS(guarded_memory_pool_t*, sysinterval_t);
+void* chGuardedPoolAllocTimeout(guarded_memory_pool_t*, sysinterval_t);
+void chGuardedPoolFreeI(guarded_memory_pool_t*, void*);
+void chGuardedPoolFree(guarded_memory_pool_t*, void*);
+
+void chMBObjectInit(mailbox_t*, msg_t*, size_t);
+void chMBPostI(mailbox_t*, msg_t);
+void chMBPostAheadI(mailbox_t*, msg_t);
+msg_t chMBFetchI(mailbox_t*, msg_t*);
+
+void chFifoObjectInit(objects_fifo_t*, size_t, size_t, void*, msg_t*);
+void* chFifoTakeObjectI(objects_fifo_t*);
+void* chFifoTakeObjectTimeoutS(objects_fifo_t*, sysinterval_t);
+void* chFifoTakeObjectTimeout(objects_fifo_t*, sysinterval_t);
+void chFifoReturnObjectI(objects_fifo_t*, void*);
+void chFifoReturnObjectS(objects_fifo_t*, void*);
+void chFifoReturnObject(objects_fifo_t*, void*);
+void chFifoSendObjectI(objects_fifo_t*, void*);
+void chFifoSendObjectS(objects_fifo_t*, void*);
+void chFifoSendObject(objects_fifo_t*, void*);
+void chFifoSendObjectAheadI(objects_fifo_t*, void*);
+void chFifoSendObjectAheadS(objects_fifo_t*, void*);
+void chFifoSendObjectAhead(objects_fifo_t*, void*);
+msg_t chFifoReceiveObjectI(objects_fifo_t*, void**);
+msg_t chFifoReceiveObjectTimeoutS(objects_fifo_t*, void**, sysinterval_t);
+msg_t chFifoReceiveObjectTimeout(objects_fifo_t*, void**, sysinterval_t);
+
+void* chHeapAlloc(memory_heap_t*, size_t);
+void chHeapFree(void*);
+
+#endif
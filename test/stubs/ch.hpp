@@ -0,0 +1,141 @@
+/*
+ * Host subset of ChibiOS RT C++ wrapper, see ch.h
+ */
+#pragma once
+#ifndef __HOST_CH_HPP__
+#define __HOST_CH_HPP__
+
+#include "ch.h"
+
+namespace chibios_rt {
+
+class ThreadReference {
+public:
+    thread_t* thread_ref;
+
+    ThreadReference(thread_t* tp = nullptr) : thread_ref(tp) {}
+};
+
+class BaseThread {
+public:
+    virtual ~BaseThread() = default;
+    virtual void main() = 0;
+
+    /*
+     * Threads don't run on host, tests call their functions directly
+     */
+    virtual ThreadReference start(tprio_t) {
+        return ThreadReference();
+    }
+
+    void setName(const char*) {}
+};
+
+template <int N>
+class BaseStaticThread : public BaseThread {};
+
+class BaseDynamicThread : public BaseThread {};
+
+class MemoryPool {
+public:
+    memory_pool_t pool;
+
+    MemoryPool(size_t size, void* (*provider)(size_t, unsigned) = nullptr) {
+        chPoolObjectInit(&pool, size, provider);
+    }
+
+    void loadArray(void* p, size_t n) {
+        chPoolLoadArray(&pool, p, n);
+    }
+
+    void* allocI() {
+        return chPoolAllocI(&pool);
+    }
+
+    void* alloc() {
+        return chPoolAlloc(&pool);
+    }
+
+    void freeI(void* p) {
+        chPoolFreeI(&pool, p);
+    }
+
+    void free(void* p) {
+        chPoolFree(&pool, p);
+    }
+};
+
+/*
+ * Lock state is checked, a test that locks twice would deadlock on target
+ */
+class Mutex {
+public:
+    void lock() {
+        host_assert(!locked, "mutex locked twice");
+        locked = true;
+    }
+
+    bool tryLock() {
+        if (locked)
+            return false;
+        locked = true;
+        return true;
+    }
+
+    void unlock() {
+        host_assert(locked, "mutex not locked");
+        locked = false;
+    }
+
+    bool isLocked() const {
+        return locked;
+    }
+
+private:
+    bool locked = false;
+};
+
+class BinarySemaphore {
+public:
+    BinarySemaphore(bool taken) : taken(taken) {}
+
+    msg_t wait() {
+        return wait(TIME_INFINITE);
+    }
+
+    /*
+     * Taken semaphore times out at once, time advances by timeout
+     */
+    msg_t wait(sysinterval_t timeout) {
+        if (!taken) {
+            taken = true;
+            return MSG_OK;
+        }
+        if (timeout != TIME_INFINITE)
+            chThdSleep(timeout);
+        return MSG_TIMEOUT;
+    }
+
+    void signal() {
+        taken = false;
+    }
+
+    void signalI() {
+        taken = false;
+    }
+
+    void reset(bool taken) {
+        this->taken = taken;
+    }
+
+    void resetI(bool taken) {
+        this->taken = taken;
+    }
+
+private:
+    bool taken;
+};
+
+}
+
+#endif
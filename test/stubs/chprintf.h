@@ -0,0 +1,10 @@
+#pragma once
+#ifndef __HOST_CHPRINTF__
+#define __HOST_CHPRINTF__
+
+#include "hal.h"
+
+int chprintf(BaseSequentialStream* chp, const char* fmt, ...);
+int chsnprintf(char* str, size_t size, const char* fmt, ...);
+
+#endif
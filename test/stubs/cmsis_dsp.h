@@ -0,0 +1,50 @@
+/*
+ * Cortex-M4 SIMD intrinsics emulated in C, so that DSP code paths can be
+ * checked against generic ones on host. Build with -D__ARM_FEATURE_DSP.
+ */
+#pragma once
+#ifndef __HOST_CMSIS_DSP__
+#define __HOST_CMSIS_DSP__
+
+#include <cstdint>
+
+static inline int32_t host_sat16(int32_t x) {
+    return x > 32767 ? 32767 : x < -32768 ? -32768 : x;
+}
+
+static inline uint32_t host_pack16(int32_t lo, int32_t hi) {
+    return (uint32_t(lo) & 0xffff) | (uint32_t(hi) << 16);
+}
+
+static inline uint32_t __QADD16(uint32_t a, uint32_t b) {
+    return host_pack16(host_sat16(int16_t(a) + int16_t(b)),
+        host_sat16(int16_t(a >> 16) + int16_t(b >> 16)));
+}
+
+static inline uint32_t __QSUB16(uint32_t a, uint32_t b) {
+    return host_pack16(host_sat16(int16_t(a) - int16_t(b)),
+        host_sat16(int16_t(a >> 16) - int16_t(b >> 16)));
+}
+
+static inline uint32_t __SMLAD(uint32_t a, uint32_t b, uint32_t acc) {
+    return uint32_t(int32_t(acc) + int16_t(a) * int16_t(b) +
+        int16_t(a >> 16) * int16_t(b >> 16));
+}
+
+static inline uint32_t __SMULBB(uint32_t a, uint32_t b) {
+    return uint32_t(int32_t(int16_t(a)) * int16_t(b));
+}
+
+static inline uint32_t __SMULTT(uint32_t a, uint32_t b) {
+    return uint32_t(int32_t(int16_t(a >> 16)) * int16_t(b >> 16));
+}
+
+#define __PKHBT(a, b, s) \
+    ((uint32_t(a) & 0x0000ffffu) | ((uint32_t(b) << (s)) & 0xffff0000u))
+#define __PKHTB(a, b, s) \
+    ((uint32_t(a) & 0xffff0000u) | ((uint32_t(b) >> (s)) & 0x0000ffffu))
+#define __SSAT(x, n) \
+    (int32_t(x) > ((1 << ((n) - 1)) - 1) ? ((1 << ((n) - 1)) - 1) : \
+     int32_t(x) < -(1 << ((n) - 1)) ? -(1 << ((n) - 1)) : int32_t(x))
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Host subset of ChibiOS HAL for unit tests. Peripheral drivers are only
+ * declared, so that every translation unit compiles; tests that link a
+ * driver provide it.
+ */
+#pragma once
+#ifndef __HOST_HAL__
+#define __HOST_HAL__
+
+#include "ch.h"
+#if defined(__ARM_FEATURE_DSP)
+#include "cmsis_dsp.h"
+#endif
+
+/*
+ * Output written with chprintf is appended to buffer when it is set, or
+ * printed to stdout
+ */
+struct BaseSequentialStream {
+    char* host_buffer = nullptr;
+    size_t host_size = 0;
+    size_t host_len = 0;
+    size_t* host_end = nullptr;
+};
+
+void halInit();
+
+struct SerialConfig {
+    uint32_t speed;
+    uint32_t cr1, cr2, cr3;
+};
+struct input_queue_t {
+    size_t full;
+};
+struct output_queue_t {
+    size_t full;
+};
+struct SerialDriver : BaseSequentialStream {
+    input_queue_t iqueue;
+    output_queue_t oqueue;
+};
+extern SerialDriver SD2, SD4;
+bool oqIsEmptyI(output_queue_t*);
+size_t oqGetFullI(output_queue_t*);
+size_t iqGetFullI(input_queue_t*);
+void sdStart(SerialDriver*, const SerialConfig*);
+void sdStop(SerialDriver*);
+size_t sdRead(SerialDriver*, uint8_t*, size_t);
+size_t sdWrite(SerialDriver*, const uint8_t*, size_t);
+msg_t sdGet(SerialDriver*);
+msg_t sdPut(SerialDriver*, uint8_t);
+
+typedef void* ioportid_t;
+extern ioportid_t GPIOA;
+#define GPIOA_LED_GREEN 5
+void palSetPad(ioportid_t, int);
+void palClearPad(ioportid_t, int);
+int palReadPad(ioportid_t, int);
+
+struct FLASH_TypeDef {
+    volatile uint32_t ACR, KEYR, OPTKEYR, SR, CR, OPTCR;
+};
+extern FLASH_TypeDef* const FLASH;
+#define FLASH_KEY1 0x45670123U
+#define FLASH_KEY2 0xCDEF89ABU
+#define FLASH_SR_BSY (1U << 16)
+#define FLASH_SR_PGSERR (1U << 7)
+#define FLASH_SR_PGPERR (1U << 6)
+#define FLASH_SR_PGAERR (1U << 5)
+#define FLASH_SR_WRPERR (1U << 4)
+#define FLASH_SR_OPERR (1U << 1)
+#define FLASH_SR_EOP (1U << 0)
+#define FLASH_CR_PG (1U << 0)
+#define FLASH_CR_SER (1U << 1)
+#define FLASH_CR_SNB_Pos 3U
+#define FLASH_CR_SNB (0x1FU << 3)
+#define FLASH_CR_PSIZE_1 (2U << 8)
+#define FLASH_CR_PSIZE (3U << 8)
+#define FLASH_CR_STRT (1U << 16)
+#define FLASH_CR_LOCK (1U << 31)
+#define FLASH_ACR_DCEN (1U << 10)
+#define FLASH_ACR_DCRST (1U << 12)
+#define FLASH_ACR_ICEN (1U << 9)
+#define FLASH_ACR_ICRST (1U << 11)
+inline void __DSB() {}
+inline void __ISB() {}
+
+struct stm32_dma_stream_t {
+    size_t remaining;
+};
+typedef uint32_t uartflags_t;
+struct UARTDriver;
+typedef void (*uartcb_t)(UARTDriver*);
+typedef void (*uartccb_t)(UARTDriver*, uint16_t);
+typedef void (*uartecb_t)(UARTDriver*, uartflags_t);
+struct UARTConfig {
+    uartcb_t txend1_cb, txend2_cb, rxend_cb;
+    uartccb_t rxchar_cb;
+    uartecb_t rxerr_cb;
+    uartcb_t timeout_cb;
+    uint32_t speed;
+    uint16_t cr1, cr2, cr3;
+};
+enum uarttxstate_t { UART_TX_IDLE, UART_TX_ACTIVE, UART_TX_COMPLETE };
+struct UARTDriver {
+    const stm32_dma_stream_t* dmarx;
+    uint32_t dmarxmode;
+    uarttxstate_t txstate;
+};
+extern UARTDriver UARTD4;
+void uartStart(UARTDriver*, const UARTConfig*);
+void uartStop(UARTDriver*);
+msg_t uartSendTimeout(UARTDriver*, size_t*, const void*, sysinterval_t);
+size_t dmaStreamGetTransactionSize(const stm32_dma_stream_t*);
+void dmaStreamDisable(const stm32_dma_stream_t*);
+void dmaStreamEnable(const stm32_dma_stream_t*);
+void dmaStreamSetMemory0(const stm32_dma_stream_t*, void*);
+void dmaStreamSetTransactionSize(const stm32_dma_stream_t*, size_t);
+void dmaStreamSetMode(const stm32_dma_stream_t*, uint32_t);
+#define STM32_DMA_CR_DIR_P2M 0
+#define STM32_DMA_CR_MINC (1U << 10)
+#define STM32_DMA_CR_CIRC (1U << 8)
+#define STM32_DMA_CR_HTIE (1U << 3)
+#define STM32_DMA_CR_TCIE (1U << 4)
+#define USART_CR1_IDLEIE (1U << 4)
+#define UART_OVERRUN_ERROR 8
+
+#endif
@@ -0,0 +1,362 @@
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "ch.h"
+#include "hal.h"
+#include "chprintf.h"
+#include "memstreams.h"
+
+systime_t host_system_time = 0;
+rtcnt_t host_cycles = 0;
+uint32_t host_device_uid[3] = {0x00230041, 0x3436510c, 0x31373832};
+static uint32_t host_us_fraction = 0;
+
+void host_assert(bool cond, const char* msg) {
+    if (!cond) {
+        fprintf(stderr, "assertion failed: %s\n", msg);
+        abort();
+    }
+}
+
+void host_advance_us(uint32_t us) {
+    host_cycles += us * (STM32_HCLK / 1000000);
+    host_us_fraction += us;
+    host_system_time += host_us_fraction / (1000000 / CH_CFG_ST_FREQUENCY);
+    host_us_fraction %= 1000000 / CH_CFG_ST_FREQUENCY;
+}
+
+/*
+ * System
+ */
+void chSysInit() {}
+void chSysLock() {}
+void chSysUnlock() {}
+void chSysLockFromISR() {}
+void chSysUnlockFromISR() {}
+syssts_t chSysGetStatusAndLockX() {
+    return 0;
+}
+void chSysRestoreStatusX(syssts_t) {}
+void chSysHalt(const char* reason) {
+    host_assert(false, reason);
+}
+void chSchRescheduleS() {}
+
+rtcnt_t chSysGetRealtimeCounterX() {
+    return host_cycles;
+}
+
+systime_t chVTGetSystemTimeX() {
+    return host_system_time;
+}
+
+systime_t chVTGetSystemTime() {
+    return host_system_time;
+}
+
+sysinterval_t chVTTimeElapsedSinceX(systime_t start) {
+    return host_system_time - start;
+}
+
+void chThdSleep(sysinterval_t time) {
+    host_advance_us(TIME_I2US(time));
+}
+
+void chThdSleepMilliseconds(uint32_t ms) {
+    host_advance_us(ms * 1000);
+}
+
+void chThdSleepMicroseconds(uint32_t us) {
+    host_advance_us(us);
+}
+
+systime_t chThdSleepUntilWindowed(systime_t prev, systime_t next) {
+    if (host_system_time - prev < next - prev)
+        host_advance_us(TIME_I2US(next - host_system_time));
+    return next;
+}
+
+static thread_t host_main_thread = {"main", 0, NORMALPRIO, nullptr, nullptr,
+    0, 0};
+
+thread_t* chThdGetSelfX() {
+    return &host_main_thread;
+}
+
+thread_t* chRegFirstThread() {
+    return &host_main_thread;
+}
+
+thread_t* chRegNextThread(thread_t* tp) {
+    return tp->newer;
+}
+
+thread_t* chThdCreateFromMemoryPool(memory_pool_t*, const char*, tprio_t,
+    void (*)(void*), void*) {
+    return nullptr;
+}
+
+/*
+ * Memory pools
+ */
+void chPoolObjectInit(memory_pool_t* mp, size_t size,
+    void* (*provider)(size_t, unsigned)) {
+    mp->free = nullptr;
+    mp->free_num = 0;
+    mp->free_size = 0;
+    mp->object_size = size;
+    mp->provider = provider;
+}
+
+void chPoolFreeI(memory_pool_t* mp, void* objp) {
+    if (mp->free_num == mp->free_size) {
+        mp->free_size = mp->free_size ? mp->free_size * 2 : 16;
+        mp->free = static_cast<void**>(
+            realloc(mp->free, mp->free_size * sizeof(void*)));
+    }
+    mp->free[mp->free_num++] = objp;
+}
+
+void chPoolFree(memory_pool_t* mp, void* objp) {
+    chPoolFreeI(mp, objp);
+}
+
+void chPoolLoadArray(memory_pool_t* mp, void* p, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        chPoolFreeI(mp, static_cast<uint8_t*>(p) + i * mp->object_size);
+}
+
+void* chPoolAllocI(memory_pool_t* mp) {
+    void* objp = nullptr;
+    if (mp->free_num)
+        objp = mp->free[--mp->free_num];
+    else if (mp->provider != nullptr)
+        objp = mp->provider(mp->object_size, 4);
+    return objp;
+}
+
+void* chPoolAlloc(memory_pool_t* mp) {
+    return chPoolAllocI(mp);
+}
+
+void chGuardedPoolObjectInit(guarded_memory_pool_t* gmp, size_t size) {
+    gmp->count = 0;
+    chPoolObjectInit(&gmp->pool, size, nullptr);
+}
+
+void chGuardedPoolFreeI(guarded_memory_pool_t* gmp, void* objp) {
+    chPoolFreeI(&gmp->pool, objp);
+    gmp->count++;
+}
+
+void chGuardedPoolFree(guarded_memory_pool_t* gmp, void* objp) {
+    chGuardedPoolFreeI(gmp, objp);
+}
+
+void chGuardedPoolLoadArray(guarded_memory_pool_t* gmp, void* p, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        chGuardedPoolFreeI(gmp,
+            static_cast<uint8_t*>(p) + i * gmp->pool.object_size);
+}
+
+void* chGuardedPoolAllocTimeoutS(guarded_memory_pool_t* gmp,
+    sysinterval_t timeout) {
+    if (gmp->count == 0) {
+        host_assert(timeout != TIME_INFINITE, "pool would block forever");
+        chThdSleep(timeout);
+        return nullptr;
+    }
+    gmp->count--;
+    return chPoolAllocI(&gmp->pool);
+}
+
+void* chGuardedPoolAllocTimeout(guarded_memory_pool_t* gmp,
+    sysinterval_t timeout) {
+    return chGuardedPoolAllocTimeoutS(gmp, timeout);
+}
+
+/*
+ * Mailboxes
+ */
+void chMBObjectInit(mailbox_t* mbp, msg_t* buf, size_t n) {
+    mbp->buffer = mbp->wrptr = mbp->rdptr = buf;
+    mbp->top = buf + n;
+    mbp->cnt = 0;
+    mbp->reset = false;
+}
+
+void chMBPostI(mailbox_t* mbp, msg_t msg) {
+    host_assert(mbp->cnt < size_t(mbp->top - mbp->buffer), "mailbox full");
+    *mbp->wrptr++ = msg;
+    if (mbp->wrptr >= mbp->top)
+        mbp->wrptr = mbp->buffer;
+    mbp->cnt++;
+}
+
+void chMBPostAheadI(mailbox_t* mbp, msg_t msg) {
+    host_assert(mbp->cnt < size_t(mbp->top - mbp->buffer), "mailbox full");
+    if (--mbp->rdptr < mbp->buffer)
+        mbp->rdptr = mbp->top - 1;
+    *mbp->rdptr = msg;
+    mbp->cnt++;
+}
+
+msg_t chMBFetchI(mailbox_t* mbp, msg_t* msgp) {
+    if (mbp->cnt == 0)
+        return MSG_TIMEOUT;
+    *msgp = *mbp->rdptr++;
+    if (mbp->rdptr >= mbp->top)
+        mbp->rdptr = mbp->buffer;
+    mbp->cnt--;
+    return MSG_OK;
+}
+
+static msg_t toMsg(void* objp) {
+    return reinterpret_cast<msg_t>(objp);
+}
+
+static void* fromMsg(msg_t msg) {
+    return reinterpret_cast<void*>(msg);
+}
+
+void chFifoObjectInit(objects_fifo_t* ofp, size_t objsize, size_t objn,
+    void* objbuf, msg_t* msgbuf) {
+    chGuardedPoolObjectInit(&ofp->free, objsize);
+    chGuardedPoolLoadArray(&ofp->free, objbuf, objn);
+    chMBObjectInit(&ofp->mbx, msgbuf, objn);
+}
+
+void* chFifoTakeObjectI(objects_fifo_t* ofp) {
+    return chGuardedPoolAllocTimeoutS(&ofp->free, TIME_IMMEDIATE);
+}
+
+void* chFifoTakeObjectTimeoutS(objects_fifo_t* ofp, sysinterval_t timeout) {
+    return chGuardedPoolAllocTimeoutS(&ofp->free, timeout);
+}
+
+void* chFifoTakeObjectTimeout(objects_fifo_t* ofp, sysinterval_t timeout) {
+    return chGuardedPoolAllocTimeoutS(&ofp->free, timeout);
+}
+
+void chFifoReturnObjectI(objects_fifo_t* ofp, void* objp) {
+    chGuardedPoolFreeI(&ofp->free, objp);
+}
+
+void chFifoReturnObjectS(objects_fifo_t* ofp, void* objp) {
+    chGuardedPoolFreeI(&ofp->free, objp);
+}
+
+void chFifoReturnObject(objects_fifo_t* ofp, void* objp) {
+    chGuardedPoolFreeI(&ofp->free, objp);
+}
+
+void chFifoSendObjectI(objects_fifo_t* ofp, void* objp) {
+    chMBPostI(&ofp->mbx, toMsg(objp));
+}
+
+void chFifoSendObjectS(objects_fifo_t* ofp, void* objp) {
+    chMBPostI(&ofp->mbx, toMsg(objp));
+}
+
+void chFifoSendObject(objects_fifo_t* ofp, void* objp) {
+    chMBPostI(&ofp->mbx, toMsg(objp));
+}
+
+void chFifoSendObjectAheadI(objects_fifo_t* ofp, void* objp) {
+    chMBPostAheadI(&ofp->mbx, toMsg(objp));
+}
+
+void chFifoSendObjectAheadS(objects_fifo_t* ofp, void* objp) {
+    chMBPostAheadI(&ofp->mbx, toMsg(objp));
+}
+
+void chFifoSendObjectAhead(objects_fifo_t* ofp, void* objp) {
+    chMBPostAheadI(&ofp->mbx, toMsg(objp));
+}
+
+msg_t chFifoReceiveObjectI(objects_fifo_t* ofp, void** objpp) {
+    msg_t msg;
+    msg_t res = chMBFetchI(&ofp->mbx, &msg);
+    if (res == MSG_OK)
+        *objpp = fromMsg(msg);
+    return res;
+}
+
+msg_t chFifoReceiveObjectTimeoutS(objects_fifo_t* ofp, void** objpp,
+    sysinterval_t timeout) {
+    msg_t res = chFifoReceiveObjectI(ofp, objpp);
+    if (res != MSG_OK) {
+        host_assert(timeout != TIME_INFINITE, "fifo would block forever");
+        chThdSleep(timeout);
+    }
+    return res;
+}
+
+msg_t chFifoReceiveObjectTimeout(objects_fifo_t* ofp, void** objpp,
+    sysinterval_t timeout) {
+    return chFifoReceiveObjectTimeoutS(ofp, objpp, timeout);
+}
+
+void* chHeapAlloc(memory_heap_t*, size_t size) {
+    return malloc(size);
+}
+
+void chHeapFree(void* p) {
+    free(p);
+}
+
+/*
+ * HAL
+ */
+SerialDriver SD2, SD4;
+ioportid_t GPIOA = nullptr;
+
+void halInit() {}
+
+static void hostWrite(BaseSequentialStream* chp, const char* data,
+    size_t len) {
+    if (chp == nullptr || chp->host_buffer == nullptr) {
+        fwrite(data, 1, len, stdout);
+        return;
+    }
+    size_t n = len;
+    if (n > chp->host_size - chp->host_len)
+        n = chp->host_size - chp->host_len;
+    memcpy(chp->host_buffer + chp->host_len, data, n);
+    chp->host_len += n;
+    if (chp->host_end != nullptr)
+        *chp->host_end = chp->host_len;
+}
+
+int chprintf(BaseSequentialStream* chp, const char* fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len > int(sizeof(buf)) - 1)
+        len = sizeof(buf) - 1;
+    hostWrite(chp, buf, len);
+    return len;
+}
+
+int chsnprintf(char* str, size_t size, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(str, size, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+void msObjectInit(MemoryStream* msp, uint8_t* buffer, size_t size,
+    size_t eos) {
+    msp->buffer = buffer;
+    msp->size = size;
+    msp->eos = eos;
+    msp->offset = 0;
+    msp->host_buffer = reinterpret_cast<char*>(buffer);
+    msp->host_size = size;
+    msp->host_len = eos;
+    msp->host_end = &msp->eos;
+}
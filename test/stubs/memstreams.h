@@ -0,0 +1,17 @@
+#pragma once
+#ifndef __HOST_MEMSTREAMS__
+#define __HOST_MEMSTREAMS__
+
+#include "hal.h"
+
+struct MemoryStream : BaseSequentialStream {
+    uint8_t* buffer;
+    size_t size;
+    size_t eos;
+    size_t offset;
+};
+
+void msObjectInit(MemoryStream* msp, uint8_t* buffer, size_t size,
+    size_t eos);
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Minimal host test support. Each test is a program that returns non-zero
+ * when a check fails, failed checks are printed with their location.
+ */
+#pragma once
+#ifndef __TEST__
+#define __TEST__
+
+#include <cstdio>
+#include <cstdint>
+
+namespace test {
+
+inline int checks = 0;
+inline int failures = 0;
+
+inline bool check(bool cond, const char* expr, const char* file, int line) {
+    checks++;
+    if (!cond) {
+        failures++;
+        printf("%s:%d: check failed: %s\n", file, line, expr);
+    }
+    return cond;
+}
+
+inline bool checkEqual(long long a, long long b, const char* expr,
+    const char* file, int line) {
+    checks++;
+    if (a != b) {
+        failures++;
+        printf("%s:%d: check failed: %s (%lld != %lld)\n", file, line, expr,
+            a, b);
+    }
+    return a == b;
+}
+
+inline int report(const char* name) {
+    printf("%s: %d checks, %d failed\n", name, checks, failures);
+    return failures ? 1 : 0;
+}
+
+}
+
+#define CHECK(cond) test::check(bool(cond), #cond, __FILE__, __LINE__)
+#define CHECK_EQ(a, b) \
+    test::checkEqual((long long)(a), (long long)(b), #a " == " #b, \
+        __FILE__, __LINE__)
+
+#endif
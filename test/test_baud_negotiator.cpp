@@ -0,0 +1,216 @@
+/*
+ * Baud rate negotiation on simulated rings. Every peer has one UART for
+ * input and output, a frame is only received if both ends run at the same
+ * rate. Like UartTxThread, a peer changes rate after the last byte of a
+ * switch frame, then holds output for BUS_BAUD_GUARD_MS, and applies a
+ * reset when it wakes up. Rings must settle at BUS_MAX_BAUD, and return to
+ * BUS_BAUD as a whole when some link fails at the new rate.
+ */
+#include <vector>
+#include "test.hpp"
+#include "baud_negotiator.hpp"
+#include "bus_protocol.hpp"
+
+using namespace owpeer;
+
+static constexpr uint32_t step_us = 10;
+static constexpr uint32_t max_us = 2000000;
+
+struct Event {
+    uint64_t time;
+    uint8_t src;
+    uint32_t baud;
+    uint8_t peer;
+    uint8_t cmd;
+    int16_t data;
+};
+
+struct Peer {
+    BaudNegotiator* negotiator;
+    uint32_t baud;
+    uint64_t tx_free;
+    // Rate change after switch frame has left
+    uint32_t next_baud;
+    uint64_t switch_time;
+};
+
+enum Fault {
+    NO_FAULT,
+    // Link drops everything that is not sent at BUS_BAUD
+    SLOW_LINK,
+    // Link drops the first switch frame
+    LOST_SWITCH,
+};
+
+static std::vector<Event> events;
+static std::vector<Peer> ring;
+static uint64_t now_us = 0;
+static size_t current = 0;
+static size_t fault_link = 0;
+static Fault fault = NO_FAULT;
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+static uint64_t getFrameUs(uint32_t baud) {
+    return (frame_size * 10 * 1000000 + baud - 1) / baud;
+}
+
+/*
+ * Frames leave one after another at the rate the peer has when they start
+ */
+static void send(uint8_t peer, uint8_t cmd, int16_t data) {
+    Peer& p = ring[current];
+    uint64_t start = std::max(now_us + 20 + random(100), p.tx_free);
+    uint32_t baud = p.switch_time && start >= p.switch_time ?
+        p.next_baud : p.baud;
+    uint64_t end = start + getFrameUs(baud);
+    p.tx_free = end;
+    events.push_back({end, uint8_t(current), baud, peer, cmd, data});
+    if (cmd == BUS_COMMAND_BAUD_SWITCH) {
+        uint32_t next = uint32_t(uint16_t(data)) * 100;
+        if (next != baud) {
+            p.next_baud = next;
+            p.switch_time = end;
+            p.tx_free = end + BUS_BAUD_GUARD_MS * 1000;
+        }
+    }
+}
+
+static void advance(uint64_t us) {
+    host_advance_us(us);
+    now_us += us;
+}
+
+static bool isDropped(const Event& event) {
+    if (event.src != fault_link)
+        return false;
+    if (fault == SLOW_LINK)
+        return event.baud != BUS_BAUD;
+    if (fault == LOST_SWITCH && event.cmd == BUS_COMMAND_BAUD_SWITCH) {
+        fault = NO_FAULT;
+        return true;
+    }
+    return false;
+}
+
+static void run(uint64_t duration) {
+    uint64_t end = now_us + duration;
+    while (now_us < end) {
+        advance(step_us);
+        for (size_t i = 0; i < ring.size(); i++) {
+            Peer& peer = ring[i];
+            if (peer.switch_time && now_us >= peer.switch_time) {
+                peer.baud = peer.next_baud;
+                peer.switch_time = 0;
+            }
+            // Tx thread wakes up
+            if (peer.negotiator->takeReset() && !peer.switch_time) {
+                peer.baud = BUS_BAUD;
+            }
+        }
+        for (size_t i = 0; i < events.size();) {
+            if (events[i].time > now_us) {
+                i++;
+                continue;
+            }
+            Event event = events[i];
+            events.erase(events.begin() + i);
+            current = (event.src + 1) % ring.size();
+            if (!isDropped(event) && ring[current].baud == event.baud)
+                ring[current].negotiator->handleCommand(event.peer,
+                    event.cmd, event.data, chVTGetSystemTimeX());
+        }
+        for (size_t i = 0; i < ring.size(); i++) {
+            current = i;
+            ring[i].negotiator->poll(chVTGetSystemTimeX());
+        }
+    }
+}
+
+static void makeRing(size_t num) {
+    for (auto& peer : ring)
+        delete peer.negotiator;
+    ring.clear();
+    events.clear();
+    for (size_t i = 0; i < num; i++)
+        ring.push_back({new BaudNegotiator(send), BUS_BAUD, 0, 0, 0});
+    for (size_t i = 0; i < num; i++) {
+        current = i;
+        ring[i].negotiator->start(i, chVTGetSystemTimeX());
+    }
+}
+
+static void checkRing(uint32_t baud, BaudNegotiator::State state) {
+    CHECK(events.empty());
+    for (auto& peer : ring) {
+        CHECK_EQ(peer.baud, baud);
+        CHECK_EQ(peer.negotiator->getBaud(), baud);
+        CHECK_EQ(peer.negotiator->getState(), state);
+    }
+}
+
+/*
+ * Ring at base rate passes an offer around, so it's usable again
+ */
+static void checkUsable() {
+    current = 0;
+    ring[0].negotiator->start(0, chVTGetSystemTimeX());
+    fault = SLOW_LINK;
+    run(max_us);
+    CHECK_EQ(ring[0].baud, BUS_BAUD);
+    CHECK(ring[0].negotiator->getState() != BaudNegotiator::OFFERED);
+}
+
+int main() {
+    for (size_t num = 1; num <= BUS_MAX_PEERS; num++) {
+        // Healthy ring switches
+        fault = NO_FAULT;
+        makeRing(num);
+        run(max_us);
+        checkRing(BUS_MAX_BAUD, BaudNegotiator::DONE);
+
+        // Reset returns to initial rate
+        for (size_t i = 0; i < num; i++)
+            ring[i].negotiator->reset();
+        run(max_us);
+        checkRing(BUS_BAUD, BaudNegotiator::IDLE);
+
+        // Every link in turn fails at the new rate, or loses the switch
+        for (size_t link = 0; link < num; link++) {
+            fault_link = link;
+            fault = SLOW_LINK;
+            makeRing(num);
+            run(max_us);
+            for (auto& peer : ring) {
+                CHECK_EQ(peer.baud, BUS_BAUD);
+                CHECK_EQ(peer.negotiator->getBaud(), BUS_BAUD);
+                CHECK(peer.negotiator->getState() != BaudNegotiator::DONE);
+            }
+            checkUsable();
+
+            // Switch that returns to peer 0 isn't needed
+            fault = LOST_SWITCH;
+            makeRing(num);
+            run(max_us);
+            if (link == num - 1) {
+                checkRing(BUS_MAX_BAUD, BaudNegotiator::DONE);
+                continue;
+            }
+            for (auto& peer : ring) {
+                CHECK_EQ(peer.baud, BUS_BAUD);
+                CHECK(peer.negotiator->getState() != BaudNegotiator::DONE);
+            }
+        }
+        fault_link = 0;
+    }
+
+    for (auto& peer : ring)
+        delete peer.negotiator;
+    return test::report("baud_negotiator");
+}
@@ -0,0 +1,135 @@
+/*
+ * Block queue with a simulated block clock of 64 samples at 48 kHz. Each
+ * block a random number of events is pushed at random bus times within the
+ * block, half of them timed 4 ms ahead. Every event must come out at a block
+ * start, never before its block. Timed events land in the block that contains
+ * their time, unless a full batch deferred them or the time is within the
+ * 1 us stamp resolution of a boundary. Untimed ones land in the next block
+ * unless it was full. Without a consumer, queue takes events only up to the
+ * horizon.
+ */
+#include <cmath>
+#include <vector>
+#include "test.hpp"
+#include "block_queue.hpp"
+
+using namespace owpeer;
+
+static constexpr uint32_t rate = 48000;
+static constexpr uint32_t block_size = 64;
+static constexpr size_t blocks = 200000;
+static constexpr uint32_t ahead_us = 4000;
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+static void testNoConsumer() {
+    BlockQueue queue;
+    queue.configure(rate, block_size);
+    size_t accepted = 0;
+    for (size_t i = 0; i < 300; i++)
+        accepted += queue.push({OWL_COMMAND_PARAMETER, 0, int16_t(i)});
+    CHECK_EQ(accepted,
+        (BlockQueue::num_batches - 1) * BlockQueue::batch_size);
+    // Consumer frees one batch per block
+    size_t num;
+    queue.startBlock(0, num);
+    CHECK_EQ(num, BlockQueue::batch_size);
+    queue.startBlock(0, num);
+    CHECK(queue.push({OWL_COMMAND_PARAMETER, 0, 0}));
+}
+
+/*
+ * Pushed event, value of BlockEvent is its index modulo table size
+ */
+struct Pushed {
+    double time;
+    uint32_t block;
+    bool timed;
+};
+
+static void testBlockClock() {
+    BlockQueue queue;
+    queue.configure(rate, block_size);
+    const double period = 1e6 * block_size / rate;
+    std::vector<Pushed> pushed(0x8000);
+    uint32_t seq = 0, delivered = 0;
+    size_t exact = 0, boundary = 0, deferred = 0, early = 0, wrong = 0;
+    size_t timed = 0, untimed = 0, untimed_deferred = 0;
+    for (uint32_t block = 1; block <= blocks; block++) {
+        double start = block * period;
+        size_t num;
+        const BlockEvent* events =
+            queue.startBlock(uint16_t(std::lround(start)), num);
+        CHECK_EQ(queue.getBlock(), block);
+        for (size_t i = 0; i < num; i++) {
+            const Pushed& p = pushed[uint16_t(events[i].value)];
+            delivered++;
+            if (block <= p.block) {
+                early++;
+                continue;
+            }
+            if (!p.timed) {
+                untimed_deferred += block != p.block + 1;
+                continue;
+            }
+            double offset = p.time - start;
+            if (offset >= 0 && offset < period)
+                exact++;
+            else if (offset < 0 && offset > -period &&
+                (offset > -1 || offset + period < 1))
+                boundary++;
+            else if (offset < 0)
+                deferred++;
+            else
+                wrong++;
+        }
+        // Events arrive during the block
+        size_t arrivals = random(12);
+        for (size_t i = 0; i < arrivals; i++) {
+            double now = start + random(uint32_t(period));
+            Pushed& p = pushed[seq & 0x7fff];
+            p.block = block;
+            p.timed = random(2);
+            BlockEvent event = {OWL_COMMAND_PARAMETER, 0,
+                int16_t(seq & 0x7fff)};
+            if (p.timed) {
+                p.time = now + ahead_us;
+                CHECK(queue.push(event,
+                    uint16_t(std::lround(now) + ahead_us)));
+                timed++;
+            }
+            else {
+                CHECK(queue.push(event));
+                untimed++;
+            }
+            seq++;
+        }
+    }
+    CHECK_EQ(early, 0);
+    CHECK_EQ(wrong, 0);
+    // Only the events of the last few blocks are still queued
+    CHECK(seq - delivered < BlockQueue::num_batches * BlockQueue::batch_size);
+    // Full batches are rare
+    CHECK(deferred * 1000 < timed);
+    CHECK(untimed_deferred * 1000 < untimed);
+    printf("%u blocks, %u events (%u timed, %u untimed), %u still queued\n",
+        unsigned(blocks), unsigned(seq), unsigned(timed), unsigned(untimed),
+        unsigned(seq - delivered));
+    printf("timed in their block %u, at 1 us of boundary %u, deferred %u, "
+        "untimed deferred %u\n", unsigned(exact), unsigned(boundary),
+        unsigned(deferred), unsigned(untimed_deferred));
+    queue.print(chp);
+}
+
+int main() {
+    testNoConsumer();
+    testBlockClock();
+    return test::report("block_queue");
+}
@@ -0,0 +1,188 @@
+/*
+ * Bus clock on a simulated ring. Every node runs its own BusClock with a
+ * crystal that is off by up to 50 ppm. Frames wait 0.05-1 ms in each node
+ * before they are sent, behind up to 32 bytes that transport still holds,
+ * and Rx thread wakes up 2-17 us after the bytes it reads. Sync is sent every
+ * BUS_CLOCK_SYNC_MS. After the first second, every node must stay synced and
+ * within 100 us of master time. Prints mean and max error for each ring size and
+ * rate, and the link delay that master has learned against the frame time.
+ * The last row stamps sync frames without the queued output, as before.
+ */
+#include <cmath>
+#include <map>
+#include <vector>
+#include "test.hpp"
+#include "bus_clock.hpp"
+
+using namespace owpeer;
+
+static constexpr double run_us = 10e6;
+static constexpr double warmup_us = 1e6;
+static constexpr double tick_us = 1000;
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+struct Event {
+    enum Type {
+        TICK,
+        TX,
+        RX,
+        HANDLE,
+    };
+    Type type;
+    size_t node;
+    uint8_t frame[frame_size];
+    // Bytes that Rx thread read after the frame
+    size_t after;
+};
+
+struct Node {
+    BusClock* clock;
+    double ppm;
+    uint32_t offset;
+};
+
+static std::vector<Node> nodes;
+static std::multimap<double, Event> events;
+static size_t current;
+static double current_us;
+
+/*
+ * Realtime counter of a node at true time
+ */
+static rtcnt_t getCycles(size_t node, double us) {
+    double cycles = us * (STM32_HCLK / 1e6) * (1 + nodes[node].ppm * 1e-6);
+    return nodes[node].offset + rtcnt_t(uint64_t(cycles));
+}
+
+static void enter(size_t node, double us) {
+    current = node;
+    current_us = us;
+    host_cycles = getCycles(node, us);
+    host_system_time = systime_t(us / (1000000 / CH_CFG_ST_FREQUENCY));
+}
+
+/*
+ * Frames sent by a node wait in output FIFO and encoder before UART Tx
+ */
+static void onSend(uint8_t peer, uint8_t cmd, int16_t data) {
+    Event event = {Event::TX, current, {uint8_t(OWL_COMMAND_COMMAND | peer),
+        cmd, uint8_t(data >> 8), uint8_t(data)}, 0};
+    events.emplace(current_us + 50 + random(950), event);
+}
+
+struct Result {
+    double mean;
+    int32_t max;
+    double link_delay;
+    bool synced;
+};
+
+static Result runRing(size_t num, uint32_t baud, bool stamp_queued) {
+    std::vector<BusClock> clocks(num, BusClock(onSend));
+    nodes.clear();
+    events.clear();
+    for (size_t i = 0; i < num; i++)
+        nodes.push_back({&clocks[i], double(random(1001)) / 10 - 50,
+            random(0xffffffff)});
+    double byte_us = 10e6 / baud;
+    rtcnt_t byte_cycles = BusClock::getByteCycles(baud);
+    for (size_t i = 0; i < num; i++) {
+        enter(i, 0);
+        clocks[i].start(i, num, chVTGetSystemTimeX());
+    }
+    for (double us = 0; us < run_us; us += tick_us)
+        events.emplace(us, Event{Event::TICK, 0, {}, 0});
+
+    double error_sum = 0;
+    size_t samples = 0;
+    int32_t error_max = 0;
+    bool synced = true;
+    while (!events.empty()) {
+        double us = events.begin()->first;
+        Event event = events.begin()->second;
+        events.erase(events.begin());
+        switch (event.type) {
+        case Event::TICK:
+            for (size_t i = 0; i < num; i++) {
+                enter(i, us);
+                clocks[i].poll(chVTGetSystemTimeX());
+            }
+            if (us < warmup_us)
+                break;
+            for (size_t i = 1; i < num; i++) {
+                synced = synced && clocks[i].isSynced();
+                int32_t error = BusClock::until(
+                    clocks[i].getTime(getCycles(i, us)),
+                    clocks[0].getTime(getCycles(0, us)));
+                error_sum += std::abs(error);
+                error_max = std::max(error_max, std::abs(error));
+                samples++;
+            }
+            break;
+        case Event::TX: {
+            // Transmission starts after output that transport holds
+            enter(event.node, us);
+            size_t queued = random(33);
+            double start = us + queued * byte_us;
+            if (BusClock::isSyncFrame(event.frame))
+                clocks[event.node].stamp(event.frame, host_cycles +
+                    (stamp_queued ? queued * byte_cycles : 0));
+            // Rx thread wakes up late and reads bytes that followed
+            Event rx = event;
+            rx.type = Event::RX;
+            rx.node = (event.node + 1) % num;
+            rx.after = random(9);
+            events.emplace(start + (frame_size + rx.after) * byte_us + 2 +
+                random(16), rx);
+            break;
+        }
+        case Event::RX:
+            enter(event.node, us);
+            if (BusClock::isSyncFrame(event.frame))
+                clocks[event.node].receiveSync(event.frame[0] & 0x0f,
+                    (event.frame[2] << 8) | event.frame[3],
+                    host_cycles - event.after * byte_cycles, baud);
+            event.type = Event::HANDLE;
+            events.emplace(us + 20 + random(200), event);
+            break;
+        case Event::HANDLE:
+            enter(event.node, us);
+            clocks[event.node].handleCommand(event.frame[0] & 0x0f,
+                event.frame[1], (event.frame[2] << 8) | event.frame[3]);
+            break;
+        }
+    }
+    // Link delay as master last sent it, in 1/16 us
+    double link_delay = 0;
+    for (size_t i = 1; i < num; i++)
+        link_delay += clocks[i].getLinkDelay();
+    return {error_sum / samples, error_max, link_delay / (num - 1) / 16,
+        synced};
+}
+
+int main() {
+    static const uint32_t bauds[] = {115200, 1500000};
+    printf("nodes  baud     mean |error|  max error  link delay  frame\n");
+    for (uint32_t baud : bauds) {
+        for (size_t num : {2, 4, 8, 16}) {
+            Result result = runRing(num, baud, true);
+            printf("%5u  %-7u  %6.1f us     %4d us    %6.1f us   %6.1f us\n",
+                unsigned(num), unsigned(baud), result.mean, result.max,
+                result.link_delay, frame_size * 10e6 / baud);
+            CHECK(result.synced);
+            CHECK(result.max < 100);
+        }
+    }
+    Result result = runRing(8, 115200, false);
+    printf("%5u  %-7u  %6.1f us     %4d us    %6.1f us   unstamped queue\n",
+        8u, 115200u, result.mean, result.max, result.link_delay);
+    return test::report("bus_clock");
+}
@@ -0,0 +1,147 @@
+/*
+ * BusData encoding and decoding through frames, and stream sinks set for
+ * each peer
+ */
+#include <array>
+#include <vector>
+#include "test.hpp"
+#include "bus_protocol.hpp"
+
+using namespace owpeer;
+
+using Frames = std::vector<std::array<uint8_t, frame_size>>;
+
+static Frames encode(BusData& data) {
+    Frames frames;
+    BusFrame frame;
+    data.encodeFrame(frame);
+    frames.push_back({frame.frame_buffer[0], frame.frame_buffer[1],
+        frame.frame_buffer[2], frame.frame_buffer[3]});
+    while (data.isEncoded()) {
+        data >> frame;
+        frames.push_back({frame.frame_buffer[0], frame.frame_buffer[1],
+            frame.frame_buffer[2], frame.frame_buffer[3]});
+    }
+    return frames;
+}
+
+/*
+ * Feeds frames to decoder, returns decoded object or empty pointer if it
+ * wasn't complete exactly at last frame
+ */
+static BusObjectPtr decode(const Frames& frames) {
+    BusObjectPtr obj;
+    for (size_t i = 0; i < frames.size(); i++) {
+        BusFrame frame;
+        memcpy(frame.frame_buffer, frames[i].data(), frame_size);
+        if (!obj)
+            obj = BusData::decodeFrame(frame);
+        else
+            std::get<BusData>(*obj) << frame;
+        bool decoded = std::get<BusData>(*obj).isDecoded();
+        if (decoded != (i == frames.size() - 1))
+            return BusObjectPtr();
+    }
+    return obj;
+}
+
+static std::vector<uint8_t> makePayload(size_t len) {
+    std::vector<uint8_t> payload(len);
+    for (size_t i = 0; i < len; i++)
+        payload[i] = i * 7 + (i >> 8);
+    return payload;
+}
+
+static void testRoundTrip() {
+    // Lengths around multiples of 3 and slab class sizes
+    static const size_t lengths[] = {1, 2, 3, 4, 5, 6, 63, 64, 65, 255, 256,
+        1023, 1024, 4095, 4096};
+    for (size_t len : lengths) {
+        auto payload = makePayload(len);
+        BusData tx(2, payload.data(), len);
+        auto frames = encode(tx);
+        CHECK_EQ(frames.size(), 1 + len / 3 + 1);
+        auto obj = decode(frames);
+        if (!CHECK(obj))
+            continue;
+        auto& rx = std::get<BusData>(*obj);
+        CHECK(!rx.isFailed());
+        CHECK_EQ(rx.getLength(), len);
+        CHECK_EQ(rx.getPeer(), 2);
+        CHECK(rx.isAllocated() &&
+            memcmp(rx.getData(), payload.data(), len) == 0);
+    }
+}
+
+/*
+ * Payload larger than largest slab class is consumed to its end and
+ * reported as failed, next transfer is decoded normally
+ */
+static void testTooLarge() {
+    auto payload = makePayload(5000);
+    BusData tx(1, payload.data(), payload.size());
+    auto frames = encode(tx);
+    auto obj = decode(frames);
+    if (CHECK(obj)) {
+        CHECK(std::get<BusData>(*obj).isFailed());
+        CHECK(!std::get<BusData>(*obj).isAllocated());
+    }
+    obj.reset();
+    BusData next(1, payload.data(), 100);
+    obj = decode(encode(next));
+    if (CHECK(obj)) {
+        CHECK(!std::get<BusData>(*obj).isFailed());
+        CHECK(memcmp(std::get<BusData>(*obj).getData(), payload.data(),
+            100) == 0);
+    }
+}
+
+class CountingSink : public BusDataSink {
+public:
+    bool open(uint32_t) override {
+        opened++;
+        return true;
+    }
+    void write(const uint8_t*, size_t len) override {
+        bytes += len;
+    }
+    void close() override {
+    }
+    void abort() override {
+    }
+    size_t opened = 0;
+    size_t bytes = 0;
+};
+
+/*
+ * Sink set for one peer is left for that peer's transfer
+ */
+static void testStreamSinks() {
+    auto payload = makePayload(100);
+    CountingSink config, firmware;
+    BusData::setStreamSink(2, &firmware);
+    BusData::setStreamSink(5, &config);
+    BusData from_5(5, payload.data(), payload.size());
+    auto obj = decode(encode(from_5));
+    CHECK_EQ(config.bytes, 100);
+    CHECK_EQ(firmware.opened, 0);
+    CHECK(obj && !std::get<BusData>(*obj).isAllocated());
+    obj.reset();
+    BusData from_2(2, payload.data(), payload.size());
+    obj = decode(encode(from_2));
+    CHECK_EQ(firmware.bytes, 100);
+    obj.reset();
+    // Each sink is used once
+    BusData again(2, payload.data(), payload.size());
+    obj = decode(encode(again));
+    CHECK(obj && std::get<BusData>(*obj).isAllocated());
+    CHECK_EQ(firmware.opened, 1);
+    CHECK_EQ(config.opened, 1);
+}
+
+int main() {
+    testRoundTrip();
+    testTooLarge();
+    testStreamSinks();
+    return test::report("bus_data");
+}
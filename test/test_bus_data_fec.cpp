@@ -0,0 +1,225 @@
+/*
+ * BusData with FEC. Transfers of 3 kB are sent as a byte stream that loses
+ * bytes at random, realigned by FrameSync and decoded like in
+ * FrameDecoderThread. Every transfer that is decoded must match its payload,
+ * frames damaged before a gap are caught by the CRC frame. Prints goodput as
+ * a fraction of link capacity for each block size, with completed transfers
+ * in brackets.
+ */
+#include <array>
+#include <vector>
+#include "test.hpp"
+#include "frame_sync.hpp"
+#include "bus_protocol.hpp"
+
+using namespace owpeer;
+
+using Frame = std::array<uint8_t, frame_size>;
+using Frames = std::vector<Frame>;
+
+static constexpr size_t transfer_len = 3000;
+static constexpr size_t trials = 200;
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+static Frames encode(BusData& data) {
+    Frames frames;
+    BusFrame frame;
+    data.encodeFrame(frame);
+    frames.push_back({frame.frame_buffer[0], frame.frame_buffer[1],
+        frame.frame_buffer[2], frame.frame_buffer[3]});
+    while (data.isEncoded()) {
+        data >> frame;
+        frames.push_back({frame.frame_buffer[0], frame.frame_buffer[1],
+            frame.frame_buffer[2], frame.frame_buffer[3]});
+    }
+    return frames;
+}
+
+static std::vector<uint8_t> makePayload(size_t len) {
+    std::vector<uint8_t> payload(len);
+    for (auto& byte : payload)
+        byte = random(256);
+    return payload;
+}
+
+enum Result {
+    DECODED,
+    FAILED,
+    CORRUPT,
+};
+
+static Result check(BusObjectPtr& rx_data,
+    const std::vector<uint8_t>& payload) {
+    auto& data = std::get<BusData>(*rx_data);
+    if (data.isFailed())
+        return FAILED;
+    // Header taken from payload after it was lost
+    if (data.getLength() != payload.size())
+        return FAILED;
+    if (memcmp(data.getData(), payload.data(), payload.size()))
+        return CORRUPT;
+    return DECODED;
+}
+
+/*
+ * Data path of FrameDecoderThread on one transfer
+ */
+static Result receive(const std::vector<uint8_t>& bytes,
+    const std::vector<uint8_t>& payload) {
+    FrameSync sync;
+    BusObjectPtr rx_data;
+    for (size_t pos = 0; pos < bytes.size();) {
+        size_t len = std::min<size_t>(1 + random(64), bytes.size() - pos);
+        pos += sync.write(bytes.data() + pos, len);
+        BusFrame frame;
+        while (sync.read(frame.frame_buffer)) {
+            auto proto = frame.getOwlProtocolType();
+            if (proto == OWL_FRAME_GAP && rx_data) {
+                // Lost frames and misaligned payload before them
+                std::get<BusData>(*rx_data).erase(std::min(
+                    frame.frame_buffer[1] + frame.frame_buffer[2], 0xff));
+            }
+            else if (proto == OWL_COMMAND_DATA) {
+                if (!rx_data)
+                    rx_data = BusData::decodeFrame(frame);
+                else
+                    std::get<BusData>(*rx_data) << frame;
+            }
+            if (rx_data && std::get<BusData>(*rx_data).isDecoded())
+                return check(rx_data, payload);
+        }
+    }
+    return FAILED;
+}
+
+/*
+ * Each frame loses a byte with given probability, returns goodput and
+ * counts completed transfers
+ */
+static double runLoss(uint8_t shift, double loss, size_t& completed) {
+    size_t payload_frames = 0, sent_frames = 0;
+    completed = 0;
+    for (size_t trial = 0; trial < trials; trial++) {
+        auto payload = makePayload(transfer_len);
+        BusData tx(3, payload.data(), payload.size());
+        tx.setFec(shift);
+        Frames frames = encode(tx);
+        // Bus keeps running after the transfer
+        for (size_t i = 0; i < 2 * (BUS_SYNC_CONFIRM_FRAMES + 1); i++)
+            frames.push_back({USB_COMMAND_SINGLE_BYTE, MIDI_TIMING_CLOCK, 0,
+                0});
+        std::vector<uint8_t> bytes;
+        for (auto& frame : frames) {
+            size_t lost = random(1000000) < loss * 1000000 ?
+                random(frame_size) : frame_size;
+            for (size_t i = 0; i < frame_size; i++) {
+                if (i != lost)
+                    bytes.push_back(frame[i]);
+            }
+        }
+        sent_frames += frames.size();
+        Result result = receive(bytes, payload);
+        CHECK(result != CORRUPT);
+        if (result == DECODED) {
+            completed++;
+            payload_frames += transfer_len / 3;
+        }
+    }
+    return double(payload_frames) / sent_frames;
+}
+
+/*
+ * Frames with every length remainder and block size arrive intact
+ */
+static void testRoundTrip() {
+    static const size_t lengths[] = {1, 2, 3, 4, 5, 6, 95, 96, 97, 1023,
+        1024, 4095, 4096};
+    for (uint8_t shift = 1; shift <= BUS_DATA_FEC_MAX_SHIFT; shift++) {
+        for (size_t len : lengths) {
+            auto payload = makePayload(len);
+            BusData tx(1, payload.data(), len);
+            tx.setFec(shift);
+            Frames frames = encode(tx);
+            // Payload, 2 parity frames per block and CRC
+            size_t num = len / 3 + 1;
+            CHECK_EQ(frames.size(),
+                1 + num + 2 * ((num + (1 << shift) - 1) >> shift) + 1);
+            std::vector<uint8_t> bytes;
+            for (auto& frame : frames)
+                bytes.insert(bytes.end(), frame.begin(), frame.end());
+            CHECK_EQ(receive(bytes, payload), DECODED);
+        }
+    }
+}
+
+/*
+ * Two damaged frames before a gap can't be rebuilt, but they are caught
+ */
+static void testDamagedFrames() {
+    auto payload = makePayload(transfer_len);
+    BusData tx(3, payload.data(), payload.size());
+    tx.setFec(4);
+    Frames frames = encode(tx);
+    BusFrame frame;
+    memcpy(frame.frame_buffer, frames[0].data(), frame_size);
+    BusObjectPtr rx_data = BusData::decodeFrame(frame);
+    auto& rx = std::get<BusData>(*rx_data);
+    for (size_t i = 1; i < frames.size(); i++) {
+        memcpy(frame.frame_buffer, frames[i].data(), frame_size);
+        if (i == 41 || i == 42)
+            frame.frame_buffer[2] ^= 0x5a;
+        if (i == 43) {
+            rx.erase(1);
+            continue;
+        }
+        rx << frame;
+    }
+    CHECK(rx.isDecoded());
+    CHECK(rx.isFailed());
+}
+
+/*
+ * Header with a block size that doesn't fit erasure mask is dropped
+ */
+static void testHeaderShift() {
+    BusFrame frame;
+    frame.fill(OWL_COMMAND_DATA | 2, 0xf0, 0x00, 0x10);
+    CHECK(!BusData::decodeFrame(frame));
+    frame.fill(OWL_COMMAND_DATA | 2, 0xd0, 0x00, 0x10);
+    CHECK(BusData::decodeFrame(frame));
+}
+
+int main() {
+    testRoundTrip();
+    testDamagedFrames();
+    testHeaderShift();
+
+    static const double losses[] = {0.0001, 0.001, 0.01};
+    static const uint8_t shifts[] = {0, 2, 4, 6};
+    printf("loss/frame");
+    for (uint8_t shift : shifts) {
+        if (shift)
+            printf("  K=%-11u", 1u << shift);
+        else
+            printf("  no FEC       ");
+    }
+    printf("\n");
+    for (double loss : losses) {
+        printf("%8.2f%%", loss * 100);
+        for (uint8_t shift : shifts) {
+            size_t completed;
+            double goodput = runLoss(shift, loss, completed);
+            printf("  %.2f (%3u%%)  ", goodput,
+                unsigned(completed * 100 / trials));
+        }
+        printf("\n");
+    }
+    return test::report("bus_data_fec");
+}
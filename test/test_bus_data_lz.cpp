@@ -0,0 +1,164 @@
+/*
+ * Compressed BusData. Sources of this tree are compressed like in
+ * firmware_upload.py and sent through frames to the stream sink and to a
+ * buffer, with and without FEC. Corrupted streams must not write past
+ * decompressed size, and short ones abort the sink. Prints compression
+ * ratio for each file.
+ */
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include "test.hpp"
+#include "lz_encoder.hpp"
+#include "bus_protocol.hpp"
+
+using namespace owpeer;
+
+static const char* const corpus[] = {
+    "../source/bus_protocol.cpp",
+    "../source/frame_sync.cpp",
+    "../source/settings_store.cpp",
+    "../include/bus_protocol.hpp",
+    "../include/message_handler.hpp",
+};
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+static std::vector<uint8_t> readFile(const char* path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+class TestSink : public BusDataSink {
+public:
+    bool open(uint32_t len) override {
+        size = len;
+        state = OPEN;
+        data.clear();
+        return true;
+    }
+    void write(const uint8_t* bytes, size_t len) override {
+        data.insert(data.end(), bytes, bytes + len);
+    }
+    void close() override {
+        state = CLOSED;
+    }
+    void abort() override {
+        state = ABORTED;
+    }
+
+    enum State {
+        IDLE,
+        OPEN,
+        CLOSED,
+        ABORTED,
+    };
+    State state = IDLE;
+    uint32_t size = 0;
+    std::vector<uint8_t> data;
+};
+
+/*
+ * Frames of compressed payload go straight to decoder
+ */
+static BusObjectPtr send(const std::vector<uint8_t>& packed, uint8_t shift) {
+    BusData tx(3, packed.data(), packed.size());
+    tx.setFec(shift);
+    BusFrame frame;
+    tx.encodeFrame(frame);
+    frame.frame_buffer[1] |= BUS_DATA_LZ_FLAG >> 16;
+    BusObjectPtr obj = BusData::decodeFrame(frame);
+    auto& rx = std::get<BusData>(*obj);
+    while (tx.isEncoded()) {
+        tx >> frame;
+        rx << frame;
+    }
+    CHECK(rx.isDecoded());
+    return obj;
+}
+
+static void testSink(const std::vector<uint8_t>& src,
+    const std::vector<uint8_t>& packed) {
+    for (uint8_t shift : {0, 4}) {
+        TestSink sink;
+        BusData::setStreamSink(3, &sink);
+        auto obj = send(packed, shift);
+        CHECK(!std::get<BusData>(*obj).isFailed());
+        CHECK_EQ(sink.state, TestSink::CLOSED);
+        CHECK_EQ(sink.size, src.size());
+        CHECK(sink.data == src);
+    }
+}
+
+static void testBuffer(const std::vector<uint8_t>& src) {
+    test::LzEncoder encoder(BUS_DATA_LZ_WINDOW_BITS, 4);
+    // Output buffer must fit a slab class
+    std::vector<uint8_t> part(src.begin(),
+        src.begin() + std::min<size_t>(src.size(), 4000));
+    auto packed = encoder.encode(part);
+    auto obj = send(packed, 0);
+    auto& rx = std::get<BusData>(*obj);
+    CHECK(!rx.isFailed());
+    CHECK(rx.getData() != nullptr &&
+        !memcmp(rx.getData(), part.data(), part.size()));
+}
+
+/*
+ * Flipped bits make any output, but never more than decompressed size
+ */
+static void testCorrupt(const std::vector<uint8_t>& src,
+    const std::vector<uint8_t>& packed) {
+    for (size_t trial = 0; trial < 100; trial++) {
+        auto bad = packed;
+        for (size_t i = 0; i < 4; i++) {
+            // Stream parameters and size stay valid
+            size_t pos = 4 + random(bad.size() - 4);
+            bad[pos] ^= 1 << random(8);
+        }
+        TestSink sink;
+        BusData::setStreamSink(3, &sink);
+        auto obj = send(bad, 0);
+        CHECK(sink.data.size() <= src.size());
+        CHECK(sink.state == TestSink::CLOSED ||
+            sink.state == TestSink::ABORTED);
+        CHECK_EQ(std::get<BusData>(*obj).isFailed(),
+            sink.state == TestSink::ABORTED);
+    }
+    // Stream ends before decompressed size is reached
+    auto short_stream = packed;
+    short_stream.resize(packed.size() / 2);
+    TestSink sink;
+    BusData::setStreamSink(3, &sink);
+    auto obj = send(short_stream, 0);
+    CHECK(std::get<BusData>(*obj).isFailed());
+    CHECK_EQ(sink.state, TestSink::ABORTED);
+}
+
+int main() {
+    test::LzEncoder encoder(BUS_DATA_LZ_WINDOW_BITS, 4);
+    size_t total = 0, total_packed = 0;
+    for (const char* path : corpus) {
+        auto src = readFile(path);
+        if (!CHECK(!src.empty()))
+            continue;
+        auto packed = encoder.encode(src);
+        printf("%-32s %6u -> %6u bytes (%2u%%)\n", path, unsigned(src.size()),
+            unsigned(packed.size()),
+            unsigned(packed.size() * 100 / src.size()));
+        total += src.size();
+        total_packed += packed.size();
+        testSink(src, packed);
+        testBuffer(src);
+        testCorrupt(src, packed);
+    }
+    printf("total %u -> %u bytes (%u%%)\n", unsigned(total),
+        unsigned(total_packed), unsigned(total_packed * 100 / total));
+    return test::report("bus_data_lz");
+}
@@ -0,0 +1,314 @@
+/*
+ * Discovery on simulated rings of 1 to 16 peers at 115200 baud. Every peer
+ * has its own output that sends one frame at a time, with random processing
+ * delay before each frame. Rings must settle with unique ids in ring order,
+ * including rings where peers start with the same token: two peers that are
+ * each other's twin, every peer a twin, and all peers alike. Peers that
+ * resume from cache must connect without discovery, unless a neighbour's
+ * RESUME conflicts or the cached value is invalid.
+ */
+#include <vector>
+#include "test.hpp"
+#include "bus_discovery.hpp"
+
+using namespace owpeer;
+
+static constexpr uint32_t frame_us = frame_size * 10 * 1000000 / 115200;
+static constexpr uint32_t step_us = 10;
+static constexpr uint32_t max_us = 5000000;
+
+struct Event {
+    uint64_t time;
+    uint8_t dst;
+    uint8_t seq;
+    uint32_t value;
+    bool resume;
+};
+
+struct Peer {
+    BusDiscovery* discovery;
+    uint32_t uid[3];
+    uint64_t tx_free;
+};
+
+static std::vector<Event> events;
+static std::vector<Peer> ring;
+static uint64_t now_us = 0;
+static size_t current = 0;
+static uint32_t rng = 1;
+static Event last_event;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+/*
+ * Frames leave the output one after another and arrive at the next peer
+ */
+static void send(uint8_t seq, uint32_t value) {
+    Peer& peer = ring[current];
+    uint64_t start = std::max(now_us + 20 + random(100), peer.tx_free);
+    peer.tx_free = start + frame_us;
+    events.push_back({peer.tx_free, uint8_t((current + 1) % ring.size()),
+        seq, value, false});
+}
+
+static void sendResume(uint8_t uid, uint32_t fingerprint) {
+    send(uid, fingerprint);
+    events.back().resume = true;
+}
+
+static void select(size_t index) {
+    current = index;
+    for (size_t i = 0; i < 3; i++)
+        host_device_uid[i] = ring[index].uid[i];
+}
+
+static void advance(uint64_t us) {
+    host_advance_us(us);
+    now_us += us;
+}
+
+static bool isSettled() {
+    if (!events.empty())
+        return false;
+    for (auto& peer : ring) {
+        if (peer.discovery->getStatus() != BUS_STATUS_CONNECTED)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Run until every peer is connected and no frames are in flight, returns
+ * time it took
+ */
+static uint64_t run() {
+    uint64_t start = now_us;
+    uint32_t poll_us = 0;
+    while (!isSettled() && now_us - start < max_us) {
+        advance(step_us);
+        for (size_t i = 0; i < events.size();) {
+            if (events[i].time <= now_us) {
+                Event event = events[i];
+                last_event = event;
+                events.erase(events.begin() + i);
+                select(event.dst);
+                if (event.resume)
+                    ring[event.dst].discovery->handleResume(
+                        event.seq, event.value, chVTGetSystemTimeX());
+                else
+                    ring[event.dst].discovery->handleDiscover(
+                        event.seq, event.value, chVTGetSystemTimeX());
+            }
+            else {
+                i++;
+            }
+        }
+        // Peers poll every 100 us, each at its own phase
+        poll_us = (poll_us + step_us) % 100;
+        for (size_t i = poll_us / step_us; i < ring.size(); i += 10) {
+            select(i);
+            ring[i].discovery->poll(chVTGetSystemTimeX());
+        }
+    }
+    return now_us - start;
+}
+
+static void makeRing(size_t num, const uint32_t* uids) {
+    for (auto& peer : ring)
+        delete peer.discovery;
+    ring.clear();
+    events.clear();
+    for (size_t i = 0; i < num; i++) {
+        ring.push_back({new BusDiscovery(send, sendResume),
+            {uids[i], 0x3436510c, 0x31373832}, 0});
+    }
+}
+
+/*
+ * Peers start at the same instant, so that peers with the same device ID
+ * pick the same first token
+ */
+static void startAll() {
+    for (size_t i = 0; i < ring.size(); i++) {
+        select(i);
+        ring[i].discovery->start(chVTGetSystemTimeX());
+    }
+}
+
+static bool checkRing() {
+    size_t num = ring.size();
+    size_t first = num;
+    for (size_t i = 0; i < num; i++) {
+        if (ring[i].discovery->getUid() == 0)
+            first = i;
+    }
+    if (!CHECK(first < num))
+        return false;
+    bool ok = true;
+    for (size_t i = 0; i < num; i++) {
+        auto& discovery = *ring[i].discovery;
+        ok &= CHECK_EQ(discovery.getStatus(), BUS_STATUS_CONNECTED);
+        ok &= CHECK_EQ(discovery.getUid(), (i + num - first) % num);
+        ok &= CHECK_EQ(discovery.getPeers(), num);
+        ok &= CHECK_EQ(discovery.getFingerprint(),
+            ring[first].discovery->getFingerprint());
+    }
+    return ok;
+}
+
+static constexpr size_t trials = 20;
+
+/*
+ * Returns mean and max connect time in us
+ */
+static void runTrials(size_t num, bool alike, uint64_t& mean,
+    uint64_t& max) {
+    uint32_t uids[BUS_MAX_PEERS];
+    uint64_t total = 0;
+    max = 0;
+    for (size_t trial = 0; trial < trials; trial++) {
+        for (size_t i = 0; i < num; i++)
+            uids[i] = alike ? 0x1234 : 0x1000 + i * 0x77 + trial * 0x3301;
+        makeRing(num, uids);
+        startAll();
+        uint64_t time = run();
+        if (!checkRing())
+            printf("%u peers%s, trial %u failed\n", unsigned(num),
+                alike ? " alike" : "", unsigned(trial));
+        total += time;
+        max = std::max(max, time);
+    }
+    mean = total / trials;
+}
+
+struct Cache {
+    uint8_t uid;
+    uint8_t peers;
+    uint32_t fingerprint;
+};
+
+/*
+ * Every peer reboots and resumes from its cache, returns time until all are
+ * connected and quiet
+ */
+static uint64_t resumeAll(std::vector<Cache>& cache) {
+    for (size_t i = 0; i < ring.size(); i++) {
+        delete ring[i].discovery;
+        ring[i].discovery = new BusDiscovery(send, sendResume);
+    }
+    for (size_t i = 0; i < ring.size(); i++) {
+        select(i);
+        ring[i].discovery->resume(chVTGetSystemTimeX(), cache[i].uid,
+            cache[i].peers, cache[i].fingerprint);
+    }
+    return run();
+}
+
+static void testResume() {
+    static const uint32_t uids[] = {1, 2, 3, 4, 5, 6, 7, 8};
+    makeRing(8, uids);
+    startAll();
+    uint64_t discover_us = run();
+    checkRing();
+    std::vector<Cache> cache;
+    for (auto& peer : ring) {
+        cache.push_back({peer.discovery->getUid(), peer.discovery->getPeers(),
+            peer.discovery->getFingerprint()});
+    }
+
+    // Valid cache connects at once and keeps ids and fingerprint
+    uint64_t resume_us = resumeAll(cache);
+    checkRing();
+    for (size_t i = 0; i < ring.size(); i++) {
+        CHECK_EQ(ring[i].discovery->getUid(), cache[i].uid);
+        CHECK_EQ(ring[i].discovery->getFingerprint(), cache[i].fingerprint);
+    }
+    printf("8 peers boot to connected: discovery %.1f ms, cache %.1f ms\n",
+        discover_us / 1000.0, resume_us / 1000.0);
+
+    // Peer with a stale fingerprint, then one with a wrong id, is found out
+    // by its neighbour and the ring is discovered again
+    std::vector<Cache> stale = cache;
+    stale[2].fingerprint ^= 1;
+    resumeAll(stale);
+    checkRing();
+    stale = cache;
+    stale[5].uid = (stale[5].uid + 1) % stale[5].peers;
+    resumeAll(stale);
+    checkRing();
+
+    // Invalid values start discovery instead of resuming
+    static const Cache invalid[] = {{0, 0, 0x1234}, {3, 3, 0x1234},
+        {0, BUS_MAX_PEERS + 1, 0x1234}};
+    for (const Cache& value : invalid) {
+        BusDiscovery discovery(send, sendResume);
+        discovery.resume(0, value.uid, value.peers, value.fingerprint);
+        CHECK_EQ(discovery.getStatus(), BUS_STATUS_DISCOVER);
+        CHECK_EQ(discovery.getUid(), NO_UID);
+    }
+    // Their discover frames are not part of any ring
+    events.clear();
+    stale = cache;
+    stale[4].peers = 0;
+    resumeAll(stale);
+    checkRing();
+}
+
+int main() {
+    printf("peers  mean ms  max ms  alike mean ms  max ms\n");
+    for (size_t num = 1; num <= BUS_MAX_PEERS; num++) {
+        uint64_t mean, max, alike_mean, alike_max;
+        runTrials(num, false, mean, max);
+        runTrials(num, true, alike_mean, alike_max);
+        printf("%5u  %7.1f  %6.1f  %13.1f  %6.1f\n", unsigned(num),
+            mean / 1000.0, max / 1000.0, alike_mean / 1000.0,
+            alike_max / 1000.0);
+    }
+
+    // Two twins, i.e. a pair with the same first token on a two peer ring,
+    // and every peer with a twin on a four peer ring
+    static const uint32_t pair[] = {0x55, 0x55};
+    makeRing(2, pair);
+    startAll();
+    run();
+    checkRing();
+    static const uint32_t twins[] = {0x55, 0x66, 0x55, 0x66};
+    makeRing(4, twins);
+    startAll();
+    run();
+    checkRing();
+
+    // Rebooted peer starts from round 0 while others are connected
+    static const uint32_t uids[] = {1, 2, 3, 4, 5, 6, 7};
+    makeRing(7, uids);
+    startAll();
+    run();
+    checkRing();
+    delete ring[3].discovery;
+    ring[3].discovery = new BusDiscovery(send, sendResume);
+    select(3);
+    ring[3].discovery->start(chVTGetSystemTimeX());
+    run();
+    checkRing();
+
+    // Late frame from the completed round is ignored
+    uint32_t fingerprint = ring[0].discovery->getFingerprint();
+    for (size_t i = 0; i < ring.size(); i++) {
+        last_event.dst = i;
+        events.push_back(last_event);
+    }
+    run();
+    checkRing();
+    CHECK_EQ(ring[0].discovery->getFingerprint(), fingerprint);
+
+    testResume();
+
+    for (auto& peer : ring)
+        delete peer.discovery;
+    return test::report("bus_discovery");
+}
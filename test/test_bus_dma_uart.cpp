@@ -0,0 +1,224 @@
+/*
+ * BusDmaUart receive path on a simulated circular DMA stream. Bursts of
+ * frames arrive in pieces of random length, DMA calls back on half and full
+ * buffer, and the line goes idle after each burst. Reader runs at random
+ * points like the Rx thread, frames must come out whole and in order across
+ * buffer wraps. A reader that falls a buffer behind drops stale data, but
+ * whatever it reads is still whole frames in order. Callback counts are
+ * compared with an interrupt per byte of the serial driver.
+ */
+#include <vector>
+#include "test.hpp"
+#include "bus_dma_uart.hpp"
+
+using namespace owpeer;
+
+static constexpr size_t bursts = 20000;
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+/*
+ * UART4 with its receive DMA stream. Counter stays at 0 after the last byte
+ * of the buffer until the next byte, as it may read on the device.
+ */
+static stm32_dma_stream_t rx_stream;
+static uint8_t* rx_memory = nullptr;
+static size_t rx_size = 0;
+static uint32_t rx_mode = 0;
+static const UARTConfig* uart_config = nullptr;
+static size_t dma_callbacks = 0, idle_callbacks = 0;
+
+UARTDriver UARTD4 = {&rx_stream, 0, UART_TX_IDLE};
+
+void uartStart(UARTDriver*, const UARTConfig* config) {
+    uart_config = config;
+}
+
+void uartStop(UARTDriver*) {}
+
+msg_t uartSendTimeout(UARTDriver*, size_t*, const void*, sysinterval_t) {
+    return MSG_OK;
+}
+
+size_t dmaStreamGetTransactionSize(const stm32_dma_stream_t* stream) {
+    return stream->remaining;
+}
+
+void dmaStreamDisable(const stm32_dma_stream_t*) {}
+void dmaStreamEnable(const stm32_dma_stream_t*) {}
+
+void dmaStreamSetMemory0(const stm32_dma_stream_t*, void* memory) {
+    rx_memory = static_cast<uint8_t*>(memory);
+}
+
+void dmaStreamSetTransactionSize(const stm32_dma_stream_t*, size_t size) {
+    rx_size = size;
+    rx_stream.remaining = size;
+}
+
+void dmaStreamSetMode(const stm32_dma_stream_t*, uint32_t mode) {
+    rx_mode = mode;
+}
+
+static void receiveByte(uint8_t byte) {
+    if (rx_stream.remaining == 0)
+        rx_stream.remaining = rx_size;
+    rx_memory[rx_size - rx_stream.remaining--] = byte;
+    bool half = rx_stream.remaining == rx_size / 2 &&
+        (rx_mode & STM32_DMA_CR_HTIE);
+    bool full = rx_stream.remaining == 0 && (rx_mode & STM32_DMA_CR_TCIE);
+    if (half || full) {
+        dma_callbacks++;
+        uart_config->rxchar_cb(&UARTD4, 0);
+    }
+}
+
+static void idleLine() {
+    idle_callbacks++;
+    uart_config->timeout_cb(&UARTD4);
+}
+
+/*
+ * Reads until reader would block
+ */
+static void readAll(std::vector<uint8_t>& received) {
+    uint8_t data[BUS_DMA_BUFFER_SIZE];
+    size_t len;
+    while ((len = bus_dma_uart.read(data,
+                frame_size + random(sizeof(data) - frame_size + 1))) != 0) {
+        CHECK_EQ(len % frame_size, 0);
+        received.insert(received.end(), data, data + len);
+    }
+}
+
+static void addFrame(std::vector<uint8_t>& bytes, uint32_t tag) {
+    const uint8_t frame[] = {uint8_t(OWL_COMMAND_PARAMETER | (tag & 0x0f)),
+        uint8_t((tag >> 4) % (PARAMETER_DH + 1)), uint8_t(tag >> 8),
+        uint8_t(tag)};
+    bytes.insert(bytes.end(), frame, frame + frame_size);
+}
+
+static void testBursts() {
+    bus_dma_uart.start(BUS_BAUD);
+    std::vector<uint8_t> sent, received;
+    uint32_t tag = 0;
+    size_t pending = 0;
+    for (size_t burst = 0; burst < bursts; burst++) {
+        std::vector<uint8_t> bytes;
+        size_t frames = 1 + random(random(4) ? 4 : 40);
+        for (size_t i = 0; i < frames; i++)
+            addFrame(bytes, tag++);
+        for (size_t pos = 0; pos < bytes.size();) {
+            // Reader runs before DMA laps it
+            size_t len = std::min<size_t>({1 + random(24), bytes.size() - pos,
+                BUS_DMA_BUFFER_SIZE - frame_size - pending});
+            for (size_t i = 0; i < len; i++)
+                receiveByte(bytes[pos + i]);
+            pos += len;
+            pending += len;
+            if (random(2) || pending + frame_size >= BUS_DMA_BUFFER_SIZE) {
+                size_t before = received.size();
+                readAll(received);
+                pending -= received.size() - before;
+            }
+        }
+        idleLine();
+        size_t before = received.size();
+        readAll(received);
+        pending -= received.size() - before;
+        CHECK_EQ(pending, 0);
+        sent.insert(sent.end(), bytes.begin(), bytes.end());
+    }
+    size_t wraps = sent.size() / BUS_DMA_BUFFER_SIZE;
+    CHECK(received == sent);
+    printf("%u bytes in %u bursts, %u buffer wraps: %u dma + %u idle "
+        "callbacks, %.1f bytes each, against %u per byte irqs\n",
+        unsigned(sent.size()), unsigned(bursts), unsigned(wraps),
+        unsigned(dma_callbacks), unsigned(idle_callbacks),
+        double(sent.size()) / (dma_callbacks + idle_callbacks),
+        unsigned(sent.size()));
+}
+
+/*
+ * Frames back to back in one burst, as at the highest rate
+ */
+static void testContinuous() {
+    bus_dma_uart.start(BUS_BAUD);
+    dma_callbacks = idle_callbacks = 0;
+    std::vector<uint8_t> sent, received;
+    for (uint32_t tag = 0; tag < 10000; tag++)
+        addFrame(sent, tag);
+    for (size_t pos = 0; pos < sent.size(); pos += BUS_DMA_BUFFER_SIZE / 2) {
+        for (size_t i = 0; i < BUS_DMA_BUFFER_SIZE / 2; i++)
+            receiveByte(sent[pos + i]);
+        readAll(received);
+    }
+    idleLine();
+    readAll(received);
+    CHECK(received == sent);
+    printf("%u bytes back to back: %u dma + %u idle callbacks, %.1f bytes "
+        "each\n", unsigned(sent.size()), unsigned(dma_callbacks),
+        unsigned(idle_callbacks),
+        double(sent.size()) / (dma_callbacks + idle_callbacks));
+}
+
+/*
+ * Frames since the last read, none of them is read before DMA passes reader
+ */
+static void testOverrun() {
+    bus_dma_uart.start(BUS_BAUD);
+    std::vector<uint8_t> sent, received;
+    for (uint32_t tag = 0; tag < 3 * BUS_DMA_BUFFER_SIZE / frame_size + 5;
+        tag++)
+        addFrame(sent, tag);
+    for (uint8_t byte : sent)
+        receiveByte(byte);
+    idleLine();
+    readAll(received);
+    CHECK(!received.empty());
+    CHECK(received.size() < BUS_DMA_BUFFER_SIZE);
+    // Whatever is read is the tail of what was sent
+    CHECK(std::equal(received.begin(), received.end(),
+        sent.end() - received.size()));
+    // Reader continues in step after resync
+    std::vector<uint8_t> more;
+    for (uint32_t tag = 0; tag < 4; tag++)
+        addFrame(more, 0x1000 + tag);
+    for (uint8_t byte : more)
+        receiveByte(byte);
+    idleLine();
+    received.clear();
+    readAll(received);
+    CHECK(received == more);
+}
+
+/*
+ * Restart replaces the stream, bytes that weren't read are dropped
+ */
+static void testRestart() {
+    bus_dma_uart.start(BUS_BAUD);
+    std::vector<uint8_t> bytes;
+    addFrame(bytes, 1);
+    for (uint8_t byte : bytes)
+        receiveByte(byte);
+    bus_dma_uart.start(2 * BUS_BAUD);
+    CHECK_EQ(bus_dma_uart.getBaud(), 2 * BUS_BAUD);
+    std::vector<uint8_t> received;
+    readAll(received);
+    CHECK(received.empty());
+}
+
+int main() {
+    testBursts();
+    testContinuous();
+    testOverrun();
+    testRestart();
+    return test::report("bus_dma_uart");
+}
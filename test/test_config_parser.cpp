@@ -0,0 +1,181 @@
+/*
+ * SysEx configuration parser. Random dumps of known keys, unknown keys and
+ * malformed records are split at random points, every valid record must come
+ * out once and in order. Records from queueConfiguration() must reach message
+ * handler's FIFO instead of settings.
+ */
+#include <string>
+#include <vector>
+#include "test.hpp"
+#include "config_parser.hpp"
+
+using namespace owpeer;
+
+// Settings are linked for applyConfiguration(), never stored here
+static FLASH_TypeDef host_flash;
+FLASH_TypeDef* const FLASH = &host_flash;
+
+static constexpr size_t dumps = 20000;
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+struct Record {
+    uint16_t key;
+    int32_t value;
+    bool operator==(const Record& other) const {
+        return key == other.key && value == other.value;
+    }
+};
+
+static std::vector<Record> applied;
+
+static bool apply(uint16_t key, int32_t value) {
+    applied.push_back({key, value});
+    return true;
+}
+
+static void testKeys() {
+    size_t found = 0, wrong = 0;
+    for (uint32_t key = 0; key < 0x10000; key++) {
+        int index = ConfigParser::findKey(key);
+        if (index < 0)
+            continue;
+        found++;
+        wrong += config_keys[index] != key;
+    }
+    CHECK_EQ(found, config_keys_num);
+    CHECK_EQ(wrong, 0);
+}
+
+static int32_t randomValue() {
+    switch (random(4)) {
+    case 0:
+        return int32_t(random(0x100)) - 0x80;
+    case 1:
+        return INT32_MIN + random(2);
+    default:
+        return int32_t(random(0xffffffff));
+    }
+}
+
+static void appendSeparator(std::string& dump) {
+    static const char separators[] = {' ', ',', '\n', '\0'};
+    dump += separators[random(sizeof(separators))];
+}
+
+/*
+ * Dump as in a SysEx message, returns records that must be applied
+ */
+static std::vector<Record> makeDump(std::string& dump) {
+    std::vector<Record> records;
+    dump = char(SYSEX_CONFIGURATION_COMMAND);
+    size_t num = 1 + random(30);
+    for (size_t i = 0; i < num; i++) {
+        char buf[11];
+        uint16_t key = config_keys[random(config_keys_num)];
+        int32_t value = randomValue();
+        size_t len = ConfigParser::format(buf, key, value);
+        switch (random(16)) {
+        case 0:
+            // Unknown key
+            buf[0] = 'z';
+            dump.append(buf, len);
+            break;
+        case 1:
+            // Not a hex digit
+            dump.append(buf, len);
+            dump += 'g';
+            break;
+        case 2:
+            // Key without value
+            dump.append(buf, 2);
+            break;
+        case 3:
+            // Too many digits
+            dump.append(buf, len);
+            dump += "123456789";
+            break;
+        default:
+            dump.append(buf, len);
+            records.push_back({key, value});
+            break;
+        }
+        appendSeparator(dump);
+    }
+    return records;
+}
+
+static void testDumps() {
+    ConfigParser parser(apply);
+    size_t records = 0, mismatches = 0;
+    std::string dump;
+    for (size_t i = 0; i < dumps; i++) {
+        auto expected = makeDump(dump);
+        applied.clear();
+        parser.open(dump.size());
+        const uint8_t* data = (const uint8_t*)dump.data();
+        for (size_t pos = 0; pos < dump.size();) {
+            size_t len = std::min<size_t>(1 + random(8), dump.size() - pos);
+            parser.write(data + pos, len);
+            pos += len;
+        }
+        parser.close();
+        mismatches += applied != expected;
+        records += expected.size();
+    }
+    CHECK_EQ(mismatches, 0);
+    printf("%u dumps with %u records parsed\n", unsigned(dumps),
+        unsigned(records));
+}
+
+/*
+ * Interrupted record is dropped
+ */
+static void testAbort() {
+    ConfigParser parser(apply);
+    applied.clear();
+    parser.open(0);
+    parser.write((const uint8_t*)"FS", 2);
+    parser.abort();
+    parser.write((const uint8_t*)"bb80 BS40", 9);
+    parser.close();
+    const Record blocksize = {
+        settingsKey(SYSEX_CONFIGURATION_AUDIO_BLOCKSIZE), 0x40};
+    CHECK_EQ(applied.size(), 1);
+    CHECK(applied.size() == 1 && applied[0] == blocksize);
+}
+
+static void testQueue() {
+    ConfigParser parser(queueConfiguration);
+    const char dump[] = "FSbb80,IO-1a";
+    parser.open(sizeof(dump));
+    parser.write((const uint8_t*)dump, sizeof(dump));
+    parser.close();
+    const Record expected[] = {
+        {settingsKey(SYSEX_CONFIGURATION_AUDIO_RATE), 0xbb80},
+        {settingsKey(SYSEX_CONFIGURATION_INPUT_OFFSET), -0x1a},
+    };
+    for (const Record& record : expected) {
+        auto obj = BusObjectPtr::receive(TIME_IMMEDIATE);
+        if (!CHECK(obj && std::holds_alternative<BusConfigRecord>(*obj)))
+            return;
+        CHECK_EQ(std::get<BusConfigRecord>(*obj).getKey(), record.key);
+        CHECK_EQ(std::get<BusConfigRecord>(*obj).getValue(), record.value);
+    }
+    CHECK(!BusObjectPtr::receive(TIME_IMMEDIATE));
+}
+
+int main() {
+    testKeys();
+    testDumps();
+    testAbort();
+    testQueue();
+    return test::report("config_parser");
+}
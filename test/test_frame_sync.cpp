@@ -0,0 +1,286 @@
+/*
+ * Frame sync on mixed streams of parameters, buttons, commands, MIDI,
+ * messages and data transfers, with one byte dropped at a random position.
+ * Stream must realign, and data transfers are reassembled like in
+ * FrameDecoderThread: a transfer cut by the gap fails, but its frames are
+ * counted out, so that the next transfer is decoded. Random payload that
+ * looks aligned, or a damaged header right before the gap, may still cost
+ * another transfer, which must stay under 1% of streams. Every internal
+ * command must also pass through a locked stream as it is.
+ *
+ * Seed is fixed, so figures only change with the protocol. Currently
+ * realignment loses 1.68 frames on average and 20 at most, with 0.62
+ * garbage frames. Average loss must stay under 2 frames.
+ */
+#include <array>
+#include <vector>
+#include "test.hpp"
+#include "frame_sync.hpp"
+#include "bus_protocol.hpp"
+
+using namespace owpeer;
+
+using Frame = std::array<uint8_t, frame_size>;
+using Frames = std::vector<Frame>;
+
+static constexpr size_t streams = 2000;
+static constexpr size_t items = 40;
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+static void push(Frames& frames, const BusFrame& frame) {
+    frames.push_back({frame.frame_buffer[0], frame.frame_buffer[1],
+        frame.frame_buffer[2], frame.frame_buffer[3]});
+}
+
+/*
+ * Random payload bytes make data frames the hardest to check
+ */
+static void addData(Frames& frames, std::vector<uint32_t>& lengths) {
+    uint32_t len = 1 + random(60);
+    std::vector<uint8_t> payload(len);
+    for (auto& byte : payload)
+        byte = random(256);
+    BusData data(random(16), payload.data(), len);
+    BusFrame frame;
+    data.encodeFrame(frame);
+    push(frames, frame);
+    while (data.isEncoded()) {
+        data >> frame;
+        push(frames, frame);
+    }
+    lengths.push_back(len);
+}
+
+static void addMessage(Frames& frames) {
+    char text[max_msg_len];
+    size_t len = random(32);
+    for (size_t i = 0; i < len; i++)
+        text[i] = 'a' + random(26);
+    text[len] = '\0';
+    BusMessage msg(random(16), text);
+    BusFrame frame = {};
+    while (msg.isEncoded()) {
+        msg.encodeFrame(frame);
+        push(frames, frame);
+    }
+}
+
+static Frames makeStream(std::vector<uint32_t>& lengths) {
+    Frames frames;
+    for (size_t i = 0; i < items; i++) {
+        uint8_t peer = random(16);
+        switch (random(7)) {
+        case 0:
+            frames.push_back({uint8_t(OWL_COMMAND_PARAMETER | peer),
+                uint8_t(random(PARAMETER_DH + 1)), uint8_t(random(16)),
+                uint8_t(random(256))});
+            break;
+        case 1:
+            frames.push_back({uint8_t(OWL_COMMAND_BUTTON | peer),
+                uint8_t(random(BUTTON_H + 1)), 0, uint8_t(random(2))});
+            break;
+        case 2:
+            frames.push_back({uint8_t(OWL_COMMAND_COMMAND | peer),
+                BUS_COMMAND_TIME_SYNC, uint8_t(random(256)),
+                uint8_t(random(256))});
+            break;
+        case 3:
+            frames.push_back({USB_COMMAND_CONTROL_CHANGE, 0xb0,
+                uint8_t(random(128)), uint8_t(random(128))});
+            break;
+        case 4:
+            frames.push_back(
+                {USB_COMMAND_SINGLE_BYTE, MIDI_TIMING_CLOCK, 0, 0});
+            break;
+        case 5:
+            addMessage(frames);
+            break;
+        default:
+            addData(frames, lengths);
+            break;
+        }
+    }
+    return frames;
+}
+
+/*
+ * Data path of FrameDecoderThread, returns lengths of transfers that were
+ * decoded without failure
+ */
+static void finish(BusObjectPtr& rx_data, std::vector<uint32_t>& decoded,
+    size_t& failed) {
+    if (!rx_data)
+        return;
+    auto& data = std::get<BusData>(*rx_data);
+    if (!data.isDecoded())
+        return;
+    if (data.isFailed())
+        failed++;
+    else
+        decoded.push_back(data.getLength());
+    rx_data.reset();
+}
+
+static std::vector<uint32_t> decodeData(const Frames& frames,
+    size_t& failed) {
+    std::vector<uint32_t> decoded;
+    BusObjectPtr rx_data;
+    for (auto& bytes : frames) {
+        BusFrame frame;
+        memcpy(frame.frame_buffer, bytes.data(), frame_size);
+        if (frame.getOwlProtocolType() == OWL_FRAME_GAP && rx_data) {
+            std::get<BusData>(*rx_data).erase(std::min(
+                frame.frame_buffer[1] + frame.frame_buffer[2], 0xff));
+            finish(rx_data, decoded, failed);
+        }
+        else if (frame.getOwlProtocolType() == OWL_COMMAND_DATA) {
+            if (rx_data && std::get<BusData>(*rx_data).getPeer() !=
+                frame.getSeq()) {
+                std::get<BusData>(*rx_data).abort();
+                finish(rx_data, decoded, failed);
+            }
+            if (!rx_data)
+                rx_data = BusData::decodeFrame(frame);
+            else
+                std::get<BusData>(*rx_data) << frame;
+            finish(rx_data, decoded, failed);
+        }
+    }
+    return decoded;
+}
+
+static Frames syncFrames(const Frames& sent) {
+    std::vector<uint8_t> bytes;
+    for (auto& frame : sent)
+        bytes.insert(bytes.end(), frame.begin(), frame.end());
+    FrameSync sync;
+    sync.write(bytes.data(), bytes.size());
+    Frames received;
+    Frame frame;
+    while (sync.read(frame.data()))
+        received.push_back(frame);
+    return received;
+}
+
+/*
+ * Commands between MIDI clocks, an unknown command must turn into a gap
+ */
+static void testCommands() {
+    static const uint8_t commands[] = {
+        BUS_COMMAND_RESUME, BUS_COMMAND_BAUD_OFFER, BUS_COMMAND_BAUD_SWITCH,
+        BUS_COMMAND_BAUD_CONFIRM, BUS_COMMAND_TIME_SYNC,
+        BUS_COMMAND_TIME_DELAY, BUS_COMMAND_TIMESTAMP, BUS_COMMAND_DATA_ERROR,
+#if BUS_SYSEX_BRIDGE == TRUE
+        BUS_COMMAND_SYSEX_BRIDGE,
+#endif
+    };
+    const Frame clock = {USB_COMMAND_SINGLE_BYTE, MIDI_TIMING_CLOCK, 0, 0};
+    for (uint8_t cmd : commands) {
+        Frames sent;
+        for (size_t i = 0; i < BUS_SYNC_CONFIRM_FRAMES + 1; i++)
+            sent.push_back(clock);
+        sent.push_back({uint8_t(OWL_COMMAND_COMMAND | 1), cmd, 0, 0});
+        for (size_t i = 0; i < BUS_SYNC_CONFIRM_FRAMES + 1; i++)
+            sent.push_back(clock);
+        if (!CHECK(syncFrames(sent) == sent))
+            printf("command 0x%02x was not passed\n", cmd);
+    }
+    Frames unknown = {clock, {uint8_t(OWL_COMMAND_COMMAND | 1), 0x70, 0, 0}};
+    for (size_t i = 0; i < BUS_SYNC_CONFIRM_FRAMES + 1; i++)
+        unknown.push_back(clock);
+    Frames received = syncFrames(unknown);
+    CHECK(received.size() > 1 && received[1][0] == OWL_FRAME_GAP);
+}
+
+int main() {
+    testCommands();
+    uint32_t lost_total = 0, lost_max = 0;
+    uint32_t garbage_total = 0;
+    size_t transfers = 0, transfers_failed = 0;
+    // Streams where random payload looked aligned, or a transfer that
+    // followed the gap was lost as well
+    size_t false_locks = 0, extra_failed = 0;
+    for (size_t n = 0; n < streams; n++) {
+        std::vector<uint32_t> lengths;
+        Frames sent = makeStream(lengths);
+        std::vector<uint8_t> bytes;
+        for (auto& frame : sent)
+            bytes.insert(bytes.end(), frame.begin(), frame.end());
+        // Byte is dropped after the first few frames, so that there is
+        // something to realign to. Bus keeps running after the stream, so
+        // that a loss near the end is found and recovered from.
+        size_t drop = 8 + random(bytes.size() - 8);
+        bytes.erase(bytes.begin() + drop);
+        for (size_t i = 0; i < 2 * (BUS_SYNC_CONFIRM_FRAMES + 1); i++) {
+            sent.push_back({USB_COMMAND_SINGLE_BYTE, MIDI_TIMING_CLOCK, 0, 0});
+            bytes.insert(bytes.end(), sent.back().begin(), sent.back().end());
+        }
+
+        FrameSync sync;
+        Frames received;
+        for (size_t pos = 0; pos < bytes.size();) {
+            size_t len = std::min<size_t>(1 + random(16), bytes.size() - pos);
+            pos += sync.write(bytes.data() + pos, len);
+            Frame frame;
+            while (sync.read(frame.data()))
+                received.push_back(frame);
+        }
+        CHECK(sync.isLocked());
+
+        // Frames that arrived intact and in order, anything else that isn't
+        // a gap marker is garbage
+        size_t intact = 0, gaps = 0;
+        for (size_t i = 0, j = 0; i < received.size(); i++) {
+            if (received[i][0] == OWL_FRAME_GAP) {
+                gaps++;
+                continue;
+            }
+            size_t next = j;
+            while (next < sent.size() && sent[next] != received[i])
+                next++;
+            if (next < sent.size()) {
+                intact++;
+                j = next + 1;
+            }
+        }
+        CHECK(gaps >= 1);
+        false_locks += gaps > 1;
+        uint32_t lost = sent.size() - intact;
+        uint32_t garbage = received.size() - gaps - intact;
+        lost_total += lost;
+        lost_max = std::max(lost_max, lost);
+        garbage_total += garbage;
+
+        // Mostly only the transfer that lost the byte fails, and every
+        // decoded transfer has a length that was sent
+        size_t failed = 0;
+        auto decoded = decodeData(received, failed);
+        CHECK(decoded.size() <= lengths.size());
+        extra_failed += decoded.size() + 1 < lengths.size();
+        for (size_t i = 0, j = 0; i < decoded.size(); i++, j++) {
+            while (j < lengths.size() && lengths[j] != decoded[i])
+                j++;
+            CHECK(j < lengths.size());
+        }
+        transfers += lengths.size();
+        transfers_failed += lengths.size() - decoded.size();
+    }
+    CHECK(lost_total < 2 * streams);
+    CHECK(false_locks * 100 < streams);
+    CHECK(extra_failed * 100 < streams);
+    printf("%u streams with one dropped byte: lost %.2f frames on average, "
+        "%u at most, garbage %.2f frames\n", unsigned(streams),
+        double(lost_total) / streams, lost_max,
+        double(garbage_total) / streams);
+    printf("false locks %u, transfers %u, failed %u, streams that failed "
+        "more than one %u\n", unsigned(false_locks), unsigned(transfers),
+        unsigned(transfers_failed), unsigned(extra_failed));
+    return test::report("frame_sync");
+}
@@ -0,0 +1,299 @@
+/*
+ * LoopbackTransport with mixed parameters, buttons, commands, MIDI, messages
+ * and data transfers. Frames are written in random batches while reads of
+ * random length drain the buffer, like UART Tx and Rx threads on one link.
+ * Bytes must come back in order, and objects decoded from them must match
+ * the ones that were sent. Writes that don't fit are dropped as a whole.
+ */
+#include <string>
+#include <vector>
+#include "test.hpp"
+#include "bus_transport.hpp"
+#include "bus_protocol.hpp"
+
+namespace owpeer {
+// Defined by bus_loopback.cpp only when it's the bus transport
+BusLoopback bus_loopback;
+}
+
+using namespace owpeer;
+
+static constexpr size_t streams = 500;
+static constexpr size_t items = 50;
+static constexpr size_t buffer_frames = BUS_LOOPBACK_BUFFER_SIZE / frame_size;
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+static void push(std::vector<uint8_t>& bytes, const BusFrame& frame) {
+    bytes.insert(bytes.end(), frame.frame_buffer,
+        frame.frame_buffer + frame_size);
+}
+
+static std::string format(const char* fmt, unsigned a, unsigned b,
+    unsigned c) {
+    char text[32];
+    snprintf(text, sizeof(text), fmt, a, b, c);
+    return text;
+}
+
+static uint32_t checksum(const uint8_t* data, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum = sum * 31 + data[i];
+    return sum;
+}
+
+/*
+ * Appends frames of a random object, returns its description
+ */
+static std::string addItem(std::vector<uint8_t>& bytes) {
+    uint8_t peer = random(16);
+    BusFrame frame;
+    switch (random(6)) {
+    case 0: {
+        PatchParameterId pid = PatchParameterId(random(PARAMETER_DH + 1));
+        int16_t value = random(0x10000);
+        BusParameter(peer, pid, value).encodeFrame(frame);
+        push(bytes, frame);
+        return format("P %u %u %d", peer, pid, value);
+    }
+    case 1: {
+        PatchButtonId bid = PatchButtonId(random(BUTTON_H + 1));
+        int16_t value = random(2);
+        BusButton(peer, bid, value).encodeFrame(frame);
+        push(bytes, frame);
+        return format("B %u %u %d", peer, bid, value);
+    }
+    case 2: {
+        int16_t value = random(0x10000);
+        BusCommand(peer, BUS_COMMAND_TIME_SYNC, value).encodeFrame(frame);
+        push(bytes, frame);
+        return format("C %u %u %d", peer, BUS_COMMAND_TIME_SYNC, value);
+    }
+    case 3: {
+        uint8_t cc = random(128), value = random(128);
+        BusMidi(USB_COMMAND_CONTROL_CHANGE, 0xb0 | peer, cc, value)
+            .encodeFrame(frame);
+        push(bytes, frame);
+        return format("M %02x %u %u", 0xb0 | peer, cc, value);
+    }
+    case 4: {
+        char text[max_msg_len];
+        size_t len = random(40);
+        for (size_t i = 0; i < len; i++)
+            text[i] = 'a' + random(26);
+        text[len] = '\0';
+        BusMessage msg(peer, text);
+        while (msg.isEncoded()) {
+            msg.encodeFrame(frame);
+            push(bytes, frame);
+        }
+        return format("T %u ", peer, 0, 0) + text;
+    }
+    default: {
+        std::vector<uint8_t> payload(1 + random(100));
+        for (auto& byte : payload)
+            byte = random(256);
+        BusData data(peer, payload.data(), payload.size());
+        data.encodeFrame(frame);
+        push(bytes, frame);
+        while (data.isEncoded()) {
+            data >> frame;
+            push(bytes, frame);
+        }
+        return format("D %u %u %08x", peer, unsigned(payload.size()),
+            checksum(payload.data(), payload.size()));
+    }
+    }
+}
+
+static std::string describe(const BusProtocolObject& obj) {
+    if (std::holds_alternative<BusParameter>(obj)) {
+        auto& param = std::get<BusParameter>(obj);
+        return format("P %u %u %d", param.getPeer(), param.getParameterId(),
+            param.getValue());
+    }
+    if (std::holds_alternative<BusButton>(obj)) {
+        auto& button = std::get<BusButton>(obj);
+        return format("B %u %u %d", button.getPeer(), button.getButtonId(),
+            button.getValue());
+    }
+    if (std::holds_alternative<BusCommand>(obj)) {
+        auto& cmd = std::get<BusCommand>(obj);
+        return format("C %u %u %d", cmd.getPeer(), cmd.getCommand(),
+            cmd.getData());
+    }
+    if (std::holds_alternative<BusMidi>(obj)) {
+        auto& midi = std::get<BusMidi>(obj);
+        return format("M %02x %u %u", midi.getStatus(), midi.getController(),
+            midi.getControllerValue());
+    }
+    if (std::holds_alternative<BusMessage>(obj)) {
+        auto& msg = std::get<BusMessage>(obj);
+        return format("T %u ", msg.getPeer(), 0, 0) + msg.getMessage();
+    }
+    if (std::holds_alternative<BusData>(obj)) {
+        auto& data = std::get<BusData>(obj);
+        if (data.isFailed())
+            return "D failed";
+        return format("D %u %u %08x", data.getPeer(), data.getLength(),
+            checksum(data.getData(), data.getLength()));
+    }
+    return "unknown";
+}
+
+/*
+ * Reassembles objects like FrameDecoderThread
+ */
+class Decoder {
+public:
+    void write(const uint8_t* bytes, size_t len) {
+        for (size_t i = 0; i < len; i += frame_size) {
+            BusFrame frame;
+            memcpy(frame.frame_buffer, bytes + i, frame_size);
+            decode(frame);
+        }
+    }
+
+    std::vector<std::string> objects;
+
+private:
+    void decode(const BusFrame& frame) {
+        if (frame.isMidi()) {
+            add(BusMidi::decodeFrame(frame));
+            return;
+        }
+        switch (frame.getOwlProtocolType()) {
+        case OWL_COMMAND_PARAMETER:
+            add(BusParameter::decodeFrame(frame));
+            break;
+        case OWL_COMMAND_BUTTON:
+            add(BusButton::decodeFrame(frame));
+            break;
+        case OWL_COMMAND_COMMAND:
+            add(BusCommand::decodeFrame(frame));
+            break;
+        case OWL_COMMAND_MESSAGE:
+            if (!rx_message)
+                rx_message = BusMessage::decodeFrame(frame);
+            else
+                std::get<BusMessage>(*rx_message) << frame;
+            if (std::get<BusMessage>(*rx_message).isDecoded())
+                add(std::move(rx_message));
+            break;
+        case OWL_COMMAND_DATA:
+            if (!rx_data)
+                rx_data = BusData::decodeFrame(frame);
+            else
+                std::get<BusData>(*rx_data) << frame;
+            if (std::get<BusData>(*rx_data).isDecoded())
+                add(std::move(rx_data));
+            break;
+        default:
+            objects.push_back("unexpected frame");
+            break;
+        }
+    }
+
+    void add(BusObjectPtr obj) {
+        objects.push_back(obj ? describe(*obj) : "empty");
+    }
+
+    BusObjectPtr rx_data;
+    BusObjectPtr rx_message;
+};
+
+static size_t readFrames(std::vector<uint8_t>& received, size_t max_len) {
+    uint8_t data[BUS_LOOPBACK_BUFFER_SIZE];
+    size_t len = LoopbackTransport::read(data, max_len);
+    CHECK_EQ(len % frame_size, 0);
+    received.insert(received.end(), data, data + len);
+    return len;
+}
+
+static void testStreams() {
+    size_t frames = 0, objects = 0, mismatches = 0;
+    for (size_t n = 0; n < streams; n++) {
+        std::vector<uint8_t> sent;
+        std::vector<std::string> expected;
+        for (size_t i = 0; i < items; i++)
+            expected.push_back(addItem(sent));
+        LoopbackTransport::start(BUS_BAUD);
+        std::vector<uint8_t> received;
+        size_t written = 0, queued = 0;
+        while (received.size() < sent.size()) {
+            size_t batch = std::min<size_t>((1 + random(12)) * frame_size,
+                sent.size() - written);
+            if (batch && queued + batch <= BUS_LOOPBACK_BUFFER_SIZE &&
+                random(2)) {
+                LoopbackTransport::write(sent.data() + written, batch);
+                written += batch;
+                queued += batch;
+            }
+            else if (queued) {
+                queued -= readFrames(received,
+                    frame_size + random(BUS_LOOPBACK_BUFFER_SIZE));
+            }
+        }
+        mismatches += received != sent;
+        Decoder decoder;
+        decoder.write(received.data(), received.size());
+        mismatches += decoder.objects != expected;
+        frames += sent.size() / frame_size;
+        objects += expected.size();
+    }
+    CHECK_EQ(mismatches, 0);
+    printf("%u streams, %u frames and %u objects came back in order\n",
+        unsigned(streams), unsigned(frames), unsigned(objects));
+}
+
+static void testOverflow() {
+    LoopbackTransport::start(BUS_BAUD);
+    std::vector<uint8_t> sent;
+    BusFrame frame;
+    for (size_t i = 0; i < buffer_frames + 4; i++) {
+        frame.fill(OWL_COMMAND_PARAMETER | 1, PARAMETER_A, 0, i);
+        push(sent, frame);
+    }
+    // Batch that doesn't fit is dropped as a whole, a smaller one still fits
+    LoopbackTransport::write(sent.data(), (buffer_frames - 2) * frame_size);
+    LoopbackTransport::write(sent.data() + (buffer_frames - 2) * frame_size,
+        4 * frame_size);
+    LoopbackTransport::write(sent.data() + (buffer_frames + 2) * frame_size,
+        2 * frame_size);
+    std::vector<uint8_t> received;
+    while (readFrames(received, BUS_LOOPBACK_BUFFER_SIZE))
+        ;
+    std::vector<uint8_t> expected(sent.begin(),
+        sent.begin() + (buffer_frames - 2) * frame_size);
+    expected.insert(expected.end(),
+        sent.begin() + (buffer_frames + 2) * frame_size, sent.end());
+    CHECK(received == expected);
+}
+
+/*
+ * Restart drops frames that weren't read
+ */
+static void testRestart() {
+    LoopbackTransport::start(BUS_BAUD);
+    const uint8_t bytes[] = {USB_COMMAND_SINGLE_BYTE, MIDI_TIMING_CLOCK, 0, 0};
+    LoopbackTransport::write(bytes, sizeof(bytes));
+    LoopbackTransport::start(2 * BUS_BAUD);
+    CHECK_EQ(LoopbackTransport::getBaud(), 2 * BUS_BAUD);
+    std::vector<uint8_t> received;
+    CHECK_EQ(readFrames(received, sizeof(bytes)), 0);
+}
+
+int main() {
+    testStreams();
+    testOverflow();
+    testRestart();
+    return test::report("loopback_transport");
+}
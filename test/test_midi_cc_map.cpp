@@ -0,0 +1,82 @@
+/*
+ * MIDI CC to parameter mapping. Every CC number on every channel is tried
+ * against a plain search of parameter_to_cc, with input channel set to each
+ * channel and to omni. 7 bit values must cover the full 12 bit range evenly.
+ */
+#include <cmath>
+#include "test.hpp"
+#include "midi_cc_map.hpp"
+
+using namespace owpeer;
+
+static BusMidi controlChange(uint8_t channel, uint8_t cc, uint8_t value) {
+    return BusMidi(USB_COMMAND_CONTROL_CHANGE, 0xb0 | channel, cc, value);
+}
+
+static int32_t search(uint8_t cc) {
+    for (size_t pid = 0; pid < parameter_to_cc.size(); pid++) {
+        if (parameter_to_cc[pid] == cc)
+            return pid;
+    }
+    return -1;
+}
+
+static void testMapping() {
+    size_t mapped = 0, mismatches = 0;
+    for (int32_t input = -1; input < 17; input++) {
+        for (uint8_t channel = 0; channel < 16; channel++) {
+            for (uint8_t cc = 0; cc < 128; cc++) {
+                PatchParameterId pid;
+                int16_t value;
+                bool ok = midiToParameter(controlChange(channel, cc, 64),
+                    input, pid, value);
+                bool on_channel = input < 0 || input > 15 || input == channel;
+                int32_t expected = on_channel ? search(cc) : -1;
+                mismatches += ok != (expected >= 0) ||
+                    (ok && pid != expected);
+                mapped += ok;
+            }
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+    // All 16 channels with 2 omni settings, one with each single channel
+    CHECK_EQ(mapped, num_parameters * (2 * 16 + 16));
+}
+
+static void testOtherMessages() {
+    PatchParameterId pid;
+    int16_t value;
+    // Note on with a parameter CC number as its note
+    BusMidi note(USB_COMMAND_NOTE_ON, 0x90, PATCH_PARAMETER_A, 100);
+    CHECK(!midiToParameter(note, midi_omni_channel, pid, value));
+    // CIN and status must agree
+    BusMidi mixed(USB_COMMAND_CONTROL_CHANGE, 0x90, PATCH_PARAMETER_A, 100);
+    CHECK(!midiToParameter(mixed, midi_omni_channel, pid, value));
+}
+
+static void testScale() {
+    int16_t last = -1;
+    double error_max = 0;
+    for (uint8_t cc_value = 0; cc_value < 128; cc_value++) {
+        PatchParameterId pid;
+        int16_t value = -1;
+        CHECK(midiToParameter(controlChange(0, PATCH_PARAMETER_B, cc_value),
+            midi_omni_channel, pid, value));
+        CHECK_EQ(pid, PARAMETER_B);
+        CHECK(value > last);
+        last = value;
+        error_max = std::max(error_max,
+            std::abs(value - cc_value * 4095.0 / 127));
+    }
+    CHECK_EQ(last, 4095);
+    CHECK(error_max < 1);
+    printf("CC values scale to 0-%d, within %.1f of exact\n", last,
+        error_max);
+}
+
+int main() {
+    testMapping();
+    testOtherMessages();
+    testScale();
+    return test::report("midi_cc_map");
+}
@@ -0,0 +1,152 @@
+/*
+ * Parameter calibration against a scalar model of its arithmetic. The same
+ * test is built again with -D__ARM_FEATURE_DSP as
+ * test_parameter_calibration_dsp for Cortex-M4 path on emulated intrinsics.
+ * Random raw values, offsets and scalars are updated a few at a time or all
+ * at once, only dirty pairs may change. Also checks that entries set with
+ * setEntry() survive configure(), and correct() on the same entries.
+ */
+#include <vector>
+#include "test.hpp"
+#include "parameter_calibration.hpp"
+
+using namespace owpeer;
+
+// Settings are linked for configure() from keys, never stored here
+static FLASH_TypeDef host_flash;
+FLASH_TypeDef* const FLASH = &host_flash;
+
+#if defined(__ARM_FEATURE_DSP)
+static const char* const name = "parameter_calibration_dsp";
+#else
+static const char* const name = "parameter_calibration";
+#endif
+
+static constexpr size_t size = ParameterCalibration::size;
+static constexpr size_t updates = 1000000;
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+static int16_t randomValue() {
+    return int16_t(random(0x10000) - 0x8000);
+}
+
+static int32_t sat(int32_t value) {
+    return std::min<int32_t>(std::max<int32_t>(value, INT16_MIN), INT16_MAX);
+}
+
+static int16_t model(int16_t raw, int16_t offset, int16_t scalar) {
+    return sat((sat(raw + offset) * scalar) >> 12);
+}
+
+static void testApply() {
+    ParameterCalibration calibration;
+    const BlockEvent events[] = {
+        {OWL_COMMAND_PARAMETER, PARAMETER_B, 1000},
+        {OWL_COMMAND_BUTTON, PARAMETER_C, 2000},
+        {OWL_COMMAND_PARAMETER, uint8_t(size), 3000},
+        {OWL_COMMAND_PARAMETER, PARAMETER_DH, -4000},
+    };
+    int16_t values[size] = {};
+    calibration.apply(events, 4);
+    CHECK(calibration.process(values));
+    CHECK_EQ(values[PARAMETER_B], 1000);
+    CHECK_EQ(values[PARAMETER_C], 0);
+    CHECK_EQ(values[PARAMETER_DH], -4000);
+    CHECK(!calibration.process(values));
+}
+
+/*
+ * Random updates, values written by process() are compared after each one
+ */
+static void testModel() {
+    ParameterCalibration calibration;
+    std::vector<int16_t> raw(size, 0), offsets(size, 0),
+        scalars(size, ParameterCalibration::unity), expected(size, 0);
+    // Sentinel shows parameters that process() must not touch
+    const int16_t untouched = 0x1234;
+    std::vector<int16_t> values(size, untouched);
+    std::vector<bool> written(size, false), custom(size, false);
+    size_t mismatches = 0, partial = 0, full = 0;
+    for (size_t update = 0; update < updates; update++) {
+        std::vector<bool> dirty(size, false);
+        if (random(64) == 0) {
+            int16_t offset = randomValue(), scalar = randomValue();
+            calibration.configure(offset, scalar);
+            for (size_t i = 0; i < size; i++) {
+                if (!custom[i]) {
+                    offsets[i] = offset;
+                    scalars[i] = scalar;
+                }
+                raw[i] = randomValue();
+                calibration.set(PatchParameterId(i), raw[i]);
+                dirty[i] = true;
+            }
+            full++;
+        }
+        else {
+            size_t num = 1 + random(4);
+            for (size_t n = 0; n < num; n++) {
+                PatchParameterId pid = PatchParameterId(random(size));
+                if (random(16) == 0) {
+                    offsets[pid] = randomValue();
+                    scalars[pid] = randomValue();
+                    custom[pid] = true;
+                    calibration.setEntry(pid, offsets[pid], scalars[pid]);
+                }
+                raw[pid] = randomValue();
+                calibration.set(pid, raw[pid]);
+                dirty[pid] = true;
+            }
+            partial++;
+        }
+        CHECK(calibration.process(values.data()));
+        for (size_t i = 0; i < size; i++) {
+            // Dirty pairs are corrected as a whole
+            if (dirty[i] || dirty[i ^ 1]) {
+                expected[i] = model(raw[i], offsets[i], scalars[i]);
+                written[i] = true;
+            }
+            mismatches += values[i] != (written[i] ? expected[i] : untouched);
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+    printf("%u partial and %u full updates match the model\n",
+        unsigned(partial), unsigned(full));
+}
+
+static void testConfigure() {
+    ParameterCalibration calibration;
+    calibration.setEntry(PARAMETER_C, 100, 2 * ParameterCalibration::unity);
+    calibration.configure(-50, ParameterCalibration::unity / 2);
+    CHECK_EQ(calibration.correct(PARAMETER_A, 1050), 500);
+    CHECK_EQ(calibration.correct(PARAMETER_C, 1000), 2200);
+    // Same settings again, as on bus reset, change nothing
+    int16_t values[size] = {};
+    calibration.process(values);
+    calibration.configure(-50, ParameterCalibration::unity / 2);
+    CHECK(!calibration.process(values));
+    CHECK_EQ(calibration.correct(PARAMETER_C, 1000), 2200);
+    // New settings still keep the custom entry
+    calibration.configure(0, ParameterCalibration::unity);
+    CHECK_EQ(calibration.correct(PARAMETER_A, 1050), 1050);
+    CHECK_EQ(calibration.correct(PARAMETER_C, 1000), 2200);
+    CHECK_EQ(calibration.correct(PatchParameterId(size), 1000), 1000);
+    // Saturates on the way
+    CHECK_EQ(calibration.correct(PARAMETER_C, 32000), 32767);
+    CHECK_EQ(calibration.correct(PARAMETER_C, -32768), -32768);
+}
+
+int main() {
+    testApply();
+    testModel();
+    testConfigure();
+    return test::report(name);
+}
@@ -0,0 +1,5 @@
+/*
+ * Parameter calibration test on Cortex-M4 path with emulated intrinsics, see
+ * Makefile for the flags
+ */
+#include "test_parameter_calibration.cpp"
@@ -0,0 +1,178 @@
+/*
+ * Outgoing parameter filter. Single updates check deadband, hysteresis,
+ * held and settled values. Then a synthetic trace of pots scanned at 1 kHz
+ * with Gaussian noise alternates idle, slow sweep, idle and fast twist. Pot
+ * reports a reading only when it changes, like the scanning code does. The
+ * receiver must end each idle period close to the pot reading, and exactly
+ * on it for a pot without noise. Prints frames sent for each pot, in total
+ * and during idle periods.
+ */
+#include <cmath>
+#include <vector>
+#include "test.hpp"
+#include "parameter_filter.hpp"
+
+using namespace owpeer;
+
+static constexpr uint16_t deadband = BUS_PARAMETER_DEADBAND;
+static constexpr uint16_t hysteresis = BUS_PARAMETER_HYSTERESIS;
+static constexpr sysinterval_t interval =
+    TIME_MS2I(BUS_PARAMETER_INTERVAL_MS);
+static constexpr sysinterval_t quiet = TIME_MS2I(BUS_PARAMETER_QUIET_MS);
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+static double gaussian() {
+    double u1 = (random(1000000) + 1) / 1000001.0;
+    double u2 = random(1000000) / 1000000.0;
+    return std::sqrt(-2 * std::log(u1)) * std::cos(2 * M_PI * u2);
+}
+
+/*
+ * Values sent by poll, as the receiver sees them
+ */
+static int16_t received[num_parameters];
+static size_t flushes[num_parameters];
+
+static void onSend(uint8_t, PatchParameterId pid, int16_t value) {
+    received[pid] = value;
+    flushes[pid]++;
+}
+
+static void testSingle() {
+    ParameterFilter filter(onSend, deadband, hysteresis, interval, quiet);
+    systime_t now = 0;
+    CHECK(filter.update(1, PARAMETER_A, 1000, now));
+    CHECK_EQ(filter.getPollInterval(now), TIME_INFINITE);
+
+    // Small change is dropped, and sent once pot stays quiet
+    now += interval;
+    CHECK(!filter.update(1, PARAMETER_A, 1000 + deadband, now));
+    CHECK_EQ(filter.getPollInterval(now), quiet);
+    filter.poll(now + quiet - 1);
+    CHECK_EQ(flushes[PARAMETER_A], 0);
+    filter.poll(now + quiet);
+    CHECK_EQ(flushes[PARAMETER_A], 1);
+    CHECK_EQ(received[PARAMETER_A], 1000 + deadband);
+    CHECK_EQ(filter.getPollInterval(now), TIME_INFINITE);
+
+    // Going back to sent value leaves nothing to settle
+    now += 2 * quiet;
+    CHECK(!filter.update(1, PARAMETER_A, 1000 + deadband + 1, now));
+    CHECK(!filter.update(1, PARAMETER_A, 1000 + deadband, now + 1));
+    CHECK_EQ(filter.getPollInterval(now), TIME_INFINITE);
+
+    // Moving back takes hysteresis
+    now += quiet;
+    CHECK(filter.update(1, PARAMETER_A, 1100, now));
+    now += interval;
+    CHECK(!filter.update(1, PARAMETER_A, 1100 - hysteresis, now));
+    CHECK(filter.update(1, PARAMETER_A, 1100 - hysteresis - 1, now));
+
+    // Fast changes are held, only the latest one is sent
+    now += 1;
+    CHECK(!filter.update(1, PARAMETER_A, 1050, now));
+    CHECK(!filter.update(1, PARAMETER_A, 1000, now + 1));
+    CHECK_EQ(filter.getPollInterval(now + 1), interval - 2);
+    filter.poll(now + interval - 2);
+    CHECK_EQ(flushes[PARAMETER_A], 1);
+    filter.poll(now + interval - 1);
+    CHECK_EQ(flushes[PARAMETER_A], 2);
+    CHECK_EQ(received[PARAMETER_A], 1000);
+
+    // Value from elsewhere cancels pending one
+    now += quiet;
+    CHECK(!filter.update(1, PARAMETER_A, 1001, now));
+    filter.cancel(PARAMETER_A);
+    filter.poll(now + quiet);
+    CHECK_EQ(flushes[PARAMETER_A], 2);
+    CHECK_EQ(filter.getPollInterval(now), TIME_INFINITE);
+
+    // Another peer sending the parameter starts over
+    CHECK(filter.update(2, PARAMETER_A, 1001, now));
+}
+
+/*
+ * Pot position in LSB for each phase of 5 s
+ */
+static double position(size_t pot, size_t ms) {
+    double t = (ms % 5000) / 5000.0;
+    double base = 500 + 700 * pot;
+    switch ((ms / 5000) % 4) {
+    case 1:
+        // Slow sweep up and back
+        return base + 1500 * std::sin(M_PI * t);
+    case 3:
+        // Fast twists
+        return base + 600 * std::sin(2 * M_PI * 5 * t);
+    default:
+        return base;
+    }
+}
+
+static void testTrace() {
+    static const double noise[] = {0, 0.6, 1.2, 1.8, 2.4};
+    constexpr size_t pots = sizeof(noise) / sizeof(noise[0]);
+    constexpr size_t duration_ms = 60000;
+    ParameterFilter filter(onSend, deadband, hysteresis, interval, quiet);
+    for (size_t pot = 0; pot < pots; pot++)
+        flushes[pot] = 0;
+    int16_t reading[pots];
+    size_t changes[pots] = {}, sent[pots] = {}, idle_sent[pots] = {};
+    size_t settle_misses = 0;
+    for (size_t ms = 0; ms < duration_ms; ms++) {
+        systime_t now = TIME_MS2I(ms);
+        bool idle = (ms / 5000) % 2 == 0;
+        for (size_t pot = 0; pot < pots; pot++) {
+            PatchParameterId pid = PatchParameterId(pot);
+            int16_t value = std::lround(std::min(std::max(
+                position(pot, ms) + noise[pot] * gaussian(), 0.0), 4095.0));
+            if (ms && value == reading[pot])
+                continue;
+            reading[pot] = value;
+            changes[pot]++;
+            if (filter.update(1, pid, value, now)) {
+                received[pot] = value;
+                sent[pot]++;
+                idle_sent[pot] += idle;
+            }
+        }
+        size_t flushed[pots];
+        for (size_t pot = 0; pot < pots; pot++)
+            flushed[pot] = flushes[pot];
+        filter.poll(now);
+        for (size_t pot = 0; pot < pots; pot++)
+            idle_sent[pot] += idle ? flushes[pot] - flushed[pot] : 0;
+        // Receiver has settled by the end of idle period
+        if (idle && ms % 5000 == 4999) {
+            for (size_t pot = 0; pot < pots; pot++) {
+                int32_t error = std::abs(received[pot] - reading[pot]);
+                CHECK(error <= hysteresis);
+                if (noise[pot] == 0)
+                    settle_misses += error != 0;
+            }
+        }
+    }
+    CHECK_EQ(settle_misses, 0);
+    printf("noise rms  changes  frames (idle)\n");
+    for (size_t pot = 0; pot < pots; pot++) {
+        sent[pot] += flushes[pot];
+        printf("%6.1f LSB %8u %7u (%u)\n", noise[pot],
+            unsigned(changes[pot]), unsigned(sent[pot]),
+            unsigned(idle_sent[pot]));
+        CHECK(sent[pot] < changes[pot]);
+    }
+}
+
+int main() {
+    testSingle();
+    testTrace();
+    return test::report("parameter_filter");
+}
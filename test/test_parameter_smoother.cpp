@@ -0,0 +1,139 @@
+/*
+ * Parameter smoother against a scalar model of its arithmetic. The same test
+ * is built again with -D__ARM_FEATURE_DSP as test_parameter_smoother_dsp, so
+ * that Cortex-M4 path runs on emulated intrinsics. Both must match the model
+ * bit for bit, which makes them identical. Also prints how many blocks a
+ * step takes to settle with the configured coefficient.
+ */
+#include <vector>
+#include "test.hpp"
+#include "parameter_smoother.hpp"
+
+using namespace owpeer;
+
+#if defined(__ARM_FEATURE_DSP)
+static const char* const name = "parameter_smoother_dsp";
+#else
+static const char* const name = "parameter_smoother";
+#endif
+
+static constexpr size_t size = ParameterSmoother::size;
+static constexpr size_t runs = 3000;
+static constexpr size_t blocks_per_run = 1000;
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+static int16_t randomValue() {
+    return int16_t(random(0x10000) - 0x8000);
+}
+
+/*
+ * One block for one parameter, rounded towards target
+ */
+static int16_t model(int16_t value, int16_t target, int32_t k) {
+    int32_t round = target > value ? 32767 : 0;
+    return (value * (32768 - k) + target * k + round) >> 15;
+}
+
+static void testApply() {
+    ParameterSmoother smoother(4096);
+    const BlockEvent events[] = {
+        {OWL_COMMAND_PARAMETER, PARAMETER_B, 1000},
+        {OWL_COMMAND_BUTTON, PARAMETER_C, 2000},
+        {OWL_COMMAND_PARAMETER, uint8_t(size), 3000},
+        {OWL_COMMAND_PARAMETER, PARAMETER_DH, -4000},
+    };
+    smoother.apply(events, 4);
+    const int16_t* targets = smoother.getTargets();
+    CHECK_EQ(targets[PARAMETER_B], 1000);
+    CHECK_EQ(targets[PARAMETER_C], 0);
+    CHECK_EQ(targets[PARAMETER_DH], -4000);
+    smoother.setValue(PARAMETER_B, 5);
+    CHECK_EQ(smoother.getValue(PARAMETER_B), 5);
+    CHECK_EQ(targets[PARAMETER_B], 5);
+}
+
+/*
+ * Random targets, jumps and coefficients from 1 to 32767
+ */
+static void testModel() {
+    size_t mismatches = 0;
+    for (size_t run = 0; run < runs; run++) {
+        int32_t k = run < 2 ? (run ? 32767 : 1) : 1 + random(32767);
+        ParameterSmoother smoother(k);
+        std::vector<int16_t> values(size, 0), targets(size, 0);
+        for (size_t block = 0; block < blocks_per_run; block++) {
+            if (random(8) == 0) {
+                PatchParameterId pid = PatchParameterId(random(size));
+                targets[pid] = randomValue();
+                smoother.setTarget(pid, targets[pid]);
+            }
+            if (random(64) == 0) {
+                PatchParameterId pid = PatchParameterId(random(size));
+                values[pid] = targets[pid] = randomValue();
+                smoother.setValue(pid, values[pid]);
+            }
+            smoother.process();
+            for (size_t i = 0; i < size; i++) {
+                values[i] = model(values[i], targets[i], k);
+                mismatches += smoother.getValues()[i] != values[i];
+            }
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+    printf("%u blocks with random targets match the model\n",
+        unsigned(runs * blocks_per_run));
+}
+
+/*
+ * Blocks until value reaches target, it never overshoots on the way
+ */
+static size_t settle(int16_t from, int16_t to, bool& overshoot) {
+    ParameterSmoother smoother(PARAMETER_SMOOTHING_COEFFICIENT);
+    smoother.setValue(PARAMETER_A, from);
+    smoother.setTarget(PARAMETER_A, to);
+    size_t blocks = 0;
+    while (smoother.getValue(PARAMETER_A) != to && blocks < 10000) {
+        int16_t last = smoother.getValue(PARAMETER_A);
+        smoother.process();
+        int16_t value = smoother.getValue(PARAMETER_A);
+        overshoot |= to > from ? value < last || value > to :
+            value > last || value < to;
+        blocks++;
+    }
+    return blocks;
+}
+
+static void testSettle() {
+    bool overshoot = false;
+    size_t up = settle(-32768, 32767, overshoot);
+    size_t down = settle(32767, -32768, overshoot);
+    size_t min = SIZE_MAX, max = 0;
+    for (size_t i = 0; i < 10000; i++) {
+        int16_t from = randomValue(), to = randomValue();
+        if (from == to)
+            continue;
+        size_t blocks = settle(from, to, overshoot);
+        min = std::min(min, blocks);
+        max = std::max(max, blocks);
+    }
+    CHECK(!overshoot);
+    CHECK(up < 10000 && down < 10000 && max < 10000);
+    printf("k=%u settles full scale up in %u blocks, down in %u, random "
+        "steps in %u-%u\n", PARAMETER_SMOOTHING_COEFFICIENT, unsigned(up),
+        unsigned(down), unsigned(min), unsigned(max));
+}
+
+int main() {
+    testApply();
+    testModel();
+    testSettle();
+    return test::report(name);
+}
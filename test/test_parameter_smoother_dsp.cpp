@@ -0,0 +1,5 @@
+/*
+ * Parameter smoother test on Cortex-M4 path with emulated intrinsics, see
+ * Makefile for the flags
+ */
+#include "test_parameter_smoother.cpp"
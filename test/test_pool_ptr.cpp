@@ -0,0 +1,212 @@
+/*
+ * PoolPtr ownership on bus_protocol_fifo. Random sequences make objects,
+ * move them between owners, post them normally or ahead, receive them and
+ * drop them on early returns. Received objects must come out in the order
+ * that the FIFO promises with their contents intact, FIFO usage must match
+ * the number of owned and posted objects after every step, and nothing may
+ * be left taken from the FIFO or bus allocator in the end.
+ */
+#include <deque>
+#include <vector>
+#include "test.hpp"
+#include "bus_protocol.hpp"
+
+using namespace owpeer;
+
+static constexpr size_t steps = 1000000;
+// Objects with a payload buffer are kept to what bus allocator holds
+static constexpr size_t max_buffered = 80;
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+/*
+ * Objects carry a serial number, so that contents can be checked
+ */
+static uint16_t serial = 0;
+static size_t buffered = 0;
+
+static BusObjectPtr makeObject() {
+    uint16_t id = ++serial & 0x7fff;
+    switch (random(buffered < max_buffered ? 4 : 2)) {
+    case 0:
+        return BusObjectPtr::make(std::in_place_type<BusParameter>, 1,
+            PARAMETER_A, int16_t(id));
+    case 1:
+        return BusObjectPtr::make(std::in_place_type<BusCommand>, 2,
+            BUS_COMMAND_TIME_SYNC, int16_t(id));
+    case 2: {
+        buffered++;
+        BusBuffer text(8);
+        snprintf((char*)text.get(), 8, "%u", id);
+        return BusObjectPtr::make(std::in_place_type<BusMessage>, 3,
+            std::move(text));
+    }
+    default:
+        buffered++;
+        return BusObjectPtr::make(std::in_place_type<BusData>, 4,
+            uint32_t(1 + id % 200));
+    }
+}
+
+static uint16_t idOf(const BusProtocolObject& obj) {
+    if (std::holds_alternative<BusParameter>(obj))
+        return std::get<BusParameter>(obj).getValue();
+    if (std::holds_alternative<BusCommand>(obj))
+        return std::get<BusCommand>(obj).getData();
+    if (std::holds_alternative<BusMessage>(obj))
+        return atoi(std::get<BusMessage>(obj).getMessage());
+    // Length of transfer only tells id modulo 200
+    return std::get<BusData>(obj).getLength() - 1;
+}
+
+static bool isData(const BusProtocolObject& obj) {
+    return std::holds_alternative<BusData>(obj);
+}
+
+static bool isBuffered(const BusProtocolObject& obj) {
+    return isData(obj) || std::holds_alternative<BusMessage>(obj);
+}
+
+static bool matches(const BusProtocolObject& obj, uint16_t id) {
+    return isData(obj) ? idOf(obj) == id % 200 : idOf(obj) == id;
+}
+
+/*
+ * Handler that gives up on some objects, which must still be returned
+ */
+static bool handle(BusObjectPtr obj) {
+    if (random(2))
+        return false;
+    if (isData(*obj) && !std::get<BusData>(*obj).isAllocated())
+        return false;
+    return true;
+}
+
+static std::vector<BusObjectPtr> owned;
+// Posted ids in receive order, the first ahead ones were sent ahead
+static std::deque<uint16_t> posted;
+static size_t ahead = 0;
+
+static void release(BusObjectPtr& obj) {
+    if (obj && isBuffered(*obj))
+        buffered--;
+    obj.reset();
+}
+
+static void drop(size_t i) {
+    release(owned[i]);
+    owned.erase(owned.begin() + i);
+}
+
+static size_t countOwned() {
+    size_t count = 0;
+    for (auto& obj : owned)
+        count += bool(obj);
+    return count;
+}
+
+int main() {
+    size_t received = 0, mismatches = 0, early = 0, order = 0;
+    for (size_t step = 0; step < steps; step++) {
+        size_t live = countOwned() + posted.size();
+        size_t i = owned.empty() ? 0 : random(owned.size());
+        switch (random(8)) {
+        case 0:
+        case 1:
+            if (live < PROTOCOL_OBJECTS_POOL_NUM) {
+                owned.push_back(makeObject());
+                CHECK(owned.back());
+            }
+            break;
+        case 2:
+            if (!owned.empty() && owned[i]) {
+                uint16_t id = idOf(*owned[i]);
+                if (random(4)) {
+                    owned[i].send();
+                    posted.push_back(id);
+                }
+                else {
+                    owned[i].sendAhead();
+                    posted.insert(posted.begin() + ahead++, id);
+                }
+                CHECK(!owned[i]);
+                owned.erase(owned.begin() + i);
+            }
+            break;
+        case 3: {
+            BusObjectPtr obj = BusObjectPtr::receive(TIME_IMMEDIATE);
+            if (!CHECK_EQ(bool(obj), !posted.empty()) || !obj)
+                break;
+            order += !matches(*obj, posted.front());
+            posted.pop_front();
+            if (ahead > 0)
+                ahead--;
+            received++;
+            if (random(2))
+                owned.push_back(std::move(obj));
+            else
+                release(obj);
+            break;
+        }
+        case 4:
+            // Move construction and assignment, possibly onto an owner that
+            // still has an object
+            if (!owned.empty()) {
+                size_t j = random(owned.size());
+                if (random(2)) {
+                    BusObjectPtr moved(std::move(owned[i]));
+                    owned[i] = std::move(moved);
+                }
+                else if (i != j) {
+                    release(owned[j]);
+                    owned[j] = std::move(owned[i]);
+                    CHECK(!owned[i]);
+                }
+            }
+            break;
+        case 5:
+            if (!owned.empty() && owned[i]) {
+                if (isBuffered(*owned[i]))
+                    buffered--;
+                early += !handle(std::move(owned[i]));
+                CHECK(!owned[i]);
+            }
+            break;
+        default:
+            if (!owned.empty())
+                drop(i);
+            break;
+        }
+        FifoStats stats = bus_protocol_fifo.getStats();
+        mismatches += stats.used != countOwned() + posted.size();
+        mismatches += stats.pending != posted.size();
+    }
+    CHECK_EQ(mismatches, 0);
+    CHECK_EQ(order, 0);
+
+    while (!owned.empty())
+        drop(0);
+    while (BusObjectPtr::receive(TIME_IMMEDIATE))
+        posted.pop_front();
+    CHECK(posted.empty());
+    FifoStats stats = bus_protocol_fifo.getStats();
+    CHECK_EQ(stats.used, 0);
+    CHECK_EQ(stats.pending, 0);
+    CHECK_EQ(stats.take_waits, 0);
+    for (size_t i = 0; i < bus_allocator.getNumClasses(); i++) {
+        CHECK_EQ(bus_allocator.getClass(i).getUsed(), 0);
+        CHECK_EQ(bus_allocator.getClass(i).getFailures(), 0);
+    }
+    printf("%u steps, %u objects taken, peak %u of %u, %u received, "
+        "%u early returns\n", unsigned(steps), unsigned(stats.takes),
+        unsigned(stats.used_peak), unsigned(stats.num), unsigned(received),
+        unsigned(early));
+    return test::report("pool_ptr");
+}
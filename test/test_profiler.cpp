@@ -0,0 +1,79 @@
+/*
+ * Profiler keeps counting past the 32-bit cycle counter wrap, about 24 s at
+ * 180 MHz, and reports main thread and ISR stacks from linker symbols
+ * instead of a missing working area.
+ */
+#include <cstring>
+#include "test.hpp"
+#include "memstreams.h"
+#include "profiler.hpp"
+
+using namespace owpeer;
+
+extern "C" {
+void profilerContextSwitch(thread_t* ntp, thread_t* otp);
+void profilerIrqEnter(void);
+void profilerIrqExit(void);
+
+uint8_t __process_stack_base__[1024];
+uint8_t __main_stack_base__[1024];
+}
+
+// Stack end symbols come from linker script on target
+asm(".globl __process_stack_end__\n"
+    ".set __process_stack_end__, __process_stack_base__ + 1024\n"
+    ".globl __main_stack_end__\n"
+    ".set __main_stack_end__, __main_stack_base__ + 1024\n");
+
+// Thread structure is located on top of its working area
+static struct {
+    uint8_t wa[512];
+    thread_t tp;
+} worker;
+
+/*
+ * Stack grows down, used part is at the end of the area
+ */
+static void fillStack(uint8_t* base, size_t size, size_t used) {
+    memset(base, CH_DBG_STACK_FILL_VALUE, size - used);
+    memset(base + size - used, 0, used);
+}
+
+int main() {
+    thread_t* main_thread = chRegFirstThread();
+    main_thread->newer = &worker.tp;
+    worker.tp = {"worker", 0, NORMALPRIO, worker.wa, nullptr, 0, 0};
+
+    // Worker runs for 30 s with a 10 us ISR every millisecond
+    profilerContextSwitch(&worker.tp, main_thread);
+    for (int i = 0; i < 30000; i++) {
+        host_advance_us(990);
+        profilerIrqEnter();
+        host_advance_us(10);
+        profilerIrqExit();
+    }
+    profilerContextSwitch(main_thread, &worker.tp);
+    uint64_t mhz = STM32_HCLK / 1000000;
+    CHECK_EQ(worker.tp.prof_cycles, 30000ull * 990 * mhz);
+    CHECK_EQ(worker.tp.prof_switches, 1);
+    CHECK_EQ(main_thread->prof_switches, 1);
+
+    // Next slice is counted from its own switch
+    profilerContextSwitch(&worker.tp, main_thread);
+    host_advance_us(1000);
+    profilerContextSwitch(main_thread, &worker.tp);
+    CHECK_EQ(worker.tp.prof_cycles, (30000ull * 990 + 1000) * mhz);
+
+    fillStack(worker.wa, sizeof(worker.wa), 100);
+    fillStack(__process_stack_base__, sizeof(__process_stack_base__), 300);
+    fillStack(__main_stack_base__, sizeof(__main_stack_base__), 200);
+    char buf[512] = {};
+    MemoryStream ms;
+    msObjectInit(&ms, (uint8_t*)buf, sizeof(buf) - 1, 0);
+    printThreadStats((BaseSequentialStream*)&ms);
+    printf("%s", buf);
+    CHECK(strstr(buf, "ISR: cpu 0.9% count 30000 stack 200/1024\r\n"));
+    CHECK(strstr(buf, "main: cpu 0.0% switches 2 stack 300/1024\r\n"));
+    CHECK(strstr(buf, "worker: cpu 99.0% switches 2 stack 100/512\r\n"));
+    return test::report("profiler");
+}
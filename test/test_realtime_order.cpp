@@ -0,0 +1,123 @@
+/*
+ * MIDI real-time frames at 300 BPM through tx_fifo while parameter bursts
+ * keep it busy. Consumer batches frames like UartTxThread and takes a frame
+ * time per frame at 115200 baud. Real-time frames must leave in the order
+ * they were posted, with Start before the first clock and Stop after the
+ * last one, and wait at most for the batch in progress.
+ */
+#include "test.hpp"
+#include "uart_fifo.hpp"
+
+using namespace owpeer;
+
+static constexpr uint64_t second_ns = 1000000000;
+static constexpr uint32_t bpm = 300;
+static constexpr uint64_t clock_ns = 60 * second_ns / (bpm * 24);
+static constexpr uint64_t frame_ns = frame_size * 10 * second_ns / 115200;
+static constexpr size_t batch_size = 8;
+static constexpr size_t burst_frames = 40;
+static constexpr size_t max_tags = 2048;
+
+static uint64_t posted_ns[max_tags];
+static uint16_t next_tag = 0;
+static size_t pending_normal = 0;
+
+/*
+ * Real-time frames carry a tag in unused bytes, so that order is checked
+ */
+static void postRealtime(uint8_t status, uint64_t now) {
+    auto frame = tx_fifo.takeObjectTimeoutInfinite();
+    frame->fill(USB_COMMAND_SINGLE_BYTE, status, next_tag & 0x7f,
+        next_tag >> 7);
+    posted_ns[next_tag++] = now;
+    postFrame(tx_fifo, frame);
+}
+
+static void postParameter(uint8_t pid) {
+    auto frame = tx_fifo.takeObjectTimeoutInfinite();
+    frame->fill(OWL_COMMAND_PARAMETER, pid, 0x12, 0x34);
+    postFrame(tx_fifo, frame);
+    pending_normal++;
+}
+
+int main() {
+    uint64_t now = 0;
+    uint64_t next_clock = 0;
+    uint64_t end = 10 * second_ns;
+    int expected_tag = 0;
+    uint64_t max_latency = 0;
+    uint64_t last_clock = 0;
+    uint64_t max_jitter = 0;
+    int clocks = 0;
+    bool started = false;
+    bool stopped = false;
+    uint8_t pid = 0;
+
+    while (!stopped || tx_fifo.getStats().pending) {
+        // Transport starts with first clock and stops after last one. Clock
+        // source posts while a batch is on the wire, at its own time.
+        while (!stopped && next_clock <= now) {
+            if (next_clock == 0)
+                postRealtime(MIDI_START, next_clock);
+            postRealtime(MIDI_TIMING_CLOCK, next_clock);
+            if (next_clock + clock_ns >= end) {
+                postRealtime(MIDI_STOP, next_clock);
+                stopped = true;
+            }
+            next_clock += clock_ns;
+        }
+        // Parameter burst keeps queue busy
+        while (!stopped && pending_normal < burst_frames)
+            postParameter(pid++ & 0x3f);
+
+        BusFrame* frames[batch_size];
+        size_t num = 0;
+        while (num < batch_size &&
+            tx_fifo.receiveObjectTimeout(&frames[num], TIME_IMMEDIATE) ==
+                MSG_OK)
+            num++;
+        for (size_t i = 0; i < num; i++) {
+            BusFrame* frame = frames[i];
+            uint64_t sent = now + i * frame_ns;
+            if (frame->isMidiRealtime()) {
+                int tag = frame->frame_buffer[2] |
+                    (frame->frame_buffer[3] << 7);
+                CHECK_EQ(tag, expected_tag);
+                expected_tag = tag + 1;
+                max_latency = std::max(max_latency, sent - posted_ns[tag]);
+                uint8_t status = frame->frame_buffer[1];
+                if (status == MIDI_START) {
+                    CHECK(clocks == 0);
+                    started = true;
+                }
+                else if (status == MIDI_TIMING_CLOCK) {
+                    CHECK(started);
+                    if (clocks++) {
+                        uint64_t interval = sent - last_clock;
+                        uint64_t jitter = interval > clock_ns ?
+                            interval - clock_ns : clock_ns - interval;
+                        max_jitter = std::max(max_jitter, jitter);
+                    }
+                    last_clock = sent;
+                }
+                else if (status == MIDI_STOP) {
+                    CHECK_EQ(clocks, int((end + clock_ns - 1) / clock_ns));
+                }
+            }
+            else {
+                pending_normal--;
+            }
+            tx_fifo.returnObject(frame);
+        }
+        now += num ? num * frame_ns : frame_ns;
+    }
+
+    CHECK_EQ(expected_tag, next_tag);
+    // A real-time frame waits for the batch on the wire and at most one
+    // real-time frame posted at the same time
+    CHECK(max_latency <= (batch_size + 1) * frame_ns);
+    CHECK(max_jitter <= (batch_size + 1) * frame_ns);
+    printf("%u BPM: %d clocks, max latency %u us, max jitter %u us\n", bpm,
+        clocks, unsigned(max_latency / 1000), unsigned(max_jitter / 1000));
+    return test::report("realtime_order");
+}
@@ -0,0 +1,243 @@
+/*
+ * Settings store on RAM backed sectors. Sector erase is only allowed when
+ * it was requested, compaction waits for it and keeps values in RAM. Flash
+ * is never programmed with the mutex held, which is checked by changing a
+ * value from inside program(). Power loss during compaction must leave
+ * values that were stored before it, and the next boot recovers.
+ */
+#include <cstring>
+#include "test.hpp"
+#include "settings_store.hpp"
+
+using namespace owpeer;
+
+// Stm32FlashStorage is linked for the global store, but never used
+static FLASH_TypeDef host_flash;
+FLASH_TypeDef* const FLASH = &host_flash;
+
+static constexpr size_t sector_size = 128;
+
+class RamStorage : public FlashStorage {
+public:
+    RamStorage() {
+        memset(data, 0xff, sizeof(data));
+    }
+
+    size_t getSectorSize(uint8_t sector) const override {
+        return sector < 2 ? sector_size : 0;
+    }
+
+    bool read(uint8_t sector, size_t offset, void* dst,
+        size_t len) const override {
+        if (!isValid(sector, offset, len))
+            return false;
+        memcpy(dst, data[sector] + offset, len);
+        return true;
+    }
+
+    bool erase(uint8_t sector) override {
+        if (!isValid(sector, 0, 0))
+            return false;
+        CHECK(erase_allowed);
+        memset(data[sector], 0xff, sector_size);
+        erases++;
+        return true;
+    }
+
+    bool program(uint8_t sector, size_t offset, const void* src,
+        size_t len) override {
+        if (!isValid(sector, offset, len))
+            return false;
+        if (fail_program || program_budget == 0) {
+            // Failed operation leaves the first word partially written
+            data[sector][offset] = 0;
+            return false;
+        }
+        // Programming can only clear bits
+        const uint8_t* bytes = static_cast<const uint8_t*>(src);
+        for (size_t i = 0; i < len; i++) {
+            CHECK_EQ(bytes[i] & ~data[sector][offset + i], 0);
+            data[sector][offset + i] &= bytes[i];
+        }
+        programs++;
+        if (program_budget > 0)
+            program_budget--;
+        if (on_program != nullptr)
+            on_program();
+        return true;
+    }
+
+    uint8_t data[2][sector_size];
+    bool erase_allowed = true;
+    bool fail_program = false;
+    // Programs that succeed before power is lost, negative for no limit
+    int32_t program_budget = -1;
+    void (*on_program)() = nullptr;
+    uint32_t erases = 0;
+    uint32_t programs = 0;
+};
+
+static RamStorage storage;
+
+static SettingsEntry makeEntry(const char* name, int32_t value) {
+    SettingsEntry entry;
+    entry.key = settingsKey(name);
+    entry.default_value = value;
+    return entry;
+}
+
+static SettingsEntry entries[] = {
+    makeEntry("aa", 1),
+    makeEntry("bb", 2),
+    makeEntry("cc", 3),
+};
+static SettingsStore store(storage, 0, 1, entries, 3);
+
+static int32_t concurrent_value = 100;
+
+/*
+ * Like a message handler that changes a value while settings thread writes
+ * flash, asserts if mutex is held
+ */
+static void setConcurrently() {
+    store.set("cc", concurrent_value++);
+}
+
+/*
+ * One pass of SettingsThread
+ */
+static void runThread() {
+    store.prepareSpare();
+    store.store();
+}
+
+static void reload(RamStorage& from, int32_t a, int32_t b, int32_t c) {
+    SettingsEntry copy[] = {
+        makeEntry("aa", 1),
+        makeEntry("bb", 2),
+        makeEntry("cc", 3),
+    };
+    SettingsStore loaded(from, 0, 1, copy, 3);
+    from.erase_allowed = false;
+    loaded.load();
+    CHECK_EQ(loaded.get("aa"), a);
+    CHECK_EQ(loaded.get("bb"), b);
+    CHECK_EQ(loaded.get("cc"), c);
+}
+
+static void reload(int32_t a, int32_t b, int32_t c) {
+    reload(storage, a, b, c);
+}
+
+/*
+ * Power is lost after each program of compaction in turn, 3 records and
+ * the header. Until the header is complete old sector stays active, and
+ * after reboot compaction is done again once spare is erased.
+ */
+static void testInterruptedCompaction() {
+    static const char* const names[] = {"aa", "bb", "cc"};
+    for (int32_t cut = 0; cut <= 4; cut++) {
+        RamStorage flash;
+        SettingsEntry list[] = {
+            makeEntry("aa", 1),
+            makeEntry("bb", 2),
+            makeEntry("cc", 3),
+        };
+        SettingsStore before(flash, 0, 1, list, 3);
+        before.load();
+        flash.erase_allowed = false;
+        for (int32_t i = 0; i < 15; i++) {
+            before.set(names[i % 3], 10 + i);
+            before.store();
+        }
+        before.set("aa", 60);
+        flash.program_budget = cut;
+        before.requestErase();
+        before.prepareSpare();
+        before.store();
+        flash.program_budget = -1;
+        reload(flash, cut < 4 ? 22 : 60, 23, 24);
+
+        SettingsEntry copy[] = {
+            makeEntry("aa", 1),
+            makeEntry("bb", 2),
+            makeEntry("cc", 3),
+        };
+        SettingsStore after(flash, 0, 1, copy, 3);
+        after.load();
+        after.set("bb", 70);
+        flash.erase_allowed = true;
+        after.requestErase();
+        after.prepareSpare();
+        after.store();
+        // Spare is dirty either way, formatting was the first erase
+        CHECK_EQ(flash.erases, 2);
+        reload(flash, cut < 4 ? 22 : 60, 70, 24);
+    }
+}
+
+int main() {
+    // Blank storage is formatted at boot
+    store.load();
+    CHECK_EQ(storage.erases, 1);
+    CHECK_EQ(store.get("aa"), 1);
+
+    // Values are appended without erasing, 15 records fit in a sector
+    storage.erase_allowed = false;
+    for (int32_t i = 0; i < 15; i++) {
+        store.set("aa", 10 + i);
+        runThread();
+    }
+    CHECK_EQ(storage.erases, 1);
+    reload(24, 2, 3);
+
+    // Full log can't be compacted before spare is erased, value stays in RAM
+    storage.erase_allowed = false;
+    store.set("aa", 50);
+    runThread();
+    CHECK_EQ(store.get("aa"), 50);
+    reload(24, 2, 3);
+
+    // Spare sector is checked on request and found blank, then postponed
+    // compaction runs. A value that changes during compaction is appended by
+    // the next store.
+    storage.on_program = setConcurrently;
+    store.requestErase();
+    runThread();
+    storage.on_program = nullptr;
+    CHECK_EQ(storage.erases, 1);
+    int32_t last = concurrent_value - 1;
+    CHECK_EQ(store.get("cc"), last);
+    storage.erase_allowed = false;
+    runThread();
+    reload(50, 2, last);
+
+    // Failed append is retried with the next store
+    store.set("bb", 7);
+    storage.fail_program = true;
+    runThread();
+    storage.fail_program = false;
+    reload(50, 2, last);
+    runThread();
+    reload(50, 7, last);
+
+    // Reset waits for erased spare as well
+    store.reset();
+    runThread();
+    reload(50, 7, last);
+    storage.erase_allowed = true;
+    store.requestErase();
+    runThread();
+    reload(1, 2, 3);
+    CHECK_EQ(storage.erases, 2);
+
+    // Spare sector is not erased again until requested
+    storage.erase_allowed = false;
+    store.set("aa", 5);
+    runThread();
+    reload(5, 2, 3);
+
+    testInterruptedCompaction();
+
+    return test::report("settings_store");
+}
@@ -0,0 +1,47 @@
+/*
+ * Stats sections longer than a BusMessage are split at line ends. Chunks
+ * must fit a message, join back to the original text and only cut lines
+ * that are longer than a message on their own.
+ */
+#include <cstring>
+#include <string>
+#include "test.hpp"
+#include "bus_protocol.hpp"
+#include "device_stats.hpp"
+
+using namespace owpeer;
+
+static void testSplit(const std::string& text, size_t max_len) {
+    std::string joined;
+    const char* p = text.c_str();
+    while (*p != '\0') {
+        size_t len = getStatsMessageLength(p, max_len);
+        CHECK(len > 0);
+        CHECK(len <= max_len);
+        std::string chunk(p, len);
+        size_t nl = chunk.rfind('\n');
+        // Chunk ends at a line end unless it's the tail or a long line
+        if (p[len] != '\0')
+            CHECK(nl == len - 1 || nl == std::string::npos);
+        joined += chunk;
+        p += len;
+    }
+    CHECK(joined == text);
+}
+
+int main() {
+    size_t max_len = max_msg_len - 1;
+    std::string table;
+    for (int i = 0; i < 40; i++)
+        table += "pool " + std::to_string(i) + " size 64 used 3 peak 12\r\n";
+    testSplit(table, max_len);
+    testSplit("", max_len);
+    testSplit("no line end", max_len);
+    testSplit(std::string(1000, 'x') + "\r\nshort\r\n", max_len);
+    testSplit(std::string(max_len - 1, 'y') + "\r\n", max_len);
+
+    CHECK_EQ(getStatsMessageLength("ab\r\ncd\r\n", 5), 4);
+    CHECK_EQ(getStatsMessageLength("ab\r\ncd", 16), 6);
+    CHECK_EQ(getStatsMessageLength("abcdefgh", 5), 5);
+    return test::report("stats_split");
+}
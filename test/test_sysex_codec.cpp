@@ -0,0 +1,187 @@
+/*
+ * SysEx codec against a byte by byte reference. Random payloads are written
+ * in random parts, packets must match the reference packetizer exactly and
+ * decode back to the payload. SysexSink is fed through BusData from one peer,
+ * and the global sink must post its packets to bus output as BusMidi.
+ */
+#include <vector>
+#include "test.hpp"
+#include "sysex_codec.hpp"
+
+using namespace owpeer;
+
+static constexpr size_t payloads = 50000;
+static constexpr size_t max_len = 600;
+
+static uint32_t rng = 1;
+
+static uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+}
+
+static std::vector<uint8_t> randomPayload(size_t len) {
+    std::vector<uint8_t> payload(len);
+    for (auto& byte : payload)
+        byte = random(0x100);
+    return payload;
+}
+
+/*
+ * Whole message as bytes, then cut to packets of 3 with F7 in the last one
+ */
+static std::vector<uint32_t> reference(uint8_t command,
+    const std::vector<uint8_t>& payload) {
+    std::vector<uint8_t> bytes = {0xf0, MIDI_SYSEX_MANUFACTURER,
+        MIDI_SYSEX_OMNI_DEVICE, command};
+    for (size_t i = 0; i < payload.size(); i += 7) {
+        size_t n = std::min<size_t>(7, payload.size() - i);
+        uint8_t bits = 0;
+        for (size_t j = 0; j < n; j++)
+            bits |= (payload[i + j] >> 7) << j;
+        bytes.push_back(bits);
+        for (size_t j = 0; j < n; j++)
+            bytes.push_back(payload[i + j] & 0x7f);
+    }
+    bytes.push_back(0xf7);
+    std::vector<uint32_t> packets;
+    for (size_t i = 0; i < bytes.size(); i += 3) {
+        size_t n = std::min<size_t>(3, bytes.size() - i);
+        uint32_t packet = i + n == bytes.size() ?
+            USB_COMMAND_SYSEX_EOX1 + n - 1 : uint32_t(USB_COMMAND_SYSEX);
+        for (size_t j = 0; j < n; j++)
+            packet |= uint32_t(bytes[i + j]) << (8 * (j + 1));
+        packets.push_back(packet);
+    }
+    return packets;
+}
+
+static std::vector<uint32_t> packets;
+
+static void collect(uint32_t packet) {
+    packets.push_back(packet);
+}
+
+/*
+ * Returns decoded payload, command is checked against expected
+ */
+static std::vector<uint8_t> decode(const std::vector<uint32_t>& input,
+    uint8_t command, bool& complete) {
+    SysexDecoder decoder;
+    std::vector<uint8_t> payload;
+    complete = false;
+    for (size_t i = 0; i < input.size(); i++) {
+        bool end = decoder.write(input[i],
+            [&](const uint8_t* data, size_t len) {
+                payload.insert(payload.end(), data, data + len);
+            });
+        complete = end && i == input.size() - 1;
+    }
+    complete = complete && decoder.getCommand() == command &&
+        decoder.getSize() == payload.size();
+    return payload;
+}
+
+static void testRandom() {
+    SysexEncoder encoder;
+    size_t mismatches = 0, round_trip = 0, counts = 0;
+    for (size_t i = 0; i < payloads; i++) {
+        auto payload = randomPayload(random(max_len + 1));
+        uint8_t command = random(0x80);
+        packets.clear();
+        encoder.begin(command, collect);
+        for (size_t pos = 0; pos < payload.size();) {
+            size_t len = std::min<size_t>(random(20), payload.size() - pos);
+            encoder.write(payload.data() + pos, len, collect);
+            pos += len;
+        }
+        encoder.end(collect);
+        mismatches += packets != reference(command, payload);
+        counts += packets.size() != SysexEncoder::getPackets(payload.size());
+        bool complete;
+        round_trip += decode(packets, command, complete) != payload ||
+            !complete;
+    }
+    CHECK_EQ(mismatches, 0);
+    CHECK_EQ(counts, 0);
+    CHECK_EQ(round_trip, 0);
+    printf("%u payloads of 0-%u bytes match reference and round trip\n",
+        unsigned(payloads), unsigned(max_len));
+}
+
+static void testOtherManufacturer() {
+    auto payload = randomPayload(20);
+    auto input = reference(SYSEX_CONFIGURATION_COMMAND, payload);
+    input[0] = (input[0] & ~0xff00) | (0x43 << 8);
+    bool complete;
+    CHECK(decode(input, SYSEX_CONFIGURATION_COMMAND, complete).empty());
+    CHECK(!complete);
+}
+
+/*
+ * Payload sent as BusData, the first byte is SysEx command
+ */
+static void testSink() {
+    SysexSink sink(collect);
+    for (size_t len : {1, 2, 8, 9, 100, 1000}) {
+        auto payload = randomPayload(len);
+        payload[0] &= 0x7f;
+        packets.clear();
+        BusData::setStreamSink(4, &sink);
+        BusData tx(4, payload.data(), payload.size());
+        BusFrame frame;
+        tx.encodeFrame(frame);
+        BusObjectPtr obj = BusData::decodeFrame(frame);
+        while (tx.isEncoded()) {
+            tx >> frame;
+            std::get<BusData>(*obj) << frame;
+        }
+        CHECK(std::get<BusData>(*obj).isDecoded());
+        CHECK(!std::get<BusData>(*obj).isAllocated());
+        CHECK(packets == reference(payload[0], std::vector<uint8_t>(
+            payload.begin() + 1, payload.end())));
+    }
+    // Interrupted transfer is terminated
+    auto payload = randomPayload(50);
+    packets.clear();
+    CHECK(sink.open(payload.size()));
+    sink.write(payload.data(), 20);
+    sink.abort();
+    bool complete;
+    CHECK(decode(packets, payload[0], complete).size() == 19);
+    CHECK(complete);
+    // Empty payload has no command
+    CHECK(!sink.open(0));
+}
+
+static void testBusOutput() {
+    auto payload = randomPayload(30);
+    payload[0] = SYSEX_CONFIGURATION_COMMAND;
+    sysex_sink.open(payload.size());
+    sysex_sink.write(payload.data(), payload.size());
+    sysex_sink.close();
+    auto expected = reference(payload[0], std::vector<uint8_t>(
+        payload.begin() + 1, payload.end()));
+    for (uint32_t packet : expected) {
+        auto obj = BusOutputPtr::receive(TIME_IMMEDIATE);
+        if (!CHECK(obj && std::holds_alternative<BusMidi>(*obj)))
+            return;
+        BusFrame frame;
+        std::get<BusMidi>(*obj).encodeFrame(frame);
+        uint32_t sent;
+        memcpy(&sent, frame.frame_buffer, sizeof(sent));
+        CHECK_EQ(sent, packet);
+        CHECK(frame.isMidi());
+    }
+    CHECK(!BusOutputPtr::receive(TIME_IMMEDIATE));
+}
+
+int main() {
+    testRandom();
+    testOtherManufacturer();
+    testSink();
+    testBusOutput();
+    return test::report("sysex_codec");
+}
@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""
+Convert, inspect and replay OpenWarePeer bus captures.
+
+  bus_capture.py convert LOG OUT     convert "capture dump" console output
+  bus_capture.py show FILE           print capture records
+  bus_capture.py replay FILE PORT    send captured frames to a peer
+
+Capture file starts with 12 byte header: "OWCP", version byte, 3 reserved
+bytes and counter frequency (uint32 LE). It's followed by records exactly as
+stored in device ring buffer, see include/bus_capture.hpp.
+
+Replay sends captured frames of one direction (Rx by default, i.e. traffic
+that the peer received) at original timing scaled by --speed, or as fast as
+possible with --max. With --echo, frames sent back by the peer are read and
+matched in order to report latency.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+MAGIC = b'OWCP'
+VERSION = 2
+HEADER = struct.Struct('<4sB3xI')
+INFO_TX = 0x80
+INFO_ANNOTATION = 0x40
+INFO_WRAPS = 0x20
+INFO_PEER_MASK = 0x0f
+DEFAULT_CLOCK = 180000000
+
+
+def parse_records(data):
+    pos = 0
+    while pos < len(data):
+        timestamp, info = struct.unpack_from('<IB', data, pos)
+        frame = data[pos + 5:pos + 9]
+        wraps = 0
+        annotation = None
+        pos += 9
+        if info & INFO_WRAPS:
+            wraps, = struct.unpack_from('<I', data, pos)
+            pos += 4
+        if info & INFO_ANNOTATION:
+            annotation, = struct.unpack_from('<I', data, pos)
+            pos += 4
+        yield timestamp, info, frame, annotation, wraps
+
+
+def load(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    magic, version, clock = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION:
+        sys.exit('%s is not a capture file' % path)
+    return clock, list(parse_records(data[HEADER.size:]))
+
+
+def unwrap(records):
+    """Convert 32 bit wrapping timestamps to monotonic cycles, whole counter
+    periods between records are stored by device as wraps"""
+    base = None
+    total = 0
+    for record in records:
+        if base is not None:
+            total += ((record[0] - base) & 0xffffffff) + (record[4] << 32)
+        base = record[0]
+        yield total, record
+
+
+def cmd_convert(args):
+    data = bytearray()
+    for line in args.log:
+        fields = line.split()
+        # Lines may be interleaved with other debug output
+        if len(fields) != 2 or fields[0] != 'C' or fields[1] == 'end':
+            continue
+        try:
+            record = bytes.fromhex(fields[1])
+        except ValueError:
+            continue
+        if len(record) not in (9, 13, 17):
+            continue
+        data += record
+    with open(args.out, 'wb') as f:
+        f.write(HEADER.pack(MAGIC, VERSION, args.clock))
+        f.write(data)
+
+
+def cmd_show(args):
+    clock, records = load(args.file)
+    for cycles, (_, info, frame, annotation, _) in unwrap(records):
+        line = '%12.1f %s peer %2d %s' % (
+            cycles * 1e6 / clock, 'tx' if info & INFO_TX else 'rx',
+            info & INFO_PEER_MASK, frame.hex())
+        if annotation is not None:
+            line += ' stage %.1fus' % (annotation * 1e6 / clock)
+        print(line)
+
+
+def cmd_replay(args):
+    import serial
+
+    clock, records = load(args.file)
+    direction = INFO_TX if args.direction == 'tx' else 0
+    frames = [(cycles, frame) for cycles, (_, info, frame, _, _) in
+              unwrap(records) if info & INFO_TX == direction]
+    if not frames:
+        sys.exit('No frames to replay')
+
+    port = serial.Serial(args.port, args.baud, timeout=0)
+    sent_at = []
+    received = bytearray()
+    latencies = []
+    start = time.perf_counter()
+    first = frames[0][0]
+    for cycles, frame in frames:
+        if not args.max:
+            target = start + (cycles - first) / clock / args.speed
+            while time.perf_counter() < target:
+                pass
+        port.write(frame)
+        sent_at.append(time.perf_counter())
+        if args.echo:
+            received += port.read(port.in_waiting or 1)
+            while len(received) >= 4 and len(latencies) < len(sent_at):
+                latencies.append(time.perf_counter() -
+                                 sent_at[len(latencies)])
+                del received[:4]
+    port.flush()
+    elapsed = time.perf_counter() - start
+
+    print('sent %d frames in %.3f s, %.0f frames/s' % (
+        len(frames), elapsed, len(frames) / elapsed))
+    if args.echo:
+        if latencies:
+            latencies.sort()
+            print('received %d frames, latency avg %.2f ms p99 %.2f ms '
+                  'max %.2f ms' % (
+                      len(latencies), 1e3 * sum(latencies) / len(latencies),
+                      1e3 * latencies[int(len(latencies) * 0.99)],
+                      1e3 * latencies[-1]))
+        else:
+            print('no frames received')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    p = sub.add_parser('convert')
+    p.add_argument('log', type=argparse.FileType('r'))
+    p.add_argument('out')
+    p.add_argument('--clock', type=int, default=DEFAULT_CLOCK,
+                   help='device counter frequency in Hz')
+    p.set_defaults(func=cmd_convert)
+
+    p = sub.add_parser('show')
+    p.add_argument('file')
+    p.set_defaults(func=cmd_show)
+
+    p = sub.add_parser('replay')
+    p.add_argument('file')
+    p.add_argument('port')
+    p.add_argument('--baud', type=int, default=115200)
+    p.add_argument('--direction', choices=('rx', 'tx'), default='rx')
+    p.add_argument('--speed', type=float, default=1.0,
+                   help='timing scale, 2 replays twice as fast')
+    p.add_argument('--max', action='store_true',
+                   help='ignore captured timing')
+    p.add_argument('--echo', action='store_true',
+                   help='read frames returned by peer and report latency')
+    p.set_defaults(func=cmd_replay)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
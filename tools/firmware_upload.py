@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+"""
+Upload firmware image to an OpenWarePeer over the digital bus.
+
+  firmware_upload.py FILE PORT [--store] [--compress]
+
+PORT must be connected to bus input of the peer and receive its output. The
+peer is asked to erase staging sector with SYSEX_FIRMWARE_UPLOAD command,
+then image is sent as BusData followed by its CRC-32. Progress reported by
+the peer is printed until image is verified. With --store, verified image is
+saved with SYSEX_FIRMWARE_STORE.
+
+With --compress, payload is sent as heatshrink compatible LZSS stream if the
+peer accepts FIRMWARE_UPLOAD_LZ option, otherwise upload falls back to plain
+transfer.
+"""
+
+import argparse
+import struct
+import sys
+import time
+import zlib
+
+OWL_COMMAND_COMMAND = 0xc0
+OWL_COMMAND_DATA = 0xe0
+SYSEX_FIRMWARE_UPLOAD = 0x10
+SYSEX_FIRMWARE_STORE = 0x11
+FIRMWARE_UPLOAD_LZ = 0x01
+BUS_DATA_LZ_FLAG = 0x080000
+BUS_DATA_LEN_MASK = 0x07ffff
+LZ_WINDOW_BITS = 9
+LZ_COUNT_BITS = 4
+
+
+def command_frame(peer, cmd, data=0):
+    return struct.pack('>BBh', OWL_COMMAND_COMMAND | peer, cmd, data)
+
+
+def lz_compress(data, window_bits=LZ_WINDOW_BITS, count_bits=LZ_COUNT_BITS):
+    """
+    Greedy LZSS in heatshrink format: tag bit 1 and a literal byte, or tag
+    bit 0, offset - 1 and length - 1. Stream is prefixed with parameters and
+    uncompressed size as expected by BusData decoder.
+    """
+    window = 1 << window_bits
+    max_count = 1 << count_bits
+    # Back reference pays off from 2 bytes
+    min_count = (1 + window_bits + count_bits) // 9 + 1
+    out = bytearray([window_bits << 4 | count_bits])
+    out += len(data).to_bytes(3, 'big')
+    bits = 0
+    nbits = 0
+    chains = {}
+
+    def put(value, num):
+        nonlocal bits, nbits
+        bits = bits << num | value
+        nbits += num
+        while nbits >= 8:
+            nbits -= 8
+            out.append(bits >> nbits & 0xff)
+        bits &= (1 << nbits) - 1
+
+    def insert(pos):
+        if pos + 2 <= len(data):
+            chains.setdefault(data[pos:pos + 2], []).append(pos)
+
+    pos = 0
+    while pos < len(data):
+        best, best_pos = 0, 0
+        limit = min(max_count, len(data) - pos)
+        candidates = chains.get(data[pos:pos + 2], [])
+        for cand in reversed(candidates[-64:]):
+            if pos - cand > window:
+                break
+            n = 0
+            while n < limit and data[cand + n] == data[pos + n]:
+                n += 1
+            if n > best:
+                best, best_pos = n, cand
+                if n == limit:
+                    break
+        if best >= min_count:
+            put(0, 1)
+            put(pos - best_pos - 1, window_bits)
+            put(best - 1, count_bits)
+        else:
+            best = 1
+            put(1, 1)
+            put(data[pos], 8)
+        for i in range(pos, pos + best):
+            insert(i)
+        pos += best
+    if nbits:
+        put(0, 8 - nbits)
+    return bytes(out)
+
+
+def data_frames(peer, payload, flags=0):
+    """BusData header, 3 bytes per frame and a zero padded last frame"""
+    head = OWL_COMMAND_DATA | peer
+    out = bytearray([head]) + (len(payload) | flags).to_bytes(3, 'big')
+    full = len(payload) // 3 * 3
+    for i in range(0, full, 3):
+        out.append(head)
+        out += payload[i:i + 3]
+    out.append(head)
+    out += payload[full:].ljust(3, b'\0')
+    return bytes(out)
+
+
+class Replies:
+    """Collects command frames sent back by the peer"""
+
+    def __init__(self, port):
+        self.port = port
+        self.buf = bytearray()
+
+    def poll(self):
+        self.buf += self.port.read(self.port.in_waiting or 1)
+        while len(self.buf) >= 4:
+            frame = bytes(self.buf[:4])
+            del self.buf[:4]
+            if frame[0] & 0xf0 == OWL_COMMAND_COMMAND:
+                _, cmd, data = struct.unpack('>BBh', frame)
+                yield cmd, data
+
+    def wait(self, cmd, timeout):
+        end = time.monotonic() + timeout
+        while time.monotonic() < end:
+            for reply, data in self.poll():
+                if reply == cmd:
+                    return data
+        sys.exit('No reply from peer')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('file')
+    parser.add_argument('port')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--peer', type=int, default=0,
+                        help='peer id used in sent frames')
+    parser.add_argument('--store', action='store_true',
+                        help='store image after verification')
+    parser.add_argument('--compress', action='store_true',
+                        help='send compressed payload if peer supports it')
+    args = parser.parse_args()
+
+    import serial
+
+    with open(args.file, 'rb') as f:
+        image = f.read()
+    payload = image + struct.pack('<I', zlib.crc32(image))
+    # Plain length must not overflow into header flags
+    if len(payload) > BUS_DATA_LEN_MASK:
+        sys.exit('Image is too large')
+    port = serial.Serial(args.port, args.baud, timeout=0)
+    replies = Replies(port)
+
+    options = FIRMWARE_UPLOAD_LZ if args.compress else 0
+    port.write(command_frame(args.peer, SYSEX_FIRMWARE_UPLOAD, options))
+    # Sector erase takes up to a couple of seconds
+    if replies.wait(SYSEX_FIRMWARE_UPLOAD, 5) != 0:
+        if not options:
+            sys.exit('Peer is not ready')
+        print('compression not supported by peer')
+        options = 0
+        port.write(command_frame(args.peer, SYSEX_FIRMWARE_UPLOAD))
+        if replies.wait(SYSEX_FIRMWARE_UPLOAD, 5) != 0:
+            sys.exit('Peer is not ready')
+
+    if options & FIRMWARE_UPLOAD_LZ:
+        packed = lz_compress(payload)
+        print('compressed %d to %d bytes' % (len(payload), len(packed)))
+        frames = data_frames(args.peer, packed, BUS_DATA_LZ_FLAG)
+    else:
+        frames = data_frames(args.peer, payload)
+    start = time.perf_counter()
+    pos = 0
+    progress = 0
+    last_reply = start
+    while progress not in (100, -1):
+        if pos < len(frames):
+            pos += port.write(frames[pos:pos + 256])
+        elif time.perf_counter() - last_reply > 5:
+            sys.exit('Peer stopped responding')
+        for cmd, data in replies.poll():
+            if cmd == SYSEX_FIRMWARE_UPLOAD:
+                progress = data
+                last_reply = time.perf_counter()
+                print('%d%%' % progress)
+    elapsed = time.perf_counter() - start
+    if progress < 0:
+        sys.exit('Upload failed')
+    print('%d bytes in %.2f s, %.0f bytes/s, link %.0f bytes/s' % (
+        len(image), elapsed, len(image) / elapsed,
+        args.baud / 10 * 3 / 4))
+
+    if args.store:
+        port.write(command_frame(args.peer, SYSEX_FIRMWARE_STORE))
+        if replies.wait(SYSEX_FIRMWARE_STORE, 2) != 0:
+            sys.exit('Store failed')
+        print('stored')
+
+
+if __name__ == '__main__':
+    main()
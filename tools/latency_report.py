@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""
+Render percentiles from "stats latency" output of OpenWarePeer debug console.
+
+Usage: latency_report.py [FILE]
+
+Input is read from FILE or stdin. Each histogram line looks like
+"<stage> n=<count> max=<cycles> <bucket>:<count> ...", where bucket N holds
+latencies in [2^N, 2^(N+1)) cycles. Percentiles are reported as the upper
+bound of the bucket they fall into, so they are accurate to a factor of 2.
+"""
+
+import argparse
+import sys
+
+PERCENTILES = (50, 90, 99, 99.9)
+
+
+def parse(lines):
+    clock = None
+    stages = []
+    for line in lines:
+        fields = line.split()
+        if len(fields) == 2 and fields[0] == 'clock':
+            clock = int(fields[1])
+        elif len(fields) >= 3 and fields[1].startswith('n='):
+            buckets = {}
+            for field in fields[3:]:
+                bucket, count = field.split(':')
+                buckets[int(bucket)] = int(count)
+            stages.append((fields[0], int(fields[1][2:]),
+                           int(fields[2][4:]), buckets))
+    return clock, stages
+
+
+def percentile(buckets, count, pct):
+    target = count * pct / 100.0
+    total = 0
+    for bucket in sorted(buckets):
+        total += buckets[bucket]
+        if total >= target:
+            return 2 ** (bucket + 1)
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('file', nargs='?', type=argparse.FileType('r'),
+                        default=sys.stdin)
+    parser.add_argument('--clock', type=int,
+                        help='counter frequency in Hz, overrides device value')
+    args = parser.parse_args()
+
+    clock, stages = parse(args.file)
+    clock = args.clock or clock
+    if not clock:
+        sys.exit('Counter frequency is unknown, use --clock')
+
+    def us(cycles):
+        return '%10.1f' % (cycles * 1e6 / clock)
+
+    print('%-10s %10s' % ('stage', 'count') +
+          ''.join('%10s' % ('p%g' % p) for p in PERCENTILES) +
+          '%10s' % 'max', '(us)')
+    for name, count, max_cycles, buckets in stages:
+        if count == 0:
+            continue
+        # Bucket bound can't be above observed maximum
+        values = [min(percentile(buckets, count, p), max_cycles)
+                  for p in PERCENTILES]
+        print('%-10s %10d' % (name, count) + ''.join(us(v) for v in values) +
+              us(max_cycles))
+
+
+if __name__ == '__main__':
+    main()